@@ -0,0 +1,199 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <tpm2-totp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "keytemplates.h"
+#include "tcti-libtpms.h"
+
+/* Measures what every code costs per selected PCR bank: PCR_Read and
+   PolicyPCR of the selection and complete calculations, against the
+   in-process TPM with the given latency per command. The latency is the same
+   for every command, so the differences between the bank sets are the
+   hashing the TPM does for each bank. Usage:
+   bench-banks [latency-us] [iterations] */
+
+static const struct {
+    const char *name;
+    uint32_t banks;
+} bank_sets[] = {
+    /* The default banks first, as the reference of the others */
+    { "SHA1,SHA256", TPM2TOTP_BANK_SHA1 | TPM2TOTP_BANK_SHA256 },
+    { "SHA1", TPM2TOTP_BANK_SHA1 },
+    { "SHA256", TPM2TOTP_BANK_SHA256 },
+    { "SHA384", TPM2TOTP_BANK_SHA384 },
+    { "SHA1,SHA256,SHA384", TPM2TOTP_BANK_SHA1 | TPM2TOTP_BANK_SHA256 |
+                            TPM2TOTP_BANK_SHA384 },
+    { "auto", TPM2TOTP_BANK_AUTO },
+};
+
+static double
+elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 +
+           (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void
+selection(uint32_t banks, TPML_PCR_SELECTION *pcrsel)
+{
+    static const TPMI_ALG_HASH hashes[] = { TPM2_ALG_SHA1, TPM2_ALG_SHA256,
+                                            TPM2_ALG_SHA384 };
+
+    TPMS_PCR_SELECTION *sel;
+
+    pcrsel->count = 0;
+    for (size_t i = 0; i < sizeof(hashes) / sizeof(hashes[0]); i++) {
+        if (!(banks & (1 << i)))
+            continue;
+        sel = &pcrsel->pcrSelections[pcrsel->count++];
+        sel->hash = hashes[i];
+        sel->sizeofSelect = 3;
+        sel->pcrSelect[0] = DEFAULT_PCRS & 0xff;
+        sel->pcrSelect[1] = DEFAULT_PCRS >> 8 & 0xff;
+        sel->pcrSelect[2] = DEFAULT_PCRS >> 16 & 0xff;
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned long latency = argc > 1 ? strtoul(argv[1], NULL, 0) : 0;
+    size_t iterations = argc > 2 ? strtoul(argv[2], NULL, 0) : 200;
+    TPMT_SYM_DEF sym = { .algorithm = TPM2_ALG_NULL };
+    TSS2_TCTI_CONTEXT *tcti;
+    TPM2TOTP_CONTEXT *context;
+    ESYS_CONTEXT *ctx;
+    ESYS_TR session;
+    TPML_PCR_SELECTION pcrsel, *pcrcheck;
+    TPML_DIGEST *values;
+    uint8_t *secret, *keyBlob;
+    size_t secret_size, keyBlob_size;
+    uint32_t banks;
+    uint64_t totp;
+    time_t now;
+    struct timespec start;
+    double read_ms, policy_ms, calculate_ms, default_ms = 0;
+    int rc;
+
+    if (iterations == 0) {
+        fprintf(stderr, "At least one iteration is needed\n");
+        return 1;
+    }
+    rc = tcti_libtpms_new(NULL, &tcti);
+    if (rc != 0) {
+        fprintf(stderr, "tcti_libtpms_new failed: 0x%08x\n", rc);
+        return 1;
+    }
+    rc = tpm2totp_context_new(tcti, &context);
+    if (rc != 0) {
+        fprintf(stderr, "tpm2totp_context_new failed: 0x%08x\n", rc);
+        return 1;
+    }
+    /* The event log of the machine does not describe the in-process TPM */
+    tpm2totp_context_setEventLog(context, "");
+    /* A second ESYS context on the same TCTI sends the single commands */
+    rc = Esys_Initialize(&ctx, tcti, NULL);
+    if (rc != TSS2_RC_SUCCESS) {
+        fprintf(stderr, "Esys_Initialize failed: 0x%08x\n", rc);
+        return 1;
+    }
+
+    printf("%zu iterations, %lu us TPM latency, PCRs 0,2,4\n",
+           iterations, latency);
+    printf("%-20s %12s %12s %14s %10s\n", "banks", "PCR_Read us",
+           "PolicyPCR us", "calculate us", "vs default");
+
+    for (size_t s = 0; s < sizeof(bank_sets) / sizeof(bank_sets[0]); s++) {
+        tcti_libtpms_set_latency(tcti, 0);
+        rc = tpm2totp_context_generateKey(context, DEFAULT_PCRS,
+                                          bank_sets[s].banks, NULL,
+                                          &secret, &secret_size,
+                                          &keyBlob, &keyBlob_size);
+        if (rc != 0) {
+            fprintf(stderr, "Generating a key for %s failed: 0x%08x\n",
+                    bank_sets[s].name, rc);
+            return 1;
+        }
+        /* The banks of the key, e.g. the ones chosen automatically */
+        banks = (uint32_t)keyBlob[4] << 24 | (uint32_t)keyBlob[5] << 16 |
+                (uint32_t)keyBlob[6] << 8 | keyBlob[7];
+        selection(banks, &pcrsel);
+        tcti_libtpms_set_latency(tcti, latency);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t i = 0; i < iterations; i++) {
+            rc = Esys_PCR_Read(ctx, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                               &pcrsel, NULL, &pcrcheck, &values);
+            if (rc != TSS2_RC_SUCCESS) {
+                fprintf(stderr, "Esys_PCR_Read failed: 0x%08x\n", rc);
+                return 1;
+            }
+            free(pcrcheck);
+            free(values);
+        }
+        read_ms = elapsed_ms(&start);
+
+        /* A trial session takes the same PolicyPCR over and over */
+        rc = Esys_StartAuthSession(ctx, ESYS_TR_NONE, ESYS_TR_NONE,
+                                   ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                                   NULL, TPM2_SE_TRIAL, &sym, TPM2_ALG_SHA256,
+                                   &session);
+        if (rc != TSS2_RC_SUCCESS) {
+            fprintf(stderr, "Esys_StartAuthSession failed: 0x%08x\n", rc);
+            return 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t i = 0; i < iterations; i++) {
+            rc = Esys_PolicyPCR(ctx, session,
+                                ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                                NULL, &pcrsel);
+            if (rc != TSS2_RC_SUCCESS) {
+                fprintf(stderr, "Esys_PolicyPCR failed: 0x%08x\n", rc);
+                return 1;
+            }
+        }
+        policy_ms = elapsed_ms(&start);
+        Esys_FlushContext(ctx, session);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t i = 0; i < iterations; i++) {
+            rc = tpm2totp_context_calculate(context, keyBlob, keyBlob_size,
+                                            &now, &totp);
+            if (rc != 0) {
+                fprintf(stderr, "tpm2totp_context_calculate failed: 0x%08x\n",
+                        rc);
+                return 1;
+            }
+        }
+        calculate_ms = elapsed_ms(&start);
+        if (s == 0)
+            default_ms = calculate_ms;
+
+        printf("%-20s %12.1f %12.1f %14.1f %+9.1f%%\n", bank_sets[s].name,
+               read_ms * 1e3 / iterations, policy_ms * 1e3 / iterations,
+               calculate_ms * 1e3 / iterations,
+               (calculate_ms / default_ms - 1) * 100);
+
+        free(keyBlob);
+        free(secret);
+    }
+
+    tcti_libtpms_set_latency(tcti, 0);
+    Esys_Finalize(&ctx);
+    tpm2totp_context_free(context);
+    tcti_libtpms_free(&tcti);
+    return 0;
+}
@@ -0,0 +1,190 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#include <tpm2-totp-coro.hpp>
+#include "tcti-libtpms.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+/* Serves requests for codes as a single-threaded service would: every
+   client is a coroutine awaiting its codes in straight-line code, and one
+   epoll loop drives the TPM. Compares the throughput with blocking calls
+   one after the other against the in-process TPM with injected latency.
+   Usage: bench-coro [latency-us] [clients] [requests-per-client] */
+
+#define NV 0x01800020
+
+static double
+elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 +
+           (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* A client requesting codes one after the other */
+static tpm2totp::task<int>
+client(tpm2totp::async_context &ac, tpm2totp::blob_view key,
+       std::size_t requests, std::size_t &served)
+{
+    for (std::size_t i = 0; i < requests; i++) {
+        auto code = co_await ac.calculate(key);
+        if (!code)
+            co_return code.rc();
+        served++;
+    }
+    co_return 0;
+}
+
+/* The service loads its key and serves all clients concurrently */
+static tpm2totp::task<int>
+service(tpm2totp::async_context &ac, std::size_t clients,
+        std::size_t requests, std::size_t &served)
+{
+    auto key = co_await ac.load_key_nv(NV);
+    if (!key)
+        co_return key.rc();
+
+    std::vector<tpm2totp::task<int>> tasks;
+    for (std::size_t i = 0; i < clients; i++) {
+        tasks.push_back(client(ac, *key, requests, served));
+        tasks.back().start();
+    }
+
+    int rc = 0;
+    for (auto &t : tasks) {
+        int r = co_await t;
+        if (r != 0)
+            rc = r;
+    }
+    co_return rc;
+}
+
+/* The event loop: wait for the TPM, continue its operations */
+static int
+run(tpm2totp::async_context &ac, tpm2totp::task<int> &main_task)
+{
+    struct epoll_event events[8];
+    int epfd, n;
+
+    auto handles = ac.poll_handles();
+    if (!handles)
+        return handles.rc();
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        return -1;
+    for (const auto &h : *handles) {
+        struct epoll_event ev = {};
+        if (h.events & POLLIN)
+            ev.events |= EPOLLIN;
+        if (h.events & POLLOUT)
+            ev.events |= EPOLLOUT;
+        ev.data.fd = h.fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, h.fd, &ev) != 0) {
+            close(epfd);
+            return -1;
+        }
+    }
+
+    main_task.start();
+    while (!main_task.done()) {
+        if (!ac.busy()) {
+            std::fprintf(stderr, "Coroutines wait without a TPM operation\n");
+            close(epfd);
+            return -1;
+        }
+        n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), -1);
+        if (n < 0 && errno != EINTR) {
+            close(epfd);
+            return -1;
+        }
+        ac.on_ready();
+    }
+    close(epfd);
+    return main_task.get();
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned long latency = argc > 1 ? std::strtoul(argv[1], nullptr, 0)
+                                     : 1000;
+    std::size_t clients = argc > 2 ? std::strtoul(argv[2], nullptr, 0) : 16;
+    std::size_t requests = argc > 3 ? std::strtoul(argv[3], nullptr, 0) : 8;
+    std::size_t total = clients * requests, served = 0;
+    TSS2_TCTI_CONTEXT *tcti;
+    struct timespec start;
+    double sync_ms, coro_ms;
+    int rc;
+
+    if (total == 0) {
+        std::fprintf(stderr, "At least one request is needed\n");
+        return 1;
+    }
+    rc = tcti_libtpms_new(nullptr, &tcti);
+    if (rc != 0) {
+        std::fprintf(stderr, "tcti_libtpms_new failed: 0x%08x\n", rc);
+        return 1;
+    }
+    {
+        auto opened = tpm2totp::context::open(tcti);
+        if (!opened) {
+            std::fprintf(stderr, "Opening the context failed: 0x%08x\n",
+                         opened.rc());
+            return 1;
+        }
+        tpm2totp::context ctx = std::move(*opened);
+
+        auto k = ctx.generate_key();
+        if (!k || !ctx.store_key_nv(k->key, NV)) {
+            std::fprintf(stderr, "Preparing the key failed\n");
+            return 1;
+        }
+        tcti_libtpms_set_latency(tcti, latency);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (std::size_t i = 0; i < total; i++) {
+            auto code = ctx.calculate(k->key);
+            if (!code) {
+                std::fprintf(stderr, "calculate failed: 0x%08x\n", code.rc());
+                return 1;
+            }
+        }
+        sync_ms = elapsed_ms(&start);
+
+        tpm2totp::async_context ac(ctx);
+        auto main_task = service(ac, clients, requests, served);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        rc = run(ac, main_task);
+        coro_ms = elapsed_ms(&start);
+        if (rc != 0 || served != total) {
+            std::fprintf(stderr, "Served %zu of %zu requests: 0x%08x\n",
+                         served, total, rc);
+            return 1;
+        }
+
+        tcti_libtpms_set_latency(tcti, 0);
+        (void)ctx.delete_key_nv(NV);
+    }
+    tcti_libtpms_free(&tcti);
+
+    std::printf("%zu requests, %lu us TPM latency\n", total, latency);
+    std::printf("blocking:   %8.1f ms (%.0f/s)\n", sync_ms,
+                total / sync_ms * 1e3);
+    std::printf("coroutines: %8.1f ms (%.0f/s), %zu clients\n", coro_ms,
+                total / coro_ms * 1e3, clients);
+    return 0;
+}
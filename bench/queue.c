@@ -0,0 +1,225 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <tpm2-totp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "keytemplates.h"
+#include "tcti-libtpms.h"
+
+/* Measures how long parallel client processes wait for a TPM that only one
+   of them can open at a time, as /dev/tpm0 without a resource manager. Each
+   client calculates codes on an in-process TPM with the given latency per
+   command, while holding an exclusive lock that stands for the open device.
+   The clients either retry the lock after a pause, as they would on EBUSY,
+   or line up with tpm2totp_queue_enter(). Usage:
+   bench-queue [clients] [rounds] [latency-us] */
+
+/* Pause between attempts to open a busy device */
+#define RETRY_US 5000
+
+enum { MODE_RETRY = 0, MODE_QUEUE, MODE_MAX };
+static const char *mode_names[MODE_MAX] = { "retry", "queue" };
+
+static double
+elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 +
+           (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static int
+compare(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Take the lock that stands for the open device, without waiting */
+static int
+device_open(int fd)
+{
+    struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+
+    return fcntl(fd, F_OFD_SETLK, &fl);
+}
+
+static void
+device_close(int fd)
+{
+    struct flock fl = { .l_type = F_UNLCK, .l_whence = SEEK_SET };
+
+    fcntl(fd, F_OFD_SETLK, &fl);
+}
+
+/* One client process, which records the wait of every round in waits */
+static int
+client(int mode, const char *device, const char *queuefile, int go,
+       size_t rounds, unsigned long latency, double *waits)
+{
+    TSS2_TCTI_CONTEXT *tcti;
+    TPM2TOTP_CONTEXT *context;
+    TPM2TOTP_QUEUE *queue;
+    uint8_t *secret, *keyBlob;
+    size_t secret_size, keyBlob_size;
+    struct timespec start;
+    uint64_t totp;
+    time_t now;
+    char c;
+    int fd, rc;
+
+    fd = open(device, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return 1;
+    rc = tcti_libtpms_new(NULL, &tcti);
+    if (rc != 0)
+        return 1;
+    rc = tpm2totp_context_new(tcti, &context);
+    if (rc != 0)
+        return 1;
+    rc = tpm2totp_context_generateKey(context, DEFAULT_PCRS, DEFAULT_BANKS,
+                                      NULL, &secret, &secret_size,
+                                      &keyBlob, &keyBlob_size);
+    if (rc != 0)
+        return 1;
+    tcti_libtpms_set_latency(tcti, latency);
+
+    /* Start together with the other clients */
+    if (read(go, &c, 1) != 0)
+        return 1;
+
+    for (size_t i = 0; i < rounds; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (mode == MODE_QUEUE) {
+            if (tpm2totp_queue_enter(queuefile, -1, &queue) != 0 ||
+                device_open(fd) != 0)
+                return 1;
+        } else {
+            while (device_open(fd) != 0)
+                usleep(RETRY_US);
+        }
+        waits[i] = elapsed_ms(&start);
+
+        rc = tpm2totp_context_calculate(context, keyBlob, keyBlob_size,
+                                        &now, &totp);
+        device_close(fd);
+        if (mode == MODE_QUEUE)
+            tpm2totp_queue_leave(queue);
+        if (rc != 0)
+            return 1;
+    }
+
+    tcti_libtpms_set_latency(tcti, 0);
+    tpm2totp_context_free(context);
+    tcti_libtpms_free(&tcti);
+    free(keyBlob);
+    free(secret);
+    close(fd);
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t clients = argc > 1 ? strtoul(argv[1], NULL, 0) : 8;
+    size_t rounds = argc > 2 ? strtoul(argv[2], NULL, 0) : 20;
+    unsigned long latency = argc > 3 ? strtoul(argv[3], NULL, 0) : 2000;
+    char device[] = "/tmp/tpm2-totp-device-XXXXXX";
+    char queuefile[] = "/tmp/tpm2-totp-queue-XXXXXX";
+    size_t total = clients * rounds;
+    double *waits, *sorted, wall_ms, sum, least, most;
+    struct timespec start;
+    int go[2], status, failed = 0;
+    pid_t pid;
+
+    if (clients == 0 || rounds == 0) {
+        fprintf(stderr, "At least one client and round are needed\n");
+        return 1;
+    }
+    waits = mmap(NULL, total * sizeof(*waits), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    sorted = calloc(total, sizeof(*sorted));
+    if (waits == MAP_FAILED || !sorted) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    close(mkstemp(device));
+    close(mkstemp(queuefile));
+
+    printf("%zu clients, %zu rounds, %lu us TPM latency\n", clients, rounds,
+           latency);
+    printf("%-8s %10s %10s %10s %10s %12s\n", "mode", "codes/s",
+           "p50 ms", "p99 ms", "max ms", "unfairness");
+
+    for (int mode = 0; mode < MODE_MAX; mode++) {
+        if (pipe(go) != 0) {
+            fprintf(stderr, "pipe failed: %s\n", strerror(errno));
+            return 1;
+        }
+        for (size_t c = 0; c < clients; c++) {
+            pid = fork();
+            if (pid < 0) {
+                fprintf(stderr, "fork failed: %s\n", strerror(errno));
+                return 1;
+            }
+            if (pid == 0) {
+                close(go[1]);
+                _exit(client(mode, device, queuefile, go[0], rounds, latency,
+                             &waits[c * rounds]));
+            }
+        }
+        close(go[0]);
+        /* The clients start once the pipe is closed, after their setup */
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        close(go[1]);
+        while ((pid = wait(&status)) > 0)
+            failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+        wall_ms = elapsed_ms(&start);
+        if (failed) {
+            fprintf(stderr, "A %s client failed\n", mode_names[mode]);
+            return 1;
+        }
+
+        /* The clients waiting the least and the most in sum */
+        least = most = -1;
+        for (size_t c = 0; c < clients; c++) {
+            sum = 0;
+            for (size_t i = 0; i < rounds; i++)
+                sum += waits[c * rounds + i];
+            if (least < 0 || sum < least)
+                least = sum;
+            if (sum > most)
+                most = sum;
+        }
+        memcpy(sorted, waits, total * sizeof(*sorted));
+        qsort(sorted, total, sizeof(*sorted), compare);
+
+        printf("%-8s %10.1f %10.1f %10.1f %10.1f %11.2fx\n", mode_names[mode],
+               total * 1e3 / wall_ms, sorted[total / 2],
+               sorted[total * 99 / 100], sorted[total - 1],
+               least > 0 ? most / least : 1.0);
+    }
+
+    unlink(device);
+    unlink(queuefile);
+    munmap(waits, total * sizeof(*waits));
+    free(sorted);
+    return 0;
+}
@@ -0,0 +1,169 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <tpm2-totp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tss2/tss2_tctildr.h>
+
+/* Calculates codes over one library context for a long time, as done by a
+   daemon, and fails if the resident memory grows or TPM objects are left
+   behind. Usage: bench-soak [calculations] [tcti] */
+
+#define SAMPLES 100
+#define WARMUP 1000
+#define RSS_SLACK_KB 1024
+
+static double
+elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 +
+           (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Resident set size in kB */
+static long
+rss_kb(void)
+{
+    long size, resident = -1;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (!f)
+        return -1;
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+        resident = -1;
+    fclose(f);
+    return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Number of transient objects and sessions loaded in the TPM */
+static int
+tpm_handles(ESYS_CONTEXT *ctx, uint32_t *count)
+{
+    static const TPM2_HANDLE first[] = { TPM2_TRANSIENT_FIRST,
+                                         TPM2_LOADED_SESSION_FIRST };
+    TPMS_CAPABILITY_DATA *data;
+    TSS2_RC rc;
+
+    *count = 0;
+    for (size_t i = 0; i < sizeof(first) / sizeof(first[0]); i++) {
+        rc = Esys_GetCapability(ctx, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                                TPM2_CAP_HANDLES, first[i],
+                                TPM2_MAX_CAP_HANDLES, NULL, &data);
+        if (rc != TSS2_RC_SUCCESS)
+            return -1;
+        *count += data->data.handles.count;
+        free(data);
+    }
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t calculations = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+    const char *config = argc > 2 ? argv[2] : NULL;
+    TSS2_TCTI_CONTEXT *tcti;
+    TPM2TOTP_CONTEXT *context;
+    ESYS_CONTEXT *ctx;
+    uint8_t *secret, *keyBlob;
+    size_t secret_size, keyBlob_size, step;
+    uint32_t handles, handles_start = 0;
+    long rss, rss_start = 0, rss_max = 0;
+    uint64_t totp;
+    time_t now;
+    struct timespec start;
+    double ms;
+    int rc;
+
+    if (calculations <= WARMUP) {
+        fprintf(stderr, "At least %d calculations are needed\n", WARMUP + 1);
+        return 1;
+    }
+    step = (calculations - WARMUP) / SAMPLES;
+    if (step == 0) step = 1;
+
+    rc = Tss2_TctiLdr_Initialize(config, &tcti);
+    if (rc != TSS2_RC_SUCCESS) {
+        fprintf(stderr, "Tss2_TctiLdr_Initialize failed: 0x%08x\n", rc);
+        return 1;
+    }
+    rc = tpm2totp_context_new(tcti, &context);
+    if (rc != 0) {
+        fprintf(stderr, "tpm2totp_context_new failed: 0x%08x\n", rc);
+        return 1;
+    }
+    /* A second ESYS context on the same TCTI looks at the TPM's handles */
+    rc = Esys_Initialize(&ctx, tcti, NULL);
+    if (rc != TSS2_RC_SUCCESS) {
+        fprintf(stderr, "Esys_Initialize failed: 0x%08x\n", rc);
+        return 1;
+    }
+
+    rc = tpm2totp_context_generateKey(context, 0, 0, NULL,
+                                      &secret, &secret_size,
+                                      &keyBlob, &keyBlob_size);
+    if (rc != 0) {
+        fprintf(stderr, "tpm2totp_context_generateKey failed: 0x%08x\n", rc);
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < calculations; i++) {
+        rc = tpm2totp_context_calculate(context, keyBlob, keyBlob_size,
+                                        &now, &totp);
+        if (rc != 0) {
+            fprintf(stderr, "tpm2totp_context_calculate failed after %zu "
+                    "calculations: 0x%08x\n", i, rc);
+            return 1;
+        }
+        if (i + 1 < WARMUP || (i + 1 - WARMUP) % step != 0)
+            continue;
+
+        rss = rss_kb();
+        if (rss < 0 || tpm_handles(ctx, &handles) != 0) {
+            fprintf(stderr, "Sampling the process or the TPM failed\n");
+            return 1;
+        }
+        if (i + 1 == WARMUP) {
+            rss_start = rss;
+            handles_start = handles;
+        }
+        if (rss > rss_max)
+            rss_max = rss;
+        if (handles != handles_start) {
+            fprintf(stderr, "%u TPM handles after %zu calculations, %u after "
+                    "%d\n", handles, i + 1, handles_start, WARMUP);
+            return 1;
+        }
+    }
+    ms = elapsed_ms(&start);
+
+    printf("%zu calculations in %.1f s (%.0f/s), RSS %ld kB -> %ld kB, "
+           "%u TPM handles\n", calculations, ms / 1e3,
+           calculations / ms * 1e3, rss_start, rss_max, handles_start);
+
+    Esys_Finalize(&ctx);
+    tpm2totp_context_free(context);
+    Tss2_TctiLdr_Finalize(&tcti);
+    free(keyBlob);
+    free(secret);
+
+    if (rss_max - rss_start > RSS_SLACK_KB) {
+        fprintf(stderr, "RSS grew by %ld kB\n", rss_max - rss_start);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <tpm2-totp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sha1mb.h"
+
+/* Verifies codes of many devices against a ±1 day window. Every tenth code
+   is wrong and costs a full window search; the others drift up to ±3 steps.
+   Usage: bench-verify [devices] [window] [kernel] */
+
+static double
+elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 +
+           (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t devices = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000;
+    unsigned int window = argc > 2 ? strtoul(argv[2], NULL, 0) : 2880;
+    const char *kernel = argc > 3 ? argv[3] : NULL;
+    uint8_t (*secrets)[20] = calloc(devices, sizeof(*secrets));
+    const uint8_t **secret_ptrs = calloc(devices, sizeof(*secret_ptrs));
+    size_t *sizes = calloc(devices, sizeof(*sizes));
+    time_t *times = calloc(devices, sizeof(*times));
+    uint64_t *otps = calloc(devices, sizeof(*otps));
+    int *drifts = calloc(devices, sizeof(*drifts));
+    int *matches = calloc(devices, sizeof(*matches));
+    size_t matched = 0;
+    struct timespec start;
+    int rc;
+
+    if (!secrets || !secret_ptrs || !sizes || !times || !otps || !drifts ||
+        !matches) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    if (sha1mb_use(kernel) != 0) {
+        fprintf(stderr, "SHA-1 kernel %s not supported\n", kernel);
+        return 1;
+    }
+
+    for (size_t i = 0; i < devices; i++) {
+        for (size_t j = 0; j < sizeof(secrets[i]); j++)
+            secrets[i][j] = rand();
+        secret_ptrs[i] = &secrets[i][0];
+        sizes[i] = sizeof(secrets[i]);
+        times[i] = 1500000000 + i;
+        rc = tpm2totp_softCalculate(secret_ptrs[i], sizes[i],
+                                    times[i] + 30 * ((int)(i % 7) - 3), 1,
+                                    &otps[i]);
+        if (rc != 0)
+            return 1;
+        if (i % 10 == 0)
+            otps[i] = 1000000;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rc = tpm2totp_verifyMany(devices, secret_ptrs, sizes, times, otps, window,
+                             drifts, matches);
+    if (rc != 0)
+        return 1;
+    for (size_t i = 0; i < devices; i++)
+        matched += matches[i];
+
+    printf("%zu devices, window ±%u: %zu matched, %.1f ms\n",
+           devices, window, matched, elapsed_ms(&start));
+
+    free(matches);
+    free(drifts);
+    free(otps);
+    free(times);
+    free(sizes);
+    free(secret_ptrs);
+    free(secrets);
+    return 0;
+}
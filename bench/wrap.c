@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <tpm2-totp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/x509.h>
+#include <tss2/tss2_mu.h>
+
+#include "keytemplates.h"
+
+/* Wraps keys for the storage primary keys of many machines, as done by a
+   provisioning server. Every machine gets its own random parent key.
+   Usage: bench-wrap [machines] [password] */
+
+static double
+elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 +
+           (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Create the public part of a storage primary key as returned by
+   tpm2totp_getPrimaryPublic(), with a software key in place of the TPM's */
+static int
+fake_primary(uint8_t *blob, size_t blob_size, size_t *size)
+{
+    TPM2B_PUBLIC primary = TPM2B_PUBLIC_PRIMARY_TEMPLATE;
+    TPMS_ECC_POINT *point = &primary.publicArea.unique.ecc;
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    EVP_PKEY *key = NULL;
+    unsigned char *der = NULL;
+    int der_size;
+
+    *size = 0;
+    if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0 ||
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx,
+                                               NID_X9_62_prime256v1) <= 0 ||
+        EVP_PKEY_keygen(ctx, &key) <= 0) {
+        EVP_PKEY_CTX_free(ctx);
+        return -1;
+    }
+    EVP_PKEY_CTX_free(ctx);
+
+    /* The uncompressed point ends the DER encoding */
+    der_size = i2d_PUBKEY(key, &der);
+    EVP_PKEY_free(key);
+    if (der_size < 64) {
+        OPENSSL_free(der);
+        return -1;
+    }
+    point->x.size = 32;
+    memcpy(&point->x.buffer[0], &der[der_size - 64], 32);
+    point->y.size = 32;
+    memcpy(&point->y.buffer[0], &der[der_size - 32], 32);
+    OPENSSL_free(der);
+
+    return Tss2_MU_TPM2B_PUBLIC_Marshal(&primary, blob, blob_size, size) ?
+           -1 : 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t machines = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000;
+    const char *password = argc > 2 ? argv[2] : NULL;
+    uint8_t (*primaries)[sizeof(TPM2B_PUBLIC)];
+    size_t *primary_sizes;
+    uint8_t pcrValues[3 * (20 + 32)] = { 0 };
+    uint8_t *secret, *importBlob;
+    size_t secret_size, importBlob_size, blob_bytes = 0;
+    struct timespec start;
+    double ms;
+    int rc;
+
+    primaries = calloc(machines, sizeof(*primaries));
+    primary_sizes = calloc(machines, sizeof(*primary_sizes));
+    if (!primaries || !primary_sizes) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < machines; i++) {
+        if (fake_primary(primaries[i], sizeof(primaries[i]),
+                         &primary_sizes[i]) != 0) {
+            fprintf(stderr, "Creating a primary key failed\n");
+            return 1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < machines; i++) {
+        rc = tpm2totp_wrapKey(0, 0, pcrValues, sizeof(pcrValues), password,
+                              primaries[i], primary_sizes[i],
+                              &secret, &secret_size,
+                              &importBlob, &importBlob_size);
+        if (rc != 0) {
+            fprintf(stderr, "tpm2totp_wrapKey failed: %d\n", rc);
+            return 1;
+        }
+        blob_bytes += importBlob_size;
+        free(secret);
+        free(importBlob);
+    }
+    ms = elapsed_ms(&start);
+
+    printf("%zu keys wrapped in %.1f ms (%.0f keys/s, %zu bytes per blob)\n",
+           machines, ms, machines / ms * 1e3, blob_bytes / machines);
+
+    free(primary_sizes);
+    free(primaries);
+    return 0;
+}
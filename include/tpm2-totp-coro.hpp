@@ -0,0 +1,495 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#ifndef TPM2_TOTP_CORO_HPP
+#define TPM2_TOTP_CORO_HPP
+
+#include <tpm2-totp.hpp>
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <vector>
+
+/* C++20 coroutines over the asynchronous operations of the library.
+ *
+ * An async_context queues the operations awaited by any number of coroutines
+ * on one thread and runs them on the TPM one after the other, since a TPM
+ * executes one command at a time anyway. Calculations queued behind each
+ * other are coalesced into one batch over a single policy session. The event
+ * loop waits for the poll handles and calls on_ready(), which resumes the
+ * coroutines whose operations are complete. Like the rest of the bindings,
+ * nothing throws; an exception escaping a task terminates. */
+
+namespace tpm2totp {
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+class task_promise_base {
+public:
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+
+        template <typename P>
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            std::coroutine_handle<> c = h.promise().continuation;
+            return c ? c : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    final_awaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() noexcept { std::terminate(); }
+
+    /* Coroutine awaiting the task, resumed when it is done */
+    std::coroutine_handle<> continuation;
+    bool started = false;
+};
+
+template <typename T>
+class task_promise : public task_promise_base {
+public:
+    task<T> get_return_object() noexcept;
+
+    template <typename U>
+    void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+
+    std::optional<T> value;
+};
+
+template <>
+class task_promise<void> : public task_promise_base {
+public:
+    task<void> get_return_object() noexcept;
+
+    void return_void() noexcept {}
+};
+
+/* An operation queued on an async_context, held by its awaiter */
+struct async_op {
+    enum class kind { calculate, load } k = kind::calculate;
+    async_op *next = nullptr;
+    std::coroutine_handle<> waiter;
+    int rc = 0;
+    bool alone = false;     /* retried without others after a failed batch */
+    /* calculate */
+    const blob_view *keys = nullptr;
+    totp *codes = nullptr;
+    std::size_t count = 0;
+    /* load */
+    std::uint32_t nv = 0;
+    blob key;
+};
+
+} /* namespace detail */
+
+/** A lazily started coroutine, which may be awaited by another one. */
+template <typename T>
+class [[nodiscard]] task {
+public:
+    using promise_type = detail::task_promise<T>;
+
+    task() noexcept = default;
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+    task(task &&other) noexcept : h_(std::exchange(other.h_, nullptr)) {}
+    task &operator=(task &&other) noexcept
+    {
+        if (this != &other) {
+            if (h_)
+                h_.destroy();
+            h_ = std::exchange(other.h_, nullptr);
+        }
+        return *this;
+    }
+    ~task()
+    {
+        if (h_)
+            h_.destroy();
+    }
+
+    /** Run the coroutine until it first suspends, without awaiting it. */
+    void start()
+    {
+        h_.promise().started = true;
+        h_.resume();
+    }
+
+    bool done() const noexcept { return !h_ || h_.done(); }
+
+    /** Value of a finished task. */
+    T get()
+    {
+        if constexpr (!std::is_void_v<T>)
+            return std::move(*h_.promise().value);
+    }
+
+    bool await_ready() const noexcept { return done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept
+    {
+        h_.promise().continuation = h;
+        /* A started task resumes the awaiting one when it is done */
+        if (h_.promise().started)
+            return std::noop_coroutine();
+        h_.promise().started = true;
+        return h_;
+    }
+
+    T await_resume() { return get(); }
+
+private:
+    friend promise_type;
+
+    explicit task(std::coroutine_handle<promise_type> h) noexcept : h_(h) {}
+
+    std::coroutine_handle<promise_type> h_;
+};
+
+/** Operations of a library context awaited by coroutines on one thread. */
+class async_context {
+public:
+    /** Run the operations of ctx, with up to max_batch keys per batch. */
+    explicit async_context(context &ctx, std::size_t max_batch = 64) noexcept
+        : ctx_(ctx.get()), max_batch_(max_batch ? max_batch : 1) {}
+    async_context(const async_context &) = delete;
+    async_context &operator=(const async_context &) = delete;
+
+    /** Handles to poll for the TPM's response, e.g. with epoll. */
+    result<std::vector<TSS2_TCTI_POLL_HANDLE>> poll_handles() const
+    {
+        TSS2_TCTI_POLL_HANDLE *handles;
+        std::size_t count;
+        int rc = tpm2totp_context_getPollHandles(ctx_, &handles, &count);
+
+        if (rc != 0)
+            return rc;
+        std::vector<TSS2_TCTI_POLL_HANDLE> v(handles, handles + count);
+        std::free(handles);
+        return v;
+    }
+
+    /** Whether an operation is running on the TPM. */
+    bool busy() const noexcept { return running_ != nullptr; }
+
+    /** Continue the running operation once the poll handles are ready.
+     *
+     * Resumes the coroutines of a completed operation after the next queued
+     * one has been sent to the TPM. Spurious calls are harmless. */
+    void on_ready()
+    {
+        detail::async_op *done = running_;
+        std::time_t now = 0;
+        int rc;
+
+        if (!done)
+            return;
+
+        if (done->k == detail::async_op::kind::load) {
+            rc = tpm2totp_context_loadKey_nv_finish(ctx_,
+                                                    done->key.out_data(),
+                                                    done->key.out_size());
+        } else {
+            rc = tpm2totp_context_calculateMany_finish(ctx_, &now,
+                                                       otps_.data());
+        }
+        if (rc == TPM2TOTP_RC_TRY_AGAIN)
+            return;
+
+        running_ = nullptr;
+        /* One bad key must not fail the requests batched with it */
+        if (rc != 0 && done->next) {
+            retry(done);
+            resume(start());
+            return;
+        }
+
+        std::size_t i = 0;
+        for (detail::async_op *op = done; op; op = op->next) {
+            op->rc = rc;
+            if (rc != 0 || op->k != detail::async_op::kind::calculate)
+                continue;
+            for (std::size_t j = 0; j < op->count; j++)
+                op->codes[j] = { otps_[i++], now };
+        }
+
+        detail::async_op *failed = start();
+        resume(done);
+        resume(failed);
+    }
+
+    class calculate_awaiter;
+    template <std::size_t N>
+    class calculate_many_awaiter;
+    class load_key_nv_awaiter;
+
+    /** Await the code of a key; the key must stay valid until resumed. */
+    calculate_awaiter calculate(blob_view key) noexcept;
+
+    /** Await the codes of N keys for the same time step. */
+    template <std::size_t N>
+    calculate_many_awaiter<N>
+    calculate_many(const std::array<blob_view, N> &keys) noexcept;
+
+    /** Await a key loaded from an NV index. */
+    load_key_nv_awaiter load_key_nv(std::uint32_t nv = 0) noexcept;
+
+private:
+    class op_awaiter {
+    public:
+        op_awaiter(const op_awaiter &) = delete;
+        op_awaiter &operator=(const op_awaiter &) = delete;
+
+        bool await_ready() const noexcept { return false; }
+
+    protected:
+        explicit op_awaiter(async_context &ac) noexcept : ac_(ac) {}
+
+        bool submit(std::coroutine_handle<> h)
+        {
+            op_.waiter = h;
+            return ac_.submit(op_);
+        }
+
+        async_context &ac_;
+        detail::async_op op_;
+    };
+
+    /* Queue an operation; false if it failed right away */
+    bool submit(detail::async_op &op)
+    {
+        op.next = nullptr;
+        op.rc = 0;
+        op.alone = false;
+        if (tail_)
+            tail_->next = &op;
+        else
+            head_ = &op;
+        tail_ = &op;
+
+        if (running_)
+            return true;
+        /* Nothing runs only while the queue is empty, so op is the head */
+        return start() == nullptr;
+    }
+
+    /* Send the operations at the head of the queue to the TPM until one
+       runs, returning those which failed to start */
+    detail::async_op *start()
+    {
+        detail::async_op *failed = nullptr, **failed_tail = &failed;
+
+        while (head_ && !running_) {
+            detail::async_op *batch = head_, *last = head_;
+            std::size_t total = head_->count;
+            int rc;
+
+            if (batch->k == detail::async_op::kind::load) {
+                rc = tpm2totp_context_loadKey_nv_async(ctx_, batch->nv);
+            } else {
+                while (!batch->alone && last->next && !last->next->alone &&
+                       last->next->k == detail::async_op::kind::calculate &&
+                       total + last->next->count <= max_batch_) {
+                    last = last->next;
+                    total += last->count;
+                }
+                data_.clear();
+                sizes_.clear();
+                for (detail::async_op *op = batch; ; op = op->next) {
+                    for (std::size_t j = 0; j < op->count; j++) {
+                        data_.push_back(op->keys[j].data());
+                        sizes_.push_back(op->keys[j].size());
+                    }
+                    if (op == last)
+                        break;
+                }
+                otps_.resize(total);
+                rc = tpm2totp_context_calculateMany_async(ctx_, total,
+                                                          data_.data(),
+                                                          sizes_.data());
+            }
+
+            head_ = last->next;
+            if (!head_)
+                tail_ = nullptr;
+            last->next = nullptr;
+
+            if (rc == 0) {
+                running_ = batch;
+                break;
+            }
+            if (batch != last) {
+                retry(batch);
+                continue;
+            }
+            for (detail::async_op *op = batch; op; op = op->next)
+                op->rc = rc;
+            *failed_tail = batch;
+            failed_tail = &last->next;
+        }
+        return failed;
+    }
+
+    /* Put the operations of a failed batch back at the head of the queue, to
+       be run one by one */
+    void retry(detail::async_op *batch) noexcept
+    {
+        detail::async_op *last = batch;
+
+        for (;;) {
+            last->alone = true;
+            if (!last->next)
+                break;
+            last = last->next;
+        }
+        last->next = head_;
+        if (!head_)
+            tail_ = last;
+        head_ = batch;
+    }
+
+    static void resume(detail::async_op *op)
+    {
+        while (op) {
+            /* The coroutine may destroy op */
+            detail::async_op *next = op->next;
+            op->waiter.resume();
+            op = next;
+        }
+    }
+
+    TPM2TOTP_CONTEXT *ctx_;
+    std::size_t max_batch_;
+    detail::async_op *head_ = nullptr, *tail_ = nullptr;
+    detail::async_op *running_ = nullptr;
+    std::vector<const std::uint8_t *> data_;
+    std::vector<std::size_t> sizes_;
+    std::vector<std::uint64_t> otps_;
+};
+
+class async_context::calculate_awaiter : public async_context::op_awaiter {
+public:
+    calculate_awaiter(async_context &ac, blob_view key) noexcept
+        : op_awaiter(ac), key_(key) {}
+
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        op_.k = detail::async_op::kind::calculate;
+        op_.keys = &key_;
+        op_.codes = &code_;
+        op_.count = 1;
+        return submit(h);
+    }
+
+    result<totp> await_resume() noexcept
+    {
+        if (op_.rc != 0)
+            return op_.rc;
+        return totp(code_);
+    }
+
+private:
+    blob_view key_;
+    totp code_;
+};
+
+template <std::size_t N>
+class async_context::calculate_many_awaiter
+    : public async_context::op_awaiter {
+public:
+    static_assert(N > 0, "At least one key is needed");
+
+    calculate_many_awaiter(async_context &ac,
+                           const std::array<blob_view, N> &keys) noexcept
+        : op_awaiter(ac), keys_(keys) {}
+
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        op_.k = detail::async_op::kind::calculate;
+        op_.keys = keys_.data();
+        op_.codes = codes_.data();
+        op_.count = N;
+        return submit(h);
+    }
+
+    result<std::array<totp, N>> await_resume() noexcept
+    {
+        if (op_.rc != 0)
+            return op_.rc;
+        return std::array<totp, N>(codes_);
+    }
+
+private:
+    std::array<blob_view, N> keys_;
+    std::array<totp, N> codes_;
+};
+
+class async_context::load_key_nv_awaiter : public async_context::op_awaiter {
+public:
+    load_key_nv_awaiter(async_context &ac, std::uint32_t nv) noexcept
+        : op_awaiter(ac), nv_(nv) {}
+
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        op_.k = detail::async_op::kind::load;
+        op_.nv = nv_;
+        return submit(h);
+    }
+
+    result<blob> await_resume() noexcept
+    {
+        if (op_.rc != 0)
+            return op_.rc;
+        return std::move(op_.key);
+    }
+
+private:
+    std::uint32_t nv_;
+};
+
+inline async_context::calculate_awaiter
+async_context::calculate(blob_view key) noexcept
+{
+    return { *this, key };
+}
+
+template <std::size_t N>
+inline async_context::calculate_many_awaiter<N>
+async_context::calculate_many(const std::array<blob_view, N> &keys) noexcept
+{
+    return { *this, keys };
+}
+
+inline async_context::load_key_nv_awaiter
+async_context::load_key_nv(std::uint32_t nv) noexcept
+{
+    return { *this, nv };
+}
+
+template <typename T>
+task<T>
+detail::task_promise<T>::get_return_object() noexcept
+{
+    return task<T>(std::coroutine_handle<task_promise>::from_promise(*this));
+}
+
+inline task<void>
+detail::task_promise<void>::get_return_object() noexcept
+{
+    return task<void>(
+        std::coroutine_handle<task_promise>::from_promise(*this));
+}
+
+} /* namespace tpm2totp */
+
+#endif /* TPM2_TOTP_CORO_HPP */
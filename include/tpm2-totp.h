@@ -8,39 +8,328 @@
 #define TPM2_TOTP_H
 
 #include <stdint.h>
+#include <stdio.h>
 #include <time.h>
 #include <tss2/tss2_esys.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define TPM2TOTP_BANK_SHA1 (1 << 0)
 #define TPM2TOTP_BANK_SHA256 (1 << 1)
 #define TPM2TOTP_BANK_SHA384 (1 << 2)
+/* Seal to the strongest single bank of the TPM (among the banks given along)
+   that covers the PCRs and that the firmware measures into */
+#define TPM2TOTP_BANK_AUTO (1 << 30)
+
+/* Size of a key's SHA256 policy digest */
+#define TPM2TOTP_POLICY_SIZE 32
+
+/* Returned by the _finish functions while the TPM has not answered yet */
+#define TPM2TOTP_RC_TRY_AGAIN ((int)TSS2_ESYS_RC_TRY_AGAIN)
 
 int
 tpm2totp_generateKey(uint32_t pcrs, uint32_t banks, const char *password,
                      uint8_t **secret, size_t *secret_size,
                      uint8_t **keyBlob, size_t *keyBlob_size);
 
+int
+tpm2totp_generateKey_tcti(uint32_t pcrs, uint32_t banks,
+                          const char *password,
+                          TSS2_TCTI_CONTEXT *tcti_context,
+                          uint8_t **secret, size_t *secret_size,
+                          uint8_t **keyBlob, size_t *keyBlob_size);
+
+typedef int (*tpm2totp_generate_cb)(uint32_t nv, const uint8_t *secret,
+                                   size_t secret_size, void *userdata);
+
+int
+tpm2totp_generateKeys_nv(uint32_t pcrs, uint32_t banks, const char *password,
+                         const uint32_t *nvs, size_t count,
+                         TSS2_TCTI_CONTEXT *tcti_context,
+                         tpm2totp_generate_cb callback, void *userdata);
+
+typedef struct TPM2TOTP_POOL TPM2TOTP_POOL;
+
+int
+tpm2totp_pool_new(uint32_t pcrs, uint32_t banks, const char *password,
+                  size_t size, TSS2_TCTI_CONTEXT *tcti_context,
+                  TPM2TOTP_POOL **pool);
+
+size_t
+tpm2totp_pool_count(TPM2TOTP_POOL *pool);
+
+int
+tpm2totp_pool_generateKey_nv(TPM2TOTP_POOL *pool, uint32_t nv,
+                             uint8_t **secret, size_t *secret_size);
+
+int
+tpm2totp_pool_setMeasurements(TPM2TOTP_POOL *pool, const char *imaCount,
+                              const char *eventlog);
+
+void
+tpm2totp_pool_free(TPM2TOTP_POOL *pool);
+
+typedef struct TPM2TOTP_QUEUE TPM2TOTP_QUEUE;
+
+int
+tpm2totp_queue_enter(const char *path, int timeout_ms, TPM2TOTP_QUEUE **queue);
+
+void
+tpm2totp_queue_leave(TPM2TOTP_QUEUE *queue);
+
+int
+tpm2totp_getPrimaryPublic(TSS2_TCTI_CONTEXT *tcti_context,
+                          uint8_t **primaryPublic, size_t *primaryPublic_size);
+
+int
+tpm2totp_wrapKey(uint32_t pcrs, uint32_t banks,
+                 const uint8_t *pcrValues, size_t pcrValues_size,
+                 const char *password,
+                 const uint8_t *primaryPublic, size_t primaryPublic_size,
+                 uint8_t **secret, size_t *secret_size,
+                 uint8_t **importBlob, size_t *importBlob_size);
+
+int
+tpm2totp_policyDigest(uint32_t pcrs, uint32_t banks,
+                      const uint8_t *pcrValues, size_t pcrValues_size,
+                      uint8_t *digest);
+
+int
+tpm2totp_importKey(const uint8_t *importBlob, size_t importBlob_size,
+                   TSS2_TCTI_CONTEXT *tcti_context,
+                   uint8_t **keyBlob, size_t *keyBlob_size);
+
 int
 tpm2totp_reseal(const uint8_t *keyBlob, size_t keyBlob_size,
                 const char *password, uint32_t pcrs, uint32_t banks,
                 uint8_t **newBlob, size_t *newBlob_size);
 
+int
+tpm2totp_reseal_tcti(const uint8_t *keyBlob, size_t keyBlob_size,
+                     const char *password, uint32_t pcrs, uint32_t banks,
+                     TSS2_TCTI_CONTEXT *tcti_context,
+                     uint8_t **newBlob, size_t *newBlob_size);
+
+int
+tpm2totp_resealKeys_nv(const char *password, uint32_t pcrs, uint32_t banks,
+                       const uint32_t *nvs, size_t count,
+                       TSS2_TCTI_CONTEXT *tcti_context);
+
 int
 tpm2totp_storeKey_nv(const uint8_t *keyBlob, size_t keyBlob_size, uint32_t nv);
 
+int
+tpm2totp_storeKey_nv_tcti(const uint8_t *keyBlob, size_t keyBlob_size,
+                          uint32_t nv, TSS2_TCTI_CONTEXT *tcti_context);
+
 int
 tpm2totp_loadKey_nv(uint32_t nv, uint8_t **keyBlob, size_t *keyBlob_size);
 
+int
+tpm2totp_loadKey_nv_tcti(uint32_t nv, TSS2_TCTI_CONTEXT *tcti_context,
+                         uint8_t **keyBlob, size_t *keyBlob_size);
+
 int
 tpm2totp_deleteKey_nv(uint32_t nv);
 
+int
+tpm2totp_deleteKey_nv_tcti(uint32_t nv, TSS2_TCTI_CONTEXT *tcti_context);
+
+typedef int (*tpm2totp_list_cb)(uint32_t nv, uint32_t pcrs, uint32_t banks,
+                                void *userdata);
+
+int
+tpm2totp_listKeys_nv(TSS2_TCTI_CONTEXT *tcti_context,
+                     tpm2totp_list_cb callback, void *userdata);
+
+int
+tpm2totp_prepareKey_nv(uint32_t nv, TSS2_TCTI_CONTEXT *tcti_context,
+                       uint8_t **prepared, size_t *prepared_size);
+
+int
+tpm2totp_calculatePrepared(const uint8_t *prepared, size_t prepared_size,
+                           TSS2_TCTI_CONTEXT *tcti_context,
+                           time_t *now, uint64_t *otp);
+
 int
 tpm2totp_calculate(const uint8_t *keyBlob, size_t keyBlob_size,
                    time_t *now, uint64_t *otp);
 
+int
+tpm2totp_calculate_tcti(const uint8_t *keyBlob, size_t keyBlob_size,
+                        TSS2_TCTI_CONTEXT *tcti_context,
+                        time_t *now, uint64_t *otp);
+
+int
+tpm2totp_calculateMany(size_t count, const uint8_t *const *keyBlobs,
+                       const size_t *keyBlob_sizes,
+                       TSS2_TCTI_CONTEXT *tcti_context,
+                       time_t *now, uint64_t *otps);
+
 int
 tpm2totp_getSecret(const uint8_t *keyBlob, size_t keyBlob_size, 
                    const char *password,
                    uint8_t **secret, size_t *secret_size);
 
+int
+tpm2totp_getSecret_tcti(const uint8_t *keyBlob, size_t keyBlob_size,
+                        const char *password, TSS2_TCTI_CONTEXT *tcti_context,
+                        uint8_t **secret, size_t *secret_size);
+
+typedef struct TPM2TOTP_CONTEXT TPM2TOTP_CONTEXT;
+
+int
+tpm2totp_context_new(TSS2_TCTI_CONTEXT *tcti_context,
+                     TPM2TOTP_CONTEXT **context);
+
+void
+tpm2totp_context_free(TPM2TOTP_CONTEXT *context);
+
+int
+tpm2totp_context_setAuth(TPM2TOTP_CONTEXT *context, const char *ownerAuth,
+                         const char *nvAuth);
+
+int
+tpm2totp_context_setEventLog(TPM2TOTP_CONTEXT *context, const char *path);
+
+int
+tpm2totp_context_generateKey(TPM2TOTP_CONTEXT *context,
+                             uint32_t pcrs, uint32_t banks,
+                             const char *password,
+                             uint8_t **secret, size_t *secret_size,
+                             uint8_t **keyBlob, size_t *keyBlob_size);
+
+int
+tpm2totp_context_generateKeys_nv(TPM2TOTP_CONTEXT *context,
+                                 uint32_t pcrs, uint32_t banks,
+                                 const char *password,
+                                 const uint32_t *nvs, size_t count,
+                                 tpm2totp_generate_cb callback, void *userdata);
+
+int
+tpm2totp_context_getPrimaryPublic(TPM2TOTP_CONTEXT *context,
+                                  uint8_t **primaryPublic,
+                                  size_t *primaryPublic_size);
+
+int
+tpm2totp_context_importKey(TPM2TOTP_CONTEXT *context,
+                           const uint8_t *importBlob, size_t importBlob_size,
+                           uint8_t **keyBlob, size_t *keyBlob_size);
+
+int
+tpm2totp_context_reseal(TPM2TOTP_CONTEXT *context,
+                        const uint8_t *keyBlob, size_t keyBlob_size,
+                        const char *password, uint32_t pcrs, uint32_t banks,
+                        uint8_t **newBlob, size_t *newBlob_size);
+
+int
+tpm2totp_context_resealKeys_nv(TPM2TOTP_CONTEXT *context,
+                               const char *password,
+                               uint32_t pcrs, uint32_t banks,
+                               const uint32_t *nvs, size_t count);
+
+int
+tpm2totp_context_storeKey_nv(TPM2TOTP_CONTEXT *context,
+                             const uint8_t *keyBlob, size_t keyBlob_size,
+                             uint32_t nv);
+
+int
+tpm2totp_context_loadKey_nv(TPM2TOTP_CONTEXT *context, uint32_t nv,
+                            uint8_t **keyBlob, size_t *keyBlob_size);
+
+int
+tpm2totp_context_deleteKey_nv(TPM2TOTP_CONTEXT *context, uint32_t nv);
+
+int
+tpm2totp_context_listKeys_nv(TPM2TOTP_CONTEXT *context,
+                             tpm2totp_list_cb callback, void *userdata);
+
+int
+tpm2totp_context_calculate(TPM2TOTP_CONTEXT *context,
+                           const uint8_t *keyBlob, size_t keyBlob_size,
+                           time_t *now, uint64_t *otp);
+
+int
+tpm2totp_context_calculateMany(TPM2TOTP_CONTEXT *context, size_t count,
+                               const uint8_t *const *keyBlobs,
+                               const size_t *keyBlob_sizes,
+                               time_t *now, uint64_t *otps);
+
+int
+tpm2totp_context_prepareKey_nv(TPM2TOTP_CONTEXT *context, uint32_t nv,
+                               uint8_t **prepared, size_t *prepared_size);
+
+int
+tpm2totp_context_calculatePrepared(TPM2TOTP_CONTEXT *context,
+                                   const uint8_t *prepared,
+                                   size_t prepared_size,
+                                   time_t *now, uint64_t *otp);
+
+int
+tpm2totp_context_getSecret(TPM2TOTP_CONTEXT *context,
+                           const uint8_t *keyBlob, size_t keyBlob_size,
+                           const char *password,
+                           uint8_t **secret, size_t *secret_size);
+
+int
+tpm2totp_context_getPollHandles(TPM2TOTP_CONTEXT *context,
+                                TSS2_TCTI_POLL_HANDLE **handles,
+                                size_t *count);
+
+int
+tpm2totp_context_calculate_async(TPM2TOTP_CONTEXT *context,
+                                 const uint8_t *keyBlob, size_t keyBlob_size);
+
+int
+tpm2totp_context_calculate_finish(TPM2TOTP_CONTEXT *context,
+                                  time_t *now, uint64_t *otp);
+
+int
+tpm2totp_context_calculateMany_async(TPM2TOTP_CONTEXT *context, size_t count,
+                                     const uint8_t *const *keyBlobs,
+                                     const size_t *keyBlob_sizes);
+
+int
+tpm2totp_context_calculateMany_finish(TPM2TOTP_CONTEXT *context,
+                                      time_t *now, uint64_t *otps);
+
+int
+tpm2totp_context_loadKey_nv_async(TPM2TOTP_CONTEXT *context, uint32_t nv);
+
+int
+tpm2totp_context_loadKey_nv_finish(TPM2TOTP_CONTEXT *context,
+                                   uint8_t **keyBlob, size_t *keyBlob_size);
+
+int
+tpm2totp_softCalculate(const uint8_t *secret, size_t secret_size, time_t now,
+                       size_t count, uint64_t *otps);
+
+int
+tpm2totp_verify(const uint8_t *secret, size_t secret_size, time_t now,
+                uint64_t otp, unsigned int window, int *drift);
+
+int
+tpm2totp_verifyMany(size_t count, const uint8_t *const *secrets,
+                    const size_t *secret_sizes, const time_t *times,
+                    const uint64_t *otps, unsigned int window,
+                    int *drifts, int *matches);
+
+int
+tpm2totp_metrics_write(FILE *out);
+
+int
+tpm2totp_metrics_writeFile(const char *path);
+
+int
+tpm2totp_metrics_listen(const char *path, int *fd);
+
+int
+tpm2totp_metrics_serve(int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* TPM2_TOTP_H */
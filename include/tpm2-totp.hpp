@@ -0,0 +1,401 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#ifndef TPM2_TOTP_HPP
+#define TPM2_TOTP_HPP
+
+#include <tpm2-totp.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#if __has_include(<version>)
+#include <version>
+#endif
+#ifdef __cpp_lib_span
+#include <span>
+#endif
+
+/* C++17 bindings of the library.
+ *
+ * A context is a move-only handle of a TPM2TOTP_CONTEXT. Keys and secrets
+ * returned by the library are owned by move-only buffers, which free them
+ * (and clear secrets) on destruction without copying. Operations return
+ * their results by value together with an error code; no exceptions are
+ * thrown. */
+
+namespace tpm2totp {
+
+/** Error category of the library's return codes. */
+class error_category : public std::error_category {
+public:
+    const char *name() const noexcept override { return "tpm2-totp"; }
+
+    std::string message(int rc) const override
+    {
+        char buf[32];
+
+        switch (rc) {
+        case -1:
+            return "general failure";
+        case -10:
+            return "password required";
+        case -20:
+            return "stopped by the callback";
+        default:
+            std::snprintf(buf, sizeof(buf), "TSS2 error 0x%08x",
+                          static_cast<unsigned int>(rc));
+            return buf;
+        }
+    }
+};
+
+inline const std::error_category &
+category() noexcept
+{
+    static const error_category instance;
+    return instance;
+}
+
+/** Return code of an operation, 0 on success. */
+class [[nodiscard]] status {
+public:
+    constexpr status(int rc = 0) noexcept : rc_(rc) {}
+
+    constexpr bool ok() const noexcept { return rc_ == 0; }
+    constexpr explicit operator bool() const noexcept { return rc_ == 0; }
+    constexpr int rc() const noexcept { return rc_; }
+    std::error_code error() const noexcept { return { rc_, category() }; }
+
+private:
+    int rc_;
+};
+
+/** Value of an operation, valid if the status is ok. */
+template <typename T>
+class [[nodiscard]] result {
+public:
+    result(int rc) noexcept(std::is_nothrow_default_constructible_v<T>)
+        : value_(), status_(rc) {}
+    result(T &&value) noexcept(std::is_nothrow_move_constructible_v<T>)
+        : value_(std::move(value)), status_(0) {}
+
+    bool ok() const noexcept { return status_.ok(); }
+    explicit operator bool() const noexcept { return status_.ok(); }
+    int rc() const noexcept { return status_.rc(); }
+    std::error_code error() const noexcept { return status_.error(); }
+
+    T &value() & noexcept { return value_; }
+    const T &value() const & noexcept { return value_; }
+    T &&value() && noexcept { return std::move(value_); }
+    T &operator*() & noexcept { return value_; }
+    const T &operator*() const & noexcept { return value_; }
+    T *operator->() noexcept { return &value_; }
+    const T *operator->() const noexcept { return &value_; }
+
+private:
+    T value_;
+    status status_;
+};
+
+/** Non-owning view of a key or other blob. */
+class blob_view {
+public:
+    constexpr blob_view() noexcept = default;
+    constexpr blob_view(const std::uint8_t *data, std::size_t size) noexcept
+        : data_(data), size_(size) {}
+    blob_view(const std::byte *data, std::size_t size) noexcept
+        : data_(reinterpret_cast<const std::uint8_t *>(data)), size_(size) {}
+
+    /** View of any contiguous container of bytes, e.g. a std::vector. */
+    template <typename C,
+              typename = decltype(std::declval<const C &>().data()),
+              typename = std::enable_if_t<
+                  sizeof(*std::declval<const C &>().data()) == 1>>
+    blob_view(const C &c) noexcept
+        : data_(reinterpret_cast<const std::uint8_t *>(c.data())),
+          size_(c.size()) {}
+
+#ifdef __cpp_lib_span
+    blob_view(std::span<const std::byte> s) noexcept
+        : data_(reinterpret_cast<const std::uint8_t *>(s.data())),
+          size_(s.size()) {}
+
+    std::span<const std::byte> bytes() const noexcept
+    {
+        return { reinterpret_cast<const std::byte *>(data_), size_ };
+    }
+#endif
+
+    constexpr const std::uint8_t *data() const noexcept { return data_; }
+    constexpr std::size_t size() const noexcept { return size_; }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+
+private:
+    const std::uint8_t *data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+namespace detail {
+
+/* Memory allocated by the library, released with free() */
+template <bool Wipe>
+class malloc_buffer {
+public:
+    malloc_buffer() noexcept = default;
+    malloc_buffer(std::uint8_t *data, std::size_t size) noexcept
+        : data_(data), size_(size) {}
+    malloc_buffer(const malloc_buffer &) = delete;
+    malloc_buffer &operator=(const malloc_buffer &) = delete;
+    malloc_buffer(malloc_buffer &&other) noexcept
+        : data_(std::exchange(other.data_, nullptr)),
+          size_(std::exchange(other.size_, 0)) {}
+    malloc_buffer &operator=(malloc_buffer &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            data_ = std::exchange(other.data_, nullptr);
+            size_ = std::exchange(other.size_, 0);
+        }
+        return *this;
+    }
+    ~malloc_buffer() { reset(); }
+
+    void reset() noexcept
+    {
+        if (Wipe && data_) {
+            volatile std::uint8_t *p = data_;
+            for (std::size_t i = 0; i < size_; i++)
+                p[i] = 0;
+        }
+        std::free(data_);
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    const std::uint8_t *data() const noexcept { return data_; }
+    std::size_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return size_ == 0; }
+
+    std::uint8_t **out_data() noexcept { reset(); return &data_; }
+    std::size_t *out_size() noexcept { return &size_; }
+
+private:
+    std::uint8_t *data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+} /* namespace detail */
+
+/** A key or another blob returned by the library. */
+using blob = detail::malloc_buffer<false>;
+
+/** A TOTP secret, cleared when it is released. */
+using secret = detail::malloc_buffer<true>;
+
+/** A calculated code. */
+struct totp {
+    std::uint64_t code = 0;
+    std::time_t time = 0;
+
+    /** RFC 6238 time step of the code. */
+    constexpr std::uint64_t timestep() const noexcept
+    {
+        return static_cast<std::uint64_t>(time) / 30;
+    }
+};
+
+/** A newly generated key and its secret. */
+struct generated_key {
+    tpm2totp::secret secret;
+    blob key;
+};
+
+/** Library context of one TPM. */
+class context {
+public:
+    context() noexcept = default;
+    context(const context &) = delete;
+    context &operator=(const context &) = delete;
+    context(context &&other) noexcept
+        : ctx_(std::exchange(other.ctx_, nullptr)) {}
+    context &operator=(context &&other) noexcept
+    {
+        if (this != &other) {
+            tpm2totp_context_free(ctx_);
+            ctx_ = std::exchange(other.ctx_, nullptr);
+        }
+        return *this;
+    }
+    ~context() { tpm2totp_context_free(ctx_); }
+
+    /** Open a context on a TPM, by default the tpm2-tss default TCTI. */
+    static result<context> open(TSS2_TCTI_CONTEXT *tcti = nullptr) noexcept
+    {
+        context c;
+        int rc = tpm2totp_context_new(tcti, &c.ctx_);
+
+        if (rc != 0)
+            return rc;
+        return c;
+    }
+
+    TPM2TOTP_CONTEXT *get() const noexcept { return ctx_; }
+    explicit operator bool() const noexcept { return ctx_ != nullptr; }
+
+    result<generated_key>
+    generate_key(std::uint32_t pcrs = 0, std::uint32_t banks = 0,
+                 const char *password = nullptr) noexcept
+    {
+        generated_key k;
+        int rc = tpm2totp_context_generateKey(ctx_, pcrs, banks, password,
+                                              k.secret.out_data(),
+                                              k.secret.out_size(),
+                                              k.key.out_data(),
+                                              k.key.out_size());
+        if (rc != 0)
+            return rc;
+        return k;
+    }
+
+    status store_key_nv(blob_view key, std::uint32_t nv = 0) noexcept
+    {
+        return tpm2totp_context_storeKey_nv(ctx_, key.data(), key.size(), nv);
+    }
+
+    result<blob> load_key_nv(std::uint32_t nv = 0) noexcept
+    {
+        blob b;
+        int rc = tpm2totp_context_loadKey_nv(ctx_, nv, b.out_data(),
+                                             b.out_size());
+        if (rc != 0)
+            return rc;
+        return b;
+    }
+
+    /** Load the key of an NV index for calculate_prepared() until reboot. */
+    result<blob> prepare_key_nv(std::uint32_t nv = 0) noexcept
+    {
+        blob b;
+        int rc = tpm2totp_context_prepareKey_nv(ctx_, nv, b.out_data(),
+                                                b.out_size());
+        if (rc != 0)
+            return rc;
+        return b;
+    }
+
+    status delete_key_nv(std::uint32_t nv = 0) noexcept
+    {
+        return tpm2totp_context_deleteKey_nv(ctx_, nv);
+    }
+
+    result<totp> calculate(blob_view key) noexcept
+    {
+        totp t;
+        int rc = tpm2totp_context_calculate(ctx_, key.data(), key.size(),
+                                            &t.time, &t.code);
+        if (rc != 0)
+            return rc;
+        return t;
+    }
+
+    result<totp> calculate_prepared(blob_view prepared) noexcept
+    {
+        totp t;
+        int rc = tpm2totp_context_calculatePrepared(ctx_, prepared.data(),
+                                                    prepared.size(),
+                                                    &t.time, &t.code);
+        if (rc != 0)
+            return rc;
+        return t;
+    }
+
+    /** Calculate the codes of N keys for the same time step. */
+    template <std::size_t N>
+    result<std::array<totp, N>>
+    calculate_many(const std::array<blob_view, N> &keys) noexcept
+    {
+        static_assert(N > 0, "At least one key is needed");
+        std::array<totp, N> t;
+        std::array<const std::uint8_t *, N> data;
+        std::array<std::size_t, N> sizes;
+        std::array<std::uint64_t, N> codes;
+        std::time_t now;
+
+        for (std::size_t i = 0; i < N; i++) {
+            data[i] = keys[i].data();
+            sizes[i] = keys[i].size();
+        }
+        int rc = tpm2totp_context_calculateMany(ctx_, N, data.data(),
+                                                sizes.data(), &now,
+                                                codes.data());
+        if (rc != 0)
+            return rc;
+        for (std::size_t i = 0; i < N; i++)
+            t[i] = { codes[i], now };
+        return t;
+    }
+
+    result<blob> reseal(blob_view key, const char *password,
+                        std::uint32_t pcrs = 0,
+                        std::uint32_t banks = 0) noexcept
+    {
+        blob b;
+        int rc = tpm2totp_context_reseal(ctx_, key.data(), key.size(),
+                                         password, pcrs, banks,
+                                         b.out_data(), b.out_size());
+        if (rc != 0)
+            return rc;
+        return b;
+    }
+
+    result<secret> get_secret(blob_view key, const char *password) noexcept
+    {
+        secret s;
+        int rc = tpm2totp_context_getSecret(ctx_, key.data(), key.size(),
+                                            password, s.out_data(),
+                                            s.out_size());
+        if (rc != 0)
+            return rc;
+        return s;
+    }
+
+    result<blob> primary_public() noexcept
+    {
+        blob b;
+        int rc = tpm2totp_context_getPrimaryPublic(ctx_, b.out_data(),
+                                                   b.out_size());
+        if (rc != 0)
+            return rc;
+        return b;
+    }
+
+    result<blob> import_key(blob_view wrapped) noexcept
+    {
+        blob b;
+        int rc = tpm2totp_context_importKey(ctx_, wrapped.data(),
+                                            wrapped.size(), b.out_data(),
+                                            b.out_size());
+        if (rc != 0)
+            return rc;
+        return b;
+    }
+
+private:
+    TPM2TOTP_CONTEXT *ctx_ = nullptr;
+};
+
+} /* namespace tpm2totp */
+
+#endif /* TPM2_TOTP_HPP */
@@ -0,0 +1,629 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#define _DEFAULT_SOURCE
+
+#include <tpm2-totp.h>
+#include "context.h"
+#include "keytemplates.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <tss2/tss2_esys.h>
+
+/* Asynchronous operations run the same TPM commands as their synchronous
+   counterparts, one ESYS _Async/_Finish pair per step. Every call of a
+   _finish function completes as many steps as the TPM has answered and sends
+   the command of the next one, so the caller only waits on the poll handles
+   while the TPM works. */
+
+enum async_step {
+    STEP_SALT = 0,
+    STEP_AUTH,
+    STEP_FLUSH_SALT,
+    STEP_PRIMARY,
+    STEP_SESSION,
+    STEP_LOAD,
+    STEP_POLICY,
+    STEP_HMAC,
+    STEP_FLUSH_KEY,
+    STEP_FLUSH_SESSION,
+    STEP_NV_HANDLE,
+    STEP_NV_PUBLIC,
+    STEP_NV_READ,
+    STEP_DONE
+};
+
+struct async_key {
+    TPM2B_PUBLIC keyPublic;
+    TPM2B_PRIVATE keyPrivate;
+    TPML_PCR_SELECTION pcrsel;
+};
+
+struct async {
+    enum { ASYNC_CALCULATE, ASYNC_LOAD } kind;
+    enum metrics_op op;
+    uint64_t start;
+    enum async_step step;
+    enum async_step next; /* step after starting the HMAC session */
+    /* calculate */
+    size_t count, i;
+    struct async_key *keys;
+    uint64_t *otps;
+    ESYS_TR salt, session, key;
+    time_t now;
+    TPM2B_MAX_BUFFER input;
+    /* loadKey_nv */
+    uint32_t nv;
+    ESYS_TR nvHandle;
+    UINT16 nvSize;
+    TPM2B_MAX_NV_BUFFER *blob;
+};
+
+static const TPMT_SYM_DEF sym = {.algorithm = TPM2_ALG_AES,
+                                 .keyBits = {.aes = 128},
+                                 .mode = {.aes = TPM2_ALG_CFB}
+};
+
+/** Get the session authorizing the owner or NV command of a step.
+ *
+ * The HMAC session of the context was started by STEP_SALT to
+ * STEP_FLUSH_SALT if needed.
+ * @param[in] context Library context of the TPM.
+ * @retval The session or ESYS_TR_PASSWORD without authorization values.
+ */
+static ESYS_TR
+async_auth(TPM2TOTP_CONTEXT *context)
+{
+    if (!CONTEXT_AUTH(context))
+        return ESYS_TR_PASSWORD;
+    Esys_TRSess_SetAttributes(context->esys, context->session,
+                              TPMA_SESSION_CONTINUESESSION, 0xff);
+    return context->session;
+}
+
+static int
+try_again(TSS2_RC rc)
+{
+    /* ESYS passes TRY_AGAIN of the lower layers through */
+    return (rc & ~TSS2_RC_LAYER_MASK) == TSS2_BASE_RC_TRY_AGAIN;
+}
+
+/** Send the command of the current step.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[in] a Pending operation.
+ * @retval TSS2_RC_SUCCESS on success.
+ */
+static TSS2_RC
+async_send(TPM2TOTP_CONTEXT *context, struct async *a)
+{
+    ESYS_CONTEXT *ctx = context->esys;
+    struct async_key *k = a->keys ? &a->keys[a->i] : NULL;
+
+    switch (a->step) {
+    case STEP_SALT:
+        return Esys_CreatePrimary_Async(ctx, ESYS_TR_RH_NULL,
+                                        ESYS_TR_PASSWORD, ESYS_TR_NONE,
+                                        ESYS_TR_NONE, &primarySensitive,
+                                        &primaryPublic, &allOutsideInfo,
+                                        &allCreationPCR);
+    case STEP_AUTH:
+        return Esys_StartAuthSession_Async(ctx, a->salt, ESYS_TR_NONE,
+                                           ESYS_TR_NONE, ESYS_TR_NONE,
+                                           ESYS_TR_NONE, NULL, TPM2_SE_HMAC,
+                                           &sym, TPM2_ALG_SHA256);
+    case STEP_FLUSH_SALT:
+        return Esys_FlushContext_Async(ctx, a->salt);
+    case STEP_PRIMARY:
+        return Esys_CreatePrimary_Async(ctx, ESYS_TR_RH_OWNER,
+                                        async_auth(context), ESYS_TR_NONE,
+                                        ESYS_TR_NONE, &primarySensitive,
+                                        &primaryPublic, &allOutsideInfo,
+                                        &allCreationPCR);
+    case STEP_SESSION:
+        return Esys_StartAuthSession_Async(ctx, ESYS_TR_NONE, ESYS_TR_NONE,
+                                           ESYS_TR_NONE, ESYS_TR_NONE,
+                                           ESYS_TR_NONE, NULL, TPM2_SE_POLICY,
+                                           &sym, TPM2_ALG_SHA256);
+    case STEP_LOAD:
+        return Esys_Load_Async(ctx, context->primary,
+                               ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
+                               &k->keyPrivate, &k->keyPublic);
+    case STEP_POLICY:
+        return Esys_PolicyPCR_Async(ctx, a->session,
+                                    ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                                    NULL, &k->pcrsel);
+    case STEP_HMAC:
+        return Esys_HMAC_Async(ctx, a->key,
+                               a->session, ESYS_TR_NONE, ESYS_TR_NONE,
+                               &a->input, TPM2_ALG_SHA1);
+    case STEP_FLUSH_KEY:
+        return Esys_FlushContext_Async(ctx, a->key);
+    case STEP_FLUSH_SESSION:
+        return Esys_FlushContext_Async(ctx, a->session);
+    case STEP_NV_HANDLE:
+        return Esys_TR_FromTPMPublic_Async(ctx, a->nv, ESYS_TR_NONE,
+                                           ESYS_TR_NONE, ESYS_TR_NONE);
+    case STEP_NV_PUBLIC:
+        return Esys_NV_ReadPublic_Async(ctx, a->nvHandle, ESYS_TR_NONE,
+                                        ESYS_TR_NONE, ESYS_TR_NONE);
+    case STEP_NV_READ:
+        return Esys_NV_Read_Async(ctx, a->nvHandle, a->nvHandle,
+                                  async_auth(context), ESYS_TR_NONE,
+                                  ESYS_TR_NONE, a->nvSize, 0/*=offset*/);
+    default:
+        return TSS2_ESYS_RC_BAD_SEQUENCE;
+    }
+}
+
+/** Receive the response of the current step and move on to the next one.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[in] a Pending operation.
+ * @retval TSS2_RC_SUCCESS on success.
+ * @retval TRY_AGAIN of any layer if the response is not there yet.
+ * @retval -1 on undefined/general failure.
+ */
+static int
+async_receive(TPM2TOTP_CONTEXT *context, struct async *a)
+{
+    ESYS_CONTEXT *ctx = context->esys;
+    TPM2B_DIGEST *output;
+    TPM2B_NV_PUBLIC *publicInfo;
+    TSS2_RC rc;
+    int ret;
+
+    switch (a->step) {
+    case STEP_SALT:
+        rc = Esys_CreatePrimary_Finish(ctx, &a->salt, NULL, NULL, NULL, NULL);
+        if (rc != TSS2_RC_SUCCESS) {
+            a->salt = ESYS_TR_NONE;
+            return rc;
+        }
+        a->step = STEP_AUTH;
+        break;
+    case STEP_AUTH:
+        rc = Esys_StartAuthSession_Finish(ctx, &context->session);
+        if (rc != TSS2_RC_SUCCESS) {
+            context->session = ESYS_TR_NONE;
+            return rc;
+        }
+        a->step = STEP_FLUSH_SALT;
+        break;
+    case STEP_FLUSH_SALT:
+        rc = Esys_FlushContext_Finish(ctx);
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+        a->salt = ESYS_TR_NONE;
+        a->step = a->next;
+        break;
+    case STEP_PRIMARY:
+        rc = Esys_CreatePrimary_Finish(ctx, &context->primary,
+                                       NULL, NULL, NULL, NULL);
+        if (rc != TSS2_RC_SUCCESS) {
+            context->primary = ESYS_TR_NONE;
+            return rc;
+        }
+        a->step = STEP_SESSION;
+        break;
+    case STEP_SESSION:
+        rc = Esys_StartAuthSession_Finish(ctx, &a->session);
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+        a->now = time(NULL);
+        context_totp_input(a->now, &a->input);
+        a->step = STEP_LOAD;
+        break;
+    case STEP_LOAD:
+        rc = Esys_Load_Finish(ctx, &a->key);
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+        a->step = STEP_POLICY;
+        break;
+    case STEP_POLICY:
+        rc = Esys_PolicyPCR_Finish(ctx);
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+        a->step = STEP_HMAC;
+        break;
+    case STEP_HMAC:
+        rc = Esys_HMAC_Finish(ctx, &output);
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+        ret = context_totp_truncate(output, &a->otps[a->i]);
+        free(output);
+        if (ret)
+            return ret;
+        a->step = STEP_FLUSH_KEY;
+        break;
+    case STEP_FLUSH_KEY:
+        rc = Esys_FlushContext_Finish(ctx);
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+        a->key = ESYS_TR_NONE;
+        a->step = ++a->i < a->count ? STEP_LOAD : STEP_FLUSH_SESSION;
+        break;
+    case STEP_FLUSH_SESSION:
+        rc = Esys_FlushContext_Finish(ctx);
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+        a->session = ESYS_TR_NONE;
+        a->step = STEP_DONE;
+        break;
+    case STEP_NV_HANDLE:
+        rc = Esys_TR_FromTPMPublic_Finish(ctx, &a->nvHandle);
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+        Esys_TR_SetAuth(ctx, a->nvHandle, &context->nvAuth);
+        a->step = STEP_NV_PUBLIC;
+        break;
+    case STEP_NV_PUBLIC:
+        rc = Esys_NV_ReadPublic_Finish(ctx, &publicInfo, NULL);
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+        a->nvSize = publicInfo->nvPublic.dataSize;
+        free(publicInfo);
+        a->step = STEP_NV_READ;
+        break;
+    case STEP_NV_READ:
+        rc = Esys_NV_Read_Finish(ctx, &a->blob);
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+        a->step = STEP_DONE;
+        break;
+    default:
+        return -1;
+    }
+    return TSS2_RC_SUCCESS;
+}
+
+/** Release the state of an operation and the TPM objects it still holds.
+ *
+ * @param[in] context Library context of the TPM.
+ */
+static void
+async_done(TPM2TOTP_CONTEXT *context)
+{
+    ESYS_CONTEXT *ctx = context->esys;
+    struct async *a = context->async;
+
+    Esys_SetTimeout(ctx, TSS2_TCTI_TIMEOUT_BLOCK);
+    if (a->salt != ESYS_TR_NONE)
+        Esys_FlushContext(ctx, a->salt);
+    if (a->key != ESYS_TR_NONE)
+        Esys_FlushContext(ctx, a->key);
+    if (a->session != ESYS_TR_NONE)
+        Esys_FlushContext(ctx, a->session);
+    if (a->nvHandle != ESYS_TR_NONE)
+        Esys_TR_Close(ctx, &a->nvHandle);
+    free(a->blob);
+    free(a->otps);
+    free(a->keys);
+    free(a);
+    context->async = NULL;
+}
+
+/** Abort a pending asynchronous operation.
+ *
+ * The response to the command in flight is awaited, since ESYS cannot send
+ * another one before, and the objects created so far are flushed.
+ * @param[in] context Library context of the TPM.
+ */
+void
+async_abort(TPM2TOTP_CONTEXT *context)
+{
+    int rc;
+
+    if (!context || !context->async)
+        return;
+
+    Esys_SetTimeout(context->esys, TSS2_TCTI_TIMEOUT_BLOCK);
+    do {
+        rc = async_receive(context, context->async);
+    } while (try_again(rc));
+    async_done(context);
+}
+
+/** Start an operation by sending the command of its first step.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[in] a The new operation.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+static int
+async_start(TPM2TOTP_CONTEXT *context, struct async *a)
+{
+    TSS2_RC rc;
+
+    a->start = metrics_now();
+    a->salt = ESYS_TR_NONE;
+    a->session = ESYS_TR_NONE;
+    a->key = ESYS_TR_NONE;
+    a->nvHandle = ESYS_TR_NONE;
+    context->async = a;
+
+    /* Owner and NV commands share the HMAC session of the context */
+    if ((a->step == STEP_PRIMARY || a->step == STEP_NV_HANDLE) &&
+        CONTEXT_AUTH(context) && context->session == ESYS_TR_NONE) {
+        a->next = a->step;
+        a->step = STEP_SALT;
+    }
+
+    rc = Esys_SetTimeout(context->esys, 0);
+    chkrc(rc, goto error);
+
+    rc = async_send(context, a);
+    chkrc(rc, goto error);
+
+    return 0;
+
+error:
+    metrics_op(a->op, a->start, rc);
+    async_done(context);
+    return (rc)? (int)rc : -1;
+}
+
+/** Continue the pending operation as far as the TPM has answered.
+ *
+ * @param[in] context Library context of the TPM.
+ * @retval 0 when the operation is complete.
+ * @retval TPM2TOTP_RC_TRY_AGAIN while it waits for the TPM.
+ * @retval -1 on undefined/general failure.
+ */
+static int
+async_run(TPM2TOTP_CONTEXT *context)
+{
+    struct async *a = context->async;
+    int rc;
+
+    for (;;) {
+        rc = async_receive(context, a);
+        if (try_again(rc))
+            return TPM2TOTP_RC_TRY_AGAIN;
+        chkrc(rc, return rc);
+        if (a->step == STEP_DONE)
+            return 0;
+        rc = async_send(context, a);
+        chkrc(rc, return rc);
+    }
+}
+
+/** Get the handles to poll for the response of a pending operation.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[out] handles Poll handles of the TPM, to be freed by the caller.
+ * @param[out] count Number of handles.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+int
+tpm2totp_context_getPollHandles(TPM2TOTP_CONTEXT *context,
+                                TSS2_TCTI_POLL_HANDLE **handles,
+                                size_t *count)
+{
+    TSS2_RC rc;
+
+    if (context == NULL || handles == NULL || count == NULL) {
+        return -1;
+    }
+
+    rc = Esys_GetPollHandles(context->esys, handles, count);
+    chkrc(rc, return rc);
+
+    return 0;
+}
+
+/** Start calculating time-based one-time passwords for several keys.
+ *
+ * The keys are unmarshalled right away and need not be kept. The operation
+ * runs the same commands as tpm2totp_context_calculateMany() and is continued
+ * by tpm2totp_context_calculateMany_finish(). No other operation may be
+ * started on the context before it is finished.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[in] count Number of keys.
+ * @param[in] keyBlobs Keys to generate the TOTPs.
+ * @param[in] keyBlob_sizes Sizes of the keys.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+int
+tpm2totp_context_calculateMany_async(TPM2TOTP_CONTEXT *context, size_t count,
+                                     const uint8_t *const *keyBlobs,
+                                     const size_t *keyBlob_sizes)
+{
+    struct async *a;
+    int rc;
+
+    if (context == NULL || context->async != NULL || keyBlobs == NULL ||
+            keyBlob_sizes == NULL || count == 0) {
+        return -1;
+    }
+
+    a = calloc(1, sizeof(*a));
+    if (!a)
+        return -1;
+    a->kind = ASYNC_CALCULATE;
+    a->op = count == 1 ? METRICS_OP_CALCULATE : METRICS_OP_CALCULATE_BATCH;
+    a->count = count;
+    a->keys = calloc(count, sizeof(*a->keys));
+    a->otps = calloc(count, sizeof(*a->otps));
+    if (!a->keys || !a->otps) {
+        free(a->keys);
+        free(a->otps);
+        free(a);
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        rc = context_unmarshal_key(keyBlobs[i], keyBlob_sizes[i],
+                                   &a->keys[i].keyPublic,
+                                   &a->keys[i].keyPrivate,
+                                   &a->keys[i].pcrsel);
+        if (rc) {
+            free(a->keys);
+            free(a->otps);
+            free(a);
+            return rc;
+        }
+    }
+
+    if (context->primary != ESYS_TR_NONE) {
+        metrics_count(METRICS_CACHE_HIT);
+        a->step = STEP_SESSION;
+    } else {
+        metrics_count(METRICS_CACHE_MISS);
+        a->step = STEP_PRIMARY;
+    }
+
+    return async_start(context, a);
+}
+
+/** Continue calculating time-based one-time passwords for several keys.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[out] nowp Time the TOTPs were calculated for.
+ * @param[out] otps Calculated TOTPs, one per key.
+ * @retval 0 on success.
+ * @retval TPM2TOTP_RC_TRY_AGAIN if the TPM has not answered yet.
+ * @retval -1 on undefined/general failure.
+ */
+int
+tpm2totp_context_calculateMany_finish(TPM2TOTP_CONTEXT *context,
+                                      time_t *nowp, uint64_t *otps)
+{
+    struct async *a;
+    int rc;
+
+    if (context == NULL || context->async == NULL || otps == NULL ||
+            context->async->kind != ASYNC_CALCULATE) {
+        return -1;
+    }
+    a = context->async;
+
+    rc = async_run(context);
+    if (rc == TPM2TOTP_RC_TRY_AGAIN)
+        return rc;
+
+    if (rc == 0) {
+        memcpy(otps, a->otps, a->count * sizeof(*otps));
+        metrics_code(a->now);
+        if (nowp) *nowp = a->now;
+    }
+    metrics_op(a->op, a->start, rc);
+    async_done(context);
+    return rc;
+}
+
+/** Start calculating a time-based one-time password for a key.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[in] keyBlob Key to generate the TOTP.
+ * @param[in] keyBlob_size Size of the key.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+int
+tpm2totp_context_calculate_async(TPM2TOTP_CONTEXT *context,
+                                 const uint8_t *keyBlob, size_t keyBlob_size)
+{
+    return tpm2totp_context_calculateMany_async(context, 1, &keyBlob,
+                                                &keyBlob_size);
+}
+
+/** Continue calculating a time-based one-time password for a key.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[out] nowp Time the TOTP was calculated for.
+ * @param[out] otp Calculated TOTP.
+ * @retval 0 on success.
+ * @retval TPM2TOTP_RC_TRY_AGAIN if the TPM has not answered yet.
+ * @retval -1 on undefined/general failure.
+ */
+int
+tpm2totp_context_calculate_finish(TPM2TOTP_CONTEXT *context,
+                                  time_t *nowp, uint64_t *otp)
+{
+    if (context == NULL || context->async == NULL ||
+            context->async->count != 1) {
+        return -1;
+    }
+
+    return tpm2totp_context_calculateMany_finish(context, nowp, otp);
+}
+
+/** Start loading a key from an NV index.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[in] nv NV index of the key (0 for the default index).
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+int
+tpm2totp_context_loadKey_nv_async(TPM2TOTP_CONTEXT *context, uint32_t nv)
+{
+    struct async *a;
+
+    if (context == NULL || context->async != NULL) {
+        return -1;
+    }
+
+    a = calloc(1, sizeof(*a));
+    if (!a)
+        return -1;
+    a->kind = ASYNC_LOAD;
+    a->op = METRICS_OP_LOAD;
+    a->nv = nv ? nv : DEFAULT_NV;
+    a->step = STEP_NV_HANDLE;
+
+    return async_start(context, a);
+}
+
+/** Continue loading a key from an NV index.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[out] keyBlob The loaded key.
+ * @param[out] keyBlob_size Size of the key.
+ * @retval 0 on success.
+ * @retval TPM2TOTP_RC_TRY_AGAIN if the TPM has not answered yet.
+ * @retval -1 on undefined/general failure.
+ */
+int
+tpm2totp_context_loadKey_nv_finish(TPM2TOTP_CONTEXT *context,
+                                   uint8_t **keyBlob, size_t *keyBlob_size)
+{
+    struct async *a;
+    int rc;
+
+    if (context == NULL || context->async == NULL || keyBlob == NULL ||
+            keyBlob_size == NULL || context->async->kind != ASYNC_LOAD) {
+        return -1;
+    }
+    a = context->async;
+
+    rc = async_run(context);
+    if (rc == TPM2TOTP_RC_TRY_AGAIN)
+        return rc;
+
+    if (rc == 0) {
+        *keyBlob = malloc(a->blob->size);
+        if (*keyBlob) {
+            *keyBlob_size = a->blob->size;
+            memcpy(*keyBlob, &a->blob->buffer[0], *keyBlob_size);
+        } else {
+            rc = -1;
+        }
+    }
+    metrics_op(a->op, a->start, rc);
+    async_done(context);
+    return rc;
+}
@@ -0,0 +1,467 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "audit.h"
+
+#include <tpm2-totp.h>
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TIMESTEPSIZE 30
+#define URI_PREFIX "otpauth://totp/"
+
+#define AUDIT_BATCH 1024
+#define AUDIT_SECRET_MAX 64
+#define AUDIT_JOBS_MAX 256
+
+/* One inventory line. Strings point into the mapped file. */
+typedef struct {
+    const char *device;
+    size_t device_len;
+    time_t time;
+    uint64_t otp;
+    int valid;
+    size_t verify_idx;
+} AUDIT_RECORD;
+
+/* A worker's slice of the file and its batch buffers, which are allocated
+   once so that records are parsed and verified without any allocation. */
+typedef struct {
+    const char *start;
+    const char *end;
+    unsigned int window;
+    pthread_t thread;
+    int started;
+    int rc;
+    FILE *out;
+    char *buf;
+    size_t buf_size;
+    AUDIT_STATS stats;
+
+    /* The device whose records are currently aggregated */
+    const char *device;
+    size_t device_len;
+    size_t device_records;
+    size_t device_mismatches;
+    size_t device_matches;
+    long device_drift;
+
+    AUDIT_RECORD records[AUDIT_BATCH];
+    uint8_t secrets[AUDIT_BATCH][AUDIT_SECRET_MAX];
+    const uint8_t *secret_ptrs[AUDIT_BATCH];
+    size_t secret_sizes[AUDIT_BATCH];
+    time_t times[AUDIT_BATCH];
+    uint64_t otps[AUDIT_BATCH];
+    int drifts[AUDIT_BATCH];
+    int matches[AUDIT_BATCH];
+} AUDIT_JOB;
+
+static const char *
+next_line(const char *p, const char *end)
+{
+    const char *eol = memchr(p, '\n', end - p);
+    return eol ? eol + 1 : end;
+}
+
+/** Find the next whitespace separated token before end.
+ * @retval The position after the token.
+ */
+static const char *
+next_token(const char *p, const char *end, const char **token, size_t *len)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+    *token = p;
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r')
+        p++;
+    *len = p - *token;
+    return p;
+}
+
+static int
+parse_uint(const char *str, size_t len, uint64_t *value)
+{
+    if (len == 0 || len > 19)
+        return -1;
+    *value = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (str[i] < '0' || str[i] > '9')
+            return -1;
+        *value = *value * 10 + (str[i] - '0');
+    }
+    return 0;
+}
+
+/** Decode base32 as written by tpm2-totp, tolerating lower case letters and
+ *  (percent-encoded) padding.
+ */
+static int
+base32dec(const char *in, size_t in_size, uint8_t *out, size_t *out_size)
+{
+    uint32_t buffer = 0;
+    int bits = 0, value;
+    size_t n = 0;
+
+    for (size_t i = 0; i < in_size; i++) {
+        char c = in[i];
+
+        if (c >= 'A' && c <= 'Z') {
+            value = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            value = c - 'a';
+        } else if (c >= '2' && c <= '7') {
+            value = c - '2' + 26;
+        } else if (c == '=') {
+            continue;
+        } else if (c == '%' && in_size - i > 2 &&
+                   !strncasecmp(&in[i + 1], "3D", 2)) {
+            i += 2;
+            continue;
+        } else {
+            return -1;
+        }
+
+        buffer = buffer << 5 | value;
+        bits += 5;
+        if (bits >= 8) {
+            if (n == *out_size)
+                return -1;
+            bits -= 8;
+            out[n++] = buffer >> bits;
+        }
+    }
+
+    *out_size = n;
+    return n > 0 ? 0 : -1;
+}
+
+/** Extract the secret from an otpauth URI.
+ *
+ * Only the parameters tpm2-totp generates (SHA-1, 6 digits, 30 seconds) are
+ * accepted.
+ */
+static int
+parse_uri(const char *uri, size_t len, uint8_t *secret, size_t *secret_size)
+{
+    const char *end = uri + len, *param, *value;
+    int have_secret = 0;
+
+    if (len < strlen(URI_PREFIX) || memcmp(uri, URI_PREFIX, strlen(URI_PREFIX)))
+        return -1;
+    param = memchr(uri, '?', len);
+    if (!param)
+        return -1;
+
+    for (param++; param < end; param = value < end ? value + 1 : end) {
+        const char *eq;
+        size_t name_len, value_len;
+
+        value = memchr(param, '&', end - param);
+        if (!value)
+            value = end;
+        eq = memchr(param, '=', value - param);
+        name_len = (eq ? eq : value) - param;
+        value_len = eq ? (size_t)(value - eq - 1) : 0;
+
+#define PARAM(name) (name_len == strlen(name) && !strncasecmp(param, name, name_len))
+#define VALUE(v) (value_len == strlen(v) && !strncasecmp(eq + 1, v, value_len))
+        if (PARAM("secret")) {
+            if (!eq || base32dec(eq + 1, value_len, secret, secret_size))
+                return -1;
+            have_secret = 1;
+        } else if ((PARAM("digits") && !VALUE("6")) ||
+                   (PARAM("period") && !VALUE("30")) ||
+                   (PARAM("algorithm") && !VALUE("SHA1"))) {
+            return -1;
+        }
+#undef VALUE
+#undef PARAM
+    }
+
+    return have_secret ? 0 : -1;
+}
+
+/** Parse one inventory line into record n of the job.
+ *
+ * @retval 0 on success (the record may be marked invalid).
+ * @retval 1 if the line is empty or a comment.
+ */
+static int
+parse_record(AUDIT_JOB *job, const char *line, const char *eol, size_t n)
+{
+    AUDIT_RECORD *record = &job->records[n];
+    const char *uri, *code, *stamp, *extra;
+    size_t uri_len, code_len, stamp_len, extra_len;
+    uint64_t value;
+
+    line = next_token(line, eol, &record->device, &record->device_len);
+    if (record->device_len == 0 || record->device[0] == '#')
+        return 1;
+    line = next_token(line, eol, &uri, &uri_len);
+    line = next_token(line, eol, &code, &code_len);
+    line = next_token(line, eol, &stamp, &stamp_len);
+    next_token(line, eol, &extra, &extra_len);
+
+    record->valid = 0;
+    job->secret_sizes[n] = AUDIT_SECRET_MAX;
+    if (extra_len != 0 ||
+        parse_uri(uri, uri_len, &job->secrets[n][0], &job->secret_sizes[n]) ||
+        parse_uint(code, code_len, &record->otp) ||
+        parse_uint(stamp, stamp_len, &value) || value > INT64_MAX)
+        return 0;
+
+    record->time = value;
+    record->valid = 1;
+    return 0;
+}
+
+static void
+flush_device(AUDIT_JOB *job)
+{
+    if (!job->device)
+        return;
+
+    fprintf(job->out, "%.*s: %zu records, %zu mismatches, ",
+            (int)job->device_len, job->device, job->device_records,
+            job->device_mismatches);
+    if (job->device_matches)
+        fprintf(job->out, "skew %+lds\n",
+                job->device_drift * TIMESTEPSIZE / (long)job->device_matches);
+    else
+        fprintf(job->out, "skew unknown\n");
+
+    job->stats.devices++;
+    job->device = NULL;
+}
+
+/** Aggregate a verified record into the report of its device.
+ *
+ * Records of a device are expected on consecutive lines; a device appearing
+ * again later is reported again.
+ */
+static void
+report_record(AUDIT_JOB *job, const AUDIT_RECORD *record)
+{
+    size_t i = record->verify_idx;
+
+    if (!job->device || job->device_len != record->device_len ||
+        memcmp(job->device, record->device, record->device_len)) {
+        flush_device(job);
+        job->device = record->device;
+        job->device_len = record->device_len;
+        job->device_records = 0;
+        job->device_mismatches = 0;
+        job->device_matches = 0;
+        job->device_drift = 0;
+    }
+
+    if (!record->valid) {
+        fprintf(job->out, "%.*s: invalid record\n",
+                (int)record->device_len, record->device);
+        job->stats.invalid++;
+        return;
+    }
+
+    job->stats.records++;
+    job->device_records++;
+    if (job->matches[i]) {
+        job->device_matches++;
+        job->device_drift += job->drifts[i];
+    } else {
+        fprintf(job->out, "%.*s: mismatch at %lld (code %06" PRIu64 ")\n",
+                (int)record->device_len, record->device,
+                (long long)record->time, record->otp);
+        job->stats.mismatches++;
+        job->device_mismatches++;
+    }
+}
+
+static void *
+audit_worker(void *arg)
+{
+    AUDIT_JOB *job = arg;
+    const char *p = job->start;
+
+    job->out = open_memstream(&job->buf, &job->buf_size);
+    if (!job->out) {
+        job->rc = -1;
+        return NULL;
+    }
+
+    while (p < job->end) {
+        size_t n = 0, verify = 0;
+
+        for (; p < job->end && n < AUDIT_BATCH; p = next_line(p, job->end)) {
+            const char *eol = memchr(p, '\n', job->end - p);
+            AUDIT_RECORD *record = &job->records[n];
+
+            if (parse_record(job, p, eol ? eol : job->end, n) != 0)
+                continue;
+            if (record->valid) {
+                record->verify_idx = verify;
+                job->secret_ptrs[verify] = &job->secrets[n][0];
+                job->secret_sizes[verify] = job->secret_sizes[n];
+                job->times[verify] = record->time;
+                job->otps[verify] = record->otp;
+                verify++;
+            }
+            n++;
+        }
+
+        if (verify > 0 &&
+            tpm2totp_verifyMany(verify, &job->secret_ptrs[0],
+                                &job->secret_sizes[0], &job->times[0],
+                                &job->otps[0], job->window,
+                                &job->drifts[0], &job->matches[0]) != 0) {
+            job->rc = -1;
+            break;
+        }
+        for (size_t i = 0; i < n; i++)
+            report_record(job, &job->records[i]);
+    }
+    flush_device(job);
+
+    if (fflush(job->out) != 0)
+        job->rc = -1;
+    return NULL;
+}
+
+/** Find the first line at or after p that does not continue the device of
+ *  the previous line, so that no device is split between two workers.
+ */
+static const char *
+split_point(const char *data, const char *p, const char *end)
+{
+    const char *prev, *device, *token;
+    size_t device_len, token_len;
+
+    if (p > data && p[-1] != '\n')
+        p = next_line(p, end);
+    if (p == data || p == end)
+        return p;
+
+    for (prev = p - 1; prev > data && prev[-1] != '\n'; prev--)
+        ;
+    next_token(prev, p - 1, &device, &device_len);
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+
+        next_token(p, eol ? eol : end, &token, &token_len);
+        if (token_len != device_len || memcmp(token, device, device_len))
+            break;
+        p = next_line(p, end);
+    }
+    return p;
+}
+
+/** Verify all records of an inventory file.
+ *
+ * Each line holds a device id, the otpauth URI of its secret, the code that
+ * was observed on the device and the unix time of the observation. The file
+ * is mapped and split at line and device boundaries into one slice per
+ * worker; the reports of the slices are written in file order.
+ * @param[in] path The inventory file.
+ * @param[in] window Number of time steps to search before and after.
+ * @param[in] jobs Number of worker threads (0 for one per CPU).
+ * @param[in] out Stream for the report.
+ * @param[out] stats The totals.
+ * @retval 0 on success.
+ * @retval -1 on failure.
+ */
+int
+audit_file(const char *path, unsigned int window, unsigned int jobs,
+           FILE *out, AUDIT_STATS *stats)
+{
+    AUDIT_JOB *job = NULL;
+    const char *data = NULL, *end;
+    struct stat st;
+    int fd, rc = 0;
+
+    memset(stats, 0, sizeof(*stats));
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return -1;
+    posix_madvise((void *)data, st.st_size, POSIX_MADV_SEQUENTIAL);
+    end = data + st.st_size;
+
+    if (jobs == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? cpus : 1;
+    }
+    if (jobs > AUDIT_JOBS_MAX)
+        jobs = AUDIT_JOBS_MAX;
+
+    job = calloc(jobs, sizeof(*job));
+    if (!job) {
+        munmap((void *)data, st.st_size);
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < jobs; i++) {
+        job[i].start = i ? job[i - 1].end : data;
+        job[i].end = i == jobs - 1 ? end :
+                     split_point(data, data + st.st_size * (i + 1) / jobs, end);
+        if (job[i].end < job[i].start)
+            job[i].end = job[i].start;
+        job[i].window = window;
+    }
+
+    /* Fall back to running a slice in this thread if no thread is left */
+    for (unsigned int i = 0; i < jobs; i++)
+        job[i].started = !pthread_create(&job[i].thread, NULL, audit_worker,
+                                         &job[i]);
+    for (unsigned int i = 0; i < jobs; i++) {
+        if (job[i].started)
+            pthread_join(job[i].thread, NULL);
+        else
+            audit_worker(&job[i]);
+    }
+
+    for (unsigned int i = 0; i < jobs; i++) {
+        if (job[i].out)
+            fclose(job[i].out);
+        if (job[i].rc != 0)
+            rc = -1;
+        if (rc == 0 && job[i].buf_size > 0 &&
+            fwrite(job[i].buf, job[i].buf_size, 1, out) != 1)
+            rc = -1;
+        free(job[i].buf);
+
+        stats->records += job[i].stats.records;
+        stats->devices += job[i].stats.devices;
+        stats->mismatches += job[i].stats.mismatches;
+        stats->invalid += job[i].stats.invalid;
+    }
+
+    free(job);
+    munmap((void *)data, st.st_size);
+    return rc;
+}
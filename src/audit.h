@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#ifndef AUDIT_H
+#define AUDIT_H
+
+#include <stdio.h>
+
+/* Totals of an audit run */
+typedef struct {
+    size_t records;
+    size_t devices;
+    size_t mismatches;
+    size_t invalid;
+} AUDIT_STATS;
+
+int
+audit_file(const char *path, unsigned int window, unsigned int jobs,
+           FILE *out, AUDIT_STATS *stats);
+
+#endif /* AUDIT_H */
@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <tss2/tss2_esys.h>
+
+#include "metrics.h"
+
+#define dbg(m, ...) fprintf(stderr, m "\n", ##__VA_ARGS__)
+
+/* Report a failed TPM or marshaling call, count it and run cmd */
+#define chkrc(rc, cmd) if (rc != TSS2_RC_SUCCESS) {\
+    dbg("ERROR in %s (%s:%i): 0x%08x\n", __func__, __FILE__, __LINE__, rc); \
+    metrics_rc(rc); cmd; }
+
+/* Some random handle from owner space for keys without an NV index */
+#define DEFAULT_NV 0x018094AF
+
+/* Attributes of the NV indices holding keys */
+#define NV_ATTRIBUTES_KEY (TPMA_NV_OWNERWRITE | \
+                           TPMA_NV_AUTHWRITE | \
+                           TPMA_NV_WRITE_STCLEAR | \
+                           TPMA_NV_READ_STCLEAR | \
+                           TPMA_NV_AUTHREAD | \
+                           TPMA_NV_OWNERREAD)
+
+/* First word of the blobs of tpm2totp_wrapKey, "TTI1" */
+#define IMPORTBLOB_MAGIC 0x54544931
+
+struct async;
+
+/* Templates of the storage primary key, defined in libtpm2-totp.c */
+extern TPM2B_PUBLIC primaryPublic;
+extern TPM2B_SENSITIVE_CREATE primarySensitive;
+extern TPM2B_DATA allOutsideInfo;
+extern TPML_PCR_SELECTION allCreationPCR;
+
+struct TPM2TOTP_CONTEXT {
+    ESYS_CONTEXT *esys;
+    ESYS_TR primary;    /* storage primary key or ESYS_TR_NONE until used */
+    struct async *async; /* pending asynchronous operation or NULL */
+    TPM2B_AUTH ownerAuth; /* authorization of the owner hierarchy */
+    TPM2B_AUTH nvAuth;  /* authorization of the NV indices of keys */
+    ESYS_TR session;    /* HMAC session for both or ESYS_TR_NONE until used */
+    char *eventlog;     /* firmware event log or NULL for DEFAULT_EVENTLOG */
+};
+
+/* Whether owner and NV commands need the HMAC session of the context */
+#define CONTEXT_AUTH(context) \
+    ((context)->ownerAuth.size != 0 || (context)->nvAuth.size != 0)
+
+/** Overwrite a secret such that the compiler cannot drop it as a dead store. */
+void
+context_wipe(void *secret, size_t size);
+
+/** Get the session authorizing owner and NV commands, started on first use. */
+TSS2_RC
+context_auth(TPM2TOTP_CONTEXT *context, TPMA_SESSION attributes,
+             ESYS_TR *session);
+
+/** Unmarshal the HMAC key of a key and the PCRs it is sealed to. */
+int
+context_unmarshal_key(const uint8_t *keyBlob, size_t keyBlob_size,
+                      TPM2B_PUBLIC *keyPublic, TPM2B_PRIVATE *keyPrivate,
+                      TPML_PCR_SELECTION *pcrsel);
+
+/** Construct the RFC 6238 HMAC input for a point in time. */
+void
+context_totp_input(time_t now, TPM2B_MAX_BUFFER *input);
+
+/** Truncate an HMAC-SHA1 to a TOTP value. */
+int
+context_totp_truncate(const TPM2B_DIGEST *output, uint64_t *otp);
+
+/** Abort a pending asynchronous operation and release its state. */
+void
+async_abort(TPM2TOTP_CONTEXT *context);
+
+#endif /* CONTEXT_H */
@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#ifndef KEYTEMPLATES_H
+#define KEYTEMPLATES_H
+
+#include <tss2/tss2_tpm2_types.h>
+
+/* Key parameters shared by the keys created on the TPM and the keys wrapped
+   in software for TPM2_Import. */
+
+/* RFC 6238 TOTP defines */
+#define TIMESTEPSIZE 30
+#define SECRETLEN 20
+
+#define DEFAULT_PCRS (0b000000000000000000010101)
+#define DEFAULT_BANKS (0b11)
+
+#define TPM2B_PUBLIC_PRIMARY_TEMPLATE { .size = 0, \
+    .publicArea = { \
+        .type = TPM2_ALG_ECC, \
+        .nameAlg = TPM2_ALG_SHA256, \
+        .objectAttributes = ( TPMA_OBJECT_USERWITHAUTH | \
+                              TPMA_OBJECT_RESTRICTED | \
+                              TPMA_OBJECT_DECRYPT | \
+                              TPMA_OBJECT_NODA | \
+                              TPMA_OBJECT_FIXEDTPM | \
+                              TPMA_OBJECT_FIXEDPARENT | \
+                              TPMA_OBJECT_SENSITIVEDATAORIGIN ), \
+        .authPolicy = { .size = 0, }, \
+        .parameters.eccDetail = { \
+            .symmetric = { .algorithm = TPM2_ALG_AES, \
+                .keyBits.aes = 128, .mode.aes = TPM2_ALG_CFB, }, \
+            .scheme = { .scheme = TPM2_ALG_NULL, .details = {} }, \
+            .curveID = TPM2_ECC_NIST_P256, \
+            .kdf = { .scheme = TPM2_ALG_NULL, .details = {} }, }, \
+        .unique.ecc = { .x.size = 0, .y.size = 0 } \
+     } }
+
+#define TPM2B_PUBLIC_KEY_TEMPLATE_UNSEAL { .size = 0, \
+    .publicArea = { \
+        .type = TPM2_ALG_KEYEDHASH, \
+        .nameAlg = TPM2_ALG_SHA256, \
+        .objectAttributes = ( TPMA_OBJECT_USERWITHAUTH ), \
+        .authPolicy = { .size = 0, .buffer = { 0 } }, \
+        .parameters.keyedHashDetail.scheme = { .scheme = TPM2_ALG_NULL, \
+            .details = { .hmac = { .hashAlg = TPM2_ALG_SHA1 } } }, \
+        .unique.keyedHash = { .size = 0, .buffer = { 0 }, }, \
+    } }
+
+#define TPM2B_PUBLIC_KEY_TEMPLATE_HMAC { .size = 0, \
+    .publicArea = { \
+        .type = TPM2_ALG_KEYEDHASH, \
+        .nameAlg = TPM2_ALG_SHA256, \
+        .objectAttributes = ( TPMA_OBJECT_SIGN_ENCRYPT ), \
+        .authPolicy = { .size = 0, .buffer = { 0 } }, \
+        .parameters.keyedHashDetail.scheme = { .scheme = TPM2_ALG_HMAC, \
+            .details = { .hmac = { .hashAlg = TPM2_ALG_SHA1 } } }, \
+        .unique.keyedHash = { .size = 0, .buffer = { 0 }, }, \
+    } }
+
+#define TPM2B_SENSITIVE_CREATE_TEMPLATE { .size = 0, \
+        .sensitive = { \
+            .userAuth = { .size = 0, .buffer = { 0 } }, \
+            .data = { .size = 0, .buffer = { 0 } }, \
+        } };
+
+#endif /* KEYTEMPLATES_H */
@@ -7,6 +7,11 @@
 #define _DEFAULT_SOURCE
 
 #include <tpm2-totp.h>
+#include "context.h"
+#include "keytemplates.h"
+#include "measure.h"
+#include "metrics.h"
+#include "sha1mb.h"
 
 #include <endian.h>
 #include <stdio.h>
@@ -17,80 +22,403 @@
 #include <tss2/tss2_mu.h>
 #include <tss2/tss2_esys.h>
 
-/* RFC 6238 TOTP defines */
-#define TIMESTEPSIZE 30
-#define SECRETLEN 20
-
-#define DEFAULT_PCRS (0b000000000000000000010101)
-#define DEFAULT_BANKS (0b11)
-#define DEFAULT_NV 0x018094AF
-
 const TPM2B_DIGEST ownerauth = { .size = 0 };
 
-#define dbg(m, ...) fprintf(stderr, m "\n", ##__VA_ARGS__)
-
-#define chkrc(rc, cmd) if (rc != TSS2_RC_SUCCESS) {\
-    dbg("ERROR in %s (%s:%i): 0x%08x\n", __func__, __FILE__, __LINE__, rc); cmd; }
-
-#define TPM2B_PUBLIC_PRIMARY_TEMPLATE { .size = 0, \
-    .publicArea = { \
-        .type = TPM2_ALG_ECC, \
-        .nameAlg = TPM2_ALG_SHA256, \
-        .objectAttributes = ( TPMA_OBJECT_USERWITHAUTH | \
-                              TPMA_OBJECT_RESTRICTED | \
-                              TPMA_OBJECT_DECRYPT | \
-                              TPMA_OBJECT_NODA | \
-                              TPMA_OBJECT_FIXEDTPM | \
-                              TPMA_OBJECT_FIXEDPARENT | \
-                              TPMA_OBJECT_SENSITIVEDATAORIGIN ), \
-        .authPolicy = { .size = 0, }, \
-        .parameters.eccDetail = { \
-            .symmetric = { .algorithm = TPM2_ALG_AES, \
-                .keyBits.aes = 128, .mode.aes = TPM2_ALG_CFB, }, \
-            .scheme = { .scheme = TPM2_ALG_NULL, .details = {} }, \
-            .curveID = TPM2_ECC_NIST_P256, \
-            .kdf = { .scheme = TPM2_ALG_NULL, .details = {} }, }, \
-        .unique.ecc = { .x.size = 0, .y.size = 0 } \
-     } }
-
-#define TPM2B_PUBLIC_KEY_TEMPLATE_UNSEAL { .size = 0, \
-    .publicArea = { \
-        .type = TPM2_ALG_KEYEDHASH, \
-        .nameAlg = TPM2_ALG_SHA256, \
-        .objectAttributes = ( TPMA_OBJECT_USERWITHAUTH ), \
-        .authPolicy = { .size = 0, .buffer = { 0 } }, \
-        .parameters.keyedHashDetail.scheme = { .scheme = TPM2_ALG_NULL, \
-            .details = { .hmac = { .hashAlg = TPM2_ALG_SHA1 } } }, \
-        .unique.keyedHash = { .size = 0, .buffer = { 0 }, }, \
-    } }
-
-#define TPM2B_PUBLIC_KEY_TEMPLATE_HMAC { .size = 0, \
-    .publicArea = { \
-        .type = TPM2_ALG_KEYEDHASH, \
-        .nameAlg = TPM2_ALG_SHA256, \
-        .objectAttributes = ( TPMA_OBJECT_SIGN_ENCRYPT ), \
-        .authPolicy = { .size = 0, .buffer = { 0 } }, \
-        .parameters.keyedHashDetail.scheme = { .scheme = TPM2_ALG_HMAC, \
-            .details = { .hmac = { .hashAlg = TPM2_ALG_SHA1 } } }, \
-        .unique.keyedHash = { .size = 0, .buffer = { 0 }, }, \
-    } }
-
-#define TPM2B_SENSITIVE_CREATE_TEMPLATE { .size = 0, \
-        .sensitive = { \
-            .userAuth = { .size = 0, .buffer = { 0 } }, \
-            .data = { .size = 0, .buffer = { 0 } }, \
-        } };
-
 TPM2B_PUBLIC primaryPublic = TPM2B_PUBLIC_PRIMARY_TEMPLATE;
 TPM2B_SENSITIVE_CREATE primarySensitive = TPM2B_SENSITIVE_CREATE_TEMPLATE;
 
 TPM2B_DATA allOutsideInfo = { .size = 0, };
 TPML_PCR_SELECTION allCreationPCR = { .count = 0 };
 
-TPM2B_AUTH emptyAuth = { .size = 0, };
+/** Create a library context for a TPM.
+ *
+ * The context keeps one ESYS context and the storage primary key for all
+ * operations on it, so a sequence of operations initializes the TPM once. The
+ * primary key is a transient object of the TPM until tpm2totp_context_free().
+ *
+ * @param[in] tcti_context Optional TCTI context to select the TPM.
+ * @param[out] context The library context.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+int
+tpm2totp_context_new(TSS2_TCTI_CONTEXT *tcti_context,
+                     TPM2TOTP_CONTEXT **context)
+{
+    TPM2TOTP_CONTEXT *c;
+    TSS2_RC rc;
+
+    if (context == NULL) {
+        return -1;
+    }
+
+    c = calloc(1, sizeof(*c));
+    if (!c)
+        return -1;
+    c->primary = ESYS_TR_NONE;
+    c->session = ESYS_TR_NONE;
+
+    rc = Esys_Initialize(&c->esys, tcti_context, NULL);
+    chkrc(rc, free(c); return rc);
+
+    rc = Esys_Startup(c->esys, TPM2_SU_CLEAR);
+    if (rc != TPM2_RC_INITIALIZE) chkrc(rc, goto error);
+
+    *context = c;
+    return 0;
+
+error:
+    Esys_Finalize(&c->esys);
+    free(c);
+    return (rc)? (int)rc : -1;
+}
+
+/** Free a library context and the objects it holds on the TPM.
+ *
+ * @param[in] context The library context.
+ */
+/** Overwrite a secret such that the compiler cannot drop it as a dead store.
+ *
+ * @param[out] secret The secret to wipe.
+ * @param[in] size Size of the secret.
+ */
+void
+context_wipe(void *secret, size_t size)
+{
+    volatile uint8_t *p = secret;
+
+    while (size--)
+        *p++ = 0;
+}
+
+void
+tpm2totp_context_free(TPM2TOTP_CONTEXT *context)
+{
+    if (!context)
+        return;
+
+    async_abort(context);
+    if (context->primary != ESYS_TR_NONE)
+        Esys_FlushContext(context->esys, context->primary);
+    if (context->session != ESYS_TR_NONE)
+        Esys_FlushContext(context->esys, context->session);
+    Esys_Finalize(&context->esys);
+    context_wipe(&context->ownerAuth, sizeof(context->ownerAuth));
+    context_wipe(&context->nvAuth, sizeof(context->nvAuth));
+    free(context->eventlog);
+    free(context);
+}
+
+/** Set the authorization values of the owner hierarchy and the NV indices.
+ *
+ * By default, both are empty and authorized with the empty password. Once an
+ * authorization value is set, the commands of the owner hierarchy
+ * (CreatePrimary, NV_DefineSpace and NV_UndefineSpace) and those of the NV
+ * indices (NV_Read and NV_Write) are authorized by one HMAC session, which is
+ * started with the first such command and kept until the context is freed.
+ * The NV indices of keys are defined with nvAuth, which is then needed to
+ * read them, e.g. for calculating a code.
+ * @param[in] context The library context.
+ * @param[in] ownerAuth Authorization value of the owner hierarchy or NULL.
+ * @param[in] nvAuth Authorization value of the NV indices or NULL.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+int
+tpm2totp_context_setAuth(TPM2TOTP_CONTEXT *context, const char *ownerAuth,
+                         const char *nvAuth)
+{
+    TSS2_RC rc;
+
+    if (context == NULL || context->async != NULL) {
+        return -1;
+    }
+    if (ownerAuth && strlen(ownerAuth) > sizeof(context->ownerAuth.buffer)) {
+        dbg("Owner password too long");
+        return -1;
+    }
+    /* The NV indices of keys have SHA1 as name algorithm */
+    if (nvAuth && strlen(nvAuth) > TPM2_SHA1_DIGEST_SIZE) {
+        dbg("NV password too long");
+        return -1;
+    }
+
+    context->ownerAuth.size = ownerAuth ? strlen(ownerAuth) : 0;
+    memcpy(&context->ownerAuth.buffer[0], ownerAuth ? ownerAuth : "",
+           context->ownerAuth.size);
+    context->nvAuth.size = nvAuth ? strlen(nvAuth) : 0;
+    memcpy(&context->nvAuth.buffer[0], nvAuth ? nvAuth : "",
+           context->nvAuth.size);
+
+    rc = Esys_TR_SetAuth(context->esys, ESYS_TR_RH_OWNER, &context->ownerAuth);
+    chkrc(rc, return rc);
+    return 0;
+}
+
+/** Set the firmware event log consulted by TPM2TOTP_BANK_AUTO.
+ *
+ * By default, the log that the kernel exports in securityfs is read.
+ * @param[in] context The library context.
+ * @param[in] path The binary event log, "" for none or NULL for the default.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+int
+tpm2totp_context_setEventLog(TPM2TOTP_CONTEXT *context, const char *path)
+{
+    char *copy = NULL;
+
+    if (context == NULL) {
+        return -1;
+    }
+    if (path) {
+        copy = strdup(path);
+        if (!copy)
+            return -1;
+    }
+    free(context->eventlog);
+    context->eventlog = copy;
+    return 0;
+}
+
+/** Get the session authorizing the owner hierarchy and the NV indices.
+ *
+ * Without authorization values, this is the empty password. Otherwise it is
+ * the HMAC session of the context, started on first use. The session is
+ * salted with a primary key of the null hierarchy, which needs no
+ * authorization and is flushed right away, so that its key cannot be derived
+ * from a recorded command stream, not even by guessing the passwords.
+ * @param[in] context The library context.
+ * @param[in] attributes Additional session attributes for the next command,
+ *            e.g. TPMA_SESSION_DECRYPT to encrypt its first parameter.
+ * @param[out] session The session.
+ * @retval TSS2_RC_SUCCESS on success.
+ */
+TSS2_RC
+context_auth(TPM2TOTP_CONTEXT *context, TPMA_SESSION attributes,
+             ESYS_TR *session)
+{
+    TPMT_SYM_DEF sym = {.algorithm = TPM2_ALG_AES,
+                        .keyBits = {.aes = 128},
+                        .mode = {.aes = TPM2_ALG_CFB}
+    };
+    ESYS_TR salt;
+    TSS2_RC rc;
+
+    if (!CONTEXT_AUTH(context)) {
+        *session = ESYS_TR_PASSWORD;
+        return TSS2_RC_SUCCESS;
+    }
+
+    if (context->session == ESYS_TR_NONE) {
+        rc = Esys_CreatePrimary(context->esys, ESYS_TR_RH_NULL,
+                                ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
+                                &primarySensitive, &primaryPublic,
+                                &allOutsideInfo, &allCreationPCR,
+                                &salt, NULL, NULL, NULL, NULL);
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
+        rc = Esys_StartAuthSession(context->esys, salt, ESYS_TR_NONE,
+                                   ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                                   NULL, TPM2_SE_HMAC, &sym, TPM2_ALG_SHA256,
+                                   &context->session);
+        Esys_FlushContext(context->esys, salt);
+        if (rc != TSS2_RC_SUCCESS) {
+            context->session = ESYS_TR_NONE;
+            return rc;
+        }
+    }
+
+    rc = Esys_TRSess_SetAttributes(context->esys, context->session,
+                                   TPMA_SESSION_CONTINUESESSION | attributes,
+                                   0xff);
+    if (rc != TSS2_RC_SUCCESS)
+        return rc;
+
+    *session = context->session;
+    return TSS2_RC_SUCCESS;
+}
+
+/** Get the storage primary key, creating it on first use.
+ *
+ * @param[in] context The library context.
+ * @param[out] primary The primary key.
+ * @retval TSS2_RC_SUCCESS on success.
+ */
+static TSS2_RC
+context_primary(TPM2TOTP_CONTEXT *context, ESYS_TR *primary)
+{
+    ESYS_TR authSession;
+    TSS2_RC rc;
+
+    if (context->primary != ESYS_TR_NONE) {
+        metrics_count(METRICS_CACHE_HIT);
+        *primary = context->primary;
+        return TSS2_RC_SUCCESS;
+    }
+    metrics_count(METRICS_CACHE_MISS);
+
+    rc = context_auth(context, 0, &authSession);
+    if (rc != TSS2_RC_SUCCESS)
+        return rc;
+
+    rc = Esys_CreatePrimary(context->esys, ESYS_TR_RH_OWNER,
+                            authSession, ESYS_TR_NONE, ESYS_TR_NONE,
+                            &primarySensitive, &primaryPublic,
+                            &allOutsideInfo, &allCreationPCR,
+                            &context->primary, NULL, NULL, NULL, NULL);
+    if (rc != TSS2_RC_SUCCESS) {
+        context->primary = ESYS_TR_NONE;
+        return rc;
+    }
+
+    *primary = context->primary;
+    return TSS2_RC_SUCCESS;
+}
+
+/* Header of a crypto agile event log: the SHA1 event that starts every log,
+   holding the Spec ID event with the digests of all following events */
+#define EVENTLOG_HEADER_SIZE (4 + 4 + 20 + 4)
+#define EVENTLOG_SPECID_SIZE (16 + 4 + 4 + 4)
+#define EVENTLOG_MAX_ALGS 16
+#define EV_NO_ACTION 3
+
+/** Get the banks that the firmware measures into from its event log.
+ *
+ * The first event of a crypto agile log (TCG PC Client Platform Firmware
+ * Profile) is the Spec ID event listing the algorithms of the digests of all
+ * events. Logs in the older format only hold SHA1 digests.
+ * @param[in] path The binary event log or "" for none.
+ * @retval The banks of the log.
+ * @retval 0 if there is no readable log.
+ */
+static uint32_t
+eventlog_banks(const char *path)
+{
+    static const char signature[16] = "Spec ID Event03";
+    uint8_t buf[EVENTLOG_HEADER_SIZE + EVENTLOG_SPECID_SIZE +
+                4 * EVENTLOG_MAX_ALGS];
+    uint8_t *specid = &buf[EVENTLOG_HEADER_SIZE];
+    uint32_t type, eventSize, count, banks = 0;
+    size_t len;
+    FILE *f;
+
+    if (*path == '\0')
+        return 0;
+    f = fopen(path, "rb");
+    if (!f)
+        return 0;
+    len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+
+    if (len < EVENTLOG_HEADER_SIZE)
+        return 0;
+    memcpy(&type, &buf[4], 4);
+    memcpy(&eventSize, &buf[28], 4);
+    eventSize = le32toh(eventSize);
+    if (le32toh(type) != EV_NO_ACTION || eventSize < EVENTLOG_SPECID_SIZE ||
+        len < EVENTLOG_HEADER_SIZE + EVENTLOG_SPECID_SIZE ||
+        memcmp(specid, signature, sizeof(signature)) != 0)
+        return TPM2TOTP_BANK_SHA1;
+
+    memcpy(&count, &specid[24], 4);
+    count = le32toh(count);
+    for (uint32_t i = 0; i < count && i < EVENTLOG_MAX_ALGS &&
+                         EVENTLOG_HEADER_SIZE + EVENTLOG_SPECID_SIZE +
+                         4 * (i + 1) <= len; i++) {
+        uint16_t alg;
+        memcpy(&alg, &specid[EVENTLOG_SPECID_SIZE + 4 * i], 2);
+        switch (le16toh(alg)) {
+        case TPM2_ALG_SHA1:
+            banks |= TPM2TOTP_BANK_SHA1;
+            break;
+        case TPM2_ALG_SHA256:
+            banks |= TPM2TOTP_BANK_SHA256;
+            break;
+        case TPM2_ALG_SHA384:
+            banks |= TPM2TOTP_BANK_SHA384;
+            break;
+        }
+    }
+    return banks;
+}
+
+/** Apply the default PCRs and banks and resolve TPM2TOTP_BANK_AUTO.
+ *
+ * Automatic selection seals to a single bank, since the TPM hashes every
+ * selected bank for each code: the strongest bank among the candidates that
+ * is allocated for all PCRs, preferring the banks of the firmware's event
+ * log, which are the ones that record the boot.
+ * @param[in] context Library context of the TPM.
+ * @param[in,out] pcrs PCRs the key should be sealed against.
+ * @param[in,out] banks PCR banks the key should be sealed against.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+static int
+context_selection(TPM2TOTP_CONTEXT *context, uint32_t *pcrs, uint32_t *banks)
+{
+    static const struct {
+        TPMI_ALG_HASH hash;
+        uint32_t bank;
+    } strongest[] = {
+        { TPM2_ALG_SHA384, TPM2TOTP_BANK_SHA384 },
+        { TPM2_ALG_SHA256, TPM2TOTP_BANK_SHA256 },
+        { TPM2_ALG_SHA1, TPM2TOTP_BANK_SHA1 },
+    };
+    const uint32_t all = TPM2TOTP_BANK_SHA1 | TPM2TOTP_BANK_SHA256 |
+                         TPM2TOTP_BANK_SHA384;
+    TPMS_CAPABILITY_DATA *capabilityData;
+    TPMS_PCR_SELECTION *sel;
+    uint32_t candidates, active = 0, measured, assigned;
+    TSS2_RC rc;
+
+    if (*pcrs == 0) *pcrs = DEFAULT_PCRS;
+    if (*banks == 0) *banks = DEFAULT_BANKS;
+    if (!(*banks & TPM2TOTP_BANK_AUTO))
+        return 0;
+
+    candidates = (*banks & all) ? (*banks & all) : all;
+
+    rc = Esys_GetCapability(context->esys,
+                            ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                            TPM2_CAP_PCRS, 0, 1, NULL, &capabilityData);
+    chkrc(rc, return rc);
+
+    for (size_t i = 0; i < capabilityData->data.assignedPCR.count; i++) {
+        sel = &capabilityData->data.assignedPCR.pcrSelections[i];
+        assigned = 0;
+        for (size_t j = 0; j < sel->sizeofSelect && j < 3; j++)
+            assigned |= (uint32_t)sel->pcrSelect[j] << (8 * j);
+        if ((assigned & *pcrs) != *pcrs)
+            continue;
+        for (size_t j = 0; j < sizeof(strongest) / sizeof(strongest[0]); j++) {
+            if (strongest[j].hash == sel->hash)
+                active |= strongest[j].bank;
+        }
+    }
+    free(capabilityData);
+    active &= candidates;
+
+    /* A log naming none of the active banks belongs to another TPM */
+    measured = eventlog_banks(context->eventlog ? context->eventlog :
+                                                  DEFAULT_EVENTLOG);
+    if ((active & measured))
+        active &= measured;
+
+    for (size_t j = 0; j < sizeof(strongest) / sizeof(strongest[0]); j++) {
+        if ((active & strongest[j].bank)) {
+            *banks = strongest[j].bank;
+            return 0;
+        }
+    }
+    dbg("No active bank covers the PCRs");
+    return -1;
+}
 
 /** Generate a key.
  *
+ * @param[in] context Library context of the TPM.
  * @param[in] pcrs PCRs the key should be sealed against.
  * @param[in] banks PCR banks the key should be sealed against.
  * @param[in] password Optional password to recover or reseal the secret.
@@ -101,18 +429,19 @@ TPM2B_AUTH emptyAuth = { .size = 0, };
  * @retval 0 on success.
  * @retval -1 on undefined/general failure.
  */
-int
-tpm2totp_generateKey(uint32_t pcrs, uint32_t banks, const char *password,
-                     uint8_t **secret, size_t *secret_size,
-                     uint8_t **keyBlob, size_t *keyBlob_size)
+static int
+generateKey(TPM2TOTP_CONTEXT *context,
+            uint32_t pcrs, uint32_t banks, const char *password,
+            uint8_t **secret, size_t *secret_size,
+            uint8_t **keyBlob, size_t *keyBlob_size)
 {
-    if (secret == NULL || secret_size == NULL || 
+    if (context == NULL || secret == NULL || secret_size == NULL ||
         keyBlob == NULL || keyBlob_size == NULL) {
         return -1;
     }
 
     TPM2B_DIGEST *t, *policyDigest;
-    ESYS_CONTEXT *ctx = NULL;
+    ESYS_CONTEXT *ctx = context->esys;
     ESYS_TR primary, session;
     TSS2_RC rc;
 
@@ -133,8 +462,9 @@ tpm2totp_generateKey(uint32_t pcrs, uint32_t banks, const char *password,
 
     TPML_PCR_SELECTION *pcrcheck, pcrsel = { .count = 0 };
 
-    if (pcrs == 0) pcrs = DEFAULT_PCRS;
-    if (banks == 0) banks = DEFAULT_BANKS;
+    rc = context_selection(context, &pcrs, &banks);
+    if (rc != TSS2_RC_SUCCESS)
+        return (int)rc;
 
     if ((banks & TPM2TOTP_BANK_SHA1)) {
         pcrsel.pcrSelections[pcrsel.count].hash = TPM2_ALG_SHA1;
@@ -162,12 +492,6 @@ tpm2totp_generateKey(uint32_t pcrs, uint32_t banks, const char *password,
         return -1;
     }
 
-    rc = Esys_Initialize(&ctx, NULL, NULL);
-    chkrc(rc, goto error);
-
-    rc = Esys_Startup(ctx, TPM2_SU_CLEAR);
-    if (rc != TPM2_RC_INITIALIZE) chkrc(rc, goto error);
-
     while (*secret_size < SECRETLEN) {
         dbg("Calling Esys_GetRandom for %li bytes", SECRETLEN - *secret_size);
         rc = Esys_GetRandom(ctx,
@@ -180,12 +504,7 @@ tpm2totp_generateKey(uint32_t pcrs, uint32_t banks, const char *password,
         free(t);
     }
 
-    dbg("Calling Esys_CreatePrimary");
-    rc = Esys_CreatePrimary(ctx, ESYS_TR_RH_OWNER, 
-                            ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
-                            &primarySensitive, &primaryPublic,
-                            &allOutsideInfo, &allCreationPCR,
-                            &primary, NULL, NULL, NULL, NULL);
+    rc = context_primary(context, &primary);
     chkrc(rc, goto error);
 
     rc = Esys_PCR_Read(ctx,
@@ -195,7 +514,8 @@ tpm2totp_generateKey(uint32_t pcrs, uint32_t banks, const char *password,
 
     if (pcrcheck->count == 0) {
         dbg("No active banks selected");
-        return -1;
+        free(pcrcheck);
+        goto error;
     }
     free(pcrcheck);
 
@@ -228,7 +548,7 @@ tpm2totp_generateKey(uint32_t pcrs, uint32_t banks, const char *password,
                      &keySensitive, &keyInPublicHmac,
                      &allOutsideInfo, &allCreationPCR,
                      &keyPrivateHmac, &keyPublicHmac, NULL, NULL, NULL);
-    chkrc(rc, Esys_FlushContext(ctx, primary); goto error);
+    chkrc(rc, goto error);
 
     if (password && strlen(password) > 0) {
         keySensitive.sensitive.userAuth.size = strlen(password);
@@ -241,11 +561,9 @@ tpm2totp_generateKey(uint32_t pcrs, uint32_t banks, const char *password,
                          &keySensitive, &keyInPublicSeal,
                          &allOutsideInfo, &allCreationPCR,
                          &keyPrivateSeal, &keyPublicSeal, NULL, NULL, NULL);
-        chkrc(rc, Esys_FlushContext(ctx, primary); goto error);
+        chkrc(rc, goto error);
     }
 
-    Esys_FlushContext(ctx, primary);
-    Esys_Finalize(&ctx);
 
     *keyBlob_size = 4 + 4;
     rc = Tss2_MU_TPM2B_PUBLIC_Marshal(keyPublicHmac, NULL, -1, keyBlob_size);
@@ -260,6 +578,7 @@ tpm2totp_generateKey(uint32_t pcrs, uint32_t banks, const char *password,
     }
 
     *keyBlob = malloc(*keyBlob_size);
+    if (!*keyBlob) goto error;
 
     rc = Tss2_MU_UINT32_Marshal(pcrs, *keyBlob, *keyBlob_size, &off);
     chkrc(rc, goto error_marshall);
@@ -280,75 +599,187 @@ tpm2totp_generateKey(uint32_t pcrs, uint32_t banks, const char *password,
         chkrc(rc, goto error_marshall);
     }
 
+    context_wipe(&keySensitive, sizeof(keySensitive));
+    free(keyPublicHmac);
+    free(keyPrivateHmac);
+    free(keyPublicSeal);
+    free(keyPrivateSeal);
+
     return 0;
 
 error_marshall:
     free(*keyBlob);
     *keyBlob = NULL;
-    return (rc)? (int)rc : -1;
 
 error:
+    context_wipe(&keySensitive, sizeof(keySensitive));
     free(keyPublicHmac);
     free(keyPrivateHmac);
     free(keyPublicSeal);
     free(keyPrivateSeal);
-    Esys_Finalize(&ctx);
     free(*secret);
     *secret = NULL;
     *secret_size = 0;
     return (rc)? (int)rc : -1;
 }
 
-/** Reseal a key to new PCR values.
+int
+tpm2totp_context_generateKey(TPM2TOTP_CONTEXT *context,
+                             uint32_t pcrs, uint32_t banks,
+                             const char *password,
+                             uint8_t **secret, size_t *secret_size,
+                             uint8_t **keyBlob, size_t *keyBlob_size)
+{
+    uint64_t start = metrics_now();
+    int rc = generateKey(context, pcrs, banks, password, secret, secret_size,
+                         keyBlob, keyBlob_size);
+
+    metrics_op(METRICS_OP_GENERATE, start, rc);
+    return rc;
+}
+
+int
+tpm2totp_generateKey_tcti(uint32_t pcrs, uint32_t banks,
+                          const char *password,
+                          TSS2_TCTI_CONTEXT *tcti_context,
+                          uint8_t **secret, size_t *secret_size,
+                          uint8_t **keyBlob, size_t *keyBlob_size)
+{
+    uint64_t start = metrics_now();
+    TPM2TOTP_CONTEXT *context;
+    int rc = tpm2totp_context_new(tcti_context, &context);
+
+    if (rc == 0) {
+        rc = generateKey(context, pcrs, banks, password, secret, secret_size,
+                         keyBlob, keyBlob_size);
+        tpm2totp_context_free(context);
+    }
+    metrics_op(METRICS_OP_GENERATE, start, rc);
+    return rc;
+}
+
+int
+tpm2totp_generateKey(uint32_t pcrs, uint32_t banks, const char *password,
+                     uint8_t **secret, size_t *secret_size,
+                     uint8_t **keyBlob, size_t *keyBlob_size)
+{
+    return tpm2totp_generateKey_tcti(pcrs, banks, password, NULL,
+                                     secret, secret_size,
+                                     keyBlob, keyBlob_size);
+}
+
+/** Marshal the parts of a key into an NV buffer.
+ */
+static TSS2_RC
+marshal_key_nv(uint32_t pcrs, uint32_t banks,
+               const TPM2B_PUBLIC *keyPublicHmac,
+               const TPM2B_PRIVATE *keyPrivateHmac,
+               const TPM2B_PUBLIC *keyPublicSeal,
+               const TPM2B_PRIVATE *keyPrivateSeal,
+               TPM2B_MAX_NV_BUFFER *blob)
+{
+    TSS2_RC rc;
+    size_t off = 0;
+
+    rc = Tss2_MU_UINT32_Marshal(pcrs, &blob->buffer[0], sizeof(blob->buffer),
+                                &off);
+    if (rc) return rc;
+    rc = Tss2_MU_UINT32_Marshal(banks, &blob->buffer[0], sizeof(blob->buffer),
+                                &off);
+    if (rc) return rc;
+    rc = Tss2_MU_TPM2B_PUBLIC_Marshal(keyPublicHmac, &blob->buffer[0],
+                                      sizeof(blob->buffer), &off);
+    if (rc) return rc;
+    rc = Tss2_MU_TPM2B_PRIVATE_Marshal(keyPrivateHmac, &blob->buffer[0],
+                                       sizeof(blob->buffer), &off);
+    if (rc) return rc;
+    if (keyPublicSeal) {
+        rc = Tss2_MU_TPM2B_PUBLIC_Marshal(keyPublicSeal, &blob->buffer[0],
+                                          sizeof(blob->buffer), &off);
+        if (rc) return rc;
+        rc = Tss2_MU_TPM2B_PRIVATE_Marshal(keyPrivateSeal, &blob->buffer[0],
+                                           sizeof(blob->buffer), &off);
+        if (rc) return rc;
+    }
+
+    blob->size = off;
+    return TSS2_RC_SUCCESS;
+}
+
+/** Finish an asynchronous Esys_Create.
+ */
+static TSS2_RC
+create_finish(ESYS_CONTEXT *ctx, TPM2B_PRIVATE **keyPrivate,
+              TPM2B_PUBLIC **keyPublic)
+{
+    TSS2_RC rc;
+
+    do {
+        rc = Esys_Create_Finish(ctx, keyPrivate, keyPublic, NULL, NULL, NULL);
+    } while (rc == TSS2_ESYS_RC_TRY_AGAIN);
+    return rc;
+}
+
+/** Generate keys for a list of NV indices.
  *
- * @param[in] keyBlob Original key.
- * @param[in] keyBlob_size Size of the key.
- * @param[in] password Password of the key.
- * @param[in] pcrs PCRs the key should be sealed against.
- * @param[in] banks PCR banks the key should be sealed against.
- * @param[out] newBlob New key.
- * @param[out] newBlob_size Size of the new key.
+ * The primary key and the policy digest are created once for all keys, and
+ * the creation of each key on the TPM overlaps with reporting the previous
+ * one. The callback is invoked in order for every key once it is stored.
+ * @param[in] context Library context of the TPM.
+ * @param[in] pcrs PCRs the keys should be sealed against.
+ * @param[in] banks PCR banks the keys should be sealed against.
+ * @param[in] password Optional password to recover or reseal the secrets.
+ * @param[in] nvs NV indices to store the keys.
+ * @param[in] count Number of NV indices.
+ * @param[in] callback Called with the NV index and the secret of each key;
+ *            a non-zero return value stops the batch.
+ * @param[in] userdata Passed to the callback.
  * @retval 0 on success.
  * @retval -1 on undefined/general failure.
- * @retval -10 on empty password.
+ * @retval -20 if the callback stopped the batch.
  */
-int
-tpm2totp_reseal(const uint8_t *keyBlob, size_t keyBlob_size,
-                const char *password, uint32_t pcrs, uint32_t banks,
-                uint8_t **newBlob, size_t *newBlob_size)
+static int
+generateKeys_nv(TPM2TOTP_CONTEXT *context,
+                uint32_t pcrs, uint32_t banks, const char *password,
+                const uint32_t *nvs, size_t count,
+                tpm2totp_generate_cb callback, void *userdata)
 {
-    if (keyBlob == NULL || !password || newBlob == NULL || newBlob_size == NULL) {
+    if (context == NULL || nvs == NULL || callback == NULL) {
         return -1;
     }
-    if (!strlen(password)) {
-        dbg("Password required.");
-        return -10;
-    }
 
-    ESYS_CONTEXT *ctx = NULL;
-    ESYS_TR primary = ESYS_TR_NONE, key, session;
+    TPM2B_DIGEST *t = NULL, *policyDigest;
+    ESYS_CONTEXT *ctx = context->esys;
+    ESYS_TR primary = ESYS_TR_NONE, session, nvHandle, authSession;
     TSS2_RC rc;
-    size_t off = 0;
-    TPM2B_SENSITIVE_DATA *secret2b = NULL;
-    TPM2B_AUTH auth;
-    TPM2B_DIGEST *policyDigest;
+    int cbrc;
+
+    TPMT_SYM_DEF sym = {.algorithm = TPM2_ALG_AES,
+                        .keyBits = {.aes = 128},
+                        .mode = {.aes = TPM2_ALG_CFB}
+    };
 
     TPM2B_PUBLIC keyInPublicHmac = TPM2B_PUBLIC_KEY_TEMPLATE_HMAC;
+    TPM2B_PUBLIC keyInPublicSeal = TPM2B_PUBLIC_KEY_TEMPLATE_UNSEAL;
     TPM2B_SENSITIVE_CREATE keySensitive = TPM2B_SENSITIVE_CREATE_TEMPLATE;
-    TPM2B_PUBLIC keyPublicSeal = { .size = 0 };
-    TPM2B_PRIVATE keyPrivateSeal = { .size = 0 };
     TPM2B_PUBLIC *keyPublicHmac = NULL;
     TPM2B_PRIVATE *keyPrivateHmac = NULL;
+    TPM2B_PUBLIC *keyPublicSeal = NULL;
+    TPM2B_PRIVATE *keyPrivateSeal = NULL;
+    TPM2B_MAX_NV_BUFFER blob;
 
     TPML_PCR_SELECTION *pcrcheck, pcrsel = { .count = 0 };
 
-    TPMT_SYM_DEF sym = {.algorithm = TPM2_ALG_AES,
-                        .keyBits = {.aes = 128},
-                        .mode = {.aes = TPM2_ALG_CFB}
-    };
+    /* Random bytes are fetched in chunks as large as the TPM allows and the
+       secret of the previous key waits for its callback. */
+    uint8_t pool[sizeof(TPMU_HA)];
+    size_t pool_size = 0;
+    uint8_t secret[2][SECRETLEN];
+    size_t pending = 0, i;
 
-    if (pcrs == 0) pcrs = DEFAULT_PCRS;
-    if (banks == 0) banks = DEFAULT_BANKS;
+    rc = context_selection(context, &pcrs, &banks);
+    if (rc != TSS2_RC_SUCCESS)
+        return (int)rc;
 
     if ((banks & TPM2TOTP_BANK_SHA1)) {
         pcrsel.pcrSelections[pcrsel.count].hash = TPM2_ALG_SHA1;
@@ -363,490 +794,2121 @@ tpm2totp_reseal(const uint8_t *keyBlob, size_t keyBlob_size,
         pcrsel.count++;
     }
 
-    for (size_t i = 0; i < pcrsel.count; i++) {
+    for (i = 0; i < pcrsel.count; i++) {
         pcrsel.pcrSelections[i].sizeofSelect = 3;
         pcrsel.pcrSelections[i].pcrSelect[0] = pcrs & 0xff;
         pcrsel.pcrSelections[i].pcrSelect[1] = pcrs >>8 & 0xff;
         pcrsel.pcrSelections[i].pcrSelect[2] = pcrs >>16 & 0xff;
     }
 
-    auth.size = strlen(password);
-    memcpy(&auth.buffer[0], password, auth.size);
-
-    /* We skip over the pcrs and banks from NV because they are not trustworthy */
-    rc = Tss2_MU_UINT32_Unmarshal(keyBlob, keyBlob_size, &off, NULL);
-    chkrc(rc, goto error);
-    rc = Tss2_MU_UINT32_Unmarshal(keyBlob, keyBlob_size, &off, NULL);
+    rc = context_primary(context, &primary);
     chkrc(rc, goto error);
 
-    rc = Tss2_MU_TPM2B_PUBLIC_Unmarshal(keyBlob, keyBlob_size, &off, NULL);
-    chkrc(rc, goto error);
-    rc = Tss2_MU_TPM2B_PRIVATE_Unmarshal(keyBlob, keyBlob_size, &off, NULL);
+    rc = Esys_PCR_Read(ctx,
+                       ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                       &pcrsel, NULL, &pcrcheck, NULL);
     chkrc(rc, goto error);
 
-    if (off == keyBlob_size) {
-        dbg("No unseal blob included.");
-        return -1;
+    if (pcrcheck->count == 0) {
+        dbg("No active banks selected");
+        free(pcrcheck);
+        rc = -1;
+        goto error;
     }
+    free(pcrcheck);
 
-    rc = Tss2_MU_TPM2B_PUBLIC_Unmarshal(keyBlob, keyBlob_size, &off,
-                                        &keyPublicSeal);
-    chkrc(rc, goto error);
-    rc = Tss2_MU_TPM2B_PRIVATE_Unmarshal(keyBlob, keyBlob_size, &off, 
-                                         &keyPrivateSeal);
+    rc = Esys_StartAuthSession(ctx, ESYS_TR_NONE, ESYS_TR_NONE,
+                    ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                    NULL, TPM2_SE_TRIAL, &sym, TPM2_ALG_SHA256,
+                    &session);
     chkrc(rc, goto error);
 
-    if (off != keyBlob_size) {
-        dbg("bad blob size");
-        return -1;
-    }
+    rc = Esys_PolicyPCR(ctx, session,
+                        ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                        NULL, &pcrsel);
+    chkrc(rc, Esys_FlushContext(ctx, session); goto error);
 
-    rc = Esys_Initialize(&ctx, NULL, NULL);
+    rc = Esys_PolicyGetDigest(ctx, session,
+                              ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                              &policyDigest);
+    Esys_FlushContext(ctx, session);
     chkrc(rc, goto error);
 
-    rc = Esys_Startup(ctx, TPM2_SU_CLEAR);
-    if (rc != TPM2_RC_INITIALIZE) chkrc(rc, goto error);
+    keyInPublicHmac.publicArea.authPolicy = *policyDigest;
+    free(policyDigest);
+
+    for (i = 0; i < count; i++) {
+        uint32_t nv = nvs[i] ? nvs[i] : DEFAULT_NV;
+        uint8_t *sec = &secret[i % 2][0];
+        size_t sec_size = 0;
+
+        while (sec_size < SECRETLEN) {
+            if (pool_size == 0) {
+                size_t want = (count - i) * SECRETLEN - sec_size;
+                if (want > sizeof(pool)) want = sizeof(pool);
+                rc = Esys_GetRandom(ctx,
+                                    ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                                    want, &t);
+                chkrc(rc, goto error);
+                pool_size = t->size;
+                memcpy(&pool[0], &t->buffer[0], pool_size);
+                free(t);
+            }
+            while (pool_size > 0 && sec_size < SECRETLEN)
+                sec[sec_size++] = pool[--pool_size];
+        }
+        context_wipe(&pool[pool_size], sizeof(pool) - pool_size);
+
+        keySensitive.sensitive.data.size = SECRETLEN;
+        memcpy(&keySensitive.sensitive.data.buffer[0], sec, SECRETLEN);
+
+        rc = Esys_Create_Async(ctx, primary,
+                               ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
+                               &keySensitive, &keyInPublicHmac,
+                               &allOutsideInfo, &allCreationPCR);
+        chkrc(rc, goto error);
 
-    rc = Esys_CreatePrimary(ctx, ESYS_TR_RH_OWNER, 
-                            ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
-                            &primarySensitive, &primaryPublic,
-                            &allOutsideInfo, &allCreationPCR,
-                            &primary, NULL, NULL, NULL, NULL);
-    chkrc(rc, goto error);
-    
-    rc = Esys_Load(ctx, primary,
-                   ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
-                   &keyPrivateSeal, &keyPublicSeal,
-                   &key);
-    chkrc(rc, goto error);
+        /* Report the previous key while the TPM is busy */
+        if (pending) {
+            pending = 0;
+            cbrc = callback(nvs[i - 1] ? nvs[i - 1] : DEFAULT_NV,
+                            &secret[(i - 1) % 2][0], SECRETLEN, userdata);
+            if (cbrc) {
+                create_finish(ctx, &keyPrivateHmac, &keyPublicHmac);
+                rc = -20;
+                goto error;
+            }
+        }
+
+        rc = create_finish(ctx, &keyPrivateHmac, &keyPublicHmac);
+        chkrc(rc, goto error);
 
-    Esys_TR_SetAuth(ctx, key, &auth);
+        /* As in generateKey, only the sealed copy has the password */
+        if (password && strlen(password) > 0) {
+            keySensitive.sensitive.userAuth.size = strlen(password);
+            memcpy(&keySensitive.sensitive.userAuth.buffer[0], password,
+                   keySensitive.sensitive.userAuth.size);
+            rc = Esys_Create(ctx, primary,
+                             ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
+                             &keySensitive, &keyInPublicSeal,
+                             &allOutsideInfo, &allCreationPCR,
+                             &keyPrivateSeal, &keyPublicSeal, NULL, NULL, NULL);
+            context_wipe(&keySensitive.sensitive.userAuth,
+                         sizeof(keySensitive.sensitive.userAuth));
+            chkrc(rc, goto error);
+        }
+        context_wipe(&keySensitive.sensitive.data,
+                     sizeof(keySensitive.sensitive.data));
+
+        rc = marshal_key_nv(pcrs, banks, keyPublicHmac, keyPrivateHmac,
+                            keyPublicSeal, keyPrivateSeal, &blob);
+        chkrc(rc, goto error);
+        free(keyPublicHmac);
+        free(keyPrivateHmac);
+        free(keyPublicSeal);
+        free(keyPrivateSeal);
+        keyPublicHmac = NULL;
+        keyPrivateHmac = NULL;
+        keyPublicSeal = NULL;
+        keyPrivateSeal = NULL;
+
+        TPM2B_NV_PUBLIC publicInfo = { .size = 0,
+            .nvPublic = {
+                .nvIndex = nv,
+                .nameAlg = TPM2_ALG_SHA1,
+                .attributes = NV_ATTRIBUTES_KEY,
+                .authPolicy = { .size = 0, .buffer = {}, },
+                .dataSize = blob.size,
+            } };
+
+        rc = context_auth(context, TPMA_SESSION_DECRYPT, &authSession);
+        chkrc(rc, goto error);
+        rc = Esys_NV_DefineSpace(ctx, ESYS_TR_RH_OWNER,
+                                 authSession, ESYS_TR_NONE, ESYS_TR_NONE,
+                                 &context->nvAuth, &publicInfo, &nvHandle);
+        chkrc(rc, goto error);
 
-    rc = Esys_Unseal(ctx, key,
-                     ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
-                     &secret2b);
-    Esys_FlushContext(ctx, key);
+        rc = context_auth(context, 0, &authSession);
+        if (rc == TSS2_RC_SUCCESS)
+            rc = Esys_NV_Write(ctx, nvHandle, nvHandle,
+                               authSession, ESYS_TR_NONE, ESYS_TR_NONE,
+                               &blob, 0/*=offset*/);
+        Esys_TR_Close(ctx, &nvHandle);
+        chkrc(rc, goto error);
+
+        pending = 1;
+    }
+
+
+    if (pending) {
+        cbrc = callback(nvs[count - 1] ? nvs[count - 1] : DEFAULT_NV,
+                        &secret[(count - 1) % 2][0], SECRETLEN, userdata);
+        context_wipe(&secret[0][0], sizeof(secret));
+        if (cbrc)
+            return -20;
+    }
+    return 0;
+
+error:
+    /* The previous key is already stored, so it is still reported */
+    if (pending && i > 0)
+        callback(nvs[i - 1] ? nvs[i - 1] : DEFAULT_NV,
+                 &secret[(i - 1) % 2][0], SECRETLEN, userdata);
+    context_wipe(&secret[0][0], sizeof(secret));
+    context_wipe(&keySensitive, sizeof(keySensitive));
+    free(keyPublicHmac);
+    free(keyPrivateHmac);
+    free(keyPublicSeal);
+    free(keyPrivateSeal);
+    return (rc)? (int)rc : -1;
+}
+
+int
+tpm2totp_context_generateKeys_nv(TPM2TOTP_CONTEXT *context,
+                                 uint32_t pcrs, uint32_t banks,
+                                 const char *password,
+                                 const uint32_t *nvs, size_t count,
+                                 tpm2totp_generate_cb callback, void *userdata)
+{
+    uint64_t start = metrics_now();
+    int rc = generateKeys_nv(context, pcrs, banks, password, nvs, count,
+                             callback, userdata);
+
+    metrics_op(METRICS_OP_GENERATE_BATCH, start, rc);
+    return rc;
+}
+
+int
+tpm2totp_generateKeys_nv(uint32_t pcrs, uint32_t banks, const char *password,
+                         const uint32_t *nvs, size_t count,
+                         TSS2_TCTI_CONTEXT *tcti_context,
+                         tpm2totp_generate_cb callback, void *userdata)
+{
+    uint64_t start = metrics_now();
+    TPM2TOTP_CONTEXT *context;
+    int rc = tpm2totp_context_new(tcti_context, &context);
+
+    if (rc == 0) {
+        rc = generateKeys_nv(context, pcrs, banks, password, nvs, count,
+                             callback, userdata);
+        tpm2totp_context_free(context);
+    }
+    metrics_op(METRICS_OP_GENERATE_BATCH, start, rc);
+    return rc;
+}
+
+/** Get the public key of the storage primary key.
+ *
+ * The storage primary key is the parent of all keys. Its public key allows
+ * tpm2totp_wrapKey() to create keys for this TPM without access to it.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[out] primaryPublic_blob Marshalled TPM2B_PUBLIC of the primary key.
+ * @param[out] primaryPublic_size Size of the public key.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+int
+tpm2totp_context_getPrimaryPublic(TPM2TOTP_CONTEXT *context,
+                                  uint8_t **primaryPublic_blob,
+                                  size_t *primaryPublic_size)
+{
+    if (context == NULL || primaryPublic_blob == NULL ||
+        primaryPublic_size == NULL) {
+        return -1;
+    }
+
+    ESYS_CONTEXT *ctx = context->esys;
+    ESYS_TR primary;
+    TPM2B_PUBLIC *outPublic = NULL;
+    TSS2_RC rc;
+    size_t off = 0;
+
+    *primaryPublic_blob = NULL;
+
+    rc = context_primary(context, &primary);
     chkrc(rc, goto error);
 
-    rc = Esys_PCR_Read(ctx,
-                       ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
-                       &pcrsel, NULL, &pcrcheck, NULL);
+    rc = Esys_ReadPublic(ctx, primary, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                         &outPublic, NULL, NULL);
     chkrc(rc, goto error);
 
-    if (pcrcheck->count == 0) {
-        dbg("No active banks selected");
+    *primaryPublic_size = 0;
+    rc = Tss2_MU_TPM2B_PUBLIC_Marshal(outPublic, NULL, -1, primaryPublic_size);
+    chkrc(rc, goto error);
+
+    *primaryPublic_blob = malloc(*primaryPublic_size);
+    if (!*primaryPublic_blob) goto error;
+
+    rc = Tss2_MU_TPM2B_PUBLIC_Marshal(outPublic, *primaryPublic_blob,
+                                      *primaryPublic_size, &off);
+    chkrc(rc, free(*primaryPublic_blob); *primaryPublic_blob = NULL;
+              goto error);
+    free(outPublic);
+
+    return 0;
+
+error:
+    free(outPublic);
+    return (rc)? (int)rc : -1;
+}
+
+int
+tpm2totp_getPrimaryPublic(TSS2_TCTI_CONTEXT *tcti_context,
+                          uint8_t **primaryPublic_blob,
+                          size_t *primaryPublic_size)
+{
+    TPM2TOTP_CONTEXT *context;
+    int rc = tpm2totp_context_new(tcti_context, &context);
+
+    if (rc == 0) {
+        rc = tpm2totp_context_getPrimaryPublic(context, primaryPublic_blob,
+                                               primaryPublic_size);
+        tpm2totp_context_free(context);
+    }
+    return rc;
+}
+
+/** Import a key wrapped by tpm2totp_wrapKey().
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[in] importBlob Wrapped key.
+ * @param[in] importBlob_size Size of the wrapped key.
+ * @param[out] keyBlob Imported key.
+ * @param[out] keyBlob_size Size of the imported key.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+static int
+importKey(TPM2TOTP_CONTEXT *context,
+          const uint8_t *importBlob, size_t importBlob_size,
+          uint8_t **keyBlob, size_t *keyBlob_size)
+{
+    if (context == NULL || importBlob == NULL || keyBlob == NULL ||
+        keyBlob_size == NULL) {
         return -1;
     }
-    free(pcrcheck);
 
-    rc = Esys_StartAuthSession(ctx, ESYS_TR_NONE, ESYS_TR_NONE,
-                    ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
-                    NULL, TPM2_SE_POLICY, &sym, TPM2_ALG_SHA256,
-                    &session);
-    chkrc(rc, goto error);
+    ESYS_CONTEXT *ctx = context->esys;
+    ESYS_TR primary;
+    TSS2_RC rc;
+    size_t off = 0;
+    uint32_t magic, pcrs, banks;
+    int sealed;
+
+    TPM2B_DATA encryptionKey = { .size = 0 };
+    TPMT_SYM_DEF_OBJECT symmetricAlg = { .algorithm = TPM2_ALG_NULL };
+    TPM2B_ENCRYPTED_SECRET inSymSeed = { .size = 0 };
+    TPM2B_PUBLIC keyPublicHmac = { .size = 0 };
+    TPM2B_PRIVATE duplicateHmac = { .size = 0 };
+    TPM2B_PUBLIC keyPublicSeal = { .size = 0 };
+    TPM2B_PRIVATE duplicateSeal = { .size = 0 };
+    TPM2B_PRIVATE *keyPrivateHmac = NULL;
+    TPM2B_PRIVATE *keyPrivateSeal = NULL;
 
-    rc = Esys_PolicyPCR(ctx, session,
-                        ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
-                        NULL, &pcrsel);
-    chkrc(rc, Esys_FlushContext(ctx, session); goto error);
+    *keyBlob = NULL;
 
-    rc = Esys_PolicyGetDigest(ctx, session,
-                              ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
-                              &policyDigest);
-    Esys_FlushContext(ctx, session);
+    rc = Tss2_MU_UINT32_Unmarshal(importBlob, importBlob_size, &off, &magic);
+    chkrc(rc, goto error);
+    if (magic != IMPORTBLOB_MAGIC) {
+        dbg("Not a wrapped key");
+        return -1;
+    }
+    rc = Tss2_MU_UINT32_Unmarshal(importBlob, importBlob_size, &off, &pcrs);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_UINT32_Unmarshal(importBlob, importBlob_size, &off, &banks);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_TPM2B_ENCRYPTED_SECRET_Unmarshal(importBlob, importBlob_size,
+                                                  &off, &inSymSeed);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_TPM2B_PUBLIC_Unmarshal(importBlob, importBlob_size, &off,
+                                        &keyPublicHmac);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_TPM2B_PRIVATE_Unmarshal(importBlob, importBlob_size, &off,
+                                         &duplicateHmac);
     chkrc(rc, goto error);
 
-    keyInPublicHmac.publicArea.authPolicy = *policyDigest;
-    free(policyDigest);    
+    sealed = off != importBlob_size;
+    if (sealed) {
+        rc = Tss2_MU_TPM2B_PUBLIC_Unmarshal(importBlob, importBlob_size, &off,
+                                            &keyPublicSeal);
+        chkrc(rc, goto error);
+        rc = Tss2_MU_TPM2B_PRIVATE_Unmarshal(importBlob, importBlob_size, &off,
+                                             &duplicateSeal);
+        chkrc(rc, goto error);
+    }
 
-    keySensitive.sensitive.data.size = secret2b->size;
-    memcpy(&keySensitive.sensitive.data.buffer[0], &secret2b->buffer[0],
-           keySensitive.sensitive.data.size);
-    free(secret2b);
+    if (off != importBlob_size) {
+        dbg("bad blob size");
+        return -1;
+    }
 
-    rc = Esys_Create(ctx, primary, 
+    rc = context_primary(context, &primary);
+    chkrc(rc, goto error);
+
+    rc = Esys_Import(ctx, primary,
                      ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
-                     &keySensitive, &keyInPublicHmac,
-                     &allOutsideInfo, &allCreationPCR,
-                     &keyPrivateHmac, &keyPublicHmac, NULL, NULL, NULL);
+                     &encryptionKey, &keyPublicHmac, &duplicateHmac,
+                     &inSymSeed, &symmetricAlg, &keyPrivateHmac);
     chkrc(rc, goto error);
-    Esys_FlushContext(ctx, primary);
-    Esys_Finalize(&ctx);
 
-    *newBlob_size = 4 + 4;
-    rc = Tss2_MU_TPM2B_PUBLIC_Marshal(keyPublicHmac, NULL, -1, newBlob_size);
+    if (sealed) {
+        rc = Esys_Import(ctx, primary,
+                         ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
+                         &encryptionKey, &keyPublicSeal, &duplicateSeal,
+                         &inSymSeed, &symmetricAlg, &keyPrivateSeal);
+        chkrc(rc, goto error);
+    }
+
+
+    *keyBlob_size = 4 + 4;
+    rc = Tss2_MU_TPM2B_PUBLIC_Marshal(&keyPublicHmac, NULL, -1, keyBlob_size);
     chkrc(rc, goto error);
-    rc = Tss2_MU_TPM2B_PRIVATE_Marshal(keyPrivateHmac, NULL, -1, newBlob_size);
+    rc = Tss2_MU_TPM2B_PRIVATE_Marshal(keyPrivateHmac, NULL, -1, keyBlob_size);
     chkrc(rc, goto error);
-    if (password && strlen(password) > 0) {
-        rc = Tss2_MU_TPM2B_PUBLIC_Marshal(&keyPublicSeal, NULL, -1, newBlob_size);
+    if (sealed) {
+        rc = Tss2_MU_TPM2B_PUBLIC_Marshal(&keyPublicSeal, NULL, -1,
+                                          keyBlob_size);
         chkrc(rc, goto error);
-        rc = Tss2_MU_TPM2B_PRIVATE_Marshal(&keyPrivateSeal, NULL, -1, newBlob_size);
+        rc = Tss2_MU_TPM2B_PRIVATE_Marshal(keyPrivateSeal, NULL, -1,
+                                           keyBlob_size);
         chkrc(rc, goto error);
     }
 
-    *newBlob = malloc(*newBlob_size);
-    off = 0;
+    *keyBlob = malloc(*keyBlob_size);
+    if (!*keyBlob) goto error;
 
-    rc = Tss2_MU_UINT32_Marshal(pcrs, *newBlob, *newBlob_size, &off);
-    chkrc(rc, goto error_marshall);
-    rc = Tss2_MU_UINT32_Marshal(banks, *newBlob, *newBlob_size, &off);
-    chkrc(rc, goto error_marshall);
-    rc = Tss2_MU_TPM2B_PUBLIC_Marshal(keyPublicHmac, 
-                                      *newBlob, *newBlob_size, &off);
-    chkrc(rc, goto error_marshall);
+    off = 0;
+    rc = Tss2_MU_UINT32_Marshal(pcrs, *keyBlob, *keyBlob_size, &off);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_UINT32_Marshal(banks, *keyBlob, *keyBlob_size, &off);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_TPM2B_PUBLIC_Marshal(&keyPublicHmac,
+                                      *keyBlob, *keyBlob_size, &off);
+    chkrc(rc, goto error);
     rc = Tss2_MU_TPM2B_PRIVATE_Marshal(keyPrivateHmac,
-                                       *newBlob, *newBlob_size, &off);
-    chkrc(rc, goto error_marshall);
-    rc = Tss2_MU_TPM2B_PUBLIC_Marshal(&keyPublicSeal,
-                                      *newBlob, *newBlob_size, &off);
-    chkrc(rc, goto error_marshall);
-    rc = Tss2_MU_TPM2B_PRIVATE_Marshal(&keyPrivateSeal,
-                                       *newBlob, *newBlob_size, &off);
-    chkrc(rc, goto error_marshall);
+                                       *keyBlob, *keyBlob_size, &off);
+    chkrc(rc, goto error);
+    if (sealed) {
+        rc = Tss2_MU_TPM2B_PUBLIC_Marshal(&keyPublicSeal,
+                                          *keyBlob, *keyBlob_size, &off);
+        chkrc(rc, goto error);
+        rc = Tss2_MU_TPM2B_PRIVATE_Marshal(keyPrivateSeal,
+                                           *keyBlob, *keyBlob_size, &off);
+        chkrc(rc, goto error);
+    }
 
-    free(keyPublicHmac);
     free(keyPrivateHmac);
+    free(keyPrivateSeal);
 
     return 0;
 
-error_marshall:
-    free(keyPublicHmac);
-    free(keyPrivateHmac);
-    free(*newBlob);
-    *newBlob = 0;
-    *newBlob_size = 0;
-
-    return (rc)? (int)rc : -1;
-
 error:
-    free(keyPublicHmac);
+    free(*keyBlob);
+    *keyBlob = NULL;
     free(keyPrivateHmac);
-    if (primary != ESYS_TR_NONE) Esys_FlushContext(ctx, primary);
-    Esys_Finalize(&ctx);
+    free(keyPrivateSeal);
     return (rc)? (int)rc : -1;
 }
 
-/** Store a key in a NV index.
+int
+tpm2totp_context_importKey(TPM2TOTP_CONTEXT *context,
+                           const uint8_t *importBlob, size_t importBlob_size,
+                           uint8_t **keyBlob, size_t *keyBlob_size)
+{
+    uint64_t start = metrics_now();
+    int rc = importKey(context, importBlob, importBlob_size, keyBlob,
+                       keyBlob_size);
+
+    metrics_op(METRICS_OP_IMPORT, start, rc);
+    return rc;
+}
+
+int
+tpm2totp_importKey(const uint8_t *importBlob, size_t importBlob_size,
+                   TSS2_TCTI_CONTEXT *tcti_context,
+                   uint8_t **keyBlob, size_t *keyBlob_size)
+{
+    uint64_t start = metrics_now();
+    TPM2TOTP_CONTEXT *context;
+    int rc = tpm2totp_context_new(tcti_context, &context);
+
+    if (rc == 0) {
+        rc = importKey(context, importBlob, importBlob_size, keyBlob,
+                       keyBlob_size);
+        tpm2totp_context_free(context);
+    }
+    metrics_op(METRICS_OP_IMPORT, start, rc);
+    return rc;
+}
+
+/** Compute the policy digest of keys sealed to PCRs.
  *
- * @param[in] keyblob Key to store to NVRAM.
- * @param[in] keyblob_size Size of the key.
- * @param[in] nv NV index to store the key.
+ * @param[in] context Library context of the TPM.
+ * @param[in] pcrs PCRs the keys should be sealed against.
+ * @param[in] banks PCR banks the keys should be sealed against.
+ * @param[out] policy Policy digest of the keys.
  * @retval 0 on success.
  * @retval -1 on undefined/general failure.
  */
-int
-tpm2totp_storeKey_nv(const uint8_t *keyBlob, size_t keyBlob_size, uint32_t nv)
+static int
+reseal_policy(TPM2TOTP_CONTEXT *context, uint32_t pcrs, uint32_t banks,
+              TPM2B_DIGEST *policy)
 {
-    if (!keyBlob)
-        return -1;
-
+    ESYS_CONTEXT *ctx = context->esys;
+    ESYS_TR session;
     TSS2_RC rc;
-    ESYS_CONTEXT *ctx;
-    ESYS_TR nvHandle;
+    TPM2B_DIGEST *policyDigest;
+    TPML_PCR_SELECTION *pcrcheck, pcrsel = { .count = 0 };
 
-    if (!nv) nv = DEFAULT_NV; /* Some random handle from owner space */
+    TPMT_SYM_DEF sym = {.algorithm = TPM2_ALG_AES,
+                        .keyBits = {.aes = 128},
+                        .mode = {.aes = TPM2_ALG_CFB}
+    };
 
-    TPM2B_NV_PUBLIC publicInfo = { .size = 0,
-        .nvPublic = {
-            .nvIndex = nv,
-            .nameAlg = TPM2_ALG_SHA1,
-            .attributes = (TPMA_NV_OWNERWRITE |
-                           TPMA_NV_AUTHWRITE |
-                           TPMA_NV_WRITE_STCLEAR |
-                           TPMA_NV_READ_STCLEAR |
-                           TPMA_NV_AUTHREAD |
-                           TPMA_NV_OWNERREAD ),
-            .authPolicy = { .size = 0, .buffer = {}, },
-            .dataSize = keyBlob_size,
-        } };
+    if ((banks & TPM2TOTP_BANK_SHA1)) {
+        pcrsel.pcrSelections[pcrsel.count].hash = TPM2_ALG_SHA1;
+        pcrsel.count++;
+    }
+    if ((banks & TPM2TOTP_BANK_SHA256)) {
+        pcrsel.pcrSelections[pcrsel.count].hash = TPM2_ALG_SHA256;
+        pcrsel.count++;
+    }
+    if ((banks & TPM2TOTP_BANK_SHA384)) {
+        pcrsel.pcrSelections[pcrsel.count].hash = TPM2_ALG_SHA384;
+        pcrsel.count++;
+    }
 
-    TPM2B_MAX_NV_BUFFER blob = { .size = keyBlob_size };
-    if (blob.size > sizeof(blob.buffer)) {
-        dbg("keyBlob too large");
+    for (size_t i = 0; i < pcrsel.count; i++) {
+        pcrsel.pcrSelections[i].sizeofSelect = 3;
+        pcrsel.pcrSelections[i].pcrSelect[0] = pcrs & 0xff;
+        pcrsel.pcrSelections[i].pcrSelect[1] = pcrs >>8 & 0xff;
+        pcrsel.pcrSelections[i].pcrSelect[2] = pcrs >>16 & 0xff;
+    }
+
+    rc = Esys_PCR_Read(ctx,
+                       ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                       &pcrsel, NULL, &pcrcheck, NULL);
+    chkrc(rc, goto error);
+
+    if (pcrcheck->count == 0) {
+        dbg("No active banks selected");
+        free(pcrcheck);
+        goto error;
+    }
+    free(pcrcheck);
+
+    rc = Esys_StartAuthSession(ctx, ESYS_TR_NONE, ESYS_TR_NONE,
+                    ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                    NULL, TPM2_SE_POLICY, &sym, TPM2_ALG_SHA256,
+                    &session);
+    chkrc(rc, goto error);
+
+    rc = Esys_PolicyPCR(ctx, session,
+                        ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                        NULL, &pcrsel);
+    chkrc(rc, Esys_FlushContext(ctx, session); goto error);
+
+    rc = Esys_PolicyGetDigest(ctx, session,
+                              ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                              &policyDigest);
+    Esys_FlushContext(ctx, session);
+    chkrc(rc, goto error);
+
+    *policy = *policyDigest;
+    free(policyDigest);
+    return 0;
+
+error:
+    return (rc)? (int)rc : -1;
+}
+
+/** Reseal a key to a policy digest.
+ *
+ * The secret is unsealed with the password and a new HMAC key for the
+ * policy is created under the primary key.
+ * @param[in] context Library context of the TPM.
+ * @param[in] primary The storage primary key.
+ * @param[in] auth Password of the key.
+ * @param[in] pcrs PCRs the key should be sealed against.
+ * @param[in] banks PCR banks the key should be sealed against.
+ * @param[in] policy Policy digest of the PCRs and banks.
+ * @param[in] keyBlob Original key.
+ * @param[in] keyBlob_size Size of the key.
+ * @param[out] newBlob New key.
+ * @param[out] newBlob_size Size of the new key.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+static int
+reseal_key(TPM2TOTP_CONTEXT *context, ESYS_TR primary, const TPM2B_AUTH *auth,
+           uint32_t pcrs, uint32_t banks, const TPM2B_DIGEST *policy,
+           const uint8_t *keyBlob, size_t keyBlob_size,
+           uint8_t **newBlob, size_t *newBlob_size)
+{
+    ESYS_CONTEXT *ctx = context->esys;
+    ESYS_TR key;
+    TSS2_RC rc;
+    size_t off = 0;
+    TPM2B_SENSITIVE_DATA *secret2b = NULL;
+
+    TPM2B_PUBLIC keyInPublicHmac = TPM2B_PUBLIC_KEY_TEMPLATE_HMAC;
+    TPM2B_SENSITIVE_CREATE keySensitive = TPM2B_SENSITIVE_CREATE_TEMPLATE;
+    TPM2B_PUBLIC keyPublicSeal = { .size = 0 };
+    TPM2B_PRIVATE keyPrivateSeal = { .size = 0 };
+    TPM2B_PUBLIC *keyPublicHmac = NULL;
+    TPM2B_PRIVATE *keyPrivateHmac = NULL;
+
+    /* We skip over the pcrs and banks from NV because they are not trustworthy */
+    rc = Tss2_MU_UINT32_Unmarshal(keyBlob, keyBlob_size, &off, NULL);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_UINT32_Unmarshal(keyBlob, keyBlob_size, &off, NULL);
+    chkrc(rc, goto error);
+
+    rc = Tss2_MU_TPM2B_PUBLIC_Unmarshal(keyBlob, keyBlob_size, &off, NULL);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_TPM2B_PRIVATE_Unmarshal(keyBlob, keyBlob_size, &off, NULL);
+    chkrc(rc, goto error);
+
+    if (off == keyBlob_size) {
+        dbg("No unseal blob included.");
+        return -1;
+    }
+
+    rc = Tss2_MU_TPM2B_PUBLIC_Unmarshal(keyBlob, keyBlob_size, &off,
+                                        &keyPublicSeal);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_TPM2B_PRIVATE_Unmarshal(keyBlob, keyBlob_size, &off, 
+                                         &keyPrivateSeal);
+    chkrc(rc, goto error);
+
+    if (off != keyBlob_size) {
+        dbg("bad blob size");
+        return -1;
+    }
+
+    rc = Esys_Load(ctx, primary,
+                   ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
+                   &keyPrivateSeal, &keyPublicSeal,
+                   &key);
+    chkrc(rc, goto error);
+
+    Esys_TR_SetAuth(ctx, key, auth);
+
+    rc = Esys_Unseal(ctx, key,
+                     ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
+                     &secret2b);
+    Esys_FlushContext(ctx, key);
+    chkrc(rc, goto error);
+
+    keyInPublicHmac.publicArea.authPolicy = *policy;
+
+    keySensitive.sensitive.data.size = secret2b->size;
+    memcpy(&keySensitive.sensitive.data.buffer[0], &secret2b->buffer[0],
+           keySensitive.sensitive.data.size);
+    context_wipe(secret2b, sizeof(*secret2b));
+    free(secret2b);
+    secret2b = NULL;
+
+    rc = Esys_Create(ctx, primary, 
+                     ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
+                     &keySensitive, &keyInPublicHmac,
+                     &allOutsideInfo, &allCreationPCR,
+                     &keyPrivateHmac, &keyPublicHmac, NULL, NULL, NULL);
+    chkrc(rc, goto error);
+
+    *newBlob_size = 4 + 4;
+    rc = Tss2_MU_TPM2B_PUBLIC_Marshal(keyPublicHmac, NULL, -1, newBlob_size);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_TPM2B_PRIVATE_Marshal(keyPrivateHmac, NULL, -1, newBlob_size);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_TPM2B_PUBLIC_Marshal(&keyPublicSeal, NULL, -1, newBlob_size);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_TPM2B_PRIVATE_Marshal(&keyPrivateSeal, NULL, -1, newBlob_size);
+    chkrc(rc, goto error);
+
+    *newBlob = malloc(*newBlob_size);
+    if (!*newBlob) goto error;
+    off = 0;
+
+    rc = Tss2_MU_UINT32_Marshal(pcrs, *newBlob, *newBlob_size, &off);
+    chkrc(rc, goto error_marshall);
+    rc = Tss2_MU_UINT32_Marshal(banks, *newBlob, *newBlob_size, &off);
+    chkrc(rc, goto error_marshall);
+    rc = Tss2_MU_TPM2B_PUBLIC_Marshal(keyPublicHmac, 
+                                      *newBlob, *newBlob_size, &off);
+    chkrc(rc, goto error_marshall);
+    rc = Tss2_MU_TPM2B_PRIVATE_Marshal(keyPrivateHmac,
+                                       *newBlob, *newBlob_size, &off);
+    chkrc(rc, goto error_marshall);
+    rc = Tss2_MU_TPM2B_PUBLIC_Marshal(&keyPublicSeal,
+                                      *newBlob, *newBlob_size, &off);
+    chkrc(rc, goto error_marshall);
+    rc = Tss2_MU_TPM2B_PRIVATE_Marshal(&keyPrivateSeal,
+                                       *newBlob, *newBlob_size, &off);
+    chkrc(rc, goto error_marshall);
+
+    context_wipe(&keySensitive, sizeof(keySensitive));
+    free(keyPublicHmac);
+    free(keyPrivateHmac);
+
+    return 0;
+
+error_marshall:
+    free(*newBlob);
+    *newBlob = 0;
+    *newBlob_size = 0;
+
+error:
+    if (secret2b)
+        context_wipe(secret2b, sizeof(*secret2b));
+    free(secret2b);
+    context_wipe(&keySensitive, sizeof(keySensitive));
+    free(keyPublicHmac);
+    free(keyPrivateHmac);
+    return (rc)? (int)rc : -1;
+}
+
+/** Reseal a key to new PCR values.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[in] keyBlob Original key.
+ * @param[in] keyBlob_size Size of the key.
+ * @param[in] password Password of the key.
+ * @param[in] pcrs PCRs the key should be sealed against.
+ * @param[in] banks PCR banks the key should be sealed against.
+ * @param[out] newBlob New key.
+ * @param[out] newBlob_size Size of the new key.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ * @retval -10 on empty password.
+ */
+static int
+reseal(TPM2TOTP_CONTEXT *context,
+       const uint8_t *keyBlob, size_t keyBlob_size,
+       const char *password, uint32_t pcrs, uint32_t banks,
+       uint8_t **newBlob, size_t *newBlob_size)
+{
+    if (context == NULL || keyBlob == NULL || !password ||
+        newBlob == NULL || newBlob_size == NULL) {
+        return -1;
+    }
+    if (!strlen(password)) {
+        dbg("Password required.");
+        return -10;
+    }
+
+    ESYS_TR primary = ESYS_TR_NONE;
+    TSS2_RC rc;
+    TPM2B_AUTH auth;
+    TPM2B_DIGEST policy;
+
+    rc = context_selection(context, &pcrs, &banks);
+    if (rc != TSS2_RC_SUCCESS)
+        return (int)rc;
+
+    auth.size = strlen(password);
+    memcpy(&auth.buffer[0], password, auth.size);
+
+    rc = context_primary(context, &primary);
+    chkrc(rc, goto error);
+
+    rc = reseal_policy(context, pcrs, banks, &policy);
+    chkrc(rc, goto error);
+
+    rc = reseal_key(context, primary, &auth, pcrs, banks, &policy,
+                    keyBlob, keyBlob_size, newBlob, newBlob_size);
+    context_wipe(&auth, sizeof(auth));
+    chkrc(rc, goto error);
+
+    metrics_count(METRICS_KEYS_RESEALED);
+    return 0;
+
+error:
+    context_wipe(&auth, sizeof(auth));
+    return (rc)? (int)rc : -1;
+}
+
+int
+tpm2totp_context_reseal(TPM2TOTP_CONTEXT *context,
+                        const uint8_t *keyBlob, size_t keyBlob_size,
+                        const char *password, uint32_t pcrs, uint32_t banks,
+                        uint8_t **newBlob, size_t *newBlob_size)
+{
+    uint64_t start = metrics_now();
+    int rc = reseal(context, keyBlob, keyBlob_size, password, pcrs, banks,
+                    newBlob, newBlob_size);
+
+    metrics_op(METRICS_OP_RESEAL, start, rc);
+    return rc;
+}
+
+int
+tpm2totp_reseal_tcti(const uint8_t *keyBlob, size_t keyBlob_size,
+                     const char *password, uint32_t pcrs, uint32_t banks,
+                     TSS2_TCTI_CONTEXT *tcti_context,
+                     uint8_t **newBlob, size_t *newBlob_size)
+{
+    uint64_t start = metrics_now();
+    TPM2TOTP_CONTEXT *context;
+    int rc = tpm2totp_context_new(tcti_context, &context);
+
+    if (rc == 0) {
+        rc = reseal(context, keyBlob, keyBlob_size, password, pcrs, banks,
+                    newBlob, newBlob_size);
+        tpm2totp_context_free(context);
+    }
+    metrics_op(METRICS_OP_RESEAL, start, rc);
+    return rc;
+}
+
+int
+tpm2totp_reseal(const uint8_t *keyBlob, size_t keyBlob_size,
+                const char *password, uint32_t pcrs, uint32_t banks,
+                uint8_t **newBlob, size_t *newBlob_size)
+{
+    return tpm2totp_reseal_tcti(keyBlob, keyBlob_size, password, pcrs, banks,
+                                NULL, newBlob, newBlob_size);
+}
+
+/** Store a key in a NV index.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[in] keyblob Key to store to NVRAM.
+ * @param[in] keyblob_size Size of the key.
+ * @param[in] nv NV index to store the key.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+static int
+storeKey_nv(TPM2TOTP_CONTEXT *context,
+            const uint8_t *keyBlob, size_t keyBlob_size, uint32_t nv)
+{
+    if (!context || !keyBlob)
+        return -1;
+
+    TSS2_RC rc;
+    ESYS_CONTEXT *ctx = context->esys;
+    ESYS_TR nvHandle, authSession;
+
+    if (!nv) nv = DEFAULT_NV; /* Some random handle from owner space */
+
+    TPM2B_NV_PUBLIC publicInfo = { .size = 0,
+        .nvPublic = {
+            .nvIndex = nv,
+            .nameAlg = TPM2_ALG_SHA1,
+            .attributes = NV_ATTRIBUTES_KEY,
+            .authPolicy = { .size = 0, .buffer = {}, },
+            .dataSize = keyBlob_size,
+        } };
+
+    TPM2B_MAX_NV_BUFFER blob = { .size = keyBlob_size };
+    if (blob.size > sizeof(blob.buffer)) {
+        dbg("keyBlob too large");
+        return -1;
+    }
+    memcpy(&blob.buffer[0], keyBlob, blob.size);
+
+    rc = context_auth(context, TPMA_SESSION_DECRYPT, &authSession);
+    chkrc(rc, goto error);
+    rc = Esys_NV_DefineSpace(ctx, ESYS_TR_RH_OWNER,
+                             authSession, ESYS_TR_NONE, ESYS_TR_NONE,
+                             &context->nvAuth, &publicInfo, &nvHandle);
+    chkrc(rc, goto error);
+
+    rc = context_auth(context, 0, &authSession);
+    if (rc == TSS2_RC_SUCCESS)
+        rc = Esys_NV_Write(ctx, nvHandle, nvHandle,
+                           authSession, ESYS_TR_NONE, ESYS_TR_NONE,
+                           &blob, 0/*=offset*/);
+    Esys_TR_Close(ctx, &nvHandle);
+    chkrc(rc, goto error);
+
+    return 0;
+
+error:
+    return (rc)? (int)rc : -1;
+}
+
+int
+tpm2totp_context_storeKey_nv(TPM2TOTP_CONTEXT *context,
+                             const uint8_t *keyBlob, size_t keyBlob_size,
+                             uint32_t nv)
+{
+    uint64_t start = metrics_now();
+    int rc = storeKey_nv(context, keyBlob, keyBlob_size, nv);
+
+    metrics_op(METRICS_OP_STORE, start, rc);
+    return rc;
+}
+
+int
+tpm2totp_storeKey_nv_tcti(const uint8_t *keyBlob, size_t keyBlob_size,
+                          uint32_t nv, TSS2_TCTI_CONTEXT *tcti_context)
+{
+    uint64_t start = metrics_now();
+    TPM2TOTP_CONTEXT *context;
+    int rc = tpm2totp_context_new(tcti_context, &context);
+
+    if (rc == 0) {
+        rc = storeKey_nv(context, keyBlob, keyBlob_size, nv);
+        tpm2totp_context_free(context);
+    }
+    metrics_op(METRICS_OP_STORE, start, rc);
+    return rc;
+}
+
+int
+tpm2totp_storeKey_nv(const uint8_t *keyBlob, size_t keyBlob_size, uint32_t nv)
+{
+    return tpm2totp_storeKey_nv_tcti(keyBlob, keyBlob_size, nv, NULL);
+}
+
+/** Load a key from a NV index.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[in] nv NV index of the key.
+ * @param[out] keyBlob Loaded key.
+ * @param[out] keyBlob_size Size of the key.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+static int
+loadKey_nv(TPM2TOTP_CONTEXT *context, uint32_t nv,
+           uint8_t **keyBlob, size_t *keyBlob_size)
+{
+    if (!context || !keyBlob || !keyBlob_size)
+        return -1;
+
+    TSS2_RC rc;
+    ESYS_CONTEXT *ctx = context->esys;
+    ESYS_TR nvHandle, authSession;
+    TPM2B_MAX_NV_BUFFER *blob;
+    TPM2B_NV_PUBLIC *publicInfo;
+
+    if (!nv) nv = DEFAULT_NV; /* Some random handle from owner space */
+
+    rc = Esys_TR_FromTPMPublic(ctx, nv,
+                               ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                               &nvHandle);
+    chkrc(rc, goto error);
+    Esys_TR_SetAuth(ctx, nvHandle, &context->nvAuth);
+
+    rc = Esys_NV_ReadPublic(ctx, nvHandle,
+                            ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                            &publicInfo, NULL);
+    chkrc(rc, Esys_TR_Close(ctx, &nvHandle); goto error);
+
+    rc = context_auth(context, 0, &authSession);
+    if (rc == TSS2_RC_SUCCESS)
+        rc = Esys_NV_Read(ctx, nvHandle, nvHandle,
+                          authSession, ESYS_TR_NONE, ESYS_TR_NONE,
+                          publicInfo->nvPublic.dataSize, 0/*=offset*/, &blob);
+    Esys_TR_Close(ctx, &nvHandle);
+    free(publicInfo);
+    chkrc(rc, goto error);
+
+    *keyBlob = malloc(blob->size);
+    if (!*keyBlob) {
+        free(blob);
+        return -1;
+    }
+    *keyBlob_size = blob->size;
+    memcpy(*keyBlob, &blob->buffer[0], *keyBlob_size);
+    free(blob);
+
+    return 0;
+
+error:
+    return (rc)? (int)rc : -1;
+}
+
+int
+tpm2totp_context_loadKey_nv(TPM2TOTP_CONTEXT *context, uint32_t nv,
+                            uint8_t **keyBlob, size_t *keyBlob_size)
+{
+    uint64_t start = metrics_now();
+    int rc = loadKey_nv(context, nv, keyBlob, keyBlob_size);
+
+    metrics_op(METRICS_OP_LOAD, start, rc);
+    return rc;
+}
+
+int
+tpm2totp_loadKey_nv_tcti(uint32_t nv, TSS2_TCTI_CONTEXT *tcti_context,
+                         uint8_t **keyBlob, size_t *keyBlob_size)
+{
+    uint64_t start = metrics_now();
+    TPM2TOTP_CONTEXT *context;
+    int rc = tpm2totp_context_new(tcti_context, &context);
+
+    if (rc == 0) {
+        rc = loadKey_nv(context, nv, keyBlob, keyBlob_size);
+        tpm2totp_context_free(context);
+    }
+    metrics_op(METRICS_OP_LOAD, start, rc);
+    return rc;
+}
+
+int
+tpm2totp_loadKey_nv(uint32_t nv, uint8_t **keyBlob, size_t *keyBlob_size)
+{
+    return tpm2totp_loadKey_nv_tcti(nv, NULL, keyBlob, keyBlob_size);
+}
+
+
+/** Delete a key from a NV index.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[in] nv NV index to delete.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+static int
+deleteKey_nv(TPM2TOTP_CONTEXT *context, uint32_t nv)
+{
+    if (!context)
+        return -1;
+
+    TSS2_RC rc;
+    ESYS_CONTEXT *ctx = context->esys;
+    ESYS_TR nvHandle, authSession;
+
+    if (!nv) nv = DEFAULT_NV; /* Some random handle from owner space */
+
+    rc = Esys_TR_FromTPMPublic(ctx, nv,
+                               ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                               &nvHandle);
+    chkrc(rc, goto error);
+
+    rc = context_auth(context, 0, &authSession);
+    if (rc == TSS2_RC_SUCCESS)
+        rc = Esys_NV_UndefineSpace(ctx, ESYS_TR_RH_OWNER, nvHandle,
+                                   authSession, ESYS_TR_NONE, ESYS_TR_NONE);
+    chkrc(rc, Esys_TR_Close(ctx, &nvHandle); goto error);
+
+
+    return 0;
+
+error:
+
+
+    return (rc)? (int)rc : -1;
+}
+
+int
+tpm2totp_context_deleteKey_nv(TPM2TOTP_CONTEXT *context, uint32_t nv)
+{
+    uint64_t start = metrics_now();
+    int rc = deleteKey_nv(context, nv);
+
+    metrics_op(METRICS_OP_DELETE, start, rc);
+    return rc;
+}
+
+int
+tpm2totp_deleteKey_nv_tcti(uint32_t nv, TSS2_TCTI_CONTEXT *tcti_context)
+{
+    uint64_t start = metrics_now();
+    TPM2TOTP_CONTEXT *context;
+    int rc = tpm2totp_context_new(tcti_context, &context);
+
+    if (rc == 0) {
+        rc = deleteKey_nv(context, nv);
+        tpm2totp_context_free(context);
+    }
+    metrics_op(METRICS_OP_DELETE, start, rc);
+    return rc;
+}
+
+int
+tpm2totp_deleteKey_nv(uint32_t nv)
+{
+    return tpm2totp_deleteKey_nv_tcti(nv, NULL);
+}
+
+/** Get the size of an NV index holding a key from the name of its handle.
+ *
+ * ESYS keeps the name, the SHA1 of the public area, with the handle. For the
+ * indices of keys only the size in the public area is unknown, so it is
+ * found by hashing the public area with every size instead of asking the
+ * TPM again.
+ * @param[in] ctx ESYS context of the handle.
+ * @param[in] nvHandle Handle from Esys_TR_FromTPMPublic().
+ * @param[in] nv NV index of the handle.
+ * @param[out] size Size of the index.
+ * @retval TSS2_RC_SUCCESS on success.
+ * @retval TSS2_ESYS_RC_BAD_VALUE if the index is not defined like a key.
+ * @retval other on failure.
+ */
+static TSS2_RC
+nv_key_size(ESYS_CONTEXT *ctx, ESYS_TR nvHandle, uint32_t nv, uint16_t *size)
+{
+    TPMS_NV_PUBLIC nvPublic = {
+        .nvIndex = nv,
+        .nameAlg = TPM2_ALG_SHA1,
+        .attributes = NV_ATTRIBUTES_KEY | TPMA_NV_WRITTEN,
+        .authPolicy = { .size = 0 },
+        .dataSize = 0,
+    };
+    uint8_t buffer[sizeof(TPMS_NV_PUBLIC)], digest[TPM2_SHA1_DIGEST_SIZE];
+    size_t off = 0;
+    TPM2B_NAME *name;
+    TSS2_RC rc;
+
+    rc = Tss2_MU_TPMS_NV_PUBLIC_Marshal(&nvPublic, buffer, sizeof(buffer),
+                                        &off);
+    if (rc != TSS2_RC_SUCCESS)
+        return rc;
+    rc = Esys_TR_GetName(ctx, nvHandle, &name);
+    if (rc != TSS2_RC_SUCCESS)
+        return rc;
+
+    rc = TSS2_ESYS_RC_BAD_VALUE;
+    if (name->size != 2 + TPM2_SHA1_DIGEST_SIZE ||
+        ((name->name[0] << 8) | name->name[1]) != TPM2_ALG_SHA1)
+        goto out;
+    /* The size is the last field of the marshalled public area */
+    for (uint32_t s = 0; s <= TPM2_MAX_NV_BUFFER_SIZE; s++) {
+        buffer[off - 2] = s >> 8;
+        buffer[off - 1] = s & 0xff;
+        sha1mb_digest(&buffer[0], off, &digest[0]);
+        if (!memcmp(&digest[0], &name->name[2], sizeof(digest))) {
+            *size = s;
+            rc = TSS2_RC_SUCCESS;
+            break;
+        }
+    }
+
+out:
+    free(name);
+    return rc;
+}
+
+/* First NV index tried for keeping a resealed key while its index is
+   redefined */
+#define NV_SCRATCH_FIRST (DEFAULT_NV + 1)
+
+/** Find an NV index that is not defined.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[in] first First index to consider.
+ * @param[out] nv The lowest free index from first on.
+ * @retval 0 on success.
+ * @retval -1 if there is no free index in the owner's NV range.
+ * @retval other on TPM failure.
+ */
+static int
+nv_free_index(TPM2TOTP_CONTEXT *context, uint32_t first, uint32_t *nv)
+{
+    TSS2_RC rc;
+    TPMI_YES_NO more = TPM2_YES;
+    TPMS_CAPABILITY_DATA *cap;
+    TPML_HANDLE *handles;
+    uint32_t candidate = first;
+    int found = 0;
+
+    /* The handles are listed in ascending order from the candidate on */
+    while (!found && more) {
+        rc = Esys_GetCapability(context->esys,
+                                ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                                TPM2_CAP_HANDLES, candidate,
+                                TPM2_MAX_CAP_HANDLES, &more, &cap);
+        chkrc(rc, return (int)rc);
+
+        handles = &cap->data.handles;
+        if (handles->count == 0)
+            more = TPM2_NO;
+        for (size_t i = 0; i < handles->count && !found; i++) {
+            if (handles->handle[i] != candidate)
+                found = 1;
+            else
+                candidate++;
+        }
+        free(cap);
+    }
+
+    if (candidate > TPM2_NV_INDEX_LAST)
+        return -1;
+    *nv = candidate;
+    return 0;
+}
+
+/** Reseal the keys of a list of NV indices to new PCR values.
+ *
+ * The primary key and the policy digest are created once for all keys. All
+ * keys are resealed before the first NV index is written, so a key that
+ * cannot be resealed, e.g. because of a different password, leaves all
+ * indices unchanged. Indices are overwritten in place if the size of the key
+ * did not change. Otherwise the resealed key is first stored in a free
+ * scratch index, which is only removed once the index of the key was
+ * redefined; if that fails, the scratch index that still holds the key is
+ * reported. A list with an index twice is rejected before any TPM command.
+ * @param[in] context Library context of the TPM.
+ * @param[in] password Password of the keys.
+ * @param[in] pcrs PCRs the keys should be sealed against.
+ * @param[in] banks PCR banks the keys should be sealed against.
+ * @param[in] nvs NV indices of the keys.
+ * @param[in] count Number of NV indices.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ * @retval -10 on empty password.
+ */
+static int
+resealKeys_nv(TPM2TOTP_CONTEXT *context, const char *password,
+              uint32_t pcrs, uint32_t banks,
+              const uint32_t *nvs, size_t count)
+{
+    if (context == NULL || !password || nvs == NULL) {
+        return -1;
+    }
+    if (!strlen(password)) {
+        dbg("Password required.");
+        return -10;
+    }
+
+    ESYS_CONTEXT *ctx = context->esys;
+    ESYS_TR primary = ESYS_TR_NONE, *nvHandles, authSession;
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+    uint32_t nv, scratch = 0;
+    size_t written = 0;
+    TPM2B_AUTH auth;
+    TPM2B_DIGEST policy;
+    TPM2B_MAX_NV_BUFFER *blob, newBlob;
+    uint8_t **newBlobs;
+    size_t *newBlob_sizes, i;
+    uint16_t *dataSizes;
+    int done = 0;
+
+    if (count == 0)
+        return 0;
+    /* A key listed twice would be resealed from its old blob twice */
+    for (i = 0; i < count; i++) {
+        for (size_t j = 0; j < i; j++) {
+            if ((nvs[i] ? nvs[i] : DEFAULT_NV) ==
+                (nvs[j] ? nvs[j] : DEFAULT_NV)) {
+                dbg("NV index 0x%08x listed twice",
+                    nvs[i] ? nvs[i] : DEFAULT_NV);
+                return -1;
+            }
+        }
+    }
+    rc = context_selection(context, &pcrs, &banks);
+    if (rc != TSS2_RC_SUCCESS)
+        return (int)rc;
+
+    nvHandles = calloc(count, sizeof(*nvHandles));
+    newBlobs = calloc(count, sizeof(*newBlobs));
+    newBlob_sizes = calloc(count, sizeof(*newBlob_sizes));
+    dataSizes = calloc(count, sizeof(*dataSizes));
+    if (!nvHandles || !newBlobs || !newBlob_sizes || !dataSizes)
+        goto error;
+    for (i = 0; i < count; i++)
+        nvHandles[i] = ESYS_TR_NONE;
+
+    auth.size = strlen(password);
+    memcpy(&auth.buffer[0], password, auth.size);
+
+    rc = context_primary(context, &primary);
+    chkrc(rc, goto error);
+
+    rc = reseal_policy(context, pcrs, banks, &policy);
+    chkrc(rc, goto error);
+
+    for (i = 0; i < count; i++) {
+        rc = Esys_TR_FromTPMPublic(ctx, nvs[i] ? nvs[i] : DEFAULT_NV,
+                                   ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                                   &nvHandles[i]);
+        chkrc(rc, goto error);
+        Esys_TR_SetAuth(ctx, nvHandles[i], &context->nvAuth);
+
+        rc = nv_key_size(ctx, nvHandles[i], nvs[i] ? nvs[i] : DEFAULT_NV,
+                         &dataSizes[i]);
+        chkrc(rc, goto error);
+
+        rc = context_auth(context, 0, &authSession);
+        chkrc(rc, goto error);
+        rc = Esys_NV_Read(ctx, nvHandles[i], nvHandles[i],
+                          authSession, ESYS_TR_NONE, ESYS_TR_NONE,
+                          dataSizes[i], 0/*=offset*/, &blob);
+        chkrc(rc, goto error);
+
+        rc = reseal_key(context, primary, &auth, pcrs, banks, &policy,
+                        &blob->buffer[0], blob->size,
+                        &newBlobs[i], &newBlob_sizes[i]);
+        free(blob);
+        chkrc(rc, goto error);
+    }
+
+    /* All keys are resealed, so the indices can be updated */
+    for (i = 0; i < count; i++) {
+        rc = context_auth(context, 0, &authSession);
+        chkrc(rc, goto error);
+
+        if (newBlob_sizes[i] != dataSizes[i]) {
+            nv = nvs[i] ? nvs[i] : DEFAULT_NV;
+            /* The scratch index is free again after every key */
+            if (!scratch) {
+                rc = nv_free_index(context, NV_SCRATCH_FIRST, &scratch);
+                chkrc(rc, goto error);
+            }
+            rc = storeKey_nv(context, newBlobs[i], newBlob_sizes[i], scratch);
+            chkrc(rc, goto error);
+
+            rc = Esys_NV_UndefineSpace(ctx, ESYS_TR_RH_OWNER, nvHandles[i],
+                                       authSession, ESYS_TR_NONE,
+                                       ESYS_TR_NONE);
+            chkrc(rc, deleteKey_nv(context, scratch); goto error);
+            nvHandles[i] = ESYS_TR_NONE;
+
+            rc = storeKey_nv(context, newBlobs[i], newBlob_sizes[i], nv);
+            if (rc != TSS2_RC_SUCCESS) {
+                dbg("NV index 0x%08x is empty, its resealed key is in NV "
+                    "index 0x%08x", nv, scratch);
+                goto error;
+            }
+            written++;
+            if (deleteKey_nv(context, scratch) != 0) {
+                dbg("Could not remove the scratch NV index 0x%08x", scratch);
+                scratch = 0;
+            }
+            continue;
+        }
+
+        newBlob.size = newBlob_sizes[i];
+        memcpy(&newBlob.buffer[0], newBlobs[i], newBlob.size);
+        rc = Esys_NV_Write(ctx, nvHandles[i], nvHandles[i],
+                           authSession, ESYS_TR_NONE, ESYS_TR_NONE,
+                           &newBlob, 0/*=offset*/);
+        chkrc(rc, goto error);
+        written++;
+    }
+    done = 1;
+
+error:
+    metrics_add(METRICS_KEYS_RESEALED, written);
+    context_wipe(&auth, sizeof(auth));
+    for (i = 0; nvHandles && i < count; i++) {
+        if (nvHandles[i] != ESYS_TR_NONE)
+            Esys_TR_Close(ctx, &nvHandles[i]);
+    }
+    for (i = 0; newBlobs && i < count; i++)
+        free(newBlobs[i]);
+    free(nvHandles);
+    free(newBlobs);
+    free(newBlob_sizes);
+    free(dataSizes);
+    if (done)
+        return 0;
+    return (rc)? (int)rc : -1;
+}
+
+int
+tpm2totp_context_resealKeys_nv(TPM2TOTP_CONTEXT *context,
+                               const char *password,
+                               uint32_t pcrs, uint32_t banks,
+                               const uint32_t *nvs, size_t count)
+{
+    uint64_t start = metrics_now();
+    int rc = resealKeys_nv(context, password, pcrs, banks, nvs, count);
+
+    metrics_op(METRICS_OP_RESEAL_BATCH, start, rc);
+    return rc;
+}
+
+int
+tpm2totp_resealKeys_nv(const char *password, uint32_t pcrs, uint32_t banks,
+                       const uint32_t *nvs, size_t count,
+                       TSS2_TCTI_CONTEXT *tcti_context)
+{
+    uint64_t start = metrics_now();
+    TPM2TOTP_CONTEXT *context;
+    int rc = tpm2totp_context_new(tcti_context, &context);
+
+    if (rc == 0) {
+        rc = resealKeys_nv(context, password, pcrs, banks, nvs, count);
+        tpm2totp_context_free(context);
+    }
+    metrics_op(METRICS_OP_RESEAL_BATCH, start, rc);
+    return rc;
+}
+
+/* Size of the start of a key up to the hash of the HMAC key's scheme */
+#define KEY_HEADER_SIZE (4 + 4 + 2 + 2 + 2 + 4 + 2 + 32 + 2 + 2)
+
+/** Check whether the start of an NV index is the start of a key.
+ *
+ * A key starts with its PCRs and banks, followed by the public part of the
+ * HMAC key, as created by generateKey() and wrapped by tpm2totp_wrapKey().
+ * @param[in] header The first KEY_HEADER_SIZE bytes of the NV index.
+ * @param[out] pcrs PCRs the key is sealed to.
+ * @param[out] banks PCR banks the key is sealed to.
+ * @retval 1 if the header is the start of a key.
+ * @retval 0 otherwise.
+ */
+static int
+key_header(const uint8_t *header, uint32_t *pcrs, uint32_t *banks)
+{
+    size_t off = 0;
+    uint16_t publicSize, type, nameAlg, scheme, hashAlg;
+    uint32_t attributes;
+    TPM2B_DIGEST policy;
+
+    if (Tss2_MU_UINT32_Unmarshal(header, KEY_HEADER_SIZE, &off, pcrs) ||
+        Tss2_MU_UINT32_Unmarshal(header, KEY_HEADER_SIZE, &off, banks) ||
+        Tss2_MU_UINT16_Unmarshal(header, KEY_HEADER_SIZE, &off, &publicSize) ||
+        Tss2_MU_UINT16_Unmarshal(header, KEY_HEADER_SIZE, &off, &type) ||
+        Tss2_MU_UINT16_Unmarshal(header, KEY_HEADER_SIZE, &off, &nameAlg) ||
+        Tss2_MU_UINT32_Unmarshal(header, KEY_HEADER_SIZE, &off, &attributes) ||
+        Tss2_MU_TPM2B_DIGEST_Unmarshal(header, KEY_HEADER_SIZE, &off,
+                                       &policy) ||
+        Tss2_MU_UINT16_Unmarshal(header, KEY_HEADER_SIZE, &off, &scheme) ||
+        Tss2_MU_UINT16_Unmarshal(header, KEY_HEADER_SIZE, &off, &hashAlg))
+        return 0;
+
+    return *pcrs != 0 && *pcrs < (1 << 24) &&
+           *banks != 0 && (*banks & ~(uint32_t)(TPM2TOTP_BANK_SHA1 |
+                                                TPM2TOTP_BANK_SHA256 |
+                                                TPM2TOTP_BANK_SHA384)) == 0 &&
+           type == TPM2_ALG_KEYEDHASH && nameAlg == TPM2_ALG_SHA256 &&
+           attributes == TPMA_OBJECT_SIGN_ENCRYPT &&
+           policy.size == TPM2_SHA256_DIGEST_SIZE &&
+           scheme == TPM2_ALG_HMAC && hashAlg == TPM2_ALG_SHA1;
+}
+
+/** Check whether an NV index holds a key.
+ *
+ * The name of the handle tells the name algorithm without another command,
+ * so only indices named with SHA1 like keys have their public area read.
+ * Only if the attributes, the policy and the size fit a key as well, the
+ * header of the key is read with the NV password. Indices that cannot be
+ * read are skipped, since they may belong to anybody.
+ * @param[in] context Library context of the TPM.
+ * @param[in] nv NV index to check.
+ * @param[out] pcrs PCRs the key is sealed to.
+ * @param[out] banks PCR banks the key is sealed to.
+ * @retval 1 if the index holds a key.
+ * @retval 0 if it does not or cannot be read.
+ */
+static int
+check_nv(TPM2TOTP_CONTEXT *context, uint32_t nv,
+         uint32_t *pcrs, uint32_t *banks)
+{
+    TSS2_RC rc;
+    ESYS_CONTEXT *ctx = context->esys;
+    ESYS_TR nvHandle, authSession;
+    TPM2B_NAME *name;
+    TPM2B_NV_PUBLIC *publicInfo;
+    TPMA_NV attributes;
+    TPM2B_MAX_NV_BUFFER *header;
+    int found = 0;
+
+    rc = Esys_TR_FromTPMPublic(ctx, nv,
+                               ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                               &nvHandle);
+    /* e.g. an index that was deleted since it was listed */
+    if (rc != TSS2_RC_SUCCESS)
+        return 0;
+    Esys_TR_SetAuth(ctx, nvHandle, &context->nvAuth);
+
+    rc = Esys_TR_GetName(ctx, nvHandle, &name);
+    if (rc != TSS2_RC_SUCCESS)
+        goto out;
+    found = name->size >= 2 &&
+            ((name->name[0] << 8) | name->name[1]) == TPM2_ALG_SHA1;
+    free(name);
+    if (!found)
+        goto out;
+
+    rc = Esys_NV_ReadPublic(ctx, nvHandle,
+                            ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                            &publicInfo, NULL);
+    if (rc != TSS2_RC_SUCCESS) {
+        found = 0;
+        goto out;
+    }
+    attributes = publicInfo->nvPublic.attributes;
+    found = publicInfo->nvPublic.nameAlg == TPM2_ALG_SHA1 &&
+            (attributes & ~(TPMA_NV_WRITTEN | TPMA_NV_WRITELOCKED))
+                == NV_ATTRIBUTES_KEY &&
+            (attributes & TPMA_NV_WRITTEN) &&
+            publicInfo->nvPublic.authPolicy.size == 0 &&
+            publicInfo->nvPublic.dataSize >= KEY_HEADER_SIZE;
+    free(publicInfo);
+    if (!found)
+        goto out;
+
+    found = 0;
+    rc = context_auth(context, 0, &authSession);
+    if (rc != TSS2_RC_SUCCESS)
+        goto out;
+    rc = Esys_NV_Read(ctx, nvHandle, nvHandle,
+                      authSession, ESYS_TR_NONE, ESYS_TR_NONE,
+                      KEY_HEADER_SIZE, 0/*=offset*/, &header);
+    /* e.g. an index of the same kind protected by another password */
+    if (rc != TSS2_RC_SUCCESS) {
+        dbg("Skipping NV index 0x%08x: 0x%08x", nv, rc);
+        goto out;
+    }
+    found = header->size == KEY_HEADER_SIZE &&
+            key_header(&header->buffer[0], pcrs, banks);
+    free(header);
+
+out:
+    Esys_TR_Close(ctx, &nvHandle);
+    return found;
+}
+
+/** List the NV indices holding keys.
+ *
+ * The handles of all NV indices are fetched in pages as large as the TPM
+ * allows, and only indices whose public area fits a key are read. Indices
+ * that cannot be read do not stop the listing.
+ * @param[in] context Library context of the TPM.
+ * @param[in] callback Called in ascending order with the NV index, PCRs and
+ *            banks of every key; a non-zero return value stops the listing.
+ * @param[in] userdata Passed to the callback.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ * @retval -20 if the callback stopped the listing.
+ */
+static int
+listKeys_nv(TPM2TOTP_CONTEXT *context, tpm2totp_list_cb callback,
+            void *userdata)
+{
+    if (!context || !callback)
+        return -1;
+
+    TSS2_RC rc;
+    ESYS_CONTEXT *ctx = context->esys;
+    TPMI_YES_NO more = TPM2_YES;
+    TPMS_CAPABILITY_DATA *cap;
+    TPML_HANDLE *handles;
+    uint32_t next = TPM2_NV_INDEX_FIRST, pcrs, banks;
+    int found;
+
+    while (more) {
+        rc = Esys_GetCapability(ctx,
+                                ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                                TPM2_CAP_HANDLES, next, TPM2_MAX_CAP_HANDLES,
+                                &more, &cap);
+        chkrc(rc, goto error);
+
+        handles = &cap->data.handles;
+        if (handles->count == 0)
+            more = TPM2_NO;
+        for (size_t i = 0; i < handles->count; i++) {
+            if (handles->handle[i] > TPM2_NV_INDEX_LAST) {
+                more = TPM2_NO;
+                break;
+            }
+            found = check_nv(context, handles->handle[i], &pcrs, &banks);
+            if (found && callback(handles->handle[i], pcrs, banks, userdata)) {
+                free(cap);
+                return -20;
+            }
+            next = handles->handle[i] + 1;
+        }
+        free(cap);
+    }
+
+    return 0;
+
+error:
+    return (rc)? (int)rc : -1;
+}
+
+int
+tpm2totp_context_listKeys_nv(TPM2TOTP_CONTEXT *context,
+                             tpm2totp_list_cb callback, void *userdata)
+{
+    uint64_t start = metrics_now();
+    int rc = listKeys_nv(context, callback, userdata);
+
+    metrics_op(METRICS_OP_LIST, start, rc);
+    return rc;
+}
+
+int
+tpm2totp_listKeys_nv(TSS2_TCTI_CONTEXT *tcti_context,
+                     tpm2totp_list_cb callback, void *userdata)
+{
+    uint64_t start = metrics_now();
+    TPM2TOTP_CONTEXT *context;
+    int rc = tpm2totp_context_new(tcti_context, &context);
+
+    if (rc == 0) {
+        rc = listKeys_nv(context, callback, userdata);
+        tpm2totp_context_free(context);
+    }
+    metrics_op(METRICS_OP_LIST, start, rc);
+    return rc;
+}
+
+/** Unmarshal the HMAC key of a key and the PCRs it is sealed to.
+ *
+ * @param[in] keyBlob Key to generate the TOTP.
+ * @param[in] keyBlob_size Size of the key.
+ * @param[out] keyPublic Public part of the HMAC key.
+ * @param[out] keyPrivate Private part of the HMAC key.
+ * @param[out] pcrsel PCR selection of the key's policy.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+int
+context_unmarshal_key(const uint8_t *keyBlob, size_t keyBlob_size,
+                      TPM2B_PUBLIC *keyPublic, TPM2B_PRIVATE *keyPrivate,
+                      TPML_PCR_SELECTION *pcrsel)
+{
+    TSS2_RC rc;
+    size_t off = 0;
+    uint32_t pcrs;
+    uint32_t banks;
+
+    if (keyBlob == NULL) {
+        return -1;
+    }
+
+    keyPublic->size = 0;
+    keyPrivate->size = 0;
+    pcrsel->count = 0;
+
+    rc = Tss2_MU_UINT32_Unmarshal(keyBlob, keyBlob_size, &off, &pcrs);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_UINT32_Unmarshal(keyBlob, keyBlob_size, &off, &banks);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_TPM2B_PUBLIC_Unmarshal(keyBlob, keyBlob_size, &off, keyPublic);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_TPM2B_PRIVATE_Unmarshal(keyBlob, keyBlob_size, &off, 
+                                         keyPrivate);
+    chkrc(rc, goto error);
+
+    if (off != keyBlob_size) {
+        rc = Tss2_MU_TPM2B_PUBLIC_Unmarshal(keyBlob, keyBlob_size, &off, NULL);
+        chkrc(rc, goto error);
+        rc = Tss2_MU_TPM2B_PRIVATE_Unmarshal(keyBlob, keyBlob_size, &off, NULL);
+        chkrc(rc, goto error);
+    }
+
+    if (off != keyBlob_size) {
+        dbg("bad blob size");
+        return -1;
+    }
+
+    if ((banks & TPM2TOTP_BANK_SHA1)) {
+        pcrsel->pcrSelections[pcrsel->count].hash = TPM2_ALG_SHA1;
+        pcrsel->count++;
+    }
+    if ((banks & TPM2TOTP_BANK_SHA256)) {
+        pcrsel->pcrSelections[pcrsel->count].hash = TPM2_ALG_SHA256;
+        pcrsel->count++;
+    }
+    if ((banks & TPM2TOTP_BANK_SHA384)) {
+        pcrsel->pcrSelections[pcrsel->count].hash = TPM2_ALG_SHA384;
+        pcrsel->count++;
+    }
+
+    for (size_t i = 0; i < pcrsel->count; i++) {
+        pcrsel->pcrSelections[i].sizeofSelect = 3;
+        pcrsel->pcrSelections[i].pcrSelect[0] = pcrs & 0xff;
+        pcrsel->pcrSelections[i].pcrSelect[1] = pcrs >>8 & 0xff;
+        pcrsel->pcrSelections[i].pcrSelect[2] = pcrs >>16 & 0xff;
+    }
+
+    return 0;
+error:
+    return (rc)? (int)rc : -1;
+}
+
+/** Construct the RFC 6238 HMAC input for a point in time. */
+void
+context_totp_input(time_t now, TPM2B_MAX_BUFFER *input)
+{
+    uint64_t tmp = now / TIMESTEPSIZE;
+
+    tmp = htobe64(tmp);
+    input->size = sizeof(tmp);
+    memcpy(&input->buffer[0], ((void*)&tmp), input->size);
+}
+
+/** Truncate an HMAC-SHA1 to a TOTP value.
+ *
+ * @param[in] output HMAC of the time step.
+ * @param[out] otp TOTP value.
+ * @retval 0 on success.
+ * @retval -1 if the HMAC has the wrong size.
+ */
+int
+context_totp_truncate(const TPM2B_DIGEST *output, uint64_t *otp)
+{
+    int offset;
+
+    if (output->size != 20) {
+        return -1;
+    }
+
+    /* Perform the RFC 6238 -> RFC 4226 HOTP truncing */
+    offset = output->buffer[output->size - 1] & 0x0f;
+
+    *otp = ((uint32_t)output->buffer[offset]   & 0x7f) << 24
+         | ((uint32_t)output->buffer[offset+1] & 0xff) << 16
+         | ((uint32_t)output->buffer[offset+2] & 0xff) <<  8
+         | ((uint32_t)output->buffer[offset+3] & 0xff);
+    *otp %= (1000000);
+
+    return 0;
+}
+
+/** Calculate the HMAC based one-time password with a loaded key.
+ *
+ * The policy session is bound to the key's PCRs for the HMAC. The session is
+ * continued, which resets its policy, such that it can be used for the next
+ * key.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[in] key Loaded HMAC key.
+ * @param[in] session Policy session.
+ * @param[in] pcrsel PCRs the key is sealed to.
+ * @param[in] input RFC 6238 counter.
+ * @param[out] otp Calculated TOTP.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+static int
+hmac_key(TPM2TOTP_CONTEXT *context, ESYS_TR key, ESYS_TR session,
+         const TPML_PCR_SELECTION *pcrsel, const TPM2B_MAX_BUFFER *input,
+         uint64_t *otp)
+{
+    ESYS_CONTEXT *ctx = context->esys;
+    TSS2_RC rc;
+    TPM2B_DIGEST *output;
+    int ret;
+
+    rc = Esys_PolicyPCR(ctx, session,
+                        ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                        NULL, pcrsel);
+    chkrc(rc, goto error);
+
+    rc = Esys_HMAC(ctx, key,
+                   session, ESYS_TR_NONE, ESYS_TR_NONE,
+                   input, TPM2_ALG_SHA1, &output);
+    chkrc(rc, goto error);
+
+    ret = context_totp_truncate(output, otp);
+    free(output);
+
+    return ret;
+error:
+    return (rc)? (int)rc : -1;
+}
+
+/** Calculate the HMAC based one-time password of one key.
+ *
+ * The key is loaded under the primary key for the HMAC and flushed again.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[in] primary Storage primary key.
+ * @param[in] session Policy session.
+ * @param[in] keyBlob Key to generate the TOTP.
+ * @param[in] keyBlob_size Size of the key.
+ * @param[in] input RFC 6238 counter.
+ * @param[out] otp Calculated TOTP.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+static int
+calculate_key(TPM2TOTP_CONTEXT *context, ESYS_TR primary, ESYS_TR session,
+              const uint8_t *keyBlob, size_t keyBlob_size,
+              const TPM2B_MAX_BUFFER *input, uint64_t *otp)
+{
+    ESYS_CONTEXT *ctx = context->esys;
+    ESYS_TR key;
+    TSS2_RC rc;
+    TPM2B_PUBLIC keyPublic;
+    TPM2B_PRIVATE keyPrivate;
+    TPML_PCR_SELECTION pcrsel;
+    int ret;
+
+    ret = context_unmarshal_key(keyBlob, keyBlob_size,
+                                &keyPublic, &keyPrivate, &pcrsel);
+    if (ret) {
+        return ret;
+    }
+
+    rc = Esys_Load(ctx, primary,
+                   ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
+                   &keyPrivate, &keyPublic,
+                   &key);
+    chkrc(rc, goto error);
+
+    ret = hmac_key(context, key, session, &pcrsel, input, otp);
+    Esys_FlushContext(ctx, key);
+
+    return ret;
+error:
+    return (rc)? (int)rc : -1;
+}
+
+/** Calculate time-based one-time passwords for several keys.
+ *
+ * The codes of all keys are calculated for the same time step with one
+ * primary key and one policy session, such that each key only costs its
+ * load and the HMAC.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[in] count Number of keys.
+ * @param[in] keyBlobs Keys to generate the TOTPs.
+ * @param[in] keyBlob_sizes Sizes of the keys.
+ * @param[out] nowp Current time.
+ * @param[out] otps Calculated TOTPs, one per key.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+static int
+calculateMany(TPM2TOTP_CONTEXT *context, size_t count,
+              const uint8_t *const *keyBlobs, const size_t *keyBlob_sizes,
+              time_t *nowp, uint64_t *otps)
+{
+    if (context == NULL || keyBlobs == NULL || keyBlob_sizes == NULL ||
+            otps == NULL || count == 0) {
         return -1;
     }
-    memcpy(&blob.buffer[0], keyBlob, blob.size);
 
-    rc = Esys_Initialize(&ctx, NULL, NULL);
-    chkrc(rc, return rc);
+    ESYS_CONTEXT *ctx = context->esys;
+    ESYS_TR primary, session;
+    TSS2_RC rc;
+    time_t now;
+    int ret;
 
-    rc = Esys_Startup(ctx, TPM2_SU_CLEAR);
-    if (rc != TPM2_RC_INITIALIZE) chkrc(rc, goto error);
+    TPM2B_MAX_BUFFER input;
 
-    rc = Esys_NV_DefineSpace(ctx, ESYS_TR_RH_OWNER,
-                             ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
-                             &emptyAuth, &publicInfo, &nvHandle);
+    TPMT_SYM_DEF sym = {.algorithm = TPM2_ALG_AES,
+                        .keyBits = {.aes = 128},
+                        .mode = {.aes = TPM2_ALG_CFB}
+    };
+
+    rc = context_primary(context, &primary);
     chkrc(rc, goto error);
 
-    rc = Esys_NV_Write(ctx, nvHandle, nvHandle,
-                       ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
-                       &blob, 0/*=offset*/);
-    Esys_TR_Close(ctx, &nvHandle);
+    rc = Esys_StartAuthSession(ctx, ESYS_TR_NONE, ESYS_TR_NONE,
+                    ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                    NULL, TPM2_SE_POLICY, &sym, TPM2_ALG_SHA256,
+                    &session);
     chkrc(rc, goto error);
 
-    Esys_Finalize(&ctx);
+    now = time(NULL);
+    context_totp_input(now, &input);
+
+    for (size_t i = 0; i < count; i++) {
+        ret = calculate_key(context, primary, session,
+                            keyBlobs[i], keyBlob_sizes[i], &input, &otps[i]);
+        if (ret) {
+            Esys_FlushContext(ctx, session);
+            return ret;
+        }
+    }
+    Esys_FlushContext(ctx, session);
 
-    return 0;
+    metrics_code(now);
+    if (nowp) *nowp = now;
 
+    return 0;
 error:
-    Esys_Finalize(&ctx);
-
     return (rc)? (int)rc : -1;
 }
 
-/** Load a key from a NV index.
- *
- * @param[in] nv NV index of the key.
- * @param[out] keyBlob Loaded key.
- * @param[out] keyBlob_size Size of the key.
- * @retval 0 on success.
- * @retval -1 on undefined/general failure.
- */
 int
-tpm2totp_loadKey_nv(uint32_t nv, uint8_t **keyBlob, size_t *keyBlob_size)
+tpm2totp_context_calculateMany(TPM2TOTP_CONTEXT *context, size_t count,
+                               const uint8_t *const *keyBlobs,
+                               const size_t *keyBlob_sizes,
+                               time_t *nowp, uint64_t *otps)
 {
-    TSS2_RC rc;
-    ESYS_CONTEXT *ctx;
-    ESYS_TR nvHandle;
-    TPM2B_MAX_NV_BUFFER *blob;
-    TPM2B_NV_PUBLIC *publicInfo;
-
-    if (!nv) nv = DEFAULT_NV; /* Some random handle from owner space */
+    uint64_t start = metrics_now();
+    int rc = calculateMany(context, count, keyBlobs, keyBlob_sizes, nowp, otps);
 
-    rc = Esys_Initialize(&ctx, NULL, NULL);
-    chkrc(rc, return rc);
-
-    rc = Esys_Startup(ctx, TPM2_SU_CLEAR);
-    if (rc != TPM2_RC_INITIALIZE) chkrc(rc, goto error);
-
-    rc = Esys_TR_FromTPMPublic(ctx, nv,
-                               ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
-                               &nvHandle);
-    chkrc(rc, goto error);
+    metrics_op(METRICS_OP_CALCULATE_BATCH, start, rc);
+    return rc;
+}
 
-    rc = Esys_NV_ReadPublic(ctx, nvHandle,
-                            ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
-                            &publicInfo, NULL);
-    chkrc(rc, goto error);
+int
+tpm2totp_calculateMany(size_t count, const uint8_t *const *keyBlobs,
+                       const size_t *keyBlob_sizes,
+                       TSS2_TCTI_CONTEXT *tcti_context,
+                       time_t *nowp, uint64_t *otps)
+{
+    uint64_t start = metrics_now();
+    TPM2TOTP_CONTEXT *context;
+    int rc = tpm2totp_context_new(tcti_context, &context);
 
-    rc = Esys_NV_Read(ctx, nvHandle, nvHandle,
-                      ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
-                      publicInfo->nvPublic.dataSize, 0/*=offset*/, &blob);
-    Esys_TR_Close(ctx, &nvHandle);
-    free(publicInfo);
-    chkrc(rc, goto error);
+    if (rc == 0) {
+        rc = calculateMany(context, count, keyBlobs, keyBlob_sizes, nowp, otps);
+        tpm2totp_context_free(context);
+    }
+    metrics_op(METRICS_OP_CALCULATE_BATCH, start, rc);
+    return rc;
+}
 
-    Esys_Finalize(&ctx);
+int
+tpm2totp_context_calculate(TPM2TOTP_CONTEXT *context,
+                           const uint8_t *keyBlob, size_t keyBlob_size,
+                           time_t *nowp, uint64_t *otp)
+{
+    uint64_t start = metrics_now();
+    int rc = calculateMany(context, 1, &keyBlob, &keyBlob_size, nowp, otp);
 
-    *keyBlob_size = blob->size;
-    *keyBlob = malloc(blob->size);
-    memcpy(*keyBlob, &blob->buffer[0], *keyBlob_size);
+    metrics_op(METRICS_OP_CALCULATE, start, rc);
+    return rc;
+}
 
-    return 0;
+int
+tpm2totp_calculate_tcti(const uint8_t *keyBlob, size_t keyBlob_size,
+                        TSS2_TCTI_CONTEXT *tcti_context,
+                        time_t *nowp, uint64_t *otp)
+{
+    uint64_t start = metrics_now();
+    TPM2TOTP_CONTEXT *context;
+    int rc = tpm2totp_context_new(tcti_context, &context);
 
-error:
-    Esys_Finalize(&ctx);
+    if (rc == 0) {
+        rc = calculateMany(context, 1, &keyBlob, &keyBlob_size, nowp, otp);
+        tpm2totp_context_free(context);
+    }
+    metrics_op(METRICS_OP_CALCULATE, start, rc);
+    return rc;
+}
 
-    return (rc)? (int)rc : -1;
+int
+tpm2totp_calculate(const uint8_t *keyBlob, size_t keyBlob_size,
+                   time_t *nowp, uint64_t *otp)
+{
+    return tpm2totp_calculate_tcti(keyBlob, keyBlob_size, NULL, nowp, otp);
 }
 
+/* First word of the blobs of tpm2totp_prepareKey_nv, "TTP1" */
+#define PREPAREDBLOB_MAGIC 0x54545031
 
-/** Delete a key from a NV index.
+/** Prepare a key from a NV index for quick calculations.
  *
- * @param[in] nv NV index to delete.
+ * Does the expensive part of a calculation ahead, e.g. while the system is
+ * still booting: the key is read from the NV index and loaded under the
+ * primary key, which is created if needed, and the context of the loaded key
+ * is saved. The prepared blob holds the saved context, which is protected by
+ * the TPM, and the PCR selection of the key. The saved context is only valid
+ * until the TPM is reset, i.e. for the current boot.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[in] nv NV index of the key.
+ * @param[out] prepared The prepared key.
+ * @param[out] prepared_size Size of the prepared key.
  * @retval 0 on success.
  * @retval -1 on undefined/general failure.
  */
-int
-tpm2totp_deleteKey_nv(uint32_t nv)
+static int
+prepareKey_nv(TPM2TOTP_CONTEXT *context, uint32_t nv,
+              uint8_t **prepared, size_t *prepared_size)
 {
-    TSS2_RC rc;
-    ESYS_CONTEXT *ctx;
-    ESYS_TR nvHandle;
-
-    if (!nv) nv = DEFAULT_NV; /* Some random handle from owner space */
+    if (!context || !prepared || !prepared_size)
+        return -1;
 
-    rc = Esys_Initialize(&ctx, NULL, NULL);
-    chkrc(rc, return rc);
+    ESYS_CONTEXT *ctx = context->esys;
+    ESYS_TR primary, key;
+    TSS2_RC rc;
+    TPM2B_PUBLIC keyPublic;
+    TPM2B_PRIVATE keyPrivate;
+    TPML_PCR_SELECTION pcrsel;
+    TPMS_CONTEXT *saved;
+    uint8_t *keyBlob;
+    size_t keyBlob_size, max, off = 0;
+    int ret;
+
+    ret = loadKey_nv(context, nv, &keyBlob, &keyBlob_size);
+    if (ret)
+        return ret;
+    ret = context_unmarshal_key(keyBlob, keyBlob_size,
+                                &keyPublic, &keyPrivate, &pcrsel);
+    free(keyBlob);
+    if (ret)
+        return ret;
+
+    rc = context_primary(context, &primary);
+    chkrc(rc, goto error);
 
-    rc = Esys_Startup(ctx, TPM2_SU_CLEAR);
-    if (rc != TPM2_RC_INITIALIZE) chkrc(rc, goto error);
+    rc = Esys_Load(ctx, primary,
+                   ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
+                   &keyPrivate, &keyPublic,
+                   &key);
+    chkrc(rc, goto error);
 
-    rc = Esys_TR_FromTPMPublic(ctx, nv,
-                               ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
-                               &nvHandle);
+    rc = Esys_ContextSave(ctx, key, &saved);
+    Esys_FlushContext(ctx, key);
     chkrc(rc, goto error);
 
-    rc = Esys_NV_UndefineSpace(ctx, ESYS_TR_RH_OWNER, nvHandle,
-                               ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE);
-    chkrc(rc, Esys_TR_Close(ctx, &nvHandle); goto error);
+    max = sizeof(uint32_t) + sizeof(*saved) + sizeof(pcrsel);
+    *prepared = malloc(max);
+    if (!*prepared) {
+        free(saved);
+        return -1;
+    }
 
-    Esys_Finalize(&ctx);
+    rc = Tss2_MU_UINT32_Marshal(PREPAREDBLOB_MAGIC, *prepared, max, &off);
+    chkrc(rc, goto error_marshal);
+    rc = Tss2_MU_TPMS_CONTEXT_Marshal(saved, *prepared, max, &off);
+    chkrc(rc, goto error_marshal);
+    rc = Tss2_MU_TPML_PCR_SELECTION_Marshal(&pcrsel, *prepared, max, &off);
+    chkrc(rc, goto error_marshal);
 
+    free(saved);
+    *prepared_size = off;
     return 0;
 
+error_marshal:
+    free(saved);
+    free(*prepared);
+    *prepared = NULL;
 error:
+    return (rc)? (int)rc : -1;
+}
+
+int
+tpm2totp_context_prepareKey_nv(TPM2TOTP_CONTEXT *context, uint32_t nv,
+                               uint8_t **prepared, size_t *prepared_size)
+{
+    uint64_t start = metrics_now();
+    int rc = prepareKey_nv(context, nv, prepared, prepared_size);
 
-    Esys_Finalize(&ctx);
+    metrics_op(METRICS_OP_PREPARE, start, rc);
+    return rc;
+}
 
-    return (rc)? (int)rc : -1;
+int
+tpm2totp_prepareKey_nv(uint32_t nv, TSS2_TCTI_CONTEXT *tcti_context,
+                       uint8_t **prepared, size_t *prepared_size)
+{
+    uint64_t start = metrics_now();
+    TPM2TOTP_CONTEXT *context;
+    int rc = tpm2totp_context_new(tcti_context, &context);
+
+    if (rc == 0) {
+        rc = prepareKey_nv(context, nv, prepared, prepared_size);
+        tpm2totp_context_free(context);
+    }
+    metrics_op(METRICS_OP_PREPARE, start, rc);
+    return rc;
 }
 
-/** Calculate a time-based one-time password for a key.
+/** Calculate a time-based one-time password with a prepared key.
  *
- * @param[in] keyBlob Key to generate the TOTP.
- * @param[in] keyBlob_size Size of the key.
+ * Only loads the saved context of the key for the policy session and the
+ * HMAC; neither the NV index nor the primary key are needed. Fails if the
+ * TPM was reset since the key was prepared.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[in] prepared Key prepared by tpm2totp_context_prepareKey_nv().
+ * @param[in] prepared_size Size of the prepared key.
  * @param[out] nowp Current time.
  * @param[out] otp Calculated TOTP.
  * @retval 0 on success.
  * @retval -1 on undefined/general failure.
  */
-int
-tpm2totp_calculate(const uint8_t *keyBlob, size_t keyBlob_size,
-                   time_t *nowp, uint64_t *otp)
+static int
+calculatePrepared(TPM2TOTP_CONTEXT *context,
+                  const uint8_t *prepared, size_t prepared_size,
+                  time_t *nowp, uint64_t *otp)
 {
-    if (keyBlob == NULL || otp == NULL) {
+    if (!context || !prepared || !otp)
         return -1;
-    }
 
-    ESYS_CONTEXT *ctx = NULL;
-    ESYS_TR primary, key, session;
+    ESYS_CONTEXT *ctx = context->esys;
+    ESYS_TR key, session;
     TSS2_RC rc;
-    TPM2B_PUBLIC keyPublic = { .size=0 };
-    TPM2B_PRIVATE keyPrivate = { .size=0 };
+    TPMS_CONTEXT saved;
+    TPML_PCR_SELECTION pcrsel;
+    TPM2B_MAX_BUFFER input;
+    uint32_t magic;
     size_t off = 0;
-    TPM2B_DIGEST *output;
-    uint32_t pcrs;
-    uint32_t banks;
     time_t now;
-    uint64_t tmp;
-    int offset;
-
-    TPM2B_MAX_BUFFER input;
-
-    TPML_PCR_SELECTION pcrsel = { .count = 0 };
+    int ret;
 
     TPMT_SYM_DEF sym = {.algorithm = TPM2_ALG_AES,
                         .keyBits = {.aes = 128},
                         .mode = {.aes = TPM2_ALG_CFB}
     };
 
-    rc = Tss2_MU_UINT32_Unmarshal(keyBlob, keyBlob_size, &off, &pcrs);
-    chkrc(rc, goto error);
-    rc = Tss2_MU_UINT32_Unmarshal(keyBlob, keyBlob_size, &off, &banks);
+    rc = Tss2_MU_UINT32_Unmarshal(prepared, prepared_size, &off, &magic);
     chkrc(rc, goto error);
-    rc = Tss2_MU_TPM2B_PUBLIC_Unmarshal(keyBlob, keyBlob_size, &off, &keyPublic);
+    if (magic != PREPAREDBLOB_MAGIC) {
+        dbg("Not a prepared key");
+        return -1;
+    }
+    rc = Tss2_MU_TPMS_CONTEXT_Unmarshal(prepared, prepared_size, &off, &saved);
     chkrc(rc, goto error);
-    rc = Tss2_MU_TPM2B_PRIVATE_Unmarshal(keyBlob, keyBlob_size, &off, 
-                                         &keyPrivate);
+    rc = Tss2_MU_TPML_PCR_SELECTION_Unmarshal(prepared, prepared_size, &off,
+                                              &pcrsel);
     chkrc(rc, goto error);
-
-    if (off != keyBlob_size) {
-        rc = Tss2_MU_TPM2B_PUBLIC_Unmarshal(keyBlob, keyBlob_size, &off, NULL);
-        chkrc(rc, goto error);
-        rc = Tss2_MU_TPM2B_PRIVATE_Unmarshal(keyBlob, keyBlob_size, &off, NULL);
-        chkrc(rc, goto error);
-    }
-
-    if (off != keyBlob_size) {
+    if (off != prepared_size) {
         dbg("bad blob size");
         return -1;
     }
 
-    if ((banks & TPM2TOTP_BANK_SHA1)) {
-        pcrsel.pcrSelections[pcrsel.count].hash = TPM2_ALG_SHA1;
-        pcrsel.count++;
-    }
-    if ((banks & TPM2TOTP_BANK_SHA256)) {
-        pcrsel.pcrSelections[pcrsel.count].hash = TPM2_ALG_SHA256;
-        pcrsel.count++;
-    }
-    if ((banks & TPM2TOTP_BANK_SHA384)) {
-        pcrsel.pcrSelections[pcrsel.count].hash = TPM2_ALG_SHA384;
-        pcrsel.count++;
-    }
-
-    for (size_t i = 0; i < pcrsel.count; i++) {
-        pcrsel.pcrSelections[i].sizeofSelect = 3;
-        pcrsel.pcrSelections[i].pcrSelect[0] = pcrs & 0xff;
-        pcrsel.pcrSelections[i].pcrSelect[1] = pcrs >>8 & 0xff;
-        pcrsel.pcrSelections[i].pcrSelect[2] = pcrs >>16 & 0xff;
-    }
-
-    rc = Esys_Initialize(&ctx, NULL, NULL);
-    chkrc(rc, goto error);
-
-    rc = Esys_Startup(ctx, TPM2_SU_CLEAR);
-    if (rc != TPM2_RC_INITIALIZE) chkrc(rc, goto error);
-
-    rc = Esys_CreatePrimary(ctx, ESYS_TR_RH_OWNER, 
-                            ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
-                            &primarySensitive, &primaryPublic,
-                            &allOutsideInfo, &allCreationPCR,
-                            &primary, NULL, NULL, NULL, NULL);
-    chkrc(rc, goto error);
-    
-    rc = Esys_Load(ctx, primary,
-                   ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
-                   &keyPrivate, &keyPublic,
-                   &key);
-    Esys_FlushContext(ctx, primary);
+    rc = Esys_ContextLoad(ctx, &saved, &key);
     chkrc(rc, goto error);
 
     rc = Esys_StartAuthSession(ctx, ESYS_TR_NONE, ESYS_TR_NONE,
                     ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
                     NULL, TPM2_SE_POLICY, &sym, TPM2_ALG_SHA256,
                     &session);
-    chkrc(rc, goto error);
-
-    rc = Esys_PolicyPCR(ctx, session,
-                        ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
-                        NULL, &pcrsel);
-    chkrc(rc, Esys_FlushContext(ctx, session); goto error);
+    chkrc(rc, Esys_FlushContext(ctx, key); goto error);
 
-    /* Construct the RFC 6238 input */
     now = time(NULL);
-    tmp = now / TIMESTEPSIZE;
-    tmp = htobe64(tmp);
-    input.size = sizeof(tmp);
-    memcpy(&input.buffer[0], ((void*)&tmp), input.size);
+    context_totp_input(now, &input);
 
-    rc = Esys_HMAC(ctx, key,
-                   session, ESYS_TR_NONE, ESYS_TR_NONE,
-                   &input, TPM2_ALG_SHA1, &output);
-    Esys_FlushContext(ctx, session);
+    ret = hmac_key(context, key, session, &pcrsel, &input, otp);
     Esys_FlushContext(ctx, key);
-    chkrc(rc, goto error);
-
-    Esys_Finalize(&ctx);
-
-    if (output->size != 20) {
-        free(output);
-        goto error;
-    }
-
-    /* Perform the RFC 6238 -> RFC 4226 HOTP truncing */
-    offset = output->buffer[output->size - 1] & 0x0f;
-
-    *otp = ((uint32_t)output->buffer[offset]   & 0x7f) << 24
-         | ((uint32_t)output->buffer[offset+1] & 0xff) << 16
-         | ((uint32_t)output->buffer[offset+2] & 0xff) <<  8
-         | ((uint32_t)output->buffer[offset+3] & 0xff);
-    *otp %= (1000000);
-
-    free(output);
+    Esys_FlushContext(ctx, session);
+    if (ret)
+        return ret;
 
+    metrics_code(now);
     if (nowp) *nowp = now;
 
     return 0;
 error:
-    Esys_Finalize(&ctx);
     return (rc)? (int)rc : -1;
 }
 
+int
+tpm2totp_context_calculatePrepared(TPM2TOTP_CONTEXT *context,
+                                   const uint8_t *prepared,
+                                   size_t prepared_size,
+                                   time_t *nowp, uint64_t *otp)
+{
+    uint64_t start = metrics_now();
+    int rc = calculatePrepared(context, prepared, prepared_size, nowp, otp);
+
+    metrics_op(METRICS_OP_CALCULATE, start, rc);
+    return rc;
+}
+
+int
+tpm2totp_calculatePrepared(const uint8_t *prepared, size_t prepared_size,
+                           TSS2_TCTI_CONTEXT *tcti_context,
+                           time_t *nowp, uint64_t *otp)
+{
+    uint64_t start = metrics_now();
+    TPM2TOTP_CONTEXT *context;
+    int rc = tpm2totp_context_new(tcti_context, &context);
+
+    if (rc == 0) {
+        rc = calculatePrepared(context, prepared, prepared_size, nowp, otp);
+        tpm2totp_context_free(context);
+    }
+    metrics_op(METRICS_OP_CALCULATE, start, rc);
+    return rc;
+}
+
 /** Recover a secret from a key.
  *
+ * @param[in] context Library context of the TPM.
  * @param[in] keyBlob Key to recover the secret from.
  * @param[in] keyBlob_size Size of the key.
  * @param[in] password Password of the key.
@@ -856,12 +2918,13 @@ error:
  * @retval -1 on undefined/general failure.
  * @retval -10 on empty password.
  */
-int
-tpm2totp_getSecret(const uint8_t *keyBlob, size_t keyBlob_size, 
-                   const char *password,
-                   uint8_t **secret, size_t *secret_size)
+static int
+getSecret(TPM2TOTP_CONTEXT *context,
+          const uint8_t *keyBlob, size_t keyBlob_size, const char *password,
+          uint8_t **secret, size_t *secret_size)
 {
-    if (keyBlob == NULL || !password || secret == NULL || secret_size == NULL) {
+    if (context == NULL || keyBlob == NULL || !password ||
+        secret == NULL || secret_size == NULL) {
         return -1;
     }
     if (!strlen(password)) {
@@ -869,13 +2932,13 @@ tpm2totp_getSecret(const uint8_t *keyBlob, size_t keyBlob_size,
         return -10;
     }
 
-    ESYS_CONTEXT *ctx = NULL;
+    ESYS_CONTEXT *ctx = context->esys;
     ESYS_TR primary, key;
     TSS2_RC rc;
     TPM2B_PUBLIC keyPublic = { .size=0 };
     TPM2B_PRIVATE keyPrivate = { .size=0 };
     size_t off = 4 + 4; /* Skipping over pcrs and banks */
-    TPM2B_SENSITIVE_DATA *secret2b;
+    TPM2B_SENSITIVE_DATA *secret2b = NULL;
     TPM2B_AUTH auth;
 
     auth.size = strlen(password);
@@ -888,7 +2951,7 @@ tpm2totp_getSecret(const uint8_t *keyBlob, size_t keyBlob_size,
 
     if (off == keyBlob_size) {
         dbg("No unseal blob included.");
-        return -1;
+        goto error;
     }
 
     rc = Tss2_MU_TPM2B_PUBLIC_Unmarshal(keyBlob, keyBlob_size, &off, &keyPublic);
@@ -899,30 +2962,20 @@ tpm2totp_getSecret(const uint8_t *keyBlob, size_t keyBlob_size,
 
     if (off != keyBlob_size) {
         dbg("bad blob size");
-        return -1;
+        goto error;
     }
 
-    rc = Esys_Initialize(&ctx, NULL, NULL);
-    chkrc(rc, goto error);
-
-    rc = Esys_Startup(ctx, TPM2_SU_CLEAR);
-    if (rc != TPM2_RC_INITIALIZE) chkrc(rc, goto error);
-
-    rc = Esys_CreatePrimary(ctx, ESYS_TR_RH_OWNER, 
-                            ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
-                            &primarySensitive, &primaryPublic,
-                            &allOutsideInfo, &allCreationPCR,
-                            &primary, NULL, NULL, NULL, NULL);
+    rc = context_primary(context, &primary);
     chkrc(rc, goto error);
     
     rc = Esys_Load(ctx, primary,
                    ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
                    &keyPrivate, &keyPublic,
                    &key);
-    Esys_FlushContext(ctx, primary);
     chkrc(rc, goto error);
 
     Esys_TR_SetAuth(ctx, key, &auth);
+    context_wipe(&auth, sizeof(auth));
 
     rc = Esys_Unseal(ctx, key,
                      ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
@@ -930,18 +2983,62 @@ tpm2totp_getSecret(const uint8_t *keyBlob, size_t keyBlob_size,
     Esys_FlushContext(ctx, key);
     chkrc(rc, goto error);
 
-    Esys_Finalize(&ctx);
-
     *secret = malloc(secret2b->size);
     if (!*secret) goto error;
 
     *secret_size = secret2b->size;
     memcpy(&(*secret)[0], &secret2b->buffer[0], *secret_size);
+    context_wipe(secret2b, sizeof(*secret2b));
+    free(secret2b);
 
     return 0;
 error:
-    Esys_Finalize(&ctx);
+    context_wipe(&auth, sizeof(auth));
+    if (secret2b)
+        context_wipe(secret2b, sizeof(*secret2b));
+    free(secret2b);
     return (rc)? (int)rc : -1;
 }
 
+int
+tpm2totp_context_getSecret(TPM2TOTP_CONTEXT *context,
+                           const uint8_t *keyBlob, size_t keyBlob_size,
+                           const char *password,
+                           uint8_t **secret, size_t *secret_size)
+{
+    uint64_t start = metrics_now();
+    int rc = getSecret(context, keyBlob, keyBlob_size, password, secret,
+                       secret_size);
+
+    metrics_op(METRICS_OP_GETSECRET, start, rc);
+    return rc;
+}
+
+int
+tpm2totp_getSecret_tcti(const uint8_t *keyBlob, size_t keyBlob_size,
+                        const char *password, TSS2_TCTI_CONTEXT *tcti_context,
+                        uint8_t **secret, size_t *secret_size)
+{
+    uint64_t start = metrics_now();
+    TPM2TOTP_CONTEXT *context;
+    int rc = tpm2totp_context_new(tcti_context, &context);
+
+    if (rc == 0) {
+        rc = getSecret(context, keyBlob, keyBlob_size, password, secret,
+                       secret_size);
+        tpm2totp_context_free(context);
+    }
+    metrics_op(METRICS_OP_GETSECRET, start, rc);
+    return rc;
+}
+
+int
+tpm2totp_getSecret(const uint8_t *keyBlob, size_t keyBlob_size, 
+                   const char *password,
+                   uint8_t **secret, size_t *secret_size)
+{
+    return tpm2totp_getSecret_tcti(keyBlob, keyBlob_size, password, NULL,
+                                   secret, secret_size);
+}
+
 
@@ -0,0 +1,206 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "measure.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Every extend the kernel makes goes along with a new entry in its
+   measurement lists, i.e. a new count or a longer log. Files in securityfs
+   do not raise inotify events; they are re-read on every check, which costs
+   a few system calls instead of a TPM command. Of a log without a size, only
+   the bytes after the previous check are read. */
+
+enum { SOURCE_IMA = 0, SOURCE_EVENTLOG, SOURCE_MAX };
+
+struct MEASURE {
+    char *paths[SOURCE_MAX];    /* NULL if the source is not watched */
+    uint64_t values[SOURCE_MAX];
+    int fd;                     /* inotify instance or -1 */
+    uint64_t generation;
+};
+
+/** Count the bytes of a log from an offset on.
+ *
+ * The log is read from the last byte before the offset, which is only
+ * missing if the log was replaced by a shorter one; then it is read whole.
+ * @param[in] fd The log.
+ * @param[in] offset Size of the log at the previous check or 0.
+ * @retval The size of the log.
+ * @retval UINT64_MAX if the log cannot be read.
+ */
+static uint64_t
+measure_count(int fd, uint64_t offset)
+{
+    char buf[4096];
+    uint64_t start = 0, value;
+    ssize_t n;
+
+    if (offset > 0 && lseek(fd, offset - 1, SEEK_SET) == (off_t)(offset - 1))
+        start = offset - 1;
+    value = start;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        value += n;
+    if (n < 0)
+        return UINT64_MAX;
+    if (start > 0 && value == start) {
+        if (lseek(fd, 0, SEEK_SET) != 0)
+            return UINT64_MAX;
+        return measure_count(fd, 0);
+    }
+    return value;
+}
+
+/** Read the current value of a source.
+ *
+ * @param[in] source The source.
+ * @param[in] path The file of the source.
+ * @param[in] previous The value of the previous check or UINT64_MAX.
+ * @retval The measurement count of IMA or the size of the event log.
+ * @retval UINT64_MAX if the file cannot be read.
+ */
+static uint64_t
+measure_read(int source, const char *path, uint64_t previous)
+{
+    char buf[4096];
+    struct stat st;
+    uint64_t value = 0;
+    ssize_t n;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return UINT64_MAX;
+
+    if (source == SOURCE_EVENTLOG && fstat(fd, &st) == 0 && st.st_size > 0) {
+        value = st.st_size;
+    } else if (source == SOURCE_EVENTLOG) {
+        /* securityfs reports a size of 0 for the generated log */
+        value = measure_count(fd, previous != UINT64_MAX ? previous : 0);
+    } else {
+        n = read(fd, buf, sizeof(buf) - 1);
+        if (n > 0) {
+            buf[n] = '\0';
+            value = strtoull(buf, NULL, 10);
+        } else {
+            value = UINT64_MAX;
+        }
+    }
+    close(fd);
+    return value;
+}
+
+/** Watch the measurements that the kernel exports.
+ *
+ * @param[in] imaCount The IMA measurement count, "" for none or NULL for
+ *            MEASURE_IMA_COUNT.
+ * @param[in] eventlog The firmware's binary event log, "" for none or NULL
+ *            for the log in securityfs.
+ * @param[out] measure The watch.
+ * @retval 0 on success.
+ * @retval -1 on failure.
+ */
+int
+measure_new(const char *imaCount, const char *eventlog, MEASURE **measure)
+{
+    const char *paths[SOURCE_MAX] = {
+        imaCount ? imaCount : MEASURE_IMA_COUNT,
+        eventlog ? eventlog : DEFAULT_EVENTLOG
+    };
+    MEASURE *m;
+
+    if (!measure)
+        return -1;
+    m = calloc(1, sizeof(*m));
+    if (!m)
+        return -1;
+
+    m->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    for (int i = 0; i < SOURCE_MAX; i++) {
+        if (*paths[i] == '\0')
+            continue;
+        m->paths[i] = strdup(paths[i]);
+        if (!m->paths[i]) {
+            measure_free(m);
+            return -1;
+        }
+        m->values[i] = measure_read(i, m->paths[i], UINT64_MAX);
+        /* Fails e.g. for a missing file, which is still re-read */
+        if (m->fd >= 0)
+            inotify_add_watch(m->fd, m->paths[i], IN_MODIFY | IN_CLOSE_WRITE |
+                              IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+    }
+
+    *measure = m;
+    return 0;
+}
+
+/** Get the file descriptor that becomes readable on changes.
+ *
+ * Only changes of regular files, e.g. fixtures in tests, are signalled;
+ * callers also have to check periodically with measure_generation().
+ * @param[in] measure The watch.
+ * @retval The inotify file descriptor or -1.
+ */
+int
+measure_fd(const MEASURE *measure)
+{
+    return measure ? measure->fd : -1;
+}
+
+/** Check whether anything was measured since the last check.
+ *
+ * @param[in] measure The watch.
+ * @retval The number of checks that found a change so far.
+ */
+uint64_t
+measure_generation(MEASURE *measure)
+{
+    char buf[4096];
+    uint64_t value;
+    int changed = 0;
+
+    /* The events only wake up waiters; the values tell what changed */
+    if (measure->fd >= 0)
+        while (read(measure->fd, buf, sizeof(buf)) > 0);
+
+    for (int i = 0; i < SOURCE_MAX; i++) {
+        if (!measure->paths[i])
+            continue;
+        value = measure_read(i, measure->paths[i], measure->values[i]);
+        if (value != measure->values[i]) {
+            measure->values[i] = value;
+            changed = 1;
+        }
+    }
+    if (changed)
+        measure->generation++;
+    return measure->generation;
+}
+
+/** Stop watching the measurements.
+ *
+ * @param[in] measure The watch or NULL.
+ */
+void
+measure_free(MEASURE *measure)
+{
+    if (!measure)
+        return;
+    if (measure->fd >= 0)
+        close(measure->fd);
+    for (int i = 0; i < SOURCE_MAX; i++)
+        free(measure->paths[i]);
+    free(measure);
+}
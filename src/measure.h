@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#ifndef MEASURE_H
+#define MEASURE_H
+
+#include <stdint.h>
+
+/* Binary event log of the firmware, also consulted by TPM2TOTP_BANK_AUTO */
+#define DEFAULT_EVENTLOG "/sys/kernel/security/tpm0/binary_bios_measurements"
+
+/* Number of measurements IMA has extended into the TPM */
+#define MEASURE_IMA_COUNT \
+    "/sys/kernel/security/ima/runtime_measurements_count"
+
+typedef struct MEASURE MEASURE;
+
+int
+measure_new(const char *imaCount, const char *eventlog, MEASURE **measure);
+
+int
+measure_fd(const MEASURE *measure);
+
+uint64_t
+measure_generation(MEASURE *measure);
+
+void
+measure_free(MEASURE *measure);
+
+#endif /* MEASURE_H */
@@ -0,0 +1,453 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <tpm2-totp.h>
+#include "metrics.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+/* Upper bounds of the latency histogram buckets in nanoseconds */
+static const uint64_t bucket_ns[] = {
+    1000000ULL, 5000000ULL, 10000000ULL, 25000000ULL, 50000000ULL,
+    100000000ULL, 250000000ULL, 500000000ULL, 1000000000ULL,
+    2500000000ULL, 5000000000ULL, 10000000000ULL,
+};
+#define NBUCKETS (sizeof(bucket_ns) / sizeof(bucket_ns[0]))
+
+static const char *op_names[METRICS_OP_MAX] = {
+    [METRICS_OP_GENERATE] = "generate",
+    [METRICS_OP_GENERATE_BATCH] = "generate_batch",
+    [METRICS_OP_RESEAL] = "reseal",
+    [METRICS_OP_STORE] = "store",
+    [METRICS_OP_LOAD] = "load",
+    [METRICS_OP_DELETE] = "delete",
+    [METRICS_OP_CALCULATE] = "calculate",
+    [METRICS_OP_GETSECRET] = "getsecret",
+    [METRICS_OP_IMPORT] = "import",
+    [METRICS_OP_GENERATE_POOL] = "generate_pool",
+    [METRICS_OP_CALCULATE_BATCH] = "calculate_batch",
+    [METRICS_OP_PREPARE] = "prepare",
+    [METRICS_OP_LIST] = "list",
+    [METRICS_OP_RESEAL_BATCH] = "reseal_batch",
+    [METRICS_OP_QUEUE] = "queue",
+};
+
+/* Seconds a client of the metrics socket may take to receive the metrics */
+#define SEND_TIMEOUT_SEC 1
+
+#define RC_SLOTS 32
+#define RC_PROBES 4
+
+/* Every thread records into its own slot, so recording is a handful of plain
+ * stores without any locked instructions. Slots are pushed onto a global list
+ * once and never freed, such that the counts of finished threads are kept
+ * and the exporter can walk the list without locking. A finished thread
+ * releases its slot, and the next new thread continues counting in it, so
+ * there are never more slots than threads running at the same time. */
+struct metrics_slot {
+    struct metrics_slot *next;
+    int used;
+    uint64_t op_failed[METRICS_OP_MAX];
+    uint64_t op_sum_ns[METRICS_OP_MAX];
+    uint64_t op_bucket[METRICS_OP_MAX][NBUCKETS + 1]; /* last one is +Inf */
+    uint64_t counter[METRICS_COUNTER_MAX];
+    uint32_t rc_key[RC_SLOTS];
+    uint64_t rc_count[RC_SLOTS];
+    uint64_t rc_other;
+    int64_t last_code;
+};
+
+static struct metrics_slot *slots = NULL;
+static __thread struct metrics_slot *self = NULL;
+static pthread_key_t slot_key;
+static pthread_once_t slot_once = PTHREAD_ONCE_INIT;
+static int slot_reuse = 0;
+
+/* Single writer per slot: a relaxed load/store pair is sufficient */
+#define ADD(var, val) __atomic_store_n(&(var), (var) + (val), __ATOMIC_RELAXED)
+#define GET(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+/* Release the slot of a finished thread for reuse */
+static void
+slot_release(void *arg)
+{
+    struct metrics_slot *s = arg;
+
+    self = NULL;
+    __atomic_store_n(&s->used, 0, __ATOMIC_RELEASE);
+}
+
+static void
+slot_init(void)
+{
+    /* Without the key, slots of finished threads are kept unused */
+    slot_reuse = pthread_key_create(&slot_key, slot_release) == 0;
+}
+
+static struct metrics_slot *
+slot(void)
+{
+    struct metrics_slot *s;
+    int unused;
+
+    if (self)
+        return self;
+
+    pthread_once(&slot_once, slot_init);
+    for (s = __atomic_load_n(&slots, __ATOMIC_ACQUIRE); s; s = s->next) {
+        unused = 0;
+        if (!__atomic_load_n(&s->used, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&s->used, &unused, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (!s) {
+        s = calloc(1, sizeof(*s));
+        if (!s)
+            return NULL;
+        s->used = 1;
+        s->next = __atomic_load_n(&slots, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&slots, &s->next, s, 1,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED));
+    }
+
+    if (slot_reuse)
+        pthread_setspecific(slot_key, s);
+    self = s;
+    return s;
+}
+
+uint64_t
+metrics_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+metrics_op(enum metrics_op op, uint64_t start, int rc)
+{
+    struct metrics_slot *s = slot();
+    uint64_t ns = metrics_now() - start;
+    size_t b;
+
+    if (!s)
+        return;
+
+    for (b = 0; b < NBUCKETS && ns > bucket_ns[b]; b++);
+    ADD(s->op_bucket[op][b], 1);
+    ADD(s->op_sum_ns[op], ns);
+    if (rc)
+        ADD(s->op_failed[op], 1);
+}
+
+void
+metrics_rc(uint32_t rc)
+{
+    struct metrics_slot *s = slot();
+    size_t i, idx;
+
+    if (!s || rc == 0)
+        return;
+
+    idx = (rc * 2654435761U) >> 27;
+    for (i = 0; i < RC_PROBES; i++, idx = (idx + 1) % RC_SLOTS) {
+        if (s->rc_key[idx] == 0)
+            __atomic_store_n(&s->rc_key[idx], rc, __ATOMIC_RELEASE);
+        if (s->rc_key[idx] == rc) {
+            ADD(s->rc_count[idx], 1);
+            return;
+        }
+    }
+    ADD(s->rc_other, 1);
+}
+
+void
+metrics_count(enum metrics_counter counter)
+{
+    metrics_add(counter, 1);
+}
+
+void
+metrics_add(enum metrics_counter counter, uint64_t n)
+{
+    struct metrics_slot *s = slot();
+
+    if (s)
+        ADD(s->counter[counter], n);
+}
+
+void
+metrics_code(time_t now)
+{
+    struct metrics_slot *s = slot();
+
+    if (s && now > s->last_code)
+        __atomic_store_n(&s->last_code, (int64_t)now, __ATOMIC_RELAXED);
+}
+
+/** Write the metrics in the Prometheus text exposition format.
+ *
+ * The values of all threads are summed up. No TPM commands are issued.
+ * @param[in] out Stream to write to.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+int
+tpm2totp_metrics_write(FILE *out)
+{
+    struct metrics_slot *s, *head = __atomic_load_n(&slots, __ATOMIC_ACQUIRE);
+    uint64_t count[METRICS_OP_MAX] = { 0 }, failed[METRICS_OP_MAX] = { 0 };
+    uint64_t sum[METRICS_OP_MAX] = { 0 };
+    uint64_t bucket[METRICS_OP_MAX][NBUCKETS + 1] = { { 0 } };
+    uint64_t counter[METRICS_COUNTER_MAX] = { 0 };
+    uint32_t rc_key[2 * RC_SLOTS] = { 0 };
+    uint64_t rc_count[2 * RC_SLOTS] = { 0 }, rc_other = 0, cum;
+    int64_t last_code = 0;
+    size_t i, j, k;
+
+    if (!out)
+        return -1;
+
+    for (s = head; s; s = s->next) {
+        for (i = 0; i < METRICS_OP_MAX; i++) {
+            failed[i] += GET(s->op_failed[i]);
+            sum[i] += GET(s->op_sum_ns[i]);
+            for (j = 0; j <= NBUCKETS; j++) {
+                cum = GET(s->op_bucket[i][j]);
+                bucket[i][j] += cum;
+                count[i] += cum;
+            }
+        }
+        for (i = 0; i < METRICS_COUNTER_MAX; i++)
+            counter[i] += GET(s->counter[i]);
+        for (i = 0; i < RC_SLOTS; i++) {
+            uint32_t rc = __atomic_load_n(&s->rc_key[i], __ATOMIC_ACQUIRE);
+            if (!rc)
+                continue;
+            for (k = 0; k < 2 * RC_SLOTS && rc_key[k] && rc_key[k] != rc; k++);
+            if (k == 2 * RC_SLOTS) {
+                rc_other += GET(s->rc_count[i]);
+                continue;
+            }
+            rc_key[k] = rc;
+            rc_count[k] += GET(s->rc_count[i]);
+        }
+        rc_other += GET(s->rc_other);
+        if (GET(s->last_code) > last_code)
+            last_code = GET(s->last_code);
+    }
+
+    fprintf(out, "# HELP tpm2totp_operation_duration_seconds "
+                 "Latency of library operations.\n"
+                 "# TYPE tpm2totp_operation_duration_seconds histogram\n");
+    for (i = 0; i < METRICS_OP_MAX; i++) {
+        cum = 0;
+        for (j = 0; j < NBUCKETS; j++) {
+            cum += bucket[i][j];
+            fprintf(out, "tpm2totp_operation_duration_seconds_bucket"
+                         "{op=\"%s\",le=\"%g\"} %llu\n", op_names[i],
+                    bucket_ns[j] / 1e9, (unsigned long long)cum);
+        }
+        fprintf(out, "tpm2totp_operation_duration_seconds_bucket"
+                     "{op=\"%s\",le=\"+Inf\"} %llu\n", op_names[i],
+                (unsigned long long)count[i]);
+        fprintf(out, "tpm2totp_operation_duration_seconds_sum{op=\"%s\"} %.9f\n",
+                op_names[i], sum[i] / 1e9);
+        fprintf(out, "tpm2totp_operation_duration_seconds_count{op=\"%s\"} %llu\n",
+                op_names[i], (unsigned long long)count[i]);
+    }
+
+    fprintf(out, "# HELP tpm2totp_operation_failures_total "
+                 "Failed library operations.\n"
+                 "# TYPE tpm2totp_operation_failures_total counter\n");
+    for (i = 0; i < METRICS_OP_MAX; i++)
+        fprintf(out, "tpm2totp_operation_failures_total{op=\"%s\"} %llu\n",
+                op_names[i], (unsigned long long)failed[i]);
+
+    fprintf(out, "# HELP tpm2totp_tpm_errors_total "
+                 "Error codes returned by the TSS or the TPM.\n"
+                 "# TYPE tpm2totp_tpm_errors_total counter\n");
+    for (k = 0; k < 2 * RC_SLOTS && rc_key[k]; k++)
+        fprintf(out, "tpm2totp_tpm_errors_total{rc=\"0x%08x\"} %llu\n",
+                rc_key[k], (unsigned long long)rc_count[k]);
+    fprintf(out, "tpm2totp_tpm_errors_total{rc=\"other\"} %llu\n",
+            (unsigned long long)rc_other);
+
+    fprintf(out, "# HELP tpm2totp_cache_requests_total "
+                 "Lookups in the TPM object caches.\n"
+                 "# TYPE tpm2totp_cache_requests_total counter\n"
+                 "tpm2totp_cache_requests_total{result=\"hit\"} %llu\n"
+                 "tpm2totp_cache_requests_total{result=\"miss\"} %llu\n",
+            (unsigned long long)counter[METRICS_CACHE_HIT],
+            (unsigned long long)counter[METRICS_CACHE_MISS]);
+
+    fprintf(out, "# HELP tpm2totp_pool_discarded_total "
+                 "Pre-generated keys discarded after a PCR change.\n"
+                 "# TYPE tpm2totp_pool_discarded_total counter\n"
+                 "tpm2totp_pool_discarded_total %llu\n",
+            (unsigned long long)counter[METRICS_POOL_DISCARDED]);
+
+    fprintf(out, "# HELP tpm2totp_counter_reads_skipped_total "
+                 "PCR update counter reads saved by unchanged measurements.\n"
+                 "# TYPE tpm2totp_counter_reads_skipped_total counter\n"
+                 "tpm2totp_counter_reads_skipped_total %llu\n",
+            (unsigned long long)counter[METRICS_COUNTER_SKIPPED]);
+
+    fprintf(out, "# HELP tpm2totp_reseals_total Keys resealed successfully.\n"
+                 "# TYPE tpm2totp_reseals_total counter\n"
+                 "tpm2totp_reseals_total %llu\n",
+            (unsigned long long)counter[METRICS_KEYS_RESEALED]);
+
+    if (last_code) {
+        fprintf(out, "# HELP tpm2totp_last_code_age_seconds "
+                     "Time since the last TOTP value was calculated.\n"
+                     "# TYPE tpm2totp_last_code_age_seconds gauge\n"
+                     "tpm2totp_last_code_age_seconds %lld\n",
+                (long long)(time(NULL) - last_code));
+    }
+
+    return ferror(out) ? -1 : 0;
+}
+
+/** Write the metrics to a file.
+ *
+ * The file is replaced atomically, such that scrapers never see a partial
+ * file when this is called periodically.
+ * @param[in] path File to write.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+int
+tpm2totp_metrics_writeFile(const char *path)
+{
+    char *tmp;
+    FILE *out;
+    int rc;
+
+    if (!path)
+        return -1;
+
+    tmp = malloc(strlen(path) + sizeof(".tmp"));
+    if (!tmp)
+        return -1;
+    sprintf(tmp, "%s.tmp", path);
+
+    out = fopen(tmp, "w");
+    if (!out) {
+        free(tmp);
+        return -1;
+    }
+
+    rc = tpm2totp_metrics_write(out);
+    if (fclose(out) != 0)
+        rc = -1;
+    if (rc == 0 && rename(tmp, path) != 0)
+        rc = -1;
+    if (rc != 0)
+        unlink(tmp);
+
+    free(tmp);
+    return rc;
+}
+
+/** Create a Unix socket for serving the metrics.
+ *
+ * The returned socket is non-blocking and can be added to the caller's poll
+ * loop; call tpm2totp_metrics_serve() whenever it becomes readable.
+ * @param[in] path Path of the socket. An existing file is replaced.
+ * @param[out] fd Listening socket.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+int
+tpm2totp_metrics_listen(const char *path, int *fd)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (!path || !fd || strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    *fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (*fd < 0)
+        return -1;
+
+    unlink(path);
+    if (bind(*fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(*fd, 8) != 0) {
+        close(*fd);
+        *fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/** Answer all pending connections on a metrics socket.
+ *
+ * Each client receives the current metrics and the connection is closed.
+ * Clients that close the connection early or do not read are given up on
+ * after SEND_TIMEOUT_SEC, without raising SIGPIPE in the caller.
+ * @param[in] fd Socket created by tpm2totp_metrics_listen().
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+int
+tpm2totp_metrics_serve(int fd)
+{
+    struct timeval tv = { .tv_sec = SEND_TIMEOUT_SEC };
+    char *buf = NULL;
+    size_t size = 0, off;
+    ssize_t n;
+    FILE *out;
+    int client, err;
+
+    while ((client = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+        /* The metrics are rendered once for all pending clients */
+        if (!buf) {
+            out = open_memstream(&buf, &size);
+            if (!out || tpm2totp_metrics_write(out) != 0 || fclose(out) != 0) {
+                if (out)
+                    fclose(out);
+                free(buf);
+                close(client);
+                return -1;
+            }
+        }
+
+        if (setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &tv,
+                       sizeof(tv)) == 0) {
+            for (off = 0; off < size; off += n) {
+                n = send(client, buf + off, size - off, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR)
+                    n = 0;
+                else if (n <= 0)
+                    break;
+            }
+        }
+        close(client);
+    }
+
+    err = errno;
+    free(buf);
+    return (err == EAGAIN || err == EWOULDBLOCK) ? 0 : -1;
+}
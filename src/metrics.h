@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+
+enum metrics_op {
+    METRICS_OP_GENERATE = 0,
+    METRICS_OP_GENERATE_BATCH,
+    METRICS_OP_RESEAL,
+    METRICS_OP_STORE,
+    METRICS_OP_LOAD,
+    METRICS_OP_DELETE,
+    METRICS_OP_CALCULATE,
+    METRICS_OP_GETSECRET,
+    METRICS_OP_IMPORT,
+    METRICS_OP_GENERATE_POOL,
+    METRICS_OP_CALCULATE_BATCH,
+    METRICS_OP_PREPARE,
+    METRICS_OP_LIST,
+    METRICS_OP_RESEAL_BATCH,
+    METRICS_OP_QUEUE,
+    METRICS_OP_MAX
+};
+
+enum metrics_counter {
+    METRICS_CACHE_HIT = 0,
+    METRICS_CACHE_MISS,
+    METRICS_POOL_DISCARDED,
+    METRICS_COUNTER_SKIPPED,
+    METRICS_KEYS_RESEALED,
+    METRICS_COUNTER_MAX
+};
+
+/** Monotonic timestamp in nanoseconds for latency measurements. */
+uint64_t
+metrics_now(void);
+
+/** Record the outcome and latency of a library operation. */
+void
+metrics_op(enum metrics_op op, uint64_t start, int rc);
+
+/** Record an error return code of the TSS or the TPM. */
+void
+metrics_rc(uint32_t rc);
+
+/** Increment one of the plain counters. */
+void
+metrics_count(enum metrics_counter counter);
+
+/** Add to one of the plain counters. */
+void
+metrics_add(enum metrics_counter counter, uint64_t n);
+
+/** Record the time a TOTP value was calculated for. */
+void
+metrics_code(time_t now);
+
+#endif /* METRICS_H */
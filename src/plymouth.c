@@ -0,0 +1,239 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "plymouth.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Requests and responses of plymouth's boot protocol (ply-boot-protocol.h) */
+#define PLY_REQUEST_SHOW_MESSAGE 'M'
+#define PLY_REQUEST_HIDE_MESSAGE 'm'
+#define PLY_ARGUMENT '\002'
+#define PLY_RESPONSE_ACK '\006'
+#define PLY_RESPONSE_NAK '\025'
+
+/* A hanging plymouthd must not stop the codes from being calculated */
+#define PLY_TIMEOUT_SEC 1
+
+struct PLYMOUTH {
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    int abstract;
+    int fd;
+    int shown;          /* message is displayed by plymouthd */
+    uint64_t step;      /* time step of the displayed message */
+    char message[PLYMOUTH_MESSAGE_MAX + 1];
+};
+
+/** Connect to plymouthd.
+ *
+ * plymouthd binds its abstract socket with the length of the name, older
+ * versions with the full, NUL padded address; both are tried.
+ * @param[in,out] ply The plymouth connection.
+ * @retval 0 on success.
+ * @retval -1 on failure.
+ */
+static int
+ply_connect(PLYMOUTH *ply)
+{
+    struct timeval tv = { .tv_sec = PLY_TIMEOUT_SEC };
+
+    ply->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (ply->fd < 0)
+        return -1;
+    if (setsockopt(ply->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0 ||
+        setsockopt(ply->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) != 0)
+        goto error;
+
+    if (connect(ply->fd, (struct sockaddr *)&ply->addr, ply->addr_len) == 0)
+        return 0;
+    if (ply->abstract &&
+        connect(ply->fd, (struct sockaddr *)&ply->addr, sizeof(ply->addr)) == 0)
+        return 0;
+
+error:
+    close(ply->fd);
+    ply->fd = -1;
+    return -1;
+}
+
+static void
+ply_disconnect(PLYMOUTH *ply)
+{
+    if (ply->fd >= 0)
+        close(ply->fd);
+    ply->fd = -1;
+}
+
+/** Send a request with a string argument and wait for the answer.
+ *
+ * The connection is dropped if it failed, such that the next request
+ * reconnects, e.g. to the plymouthd of the root file system.
+ * @param[in,out] ply The plymouth connection.
+ * @param[in] command The request type.
+ * @param[in] argument The argument of at most PLYMOUTH_MESSAGE_MAX bytes.
+ * @retval 0 if plymouthd acknowledged the request.
+ * @retval -1 on failure.
+ */
+static int
+ply_request(PLYMOUTH *ply, char command, const char *argument)
+{
+    char buf[3 + PLYMOUTH_MESSAGE_MAX + 1];
+    size_t len = strlen(argument);
+    ssize_t n;
+    char response;
+
+    /* Command, argument marker, argument size and the argument with its NUL */
+    buf[0] = command;
+    buf[1] = PLY_ARGUMENT;
+    buf[2] = (char)(len + 1);
+    memcpy(&buf[3], argument, len + 1);
+
+    n = send(ply->fd, buf, 3 + len + 1, MSG_NOSIGNAL);
+    if (n != (ssize_t)(3 + len + 1))
+        goto error;
+
+    do {
+        n = recv(ply->fd, &response, 1, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n != 1)
+        goto error;
+    if (response == PLY_RESPONSE_ACK)
+        return 0;
+    if (response == PLY_RESPONSE_NAK) {
+        errno = EPROTO;
+        return -1;
+    }
+
+error:
+    if (n >= 0)
+        errno = EPROTO;
+    ply_disconnect(ply);
+    return -1;
+}
+
+/** Create a connection to plymouthd for displaying codes.
+ *
+ * The daemon is only contacted by the first update.
+ * @param[in] path Socket of plymouthd, abstract if starting with '@', or NULL
+ *            for PLYMOUTH_SOCKET.
+ * @param[out] ply The plymouth connection.
+ * @retval 0 on success.
+ * @retval -1 on failure.
+ */
+int
+plymouth_new(const char *path, PLYMOUTH **ply)
+{
+    size_t len;
+
+    if (!ply)
+        return -1;
+    if (!path)
+        path = PLYMOUTH_SOCKET;
+    len = strlen(path);
+    if (len == 0 || len >= sizeof((*ply)->addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    *ply = calloc(1, sizeof(**ply));
+    if (!*ply)
+        return -1;
+
+    (*ply)->addr.sun_family = AF_UNIX;
+    memcpy((*ply)->addr.sun_path, path, len);
+    (*ply)->abstract = path[0] == '@';
+    if ((*ply)->abstract)
+        (*ply)->addr.sun_path[0] = '\0';
+    (*ply)->addr_len = offsetof(struct sockaddr_un, sun_path) + len +
+                       !(*ply)->abstract;
+    (*ply)->fd = -1;
+    return 0;
+}
+
+/** Replace the displayed message.
+ *
+ * @param[in,out] ply The connected plymouth connection.
+ * @param[in] message The new message.
+ * @retval 0 on success.
+ * @retval -1 on failure.
+ */
+static int
+ply_replace(PLYMOUTH *ply, const char *message)
+{
+    if (ply->shown) {
+        /* A restarted plymouthd does not know the message and refuses */
+        if (ply_request(ply, PLY_REQUEST_HIDE_MESSAGE, ply->message) != 0 &&
+            ply->fd < 0)
+            return -1;
+        ply->shown = 0;
+    }
+    return ply_request(ply, PLY_REQUEST_SHOW_MESSAGE, message);
+}
+
+/** Display a message for a time step in place of the previous one.
+ *
+ * Nothing is sent if the message of the step is already displayed, so this
+ * can be called whenever the caller wakes up. Otherwise the previous message
+ * is hidden and the new one shown. A connection closed since the last update
+ * is reopened once; a failed update is retried with the next call.
+ * @param[in,out] ply The plymouth connection.
+ * @param[in] step The time step of the message.
+ * @param[in] message The message of at most PLYMOUTH_MESSAGE_MAX bytes.
+ * @retval 0 on success.
+ * @retval -1 on failure.
+ */
+int
+plymouth_update(PLYMOUTH *ply, uint64_t step, const char *message)
+{
+    int fresh;
+
+    if (!ply || !message)
+        return -1;
+    if (strlen(message) > PLYMOUTH_MESSAGE_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (ply->shown && ply->step == step && !strcmp(ply->message, message))
+        return 0;
+
+    do {
+        fresh = ply->fd < 0;
+        if (fresh && ply_connect(ply) != 0)
+            return -1;
+        if (ply_replace(ply, message) == 0) {
+            ply->shown = 1;
+            ply->step = step;
+            strcpy(ply->message, message);
+            return 0;
+        }
+    } while (!fresh && ply->fd < 0);
+
+    return -1;
+}
+
+/** Close the connection to plymouthd.
+ *
+ * The message stays displayed.
+ * @param[in] ply The plymouth connection or NULL.
+ */
+void
+plymouth_free(PLYMOUTH *ply)
+{
+    if (!ply)
+        return;
+    ply_disconnect(ply);
+    free(ply);
+}
@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#ifndef PLYMOUTH_H
+#define PLYMOUTH_H
+
+#include <stdint.h>
+
+/* Abstract socket of plymouthd's boot protocol, '@' standing for the
+   leading NUL byte */
+#define PLYMOUTH_SOCKET "@/org/freedesktop/plymouthd"
+
+/* Longest message the protocol can carry */
+#define PLYMOUTH_MESSAGE_MAX 254
+
+typedef struct PLYMOUTH PLYMOUTH;
+
+int
+plymouth_new(const char *path, PLYMOUTH **ply);
+
+int
+plymouth_update(PLYMOUTH *ply, uint64_t step, const char *message);
+
+void
+plymouth_free(PLYMOUTH *ply);
+
+#endif /* PLYMOUTH_H */
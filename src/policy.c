@@ -0,0 +1,611 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "policy.h"
+
+#include <tpm2-totp.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define POLICY_CHUNK_SIZE (1 << 18)
+#define POLICY_JOBS_MAX 256
+#define POLICY_VALUES_MAX (24 * (20 + 32 + 48))
+
+#define MEMO_BUCKETS (1 << 16)
+#define MEMO_LOCKS 64
+#define MEMO_MAX (1 << 18)
+
+/* A memoized digest. Entries are never changed or freed while workers run,
+   so lookups walk the chains without taking a lock. */
+typedef struct MEMO_ENTRY {
+    struct MEMO_ENTRY *next;
+    uint64_t hash;
+    uint32_t pcrs;
+    uint32_t banks;
+    size_t size;
+    uint8_t digest[TPM2TOTP_POLICY_SIZE];
+    uint8_t values[];
+} MEMO_ENTRY;
+
+typedef struct {
+    MEMO_ENTRY *buckets[MEMO_BUCKETS];
+    pthread_mutex_t locks[MEMO_LOCKS];
+    size_t count;
+} MEMO;
+
+/* A block of whole input lines and the output of its records */
+typedef struct {
+    enum { CHUNK_FREE, CHUNK_BUSY, CHUNK_DONE } state;
+    char *data;
+    size_t size;
+    size_t capacity;
+    char *out;
+    size_t out_size;
+    size_t out_capacity;
+    int rc;
+    POLICY_STATS stats;
+} POLICY_CHUNK;
+
+/* Chunks are read into a ring, computed by the workers and written in input
+   order as soon as the ring needs their slot again. */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t done;
+    POLICY_CHUNK *chunks;
+    size_t nchunks;
+    size_t next_read;
+    size_t next_work;
+    int eof;
+    uint32_t pcrs;
+    uint32_t banks;
+    MEMO *memo;
+    POLICY_STATS stats;
+} POLICY_ENGINE;
+
+/** Find the next whitespace separated token before end.
+ * @retval The position after the token.
+ */
+static const char *
+next_token(const char *p, const char *end, const char **token, size_t *len)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+    *token = p;
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r')
+        p++;
+    *len = p - *token;
+    return p;
+}
+
+/** Parse a list of PCRs as accepted by --pcrs, e.g. 0,2,4. */
+static int
+parse_pcrs(const char *str, size_t len, uint32_t *pcrs)
+{
+    unsigned int pcr = 0;
+    int digits = 0;
+
+    *pcrs = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (i == len || str[i] == ',') {
+            if (!digits)
+                return -1;
+            *pcrs |= 1 << pcr;
+            pcr = 0;
+            digits = 0;
+        } else if (str[i] >= '0' && str[i] <= '9' && digits < 2) {
+            pcr = pcr * 10 + (str[i] - '0');
+            digits++;
+            if (pcr > 23)
+                return -1;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/** Parse a list of PCR banks as accepted by --banks, e.g. SHA1,SHA256. */
+static int
+parse_banks(const char *str, size_t len, uint32_t *banks)
+{
+    const char *end = str + len, *comma;
+    size_t n;
+
+    *banks = 0;
+    for (; str <= end; str = comma + 1) {
+        comma = memchr(str, ',', end - str);
+        if (!comma)
+            comma = end;
+        n = comma - str;
+#define BANK(name) (n == strlen(name) && !memcmp(str, name, n))
+        if (BANK("SHA1"))
+            *banks |= TPM2TOTP_BANK_SHA1;
+        else if (BANK("SHA256"))
+            *banks |= TPM2TOTP_BANK_SHA256;
+        else if (BANK("SHA384"))
+            *banks |= TPM2TOTP_BANK_SHA384;
+        else
+            return -1;
+#undef BANK
+    }
+    return 0;
+}
+
+/* Values of the hex digits plus one, zero for other characters */
+static const uint8_t hex_values[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6,
+    ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+static int
+parse_hex(const char *str, size_t len, uint8_t *out, size_t *out_size)
+{
+    const unsigned char *in = (const unsigned char *)str;
+    unsigned int hi, lo, invalid = 0;
+
+    if (len % 2 || len / 2 > *out_size)
+        return -1;
+    for (size_t i = 0; i < len / 2; i++) {
+        hi = hex_values[in[2 * i]];
+        lo = hex_values[in[2 * i + 1]];
+        invalid |= (hi - 1) | (lo - 1);
+        out[i] = (hi - 1) << 4 | (lo - 1);
+    }
+    *out_size = len / 2;
+    return invalid > 0xf ? -1 : 0;
+}
+
+/* FNV-1a over the selection and the values, taken eight bytes at a time */
+static uint64_t
+memo_hash(uint32_t pcrs, uint32_t banks, const uint8_t *values, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL, word;
+    size_t i;
+
+    hash = (hash ^ ((uint64_t)banks << 32 | pcrs)) * 0x100000001b3ULL;
+    for (i = 0; i + 8 <= size; i += 8) {
+        memcpy(&word, &values[i], 8);
+        hash = (hash ^ word) * 0x100000001b3ULL;
+        hash ^= hash >> 29;
+    }
+    for (; i < size; i++)
+        hash = (hash ^ values[i]) * 0x100000001b3ULL;
+    return hash ^ hash >> 32;
+}
+
+static const MEMO_ENTRY *
+memo_find(const MEMO_ENTRY *entry, uint64_t hash, uint32_t pcrs,
+          uint32_t banks, const uint8_t *values, size_t size)
+{
+    for (; entry; entry = entry->next) {
+        if (entry->hash == hash && entry->pcrs == pcrs &&
+            entry->banks == banks && entry->size == size &&
+            !memcmp(entry->values, values, size))
+            return entry;
+    }
+    return NULL;
+}
+
+/** Look up the policy digest of a record, computing it if it is not known.
+ *
+ * Once MEMO_MAX digests are stored, further ones are computed every time.
+ * @retval 0 if the digest was memoized.
+ * @retval 1 if it was computed.
+ * @retval -1 if the values do not match the selection.
+ */
+static int
+memo_digest(MEMO *memo, uint32_t pcrs, uint32_t banks, const uint8_t *values,
+            size_t size, uint8_t *digest)
+{
+    uint64_t hash = memo_hash(pcrs, banks, values, size);
+    MEMO_ENTRY **bucket = &memo->buckets[hash % MEMO_BUCKETS];
+    pthread_mutex_t *lock = &memo->locks[hash % MEMO_LOCKS];
+    const MEMO_ENTRY *found;
+    MEMO_ENTRY *entry;
+
+    found = memo_find(__atomic_load_n(bucket, __ATOMIC_ACQUIRE), hash, pcrs,
+                      banks, values, size);
+    if (found) {
+        memcpy(digest, found->digest, TPM2TOTP_POLICY_SIZE);
+        return 0;
+    }
+
+    if (tpm2totp_policyDigest(pcrs, banks, values, size, digest) != 0)
+        return -1;
+
+    if (__atomic_load_n(&memo->count, __ATOMIC_RELAXED) >= MEMO_MAX)
+        return 1;
+    entry = malloc(sizeof(*entry) + size);
+    if (!entry)
+        return 1;
+    entry->hash = hash;
+    entry->pcrs = pcrs;
+    entry->banks = banks;
+    entry->size = size;
+    memcpy(entry->digest, digest, TPM2TOTP_POLICY_SIZE);
+    memcpy(entry->values, values, size);
+
+    /* Another worker may have stored the same record meanwhile */
+    pthread_mutex_lock(lock);
+    if (memo_find(*bucket, hash, pcrs, banks, values, size)) {
+        pthread_mutex_unlock(lock);
+        free(entry);
+        return 1;
+    }
+    entry->next = *bucket;
+    __atomic_store_n(bucket, entry, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&memo->count, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(lock);
+    return 1;
+}
+
+static MEMO *
+memo_new(void)
+{
+    MEMO *memo = calloc(1, sizeof(*memo));
+
+    if (!memo)
+        return NULL;
+    for (size_t i = 0; i < MEMO_LOCKS; i++)
+        pthread_mutex_init(&memo->locks[i], NULL);
+    return memo;
+}
+
+static void
+memo_free(MEMO *memo)
+{
+    MEMO_ENTRY *entry, *next;
+
+    if (!memo)
+        return;
+    for (size_t i = 0; i < MEMO_BUCKETS; i++) {
+        for (entry = memo->buckets[i]; entry; entry = next) {
+            next = entry->next;
+            free(entry);
+        }
+    }
+    for (size_t i = 0; i < MEMO_LOCKS; i++)
+        pthread_mutex_destroy(&memo->locks[i]);
+    free(memo);
+}
+
+/** Append to the output of a chunk. */
+static int
+chunk_write(POLICY_CHUNK *chunk, const char *str, size_t len)
+{
+    char *out;
+    size_t capacity;
+
+    if (chunk->out_size + len > chunk->out_capacity) {
+        capacity = chunk->out_capacity ? chunk->out_capacity :
+                                         POLICY_CHUNK_SIZE;
+        while (chunk->out_size + len > capacity)
+            capacity *= 2;
+        out = realloc(chunk->out, capacity);
+        if (!out)
+            return -1;
+        chunk->out = out;
+        chunk->out_capacity = capacity;
+    }
+    memcpy(&chunk->out[chunk->out_size], str, len);
+    chunk->out_size += len;
+    return 0;
+}
+
+/** Compute the digest of one input line and append the result.
+ *
+ * A line holds an id and the PCR values in hex, optionally with PCRs and
+ * banks in between that replace the selection of the command line.
+ */
+static int
+policy_record(POLICY_ENGINE *e, POLICY_CHUNK *chunk, const char *line,
+              const char *eol)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *id, *tokens[4];
+    size_t id_len, lens[4], ntokens, size = POLICY_VALUES_MAX;
+    uint8_t values[POLICY_VALUES_MAX], digest[TPM2TOTP_POLICY_SIZE];
+    char result[1 + 2 * TPM2TOTP_POLICY_SIZE + 1];
+    uint32_t pcrs = e->pcrs, banks = e->banks;
+    int rc = -1;
+
+    line = next_token(line, eol, &id, &id_len);
+    if (id_len == 0 || id[0] == '#')
+        return 0;
+    for (ntokens = 0; ntokens < 4; ntokens++) {
+        line = next_token(line, eol, &tokens[ntokens], &lens[ntokens]);
+        if (lens[ntokens] == 0)
+            break;
+    }
+
+    if ((ntokens == 1 ||
+         (ntokens == 3 && !parse_pcrs(tokens[0], lens[0], &pcrs) &&
+          !parse_banks(tokens[1], lens[1], &banks))) &&
+        !parse_hex(tokens[ntokens - 1], lens[ntokens - 1], values, &size))
+        rc = memo_digest(e->memo, pcrs, banks, values, size, digest);
+
+    chunk->stats.records++;
+    if (rc < 0) {
+        chunk->stats.invalid++;
+        if (chunk_write(chunk, id, id_len) ||
+            chunk_write(chunk, " invalid\n", strlen(" invalid\n")))
+            return -1;
+        return 0;
+    }
+    if (rc > 0)
+        chunk->stats.computed++;
+
+    result[0] = ' ';
+    for (size_t i = 0; i < TPM2TOTP_POLICY_SIZE; i++) {
+        result[1 + 2 * i] = hex[digest[i] >> 4];
+        result[2 + 2 * i] = hex[digest[i] & 0xf];
+    }
+    result[sizeof(result) - 1] = '\n';
+    if (chunk_write(chunk, id, id_len) ||
+        chunk_write(chunk, result, sizeof(result)))
+        return -1;
+    return 0;
+}
+
+static void
+policy_chunk(POLICY_ENGINE *e, POLICY_CHUNK *chunk)
+{
+    const char *p = chunk->data, *end = chunk->data + chunk->size, *eol;
+
+    chunk->out_size = 0;
+    memset(&chunk->stats, 0, sizeof(chunk->stats));
+    chunk->rc = 0;
+
+    for (; p < end; p = eol + 1) {
+        eol = memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+        if (policy_record(e, chunk, p, eol) != 0) {
+            chunk->rc = -1;
+            return;
+        }
+    }
+}
+
+static void *
+policy_worker(void *arg)
+{
+    POLICY_ENGINE *e = arg;
+    POLICY_CHUNK *chunk;
+
+    pthread_mutex_lock(&e->lock);
+    for (;;) {
+        while (e->next_work == e->next_read && !e->eof)
+            pthread_cond_wait(&e->ready, &e->lock);
+        if (e->next_work == e->next_read)
+            break;
+        chunk = &e->chunks[e->next_work++ % e->nchunks];
+        pthread_mutex_unlock(&e->lock);
+
+        policy_chunk(e, chunk);
+
+        pthread_mutex_lock(&e->lock);
+        chunk->state = CHUNK_DONE;
+        pthread_cond_broadcast(&e->done);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return NULL;
+}
+
+/** Read whole lines into a chunk.
+ *
+ * The partial line at the end of the data read is carried over to the next
+ * chunk.
+ * @param[in] in The input stream.
+ * @param[in,out] chunk The chunk to fill.
+ * @param[in,out] carry The partial line of the previous chunk.
+ * @param[in,out] carry_size Size of the partial line.
+ * @param[out] eof Set at the end of the input.
+ * @retval 0 on success.
+ * @retval -1 on failure.
+ */
+static int
+read_chunk(FILE *in, POLICY_CHUNK *chunk, char **carry, size_t *carry_size,
+           int *eof)
+{
+    const char *eol;
+    size_t n, lines;
+    char *data;
+
+    if (!chunk->data) {
+        chunk->data = malloc(POLICY_CHUNK_SIZE);
+        if (!chunk->data)
+            return -1;
+        chunk->capacity = POLICY_CHUNK_SIZE;
+    }
+    /* A line longer than a chunk is read whole */
+    if (*carry_size >= chunk->capacity) {
+        data = realloc(chunk->data, *carry_size * 2);
+        if (!data)
+            return -1;
+        chunk->data = data;
+        chunk->capacity = *carry_size * 2;
+    }
+    if (*carry_size)
+        memcpy(chunk->data, *carry, *carry_size);
+    chunk->size = *carry_size;
+
+    n = fread(&chunk->data[chunk->size], 1, chunk->capacity - chunk->size, in);
+    chunk->size += n;
+    if (n == 0 || feof(in)) {
+        if (ferror(in))
+            return -1;
+        *eof = feof(in);
+        if (*eof) {
+            *carry_size = 0;
+            return 0;
+        }
+    }
+
+    eol = memrchr(chunk->data, '\n', chunk->size);
+    lines = eol ? (size_t)(eol + 1 - chunk->data) : 0;
+    if (chunk->size - lines > *carry_size) {
+        data = realloc(*carry, chunk->size - lines);
+        if (!data)
+            return -1;
+        *carry = data;
+    }
+    *carry_size = chunk->size - lines;
+    memcpy(*carry, &chunk->data[lines], *carry_size);
+    chunk->size = lines;
+    return 0;
+}
+
+/** Write the output of a computed chunk and release its slot. */
+static int
+flush_chunk(POLICY_ENGINE *e, POLICY_CHUNK *chunk, FILE *out, int rc)
+{
+    if (chunk->state != CHUNK_DONE)
+        return rc;
+    if (chunk->rc != 0)
+        rc = -1;
+    if (rc == 0 && chunk->out_size > 0 &&
+        fwrite(chunk->out, chunk->out_size, 1, out) != 1)
+        rc = -1;
+
+    e->stats.records += chunk->stats.records;
+    e->stats.computed += chunk->stats.computed;
+    e->stats.invalid += chunk->stats.invalid;
+    chunk->state = CHUNK_FREE;
+    return rc;
+}
+
+static void
+wait_chunk(POLICY_ENGINE *e, POLICY_CHUNK *chunk)
+{
+    pthread_mutex_lock(&e->lock);
+    while (chunk->state == CHUNK_BUSY)
+        pthread_cond_wait(&e->done, &e->lock);
+    pthread_mutex_unlock(&e->lock);
+}
+
+/** Compute the policy digests of a stream of PCR value sets.
+ *
+ * Each line holds an id, optionally the PCRs and banks of the policy in the
+ * syntax of --pcrs and --banks, and the expected PCR values in hex,
+ * concatenated bank by bank in ascending PCR order. For each line, the id
+ * and the digest that tpm2totp_generateKey() would set as the key's policy
+ * are written in input order; lines whose values do not match their
+ * selection are reported as invalid. The input is read in chunks that a pool
+ * of workers computes while the next ones are read, and the digests are
+ * memoized such that identical sets are only computed once.
+ * @param[in] in The input stream.
+ * @param[in] pcrs PCRs of lines without a selection (0 for the default).
+ * @param[in] banks PCR banks of lines without a selection (0 for the default).
+ * @param[in] jobs Number of worker threads (0 for one per CPU).
+ * @param[in] out Stream for the digests.
+ * @param[out] stats The totals.
+ * @retval 0 on success.
+ * @retval -1 on failure.
+ */
+int
+policy_stream(FILE *in, uint32_t pcrs, uint32_t banks, unsigned int jobs,
+              FILE *out, POLICY_STATS *stats)
+{
+    POLICY_ENGINE e = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .ready = PTHREAD_COND_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER,
+        .pcrs = pcrs,
+        .banks = banks,
+    };
+    pthread_t *threads = NULL;
+    unsigned int started = 0;
+    POLICY_CHUNK *chunk;
+    char *carry = NULL;
+    size_t carry_size = 0;
+    int eof = 0, rc = 0;
+
+    memset(stats, 0, sizeof(*stats));
+
+    if (jobs == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? cpus : 1;
+    }
+    if (jobs > POLICY_JOBS_MAX)
+        jobs = POLICY_JOBS_MAX;
+
+    /* Enough chunks to keep all workers busy while the oldest is written */
+    e.nchunks = 2 * jobs;
+    e.chunks = calloc(e.nchunks, sizeof(*e.chunks));
+    e.memo = memo_new();
+    threads = calloc(jobs, sizeof(*threads));
+    if (!e.chunks || !e.memo || !threads) {
+        rc = -1;
+        goto out;
+    }
+
+    for (; started < jobs; started++) {
+        if (pthread_create(&threads[started], NULL, policy_worker, &e) != 0)
+            break;
+    }
+
+    while (!eof && rc == 0) {
+        chunk = &e.chunks[e.next_read % e.nchunks];
+        wait_chunk(&e, chunk);
+        rc = flush_chunk(&e, chunk, out, rc);
+        if (rc != 0 || read_chunk(in, chunk, &carry, &carry_size, &eof) != 0) {
+            rc = -1;
+            break;
+        }
+        if (chunk->size == 0)
+            continue;
+
+        /* Fall back to computing in this thread if no thread is left */
+        if (started == 0) {
+            policy_chunk(&e, chunk);
+            chunk->state = CHUNK_DONE;
+            e.next_read++;
+            continue;
+        }
+        pthread_mutex_lock(&e.lock);
+        chunk->state = CHUNK_BUSY;
+        e.next_read++;
+        pthread_cond_signal(&e.ready);
+        pthread_mutex_unlock(&e.lock);
+    }
+
+    pthread_mutex_lock(&e.lock);
+    e.eof = 1;
+    pthread_cond_broadcast(&e.ready);
+    pthread_mutex_unlock(&e.lock);
+
+    /* The oldest chunk is in the slot that would have been read next */
+    for (size_t i = 0; i < e.nchunks; i++) {
+        chunk = &e.chunks[(e.next_read + i) % e.nchunks];
+        wait_chunk(&e, chunk);
+        rc = flush_chunk(&e, chunk, out, rc);
+    }
+
+out:
+    for (unsigned int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    if (e.chunks) {
+        for (size_t i = 0; i < e.nchunks; i++) {
+            free(e.chunks[i].data);
+            free(e.chunks[i].out);
+        }
+    }
+    *stats = e.stats;
+    memo_free(e.memo);
+    free(e.chunks);
+    free(threads);
+    free(carry);
+    return rc;
+}
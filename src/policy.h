@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#ifndef POLICY_H
+#define POLICY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Totals of a policy run */
+typedef struct {
+    size_t records;
+    size_t computed;    /* records whose digest was not memoized */
+    size_t invalid;
+} POLICY_STATS;
+
+int
+policy_stream(FILE *in, uint32_t pcrs, uint32_t banks, unsigned int jobs,
+              FILE *out, POLICY_STATS *stats);
+
+#endif /* POLICY_H */
@@ -0,0 +1,537 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <tpm2-totp.h>
+#include "context.h"
+#include "keytemplates.h"
+#include "measure.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tss2/tss2_esys.h>
+
+/* Seconds to wait before retrying after the TPM failed to create a key */
+#define POOL_RETRY 1
+
+/* Milliseconds between checks of the measurements in securityfs, which do
+   not raise inotify events */
+#define POOL_MEASURE_INTERVAL 1000
+
+/* PCRs that do not increment pcrUpdateCounter (PC Client Platform TPM
+   Profile), so changes of their values would go unnoticed by the pool */
+#define POOL_NOINCREMENT_PCRS ((1 << 16) | (1 << 23))
+
+typedef struct {
+    uint8_t *secret;
+    size_t secret_size;
+    uint8_t *keyBlob;
+    size_t keyBlob_size;
+    uint32_t counter;
+} POOL_ENTRY;
+
+struct TPM2TOTP_POOL {
+    uint32_t pcrs;
+    uint32_t banks;
+    char *password;
+    TPM2TOTP_CONTEXT *context;
+    pthread_mutex_t tpm;    /* serializes all commands on the TPM */
+    pthread_mutex_t lock;   /* protects the fields below */
+    pthread_cond_t cond;    /* signals free slots and stop */
+    int stop;
+    size_t size;
+    size_t count;
+    POOL_ENTRY *entries;
+    pthread_t filler;
+    int wake[2];            /* wakes the filler while it watches */
+    /* Only with measurements, protected by tpm: */
+    MEASURE *measure;
+    uint64_t generation;    /* of the last counter read */
+    uint32_t counter;
+    int counter_valid;      /* counter is current while generation is */
+};
+
+static void
+entry_free(POOL_ENTRY *entry)
+{
+    context_wipe(entry->secret, entry->secret_size);
+    free(entry->secret);
+    free(entry->keyBlob);
+    memset(entry, 0, sizeof(*entry));
+}
+
+/** Read the PCR update counter of the TPM.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[out] counter Current pcrUpdateCounter.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+static int
+read_counter(TPM2TOTP_CONTEXT *context, uint32_t *counter)
+{
+    ESYS_CONTEXT *ctx = context->esys;
+    TSS2_RC rc;
+    TPML_PCR_SELECTION *pcrsel = NULL;
+    TPML_DIGEST *values = NULL;
+    /* No PCR is selected; only the counter is returned */
+    TPML_PCR_SELECTION empty = { .count = 1, .pcrSelections = {
+        { .hash = TPM2_ALG_SHA256, .sizeofSelect = 3, .pcrSelect = { 0 } } } };
+
+    rc = Esys_PCR_Read(ctx, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                       &empty, counter, &pcrsel, &values);
+    chkrc(rc, return rc);
+    free(pcrsel);
+    free(values);
+
+    return 0;
+}
+
+/** Get the PCR update counter, from the TPM only if something was measured.
+ *
+ * Without measurements, the counter is always read. Otherwise the last value
+ * is reused as long as the kernel's measurements stay the same. After a
+ * change the counter is read twice, once right away and once on the next
+ * check, since the extend may still be on its way to the TPM.
+ * @param[in] pool The pool, with its TPM locked.
+ * @param[out] counter Current pcrUpdateCounter.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+static int
+pool_counter(TPM2TOTP_POOL *pool, uint32_t *counter)
+{
+    uint64_t generation = 0;
+    int rc;
+
+    if (pool->measure) {
+        generation = measure_generation(pool->measure);
+        if (pool->counter_valid && generation == pool->generation) {
+            metrics_count(METRICS_COUNTER_SKIPPED);
+            *counter = pool->counter;
+            return 0;
+        }
+    }
+
+    rc = read_counter(pool->context, counter);
+    if (rc != 0) {
+        pool->counter_valid = 0;
+        return rc;
+    }
+    pool->counter_valid = pool->measure && pool->generation == generation;
+    pool->generation = generation;
+    pool->counter = *counter;
+    return 0;
+}
+
+/** Wake up the filler thread, whether it waits on cond or watches.
+ *
+ * @param[in] pool The pool, with lock held.
+ */
+static void
+pool_wake(TPM2TOTP_POOL *pool)
+{
+    pthread_cond_signal(&pool->cond);
+    if (pool->measure && write(pool->wake[1], "", 1) < 0) {
+        /* The pipe is full, so the filler wakes up anyway */
+    }
+}
+
+/** Wait for new measurements and discard the keys they made stale.
+ *
+ * A full pool only issues TPM commands after the kernel measured something.
+ * @param[in] pool The pool.
+ * @param[in] measure The measurements of the pool.
+ */
+static void
+pool_watch(TPM2TOTP_POOL *pool, MEASURE *measure)
+{
+    struct pollfd fds[2] = {
+        { .fd = measure_fd(measure), .events = POLLIN },
+        { .fd = pool->wake[0], .events = POLLIN },
+    };
+    char buf[64];
+    uint32_t counter;
+    size_t kept = 0;
+
+    while (poll(fds, 2, POOL_MEASURE_INTERVAL) < 0 && errno == EINTR);
+    while (read(pool->wake[0], buf, sizeof(buf)) > 0);
+
+    pthread_mutex_lock(&pool->tpm);
+    if (pool_counter(pool, &counter) == 0) {
+        pthread_mutex_lock(&pool->lock);
+        for (size_t i = 0; i < pool->count; i++) {
+            if (pool->entries[i].counter == counter) {
+                pool->entries[kept++] = pool->entries[i];
+            } else {
+                entry_free(&pool->entries[i]);
+                metrics_count(METRICS_POOL_DISCARDED);
+            }
+        }
+        pool->count = kept;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->tpm);
+}
+
+/** Create a key for the pool.
+ *
+ * The key is only usable if no PCR changed while it was created, i.e. the
+ * counter is the same before and after.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+static int
+pool_create(TPM2TOTP_POOL *pool, POOL_ENTRY *entry)
+{
+    uint32_t after;
+    int rc;
+
+    pthread_mutex_lock(&pool->tpm);
+    rc = pool_counter(pool, &entry->counter);
+    if (rc == 0)
+        rc = tpm2totp_context_generateKey(pool->context, pool->pcrs,
+                                          pool->banks, pool->password,
+                                          &entry->secret, &entry->secret_size,
+                                          &entry->keyBlob,
+                                          &entry->keyBlob_size);
+    if (rc == 0) {
+        rc = pool_counter(pool, &after);
+        if (rc != 0 || after != entry->counter) {
+            entry_free(entry);
+            rc = -1;
+        }
+    }
+    pthread_mutex_unlock(&pool->tpm);
+    return rc;
+}
+
+/** Keep the pool filled until it is freed. */
+static void *
+pool_filler(void *arg)
+{
+    TPM2TOTP_POOL *pool = arg;
+    POOL_ENTRY entry;
+    MEASURE *measure;
+    struct timespec retry;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop) {
+        if (pool->count == pool->size && !pool->measure) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+            continue;
+        }
+        if (pool->count == pool->size) {
+            /* Set once and freed after the thread is joined */
+            measure = pool->measure;
+            pthread_mutex_unlock(&pool->lock);
+            pool_watch(pool, measure);
+            pthread_mutex_lock(&pool->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        memset(&entry, 0, sizeof(entry));
+        if (pool_create(pool, &entry) != 0) {
+            pthread_mutex_lock(&pool->lock);
+            clock_gettime(CLOCK_REALTIME, &retry);
+            retry.tv_sec += POOL_RETRY;
+            while (!pool->stop && pthread_cond_timedwait(&pool->cond,
+                        &pool->lock, &retry) != ETIMEDOUT);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->count < pool->size)
+            pool->entries[pool->count++] = entry;
+        else
+            entry_free(&entry);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/** Start a pool of keys created in the background.
+ *
+ * A thread keeps up to size keys ready for tpm2totp_pool_generateKey_nv(). The
+ * pool uses the TPM from this thread while it exists, so the TCTI context must
+ * only be used through the pool until tpm2totp_pool_free().
+ *
+ * @param[in] pcrs PCRs the keys should be sealed against.
+ * @param[in] banks PCR banks the keys should be sealed against.
+ * @param[in] password Optional password to recover or reseal the secrets.
+ * @param[in] size Number of keys to keep ready.
+ * @param[in] tcti_context Optional TCTI context to select the TPM.
+ * @param[out] pool The pool.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+int
+tpm2totp_pool_new(uint32_t pcrs, uint32_t banks, const char *password,
+                  size_t size, TSS2_TCTI_CONTEXT *tcti_context,
+                  TPM2TOTP_POOL **pool)
+{
+    TPM2TOTP_POOL *p;
+    int rc;
+
+    if (pool == NULL || size == 0) {
+        return -1;
+    }
+
+    if (pcrs == 0) pcrs = DEFAULT_PCRS;
+    if (banks == 0) banks = DEFAULT_BANKS;
+
+    if (pcrs & POOL_NOINCREMENT_PCRS) {
+        dbg("PCRs 16 and 23 cannot be used with a key pool");
+        return -1;
+    }
+
+    p = calloc(1, sizeof(*p));
+    if (!p)
+        return -1;
+    p->entries = calloc(size, sizeof(*p->entries));
+    if (password)
+        p->password = strdup(password);
+    if (!p->entries || (password && !p->password)) {
+        free(p->entries);
+        free(p->password);
+        free(p);
+        return -1;
+    }
+    if (pipe(p->wake) != 0) {
+        free(p->entries);
+        free(p->password);
+        free(p);
+        return -1;
+    }
+    fcntl(p->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(p->wake[1], F_SETFL, O_NONBLOCK);
+    rc = tpm2totp_context_new(tcti_context, &p->context);
+    if (rc != 0) {
+        close(p->wake[0]);
+        close(p->wake[1]);
+        free(p->entries);
+        free(p->password);
+        free(p);
+        return rc;
+    }
+    p->pcrs = pcrs;
+    p->banks = banks;
+    p->size = size;
+    pthread_mutex_init(&p->tpm, NULL);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    if (pthread_create(&p->filler, NULL, pool_filler, p) != 0) {
+        pthread_cond_destroy(&p->cond);
+        pthread_mutex_destroy(&p->lock);
+        pthread_mutex_destroy(&p->tpm);
+        tpm2totp_context_free(p->context);
+        close(p->wake[0]);
+        close(p->wake[1]);
+        free(p->entries);
+        free(p->password);
+        free(p);
+        return -1;
+    }
+
+    *pool = p;
+    return 0;
+}
+
+/** Number of keys that are ready in the pool.
+ *
+ * @param[in] pool The pool.
+ * @retval Number of keys.
+ */
+size_t
+tpm2totp_pool_count(TPM2TOTP_POOL *pool)
+{
+    size_t count;
+
+    pthread_mutex_lock(&pool->lock);
+    count = pool->count;
+    pthread_mutex_unlock(&pool->lock);
+    return count;
+}
+
+/** Take a key from the pool.
+ *
+ * All keys created before the last PCR change are discarded.
+ * @retval 0 on success.
+ * @retval -1 if no current key is ready.
+ */
+static int
+pool_take(TPM2TOTP_POOL *pool, uint32_t counter, POOL_ENTRY *entry)
+{
+    int rc = -1;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count > 0) {
+        *entry = pool->entries[--pool->count];
+        if (entry->counter == counter) {
+            rc = 0;
+            break;
+        }
+        entry_free(entry);
+        metrics_count(METRICS_POOL_DISCARDED);
+    }
+    pool_wake(pool);
+    pthread_mutex_unlock(&pool->lock);
+    return rc;
+}
+
+/** Generate a key from the pool and store it in a NV index.
+ *
+ * A ready key is used if the PCRs did not change since it was created; only
+ * the NV index is written then. Otherwise the key is created right away.
+ *
+ * @param[in] pool The pool.
+ * @param[in] nv NV index to store the key.
+ * @param[out] secret Generated secret.
+ * @param[out] secret_size Size of the secret.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+static int
+pool_generateKey_nv(TPM2TOTP_POOL *pool, uint32_t nv,
+                    uint8_t **secret, size_t *secret_size)
+{
+    POOL_ENTRY entry = { .secret = NULL };
+    uint32_t counter;
+    int rc;
+
+    if (pool == NULL || secret == NULL || secret_size == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->tpm);
+
+    rc = pool_counter(pool, &counter);
+    if (rc != 0)
+        goto out;
+
+    if (pool_take(pool, counter, &entry) == 0) {
+        metrics_count(METRICS_CACHE_HIT);
+    } else {
+        metrics_count(METRICS_CACHE_MISS);
+        rc = tpm2totp_context_generateKey(pool->context, pool->pcrs,
+                                          pool->banks, pool->password,
+                                          &entry.secret, &entry.secret_size,
+                                          &entry.keyBlob, &entry.keyBlob_size);
+        if (rc != 0)
+            goto out;
+    }
+
+    rc = tpm2totp_context_storeKey_nv(pool->context, entry.keyBlob,
+                                      entry.keyBlob_size, nv);
+    if (rc != 0) {
+        entry_free(&entry);
+        goto out;
+    }
+
+    *secret = entry.secret;
+    *secret_size = entry.secret_size;
+    free(entry.keyBlob);
+
+out:
+    pthread_mutex_unlock(&pool->tpm);
+    return rc;
+}
+
+int
+tpm2totp_pool_generateKey_nv(TPM2TOTP_POOL *pool, uint32_t nv,
+                             uint8_t **secret, size_t *secret_size)
+{
+    uint64_t start = metrics_now();
+    int rc = pool_generateKey_nv(pool, nv, secret, secret_size);
+
+    metrics_op(METRICS_OP_GENERATE_POOL, start, rc);
+    return rc;
+}
+
+/** Watch the kernel's measurements instead of asking the TPM for changes.
+ *
+ * By default, every key taken from the pool costs a read of the TPM's PCR
+ * update counter to find out whether the PCRs changed since the key was
+ * created. With measurements, the counter is only read after the IMA
+ * measurement count or the size of the firmware's event log changed, and
+ * keys made stale by a change are replaced in the background right away.
+ * PCRs extended by other means, e.g. by user space, are only noticed with
+ * the next measurement. The measurements can only be set once.
+ *
+ * @param[in] pool The pool.
+ * @param[in] imaCount The IMA measurement count, "" for none or NULL for the
+ *            file in securityfs.
+ * @param[in] eventlog The firmware's binary event log, "" for none or NULL
+ *            for the file in securityfs.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+int
+tpm2totp_pool_setMeasurements(TPM2TOTP_POOL *pool, const char *imaCount,
+                              const char *eventlog)
+{
+    MEASURE *measure;
+
+    if (pool == NULL || pool->measure != NULL) {
+        return -1;
+    }
+    if (measure_new(imaCount, eventlog, &measure) != 0)
+        return -1;
+
+    pthread_mutex_lock(&pool->tpm);
+    pthread_mutex_lock(&pool->lock);
+    pool->measure = measure;
+    pool->counter_valid = 0;
+    pool_wake(pool);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->tpm);
+    return 0;
+}
+
+/** Stop the pool and discard its keys.
+ *
+ * A key that is being created is finished first.
+ * @param[in] pool The pool.
+ */
+void
+tpm2totp_pool_free(TPM2TOTP_POOL *pool)
+{
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pool_wake(pool);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_join(pool->filler, NULL);
+
+    for (size_t i = 0; i < pool->count; i++)
+        entry_free(&pool->entries[i]);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->tpm);
+    tpm2totp_context_free(pool->context);
+    measure_free(pool->measure);
+    close(pool->wake[0]);
+    close(pool->wake[1]);
+    free(pool->entries);
+    if (pool->password)
+        context_wipe(pool->password, strlen(pool->password));
+    free(pool->password);
+    free(pool);
+}
@@ -0,0 +1,233 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <tpm2-totp.h>
+#include "metrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The queue file starts with the next ticket to hand out and the ticket
+   being served. Every ticket in the queue holds a lock on a byte of its own
+   further on in the file, such that tickets of processes that died or gave
+   up are skipped. The locks are open file description locks, which belong
+   to the open file, so that threads queue like processes and every lock is
+   released when the file is closed, in the end by the kernel. */
+
+/* Queue file of the processes sharing a TPM without a resource manager */
+#define DEFAULT_QUEUE "/run/tpm2-totp.lock"
+
+#define QUEUE_HEADER 16
+#define QUEUE_SLOTS_BASE 4096
+#define QUEUE_SLOTS (1 << 20)
+
+/* Milliseconds between checks for tickets abandoned without a write */
+#define QUEUE_CHECK_INTERVAL 50
+
+struct TPM2TOTP_QUEUE {
+    int fd;
+    uint64_t ticket;
+};
+
+/** Lock or unlock a range of the queue file.
+ *
+ * @param[in] fd The queue file.
+ * @param[in] type F_WRLCK or F_UNLCK.
+ * @param[in] start First byte of the range.
+ * @param[in] len Length of the range.
+ * @param[in] wait Wait for a conflicting lock to go away.
+ * @retval 0 on success.
+ * @retval -1 on failure, with errno set.
+ */
+static int
+queue_lock(int fd, short type, off_t start, off_t len, int wait)
+{
+    struct flock fl = { .l_type = type, .l_whence = SEEK_SET,
+                        .l_start = start, .l_len = len };
+    int rc;
+
+    do {
+        rc = fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+    } while (rc != 0 && errno == EINTR);
+    return rc;
+}
+
+/** Check whether a ticket is still held by anyone.
+ *
+ * @param[in] fd The queue file.
+ * @param[in] ticket The ticket.
+ * @retval 1 if the ticket's byte is locked.
+ * @retval 0 if it is not, or cannot be checked.
+ */
+static int
+queue_held(int fd, uint64_t ticket)
+{
+    struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET,
+                        .l_start = QUEUE_SLOTS_BASE + ticket % QUEUE_SLOTS,
+                        .l_len = 1 };
+
+    if (fcntl(fd, F_OFD_GETLK, &fl) != 0)
+        return 0;
+    return fl.l_type != F_UNLCK;
+}
+
+/** Read the ticket counters, zero for a new file. */
+static void
+queue_read(int fd, uint64_t counters[2])
+{
+    if (pread(fd, counters, QUEUE_HEADER, 0) != QUEUE_HEADER)
+        counters[0] = counters[1] = 0;
+}
+
+/** Write the ticket counters. */
+static int
+queue_write(int fd, const uint64_t counters[2])
+{
+    return pwrite(fd, counters, QUEUE_HEADER, 0) == QUEUE_HEADER ? 0 : -1;
+}
+
+/** Wait for the TPM behind the other processes that use a queue file.
+ *
+ * Processes that open the same TPM device without a resource manager may
+ * each line up in a queue file and use the TPM in the order in which they
+ * arrived, instead of retrying to open the device until it is not busy. The
+ * TPM has to be opened after entering the queue and closed before leaving
+ * it. Processes that end or give up without leaving are skipped.
+ *
+ * @param[in] path The queue file, created if missing; NULL for
+ *            /run/tpm2-totp.lock.
+ * @param[in] timeout_ms Milliseconds to wait at most, -1 for no limit.
+ * @param[out] queue The place in the queue, to be left with
+ *             tpm2totp_queue_leave().
+ * @retval 0 on success.
+ * @retval -1 on failure, with errno ETIMEDOUT if the wait timed out.
+ */
+int
+tpm2totp_queue_enter(const char *path, int timeout_ms, TPM2TOTP_QUEUE **queue)
+{
+    uint64_t start = metrics_now(), deadline, now, counters[2], serving;
+    struct pollfd pfd = { .fd = -1, .events = POLLIN };
+    char buf[256];
+    int fd, wait_ms, err;
+    TPM2TOTP_QUEUE *q;
+
+    if (!queue) {
+        errno = EINVAL;
+        return -1;
+    }
+    deadline = start + (uint64_t)timeout_ms * 1000000;
+
+    fd = open(path ? path : DEFAULT_QUEUE, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        goto error;
+    q = calloc(1, sizeof(*q));
+    if (!q) {
+        close(fd);
+        goto error;
+    }
+    q->fd = fd;
+
+    /* Take a ticket and mark it as held in one go */
+    if (queue_lock(fd, F_WRLCK, 0, QUEUE_HEADER, 1) != 0)
+        goto error_free;
+    queue_read(fd, counters);
+    q->ticket = counters[0]++;
+    if (queue_write(fd, counters) != 0 ||
+        queue_lock(fd, F_WRLCK, QUEUE_SLOTS_BASE + q->ticket % QUEUE_SLOTS, 1,
+                   0) != 0) {
+        queue_lock(fd, F_UNLCK, 0, QUEUE_HEADER, 0);
+        goto error_free;
+    }
+    queue_lock(fd, F_UNLCK, 0, QUEUE_HEADER, 0);
+
+    /* Every write to the counters may be the turn of this ticket */
+    pfd.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (pfd.fd >= 0 && inotify_add_watch(pfd.fd, path ? path : DEFAULT_QUEUE,
+                                         IN_MODIFY) < 0) {
+        close(pfd.fd);
+        pfd.fd = -1;
+    }
+
+    while (1) {
+        if (queue_lock(fd, F_WRLCK, 0, QUEUE_HEADER, 1) != 0)
+            goto error_free;
+        queue_read(fd, counters);
+        serving = counters[1];
+        while (counters[1] != q->ticket && !queue_held(fd, counters[1]))
+            counters[1]++;
+        if (counters[1] != serving)
+            queue_write(fd, counters);
+        queue_lock(fd, F_UNLCK, 0, QUEUE_HEADER, 0);
+        if (counters[1] == q->ticket)
+            break;
+
+        now = metrics_now();
+        if (timeout_ms >= 0 && now >= deadline) {
+            errno = ETIMEDOUT;
+            goto error_free;
+        }
+        wait_ms = QUEUE_CHECK_INTERVAL;
+        if (timeout_ms >= 0 && (deadline - now) / 1000000 < (uint64_t)wait_ms)
+            wait_ms = (deadline - now) / 1000000 + 1;
+        if (pfd.fd < 0 || poll(&pfd, 1, wait_ms) < 0) {
+            struct timespec tick = { .tv_sec = 0,
+                                     .tv_nsec = wait_ms * 1000000L };
+            nanosleep(&tick, NULL);
+        }
+        if (pfd.fd >= 0)
+            while (read(pfd.fd, buf, sizeof(buf)) > 0);
+    }
+
+    if (pfd.fd >= 0)
+        close(pfd.fd);
+    *queue = q;
+    metrics_op(METRICS_OP_QUEUE, start, 0);
+    return 0;
+
+error_free:
+    err = errno;
+    if (pfd.fd >= 0)
+        close(pfd.fd);
+    /* Closing the file gives up the ticket */
+    close(q->fd);
+    free(q);
+    errno = err;
+error:
+    metrics_op(METRICS_OP_QUEUE, start, -1);
+    return -1;
+}
+
+/** Leave the queue and let the next process use the TPM.
+ *
+ * @param[in] queue The place in the queue or NULL.
+ */
+void
+tpm2totp_queue_leave(TPM2TOTP_QUEUE *queue)
+{
+    uint64_t counters[2];
+
+    if (!queue)
+        return;
+    if (queue_lock(queue->fd, F_WRLCK, 0, QUEUE_HEADER, 1) == 0) {
+        queue_read(queue->fd, counters);
+        if (counters[1] == queue->ticket) {
+            counters[1]++;
+            queue_write(queue->fd, counters);
+        }
+        queue_lock(queue->fd, F_UNLCK, 0, QUEUE_HEADER, 0);
+    }
+    /* Without the lock, the ticket is skipped by the next one anyway */
+    close(queue->fd);
+    free(queue);
+}
@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+/* SHA-1 compression kernel template, included by sha1mb.c once per
+ * instruction set. The includer defines
+ *   KERNEL      name of the function
+ *   KERNEL_ATTR function attributes (e.g. the target instruction set)
+ *   VEC         lane vector type (plain uint32_t for the scalar kernel)
+ *   VEC_LANES   number of lanes in VEC
+ * The GCC vector extensions make the same code compile to SSE2 or AVX2. */
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define LOAD(v, p) memcpy(&(v), (p), sizeof(VEC))
+#define STORE(p, v) memcpy((p), &(v), sizeof(VEC))
+
+#define SCHEDULE(t) \
+    (w[(t) & 15] = ROL(w[((t) - 3) & 15] ^ w[((t) - 8) & 15] ^ \
+                       w[((t) - 14) & 15] ^ w[(t) & 15], 1))
+
+#define ROUND(f, k, wt) do { \
+        tmp = ROL(a, 5) + (f) + e + (k) + (wt); \
+        e = d; d = c; c = ROL(b, 30); b = a; a = tmp; \
+    } while (0)
+
+#define F1 (d ^ (b & (c ^ d)))
+#define F2 (b ^ c ^ d)
+#define F3 ((b & c) | (d & (b | c)))
+
+static void KERNEL_ATTR
+KERNEL(sha1mb_state state, const sha1mb_block block)
+{
+    VEC a, b, c, d, e, tmp, w[16];
+    VEC h0, h1, h2, h3, h4;
+    size_t lane;
+    int t;
+
+    for (lane = 0; lane < SHA1MB_LANES; lane += VEC_LANES) {
+        LOAD(h0, &state[0][lane]);
+        LOAD(h1, &state[1][lane]);
+        LOAD(h2, &state[2][lane]);
+        LOAD(h3, &state[3][lane]);
+        LOAD(h4, &state[4][lane]);
+        for (t = 0; t < 16; t++)
+            LOAD(w[t], &block[t][lane]);
+
+        a = h0; b = h1; c = h2; d = h3; e = h4;
+
+        for (t = 0; t < 16; t++)
+            ROUND(F1, 0x5a827999, w[t]);
+        for (; t < 20; t++)
+            ROUND(F1, 0x5a827999, SCHEDULE(t));
+        for (; t < 40; t++)
+            ROUND(F2, 0x6ed9eba1, SCHEDULE(t));
+        for (; t < 60; t++)
+            ROUND(F3, 0x8f1bbcdc, SCHEDULE(t));
+        for (; t < 80; t++)
+            ROUND(F2, 0xca62c1d6, SCHEDULE(t));
+
+        h0 += a; h1 += b; h2 += c; h3 += d; h4 += e;
+
+        STORE(&state[0][lane], h0);
+        STORE(&state[1][lane], h1);
+        STORE(&state[2][lane], h2);
+        STORE(&state[3][lane], h3);
+        STORE(&state[4][lane], h4);
+    }
+}
+
+#undef F1
+#undef F2
+#undef F3
+#undef ROUND
+#undef SCHEDULE
+#undef STORE
+#undef LOAD
+#undef ROL
@@ -0,0 +1,141 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#include "sha1mb.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA1MB_X86 1
+#endif
+
+const uint32_t sha1mb_iv[5] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+#define KERNEL sha1mb_compress_scalar
+#define KERNEL_ATTR
+#define VEC uint32_t
+#define VEC_LANES 1
+#include "sha1mb-kernel.h"
+#undef VEC_LANES
+#undef VEC
+#undef KERNEL_ATTR
+#undef KERNEL
+
+#ifdef SHA1MB_X86
+typedef uint32_t sha1mb_v4 __attribute__((vector_size(16)));
+typedef uint32_t sha1mb_v8 __attribute__((vector_size(32)));
+
+#define KERNEL sha1mb_compress_sse2
+#define KERNEL_ATTR __attribute__((target("sse2")))
+#define VEC sha1mb_v4
+#define VEC_LANES 4
+#include "sha1mb-kernel.h"
+#undef VEC_LANES
+#undef VEC
+#undef KERNEL_ATTR
+#undef KERNEL
+
+#define KERNEL sha1mb_compress_avx2
+#define KERNEL_ATTR __attribute__((target("avx2")))
+#define VEC sha1mb_v8
+#define VEC_LANES 8
+#include "sha1mb-kernel.h"
+#undef VEC_LANES
+#undef VEC
+#undef KERNEL_ATTR
+#undef KERNEL
+#endif /* SHA1MB_X86 */
+
+typedef void (*sha1mb_kernel)(sha1mb_state, const sha1mb_block);
+
+static const struct {
+    const char *name;
+    sha1mb_kernel fn;
+} kernels[] = {
+#ifdef SHA1MB_X86
+    { "avx2", sha1mb_compress_avx2 },
+    { "sse2", sha1mb_compress_sse2 },
+#endif
+    { "scalar", sha1mb_compress_scalar },
+};
+
+/* Concurrent first calls from several threads all pick the same kernel */
+static sha1mb_kernel kernel = NULL;
+
+static int
+supported(const char *name)
+{
+#ifdef SHA1MB_X86
+    __builtin_cpu_init();
+    if (!strcmp(name, "avx2"))
+        return __builtin_cpu_supports("avx2");
+    if (!strcmp(name, "sse2"))
+        return __builtin_cpu_supports("sse2");
+#endif
+    return !strcmp(name, "scalar");
+}
+
+int
+sha1mb_use(const char *impl)
+{
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (impl && strcmp(impl, kernels[i].name))
+            continue;
+        if (!supported(kernels[i].name))
+            continue;
+        __atomic_store_n(&kernel, kernels[i].fn, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return -1;
+}
+
+void
+sha1mb_compress(sha1mb_state state, const sha1mb_block block)
+{
+    sha1mb_kernel fn = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
+
+    if (!fn) {
+        sha1mb_use(NULL);
+        fn = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
+    }
+    fn(state, block);
+}
+
+void
+sha1mb_digest(const uint8_t *data, size_t size, uint8_t digest[20])
+{
+    sha1mb_state state;
+    sha1mb_block block;
+    uint8_t tail[128] = { 0 };
+    size_t rest = size % 64, tail_size = rest < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t)size * 8;
+
+    /* The unused lanes are compressed as well, so they start defined */
+    memset(state, 0, sizeof(state));
+    memset(block, 0, sizeof(block));
+    for (int i = 0; i < 5; i++)
+        state[i][0] = sha1mb_iv[i];
+
+    memcpy(&tail[0], &data[size - rest], rest);
+    tail[rest] = 0x80;
+    for (int i = 0; i < 8; i++)
+        tail[tail_size - 1 - i] = bits >> (8 * i);
+
+    /* Only lane 0 carries data; the other lanes compress zeros */
+    for (size_t off = 0; off < size - rest + tail_size; off += 64) {
+        const uint8_t *p = off < size - rest ? &data[off] :
+                                               &tail[off - (size - rest)];
+        for (int t = 0; t < 16; t++)
+            block[t][0] = (uint32_t)p[4*t] << 24 | (uint32_t)p[4*t+1] << 16 |
+                          (uint32_t)p[4*t+2] << 8 | p[4*t+3];
+        sha1mb_compress(state, block);
+    }
+
+    for (int i = 0; i < 20; i++)
+        digest[i] = state[i / 4][0] >> (24 - 8 * (i % 4));
+}
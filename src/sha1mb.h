@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#ifndef SHA1MB_H
+#define SHA1MB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Number of independent SHA-1 computations per call. The state and the
+ * message block are stored lane-interleaved ("structure of arrays"), i.e.
+ * state[i][lane] is word i of the hash state of the given lane. */
+#define SHA1MB_LANES 8
+
+typedef uint32_t sha1mb_state[5][SHA1MB_LANES];
+typedef uint32_t sha1mb_block[16][SHA1MB_LANES];
+
+extern const uint32_t sha1mb_iv[5];
+
+/** Compress one message block per lane into the lane's state.
+ *
+ * The block words are expected in host order, i.e. already converted from
+ * the big-endian message bytes.
+ */
+void
+sha1mb_compress(sha1mb_state state, const sha1mb_block block);
+
+/** Select a compression kernel.
+ *
+ * @param[in] impl "scalar", "sse2", "avx2" or NULL for the fastest one
+ *            supported by the CPU.
+ * @retval 0 on success.
+ * @retval -1 if the kernel is not supported on this CPU.
+ */
+int
+sha1mb_use(const char *impl);
+
+/** Plain SHA-1 of a message, used for over-long HMAC keys. */
+void
+sha1mb_digest(const uint8_t *data, size_t size, uint8_t digest[20]);
+
+#endif /* SHA1MB_H */
@@ -12,10 +12,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <qrencode.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <tss2/tss2_tctildr.h>
+
+#include "audit.h"
+#include "plymouth.h"
+#include "policy.h"
 
 #define VERB(...) if (opt.verbose) fprintf(stderr, __VA_ARGS__)
 #define ERR(...) fprintf(stderr, __VA_ARGS__)
@@ -23,39 +35,104 @@
 #define chkrc(rc, cmd) if (rc != TSS2_RC_SUCCESS) {\
     ERR("ERROR in %s (%s:%i): 0x%08x\n", __func__, __FILE__, __LINE__, rc); cmd; }
 
+/* Keys prepared during boot, which does not survive a reboot like the TPM's
+   saved contexts */
+#define RUNDIR "/run/tpm2-totp"
+
 char *help =
-    "Usage: [options] {generate|calculate|reseal|recover|clean}\n"
+    "Usage: [options] {generate|calculate|watch|reseal|recover|clean|audit FILE|\n"
+    "                  parent FILE|wrap PARENT PCRVALUES FILE|import FILE|batch|\n"
+    "                  prepare|list|policy FILE}\n"
     "Options:\n"
     "    -h, --help      print help\n"
-    "    -b, --banks     Selected PCR banks (default: SHA1,SHA256)\n"
+    "    -b, --banks     Selected PCR banks (default: SHA1,SHA256); auto picks\n"
+    "                    the strongest active one\n"
+    "    -e, --events    Check the PCRs for the pool only after the kernel\n"
+    "                    measured something (batch with --pool only)\n"
+    "    -j, --jobs      Number of worker threads (audit and policy, default:\n"
+    "                    CPUs; multiple TPMs, default: one per TPM)\n"
+    "    -k, --pool      Number of keys to create ahead in the background for\n"
+    "                    generate (batch only, default: 0)\n"
+    "    -m, --metrics   File to export metrics to (watch only)\n"
+    "    -M, --metrics-socket\n"
+    "                    Unix socket to serve metrics on (watch only)\n"
+    "    -n, --nv-password\n"
+    "                    Password of the NV indices (default: None)\n"
     "    -N, --nvindex   TPM NV index to store data (default: 0x018094AF)\n"
+    "                    generate, calculate, prepare and reseal also take\n"
+    "                    a list, e.g. 0x1800000-0x180000F,...\n"
+    "    -o, --owner-password\n"
+    "                    Password of the owner hierarchy (default: None)\n"
     "    -P, --password  Password for recovery/resealing (default: None)\n"
     "    -p, --pcrs      Selected PCR registers (default: 0,2,4,6)\n"
+    "    -q, --queue     Seconds to wait at most for other tpm2-totp processes\n"
+    "                    using the TPM, in the order they arrived, for TPMs\n"
+    "                    without resource manager (default: no waiting)\n"
+    "    -r, --rundir    Directory of the keys prepared for calculate\n"
+    "                    (default: " RUNDIR ")\n"
     "    -t, --time      Show the time used for calculation\n"
+    "    -T, --tcti      TCTI configuration of the TPM, e.g. device:/dev/tpmrm0;\n"
+    "                    repeat to run the command on several TPMs in parallel\n"
     "    -v, --verbose   print verbose messages\n"
+    "    -w, --window    Time steps to accept before and after the observed\n"
+    "                    time (audit only, default: 2880)\n"
+    "    -y, --plymouth  Display the codes with plymouth instead of printing\n"
+    "                    them (watch only)\n"
     "\n";
 
-static const char *optstr = "hb:N:P:p:tv";
+static const char *optstr = "hb:ej:k:m:M:n:N:o:P:p:q:r:tT:vw:y";
 
 static const struct option long_options[] = {
     {"help",     no_argument,       0, 'h'},
     {"banks",    required_argument, 0, 'b'},
+    {"events",   no_argument,       0, 'e'},
+    {"jobs",     required_argument, 0, 'j'},
+    {"pool",     required_argument, 0, 'k'},
+    {"metrics",  required_argument, 0, 'm'},
+    {"metrics-socket", required_argument, 0, 'M'},
+    {"nv-password", required_argument, 0, 'n'},
     {"nvindex",  required_argument, 0, 'N'},
+    {"owner-password", required_argument, 0, 'o'},
     {"password", required_argument, 0, 'P'},
     {"pcrs",     required_argument, 0, 'p'},
+    {"queue",    required_argument, 0, 'q'},
+    {"rundir",   required_argument, 0, 'r'},
     {"time",     no_argument,       0, 't'},
+    {"tcti",     required_argument, 0, 'T'},
     {"verbose",  no_argument,       0, 'v'},
+    {"window",   required_argument, 0, 'w'},
+    {"plymouth", no_argument,       0, 'y'},
     {0,          0,                 0,  0 }
 };
 
 static struct opt {
-    enum { CMD_NONE, CMD_GENERATE, CMD_CALCULATE, CMD_RESEAL, CMD_RECOVER, CMD_CLEAN } cmd;
+    enum { CMD_NONE, CMD_GENERATE, CMD_CALCULATE, CMD_WATCH, CMD_RESEAL,
+           CMD_RECOVER, CMD_CLEAN, CMD_AUDIT, CMD_PARENT, CMD_WRAP,
+           CMD_IMPORT, CMD_BATCH, CMD_PREPARE, CMD_LIST, CMD_POLICY } cmd;
     int banks;
+    char *file;
+    char *pcrfile;
+    char *outfile;
+    unsigned int jobs;
+    unsigned int pool;
+    int events;
+    char *metrics;
+    char *metrics_socket;
     int nvindex;
+    uint32_t *nvindices;
+    size_t nvcount;
+    char *nvpassword;
+    char *ownerpassword;
     char *password;
     int pcrs;
+    int queue;
+    char *rundir;
     int time;
+    char **tctis;
+    size_t tcticount;
     int verbose;
+    unsigned int window;
+    int plymouth;
 } opt;
 
 int
@@ -77,6 +154,8 @@ parse_banks(char *str, int *banks)
             *banks |= TPM2TOTP_BANK_SHA256;
         } else if (strcmp(token, "SHA384") == 0) {
             *banks |= TPM2TOTP_BANK_SHA384;
+        } else if (strcmp(token, "auto") == 0) {
+            *banks |= TPM2TOTP_BANK_AUTO;
         } else {
             return -1;
         }
@@ -114,48 +193,161 @@ parse_pcrs(char *str, int *pcrs)
     return 0;
 }
 
+#define NVINDICES_MAX 65536
+
+static int
+parse_nvindex(const char *str, uint32_t *nv)
+{
+    char *endptr;
+    unsigned long value;
+
+    errno = 0;
+    value = strtoul(str, &endptr, 0);
+    if (errno || endptr == str || *endptr != '\0' || value > UINT32_MAX)
+        return -1;
+    *nv = value;
+    return 0;
+}
+
+/** Parse a list of NV indices and ranges of NV indices.
+ *
+ * @param[in] str Comma separated indices or first-last ranges.
+ * @param[out] nvs The indices (callee-allocated).
+ * @param[out] count Number of indices.
+ * @retval 0 on success
+ * @retval -1 on failure
+ */
+int
+parse_nvindices(char *str, uint32_t **nvs, size_t *count)
+{
+    char *token, *last;
+    char *saveptr;
+    uint32_t first, end, *tmp;
+
+    *nvs = NULL;
+    *count = 0;
+
+    token = strtok_r(str, ",", &saveptr);
+    if (!token) {
+        return -1;
+    }
+    while (token) {
+        last = strchr(token, '-');
+        if (last)
+            *last++ = '\0';
+        if (parse_nvindex(token, &first) != 0 ||
+            parse_nvindex(last ? last : token, &end) != 0 || end < first ||
+            end - first >= NVINDICES_MAX - *count) {
+            free(*nvs);
+            return -1;
+        }
+        tmp = realloc(*nvs, (*count + end - first + 1) * sizeof(**nvs));
+        if (!tmp) {
+            free(*nvs);
+            return -1;
+        }
+        *nvs = tmp;
+        for (uint64_t nv = first; nv <= end; nv++)
+            (*nvs)[(*count)++] = nv;
+        token = strtok_r(NULL, ",", &saveptr);
+    }
+
+    return 0;
+}
+
 /** Parse and set command line options.
  *
  * This function parses the command line options and sets the appropriate values
- * in the opt struct.
+ * in the opt struct. It can be called again for the lines of a batch.
  * @param argc The argument count.
  * @param argv The arguments.
  * @retval 0 on success
  * @retval 1 on failure
+ * @retval -1 if the help was printed
  */
 int
 parse_opts(int argc, char **argv)
 {
     /* set the default values */
+    free(opt.nvindices);
+    free(opt.tctis);
     opt.cmd = CMD_NONE;
     opt.banks = 0;
+    opt.file = NULL;
+    opt.pcrfile = NULL;
+    opt.outfile = NULL;
+    opt.jobs = 0;
+    opt.pool = 0;
+    opt.events = 0;
+    opt.metrics = NULL;
+    opt.metrics_socket = NULL;
     opt.nvindex = 0;
+    opt.nvindices = NULL;
+    opt.nvcount = 0;
+    opt.nvpassword = NULL;
+    opt.ownerpassword = NULL;
     opt.password = NULL;
     opt.pcrs = 0;
+    opt.rundir = RUNDIR;
     opt.time = 0;
+    opt.tctis = NULL;
+    opt.tcticount = 0;
     opt.verbose = 0;
+    opt.window = 2880;
+    opt.plymouth = 0;
+    opt.queue = -1;
 
-    /* parse the options */
+    /* parse the options; 0 makes getopt start over for every batch line */
+    char **tctis;
     int c;
     int opt_idx = 0;
+    optind = 0;
     while (-1 != (c = getopt_long(argc, argv, optstr,
                                   long_options, &opt_idx))) {
         switch(c) {
         case 'h':
             printf("%s", help);
-            exit(0);
+            return -1;
         case 'b':
             if (parse_banks(optarg, &opt.banks) != 0) {
                 ERR("Error parsing banks.\n");
-                exit(1);
+                return 1;
+            }
+            break;
+        case 'e':
+            opt.events = 1;
+            break;
+        case 'j':
+            if (sscanf(optarg, "%u", &opt.jobs) != 1) {
+                ERR("Error parsing jobs.\n");
+                return 1;
+            }
+            break;
+        case 'k':
+            if (sscanf(optarg, "%u", &opt.pool) != 1) {
+                ERR("Error parsing pool.\n");
+                return 1;
             }
             break;
+        case 'm':
+            opt.metrics = optarg;
+            break;
+        case 'M':
+            opt.metrics_socket = optarg;
+            break;
+        case 'n':
+            opt.nvpassword = optarg;
+            break;
         case 'N':
-            if (sscanf(optarg, "0x%x", &opt.nvindex) != 1
-                && sscanf(optarg, "%i", &opt.nvindex) != 1) {
+            free(opt.nvindices);
+            if (parse_nvindices(optarg, &opt.nvindices, &opt.nvcount) != 0) {
                 ERR("Error parsing nvindex.\n");
-                exit(1);
+                return 1;
             }
+            opt.nvindex = opt.nvindices[0];
+            break;
+        case 'o':
+            opt.ownerpassword = optarg;
             break;
         case 'P':
             opt.password = optarg;
@@ -163,49 +355,196 @@ parse_opts(int argc, char **argv)
         case 'p':
             if (parse_pcrs(optarg, &opt.pcrs) != 0) {
                 ERR("Error parsing pcrs.\n");
-                exit(1);
+                return 1;
+            }
+            break;
+        case 'q':
+            if (sscanf(optarg, "%i", &opt.queue) != 1 || opt.queue < 0 ||
+                opt.queue > INT_MAX / 1000) {
+                ERR("Error parsing queue.\n");
+                return 1;
             }
             break;
+        case 'r':
+            opt.rundir = optarg;
+            break;
         case 't':
             opt.time = 1;
             break;
+        case 'T':
+            tctis = realloc(opt.tctis, (opt.tcticount + 1) * sizeof(*tctis));
+            if (!tctis) {
+                ERR("Out of memory.\n");
+                return 1;
+            }
+            opt.tctis = tctis;
+            opt.tctis[opt.tcticount++] = optarg;
+            break;
         case 'v':
             opt.verbose = 1;
             break;
+        case 'w':
+            if (sscanf(optarg, "%u", &opt.window) != 1) {
+                ERR("Error parsing window.\n");
+                return 1;
+            }
+            break;
+        case 'y':
+            opt.plymouth = 1;
+            break;
         default:
             ERR("Unknown option at index %i.\n\n", opt_idx);
             ERR("%s", help);
-            exit(1);
+            return 1;
         }
     }
 
     /* parse the non-option arguments */
     if (optind >= argc) {
-        ERR("Missing command: generate, calculate, reseal, recover, clean.\n\n");
+        ERR("Missing command: generate, calculate, watch, reseal, recover, clean, audit,\n"
+            "parent, wrap, import, batch, prepare, list, policy.\n\n");
         ERR("%s", help);
-        exit(1);
+        return 1;
     }
     if (!strcmp(argv[optind], "generate")) {
         opt.cmd = CMD_GENERATE;
     } else if (!strcmp(argv[optind], "calculate")) {
         opt.cmd = CMD_CALCULATE;
+    } else if (!strcmp(argv[optind], "watch")) {
+        opt.cmd = CMD_WATCH;
     } else if (!strcmp(argv[optind], "reseal")) {
         opt.cmd = CMD_RESEAL;
     } else if (!strcmp(argv[optind], "recover")) {
         opt.cmd = CMD_RECOVER;
     } else if (!strcmp(argv[optind], "clean")) {
         opt.cmd = CMD_CLEAN;
+    } else if (!strcmp(argv[optind], "audit")) {
+        opt.cmd = CMD_AUDIT;
+    } else if (!strcmp(argv[optind], "parent")) {
+        opt.cmd = CMD_PARENT;
+    } else if (!strcmp(argv[optind], "wrap")) {
+        opt.cmd = CMD_WRAP;
+    } else if (!strcmp(argv[optind], "import")) {
+        opt.cmd = CMD_IMPORT;
+    } else if (!strcmp(argv[optind], "batch")) {
+        opt.cmd = CMD_BATCH;
+    } else if (!strcmp(argv[optind], "prepare")) {
+        opt.cmd = CMD_PREPARE;
+    } else if (!strcmp(argv[optind], "list")) {
+        opt.cmd = CMD_LIST;
+    } else if (!strcmp(argv[optind], "policy")) {
+        opt.cmd = CMD_POLICY;
     } else {
-        ERR("Unknown command: generate, calculate, reseal, recover, clean.\n\n");
+        ERR("Unknown command: generate, calculate, watch, reseal, recover, clean, audit,\n"
+            "parent, wrap, import, batch, prepare, list, policy.\n\n");
         ERR("%s", help);
-        exit(1);
+        return 1;
     }        
     optind++;
 
+    if (opt.cmd == CMD_AUDIT) {
+        if (optind >= argc) {
+            ERR("Missing inventory file for audit.\n\n");
+            ERR("%s", help);
+            return 1;
+        }
+        opt.file = argv[optind++];
+    }
+
+    if (opt.cmd == CMD_POLICY) {
+        if (optind >= argc) {
+            ERR("Missing PCR values file for policy.\n\n");
+            ERR("%s", help);
+            return 1;
+        }
+        opt.file = argv[optind++];
+    }
+
+    if (opt.cmd == CMD_PARENT || opt.cmd == CMD_IMPORT) {
+        if (optind >= argc) {
+            ERR("Missing file for %s.\n\n", argv[optind - 1]);
+            ERR("%s", help);
+            return 1;
+        }
+        opt.file = argv[optind++];
+    }
+
+    if (opt.cmd == CMD_WRAP) {
+        if (optind + 3 > argc) {
+            ERR("Missing primary key, PCR values or output file for wrap.\n\n");
+            ERR("%s", help);
+            return 1;
+        }
+        opt.file = argv[optind++];
+        opt.pcrfile = argv[optind++];
+        opt.outfile = argv[optind++];
+    }
+
+    if (opt.nvcount > 1 && opt.cmd != CMD_GENERATE &&
+                           opt.cmd != CMD_CALCULATE &&
+                           opt.cmd != CMD_PREPARE &&
+                           opt.cmd != CMD_RESEAL) {
+        ERR("Only generate, calculate, prepare and reseal accept multiple NV\n"
+            "indices.\n\n");
+        ERR("%s", help);
+        return 1;
+    }
+
+    if (opt.pool && opt.cmd != CMD_BATCH) {
+        ERR("Only batch keeps a pool of keys.\n\n");
+        ERR("%s", help);
+        return 1;
+    }
+
+    if (opt.events && !opt.pool) {
+        ERR("Only the pool of keys follows the measurements.\n\n");
+        ERR("%s", help);
+        return 1;
+    }
+
+    if ((opt.banks & TPM2TOTP_BANK_AUTO) &&
+        (opt.cmd == CMD_WRAP || opt.cmd == CMD_POLICY)) {
+        ERR("The banks can only be chosen automatically on the TPM.\n\n");
+        ERR("%s", help);
+        return 1;
+    }
+
+#ifndef HAVE_CRYPTO
+    if (opt.cmd == CMD_WRAP || opt.cmd == CMD_POLICY) {
+        ERR("This build of tpm2-totp has no libcrypto for wrap and policy.\n");
+        return 1;
+    }
+#endif
+
+    /* The pool creates keys through a context of its own */
+    if (opt.pool && (opt.ownerpassword || opt.nvpassword)) {
+        ERR("The pool of keys cannot use owner or NV passwords.\n\n");
+        ERR("%s", help);
+        return 1;
+    }
+
+    if (opt.tcticount > 1 && (opt.cmd == CMD_WATCH || opt.cmd == CMD_AUDIT ||
+                              opt.cmd == CMD_PARENT || opt.cmd == CMD_WRAP ||
+                              opt.cmd == CMD_IMPORT || opt.cmd == CMD_BATCH ||
+                              opt.cmd == CMD_PREPARE ||
+                              opt.cmd == CMD_POLICY)) {
+        ERR("Only one TPM can be used for watch, parent, import, batch and prepare\n"
+            "and none for audit, wrap and policy.\n\n");
+        ERR("%s", help);
+        return 1;
+    }
+
+    if (opt.queue >= 0 && (opt.tcticount > 1 || opt.cmd == CMD_AUDIT ||
+                           opt.cmd == CMD_WRAP || opt.cmd == CMD_POLICY)) {
+        ERR("Only commands on a single TPM wait in the queue.\n\n");
+        ERR("%s", help);
+        return 1;
+    }
+
     if (optind < argc) {
         ERR("Unknown argument provided.\n\n");
         ERR("%s", help);
-        exit(1);
+        return 1;
     }
     return 0;
 }
@@ -252,7 +591,7 @@ qrencode(const char *url)
 {
     QRcode *qrcode = QRcode_encodeString(url, 0/*=version*/, QR_ECLEVEL_L,
                                          QR_MODE_8, 1/*=case*/);
-    if (!qrcode) { ERR("QRcode failed."); exit(1); }
+    if (!qrcode) { ERR("QRcode failed."); return NULL; }
 
     char *qrpic = malloc(/* Margins top / bot*/ 2 * (
                             (qrcode->width+2) * 2 - 2 + 
@@ -281,112 +620,1073 @@ qrencode(const char *url)
 }
 
 #define URL_PREFIX "otpauth://totp/TPM2-TOTP?secret="
+#define TIMESTEPSIZE 30
 
-/** Main function
+/** Print the otpauth URI of a key generated in a batch.
+ */
+static int
+print_uri(uint32_t nv, const uint8_t *secret, size_t secret_size,
+          void *userdata)
+{
+    FILE *out = userdata;
+    char *base32key = base32enc(secret, secret_size);
+
+    if (!base32key)
+        return -1;
+    fprintf(out, "0x%08" PRIx32 " " URL_PREFIX "%s\n", nv, base32key);
+    free(base32key);
+    return fflush(out) ? -1 : 0;
+}
+
+/** Print the NV index of a key with the PCRs and banks it is sealed to.
+ */
+static int
+print_key(uint32_t nv, uint32_t pcrs, uint32_t banks, void *userdata)
+{
+    FILE *out = userdata;
+    const char *sep = "";
+
+    fprintf(out, "0x%08" PRIx32 " pcrs=", nv);
+    for (int i = 0; i < 24; i++) {
+        if (pcrs & (1 << i)) {
+            fprintf(out, "%s%i", sep, i);
+            sep = ",";
+        }
+    }
+    fprintf(out, " banks=");
+    sep = "";
+    if (banks & TPM2TOTP_BANK_SHA1) {
+        fprintf(out, "SHA1");
+        sep = ",";
+    }
+    if (banks & TPM2TOTP_BANK_SHA256) {
+        fprintf(out, "%sSHA256", sep);
+        sep = ",";
+    }
+    if (banks & TPM2TOTP_BANK_SHA384)
+        fprintf(out, "%sSHA384", sep);
+    fprintf(out, "\n");
+    return fflush(out) ? -1 : 0;
+}
+
+/** Print the otpauth URI of a secret and its QR code.
+ */
+static int
+print_secret(const uint8_t *secret, size_t secret_size, FILE *out)
+{
+    char *base32key, *url, *qrpic;
+
+    base32key = base32enc(secret, secret_size);
+    url = calloc(1, strlen(base32key) + strlen(URL_PREFIX) + 1);
+    if (!url) {
+        free(base32key);
+        return -1;
+    }
+    sprintf(url, URL_PREFIX "%s", base32key);
+    free(base32key);
+
+    qrpic = qrencode(url);
+    if (!qrpic) {
+        free(url);
+        return -1;
+    }
+
+    fprintf(out, "%s\n", qrpic);
+    fprintf(out, "%s\n", url);
+    free(qrpic);
+    free(url);
+    return 0;
+}
+
+/** Read a whole file.
+ *
+ * @param[in] path File to read.
+ * @param[out] data Contents of the file (callee-allocated).
+ * @param[out] size Size of the contents.
+ * @retval 0 on success
+ * @retval -1 on failure
+ */
+static int
+read_file(const char *path, uint8_t **data, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    uint8_t *tmp;
+    size_t n;
+
+    *data = NULL;
+    *size = 0;
+    if (!f)
+        return -1;
+    do {
+        tmp = realloc(*data, *size + 4096);
+        if (!tmp) {
+            free(*data);
+            fclose(f);
+            return -1;
+        }
+        *data = tmp;
+        n = fread(&(*data)[*size], 1, 4096, f);
+        *size += n;
+    } while (n == 4096);
+    if (ferror(f)) {
+        free(*data);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+/** Write a whole file.
+ *
+ * @param[in] path File to write.
+ * @param[in] data Contents of the file.
+ * @param[in] size Size of the contents.
+ * @retval 0 on success
+ * @retval -1 on failure
+ */
+static int
+write_file(const char *path, const uint8_t *data, size_t size)
+{
+    FILE *f = fopen(path, "wb");
+
+    if (!f)
+        return -1;
+    if (fwrite(data, 1, size, f) != size) {
+        fclose(f);
+        return -1;
+    }
+    return fclose(f) ? -1 : 0;
+}
+
+/** Wrap a new secret for the TPM of a primary key in software.
  *
- * This function initializes OpenSSL and then calls the key generation
- * functions.
- * @param argc The argument count.
- * @param argv The arguments.
  * @retval 0 on success
  * @retval 1 on failure
  */
-int
-main(int argc, char **argv)
+static int
+wrap(void)
 {
-    if (parse_opts(argc, argv) != 0)
-        exit(1);
+    uint8_t *primary, *pcrValues, *secret, *importBlob;
+    size_t primary_size, pcrValues_size, secret_size, importBlob_size;
+    int rc;
+
+    if (read_file(opt.file, &primary, &primary_size) != 0) {
+        ERR("Error reading %s: %s\n", opt.file, strerror(errno));
+        return 1;
+    }
+    if (read_file(opt.pcrfile, &pcrValues, &pcrValues_size) != 0) {
+        ERR("Error reading %s: %s\n", opt.pcrfile, strerror(errno));
+        free(primary);
+        return 1;
+    }
+
+    rc = tpm2totp_wrapKey(opt.pcrs, opt.banks, pcrValues, pcrValues_size,
+                          opt.password, primary, primary_size,
+                          &secret, &secret_size,
+                          &importBlob, &importBlob_size);
+    free(primary);
+    free(pcrValues);
+    chkrc(rc, return 1);
+
+    rc = write_file(opt.outfile, importBlob, importBlob_size);
+    free(importBlob);
+    if (rc != 0) {
+        ERR("Error writing %s: %s\n", opt.outfile, strerror(errno));
+        free(secret);
+        return 1;
+    }
+
+    rc = print_secret(secret, secret_size, stdout);
+    free(secret);
+    return rc ? 1 : 0;
+}
+
+/** Compute the policy digests of a file of PCR value sets in software.
+ *
+ * @retval 0 on success
+ * @retval 1 on failure or if a set is invalid
+ */
+static int
+policy(void)
+{
+    POLICY_STATS stats;
+    FILE *in = stdin;
+    int rc;
+
+    if (strcmp(opt.file, "-") && !(in = fopen(opt.file, "r"))) {
+        ERR("Error reading %s: %s\n", opt.file, strerror(errno));
+        return 1;
+    }
+
+    rc = policy_stream(in, opt.pcrs, opt.banks, opt.jobs, stdout, &stats);
+    if (in != stdin)
+        fclose(in);
+    if (rc != 0 || fflush(stdout) != 0) {
+        ERR("Error computing policies of %s: %s\n", opt.file, strerror(errno));
+        return 1;
+    }
+    if (opt.verbose)
+        ERR("%zu records: %zu computed, %zu invalid\n", stats.records,
+            stats.computed, stats.invalid);
+    return stats.invalid ? 1 : 0;
+}
+
+/** Wait for the beginning of the next TOTP time step.
+ *
+ * Metrics requests arriving on the socket are answered while waiting.
+ * @param[in] fd Metrics socket or -1.
+ */
+static void
+wait_timestep(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    struct timespec ts;
+    time_t step;
+    int timeout;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    step = ts.tv_sec / TIMESTEPSIZE;
+    while (ts.tv_sec / TIMESTEPSIZE == step) {
+        timeout = (TIMESTEPSIZE - ts.tv_sec % TIMESTEPSIZE) * 1000
+                - ts.tv_nsec / 1000000;
+        if (poll(&pfd, 1, timeout) > 0)
+            tpm2totp_metrics_serve(fd);
+        clock_gettime(CLOCK_REALTIME, &ts);
+    }
+}
+
+/** Calculate and print the TOTP values of all NV indices given with -N.
+ *
+ * All keys are loaded from NV first and the values are calculated together,
+ * for the same time step, then printed with the NV index on one line each.
+ * @param[in] context Library context of the TPM.
+ * @param[in] out Stream for the output.
+ * @retval 0 on success
+ * @retval 1 on failure
+ */
+static int
+calculate_nvindices(TPM2TOTP_CONTEXT *context, FILE *out)
+{
+    int rc = 1;
+    uint8_t **keyBlobs;
+    size_t *keyBlob_sizes, i;
+    uint64_t *totps;
+    time_t now;
+    char timestr[100] = { 0, };
+
+    keyBlobs = calloc(opt.nvcount, sizeof(*keyBlobs));
+    keyBlob_sizes = calloc(opt.nvcount, sizeof(*keyBlob_sizes));
+    totps = calloc(opt.nvcount, sizeof(*totps));
+    if (!keyBlobs || !keyBlob_sizes || !totps) {
+        ERR("Out of memory\n");
+        goto out;
+    }
+
+    for (i = 0; i < opt.nvcount; i++) {
+        rc = tpm2totp_context_loadKey_nv(context, opt.nvindices[i],
+                                         &keyBlobs[i], &keyBlob_sizes[i]);
+        chkrc(rc, ERR("Loading NV index 0x%08" PRIx32 " failed\n",
+                      opt.nvindices[i]); rc = 1; goto out);
+    }
+
+    rc = tpm2totp_context_calculateMany(context, opt.nvcount,
+                                        (const uint8_t *const *)keyBlobs,
+                                        keyBlob_sizes, &now, totps);
+    chkrc(rc, rc = 1; goto out);
+    if (opt.time) {
+        rc = !strftime (timestr, sizeof(timestr)-1, "%Y-%m-%d %H:%M:%S: ",
+                        localtime (&now));
+        chkrc(rc, rc = 1; goto out);
+    }
+    for (i = 0; i < opt.nvcount; i++)
+        fprintf(out, "0x%08" PRIx32 " %s%06ld\n", opt.nvindices[i], timestr,
+                totps[i]);
+
+out:
+    if (keyBlobs)
+        for (i = 0; i < opt.nvcount; i++)
+            free(keyBlobs[i]);
+    free(keyBlobs);
+    free(keyBlob_sizes);
+    free(totps);
+    return rc;
+}
+
+/** Path of the prepared key of an NV index.
+ *
+ * @param[in] nv NV index as given with -N, 0 for the default.
+ * @param[out] path Buffer of PATH_MAX bytes for the path.
+ * @retval 0 on success
+ * @retval -1 if the path is too long
+ */
+static int
+prepared_path(uint32_t nv, char *path)
+{
+    int n = snprintf(path, PATH_MAX, "%s/0x%08" PRIx32, opt.rundir, nv);
+
+    return (n < 0 || n >= PATH_MAX) ? -1 : 0;
+}
+
+/** Remove the prepared key of an NV index whose key changed or was deleted.
+ *
+ * @param[in] nv NV index as given with -N, 0 for the default.
+ */
+static void
+forget_prepared(uint32_t nv)
+{
+    char path[PATH_MAX];
+
+    if (prepared_path(nv, path) == 0 && unlink(path) == 0)
+        VERB("Removed prepared key %s\n", path);
+}
+
+/** Prepare the keys of all NV indices given with -N for calculate.
+ *
+ * The prepared keys are written to files in the run directory, replacing
+ * older ones atomically, such that a concurrent calculate either finds the
+ * old or the new key.
+ * @param[in] context Library context of the TPM.
+ * @retval 0 on success
+ * @retval 1 on failure
+ */
+static int
+prepare_nvindices(TPM2TOTP_CONTEXT *context)
+{
+    uint32_t single = opt.nvindex;
+    const uint32_t *nvs = opt.nvcount ? opt.nvindices : &single;
+    size_t count = opt.nvcount ? opt.nvcount : 1;
+    char path[PATH_MAX], tmp[PATH_MAX + 4];
+    uint8_t *prepared;
+    size_t prepared_size;
+    ssize_t written;
+    int rc, fd;
+
+    if (mkdir(opt.rundir, 0700) != 0 && errno != EEXIST) {
+        ERR("Error creating %s: %s\n", opt.rundir, strerror(errno));
+        return 1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (prepared_path(nvs[i], path) != 0) {
+            ERR("Run directory path too long\n");
+            return 1;
+        }
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
 
+        rc = tpm2totp_context_prepareKey_nv(context, nvs[i],
+                                            &prepared, &prepared_size);
+        chkrc(rc, ERR("Preparing NV index 0x%08" PRIx32 " failed\n", nvs[i]);
+                  return 1);
+
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        written = fd < 0 ? -1 : write(fd, prepared, prepared_size);
+        free(prepared);
+        if (fd < 0 || written != (ssize_t)prepared_size || close(fd) != 0 ||
+                rename(tmp, path) != 0) {
+            ERR("Error writing %s: %s\n", path, strerror(errno));
+            unlink(tmp);
+            return 1;
+        }
+        VERB("Prepared NV index 0x%08" PRIx32 " in %s\n", nvs[i], path);
+    }
+    return 0;
+}
+
+/** Calculate with the prepared key of the NV index, if there is one.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[out] now Time of the calculation.
+ * @param[out] totp The TOTP value.
+ * @retval 0 on success
+ * @retval 1 if there is no usable prepared key
+ */
+static int
+calculate_prepared(TPM2TOTP_CONTEXT *context, time_t *now, uint64_t *totp)
+{
+    char path[PATH_MAX];
+    uint8_t *prepared;
+    size_t prepared_size;
+    int rc;
+
+    if (prepared_path(opt.nvindex, path) != 0 ||
+            read_file(path, &prepared, &prepared_size) != 0)
+        return 1;
+
+    rc = tpm2totp_context_calculatePrepared(context, prepared, prepared_size,
+                                            now, totp);
+    free(prepared);
+    if (rc != 0) {
+        /* e.g. prepared in an earlier boot or for another TPM */
+        VERB("Prepared key %s is not usable, loading it from NV\n", path);
+        return 1;
+    }
+    VERB("Calculated with prepared key %s\n", path);
+    return 0;
+}
+
+/** Run a command on one TPM.
+ *
+ * @param[in] context Library context of the TPM.
+ * @param[in] pool Optional pool of keys for generate.
+ * @param[in] out Stream for the command's output.
+ * @retval 0 on success
+ * @retval 1 on failure
+ */
+static int
+run_command(TPM2TOTP_CONTEXT *context, TPM2TOTP_POOL *pool, FILE *out)
+{
     int rc;
     uint8_t *secret, *keyBlob, *newBlob;
+    uint32_t nvindex;
     size_t secret_size, keyBlob_size, newBlob_size;
-    char *base32key, *url, *qrpic;
     uint64_t totp;
     time_t now;
     char timestr[100] = { 0, };
 
     switch(opt.cmd) {
     case CMD_GENERATE:
-        rc = tpm2totp_generateKey(opt.pcrs, opt.banks, opt.password,
-                                  &secret, &secret_size, 
-                                  &keyBlob, &keyBlob_size);
-        chkrc(rc, exit(1));
-
-        rc = tpm2totp_storeKey_nv(keyBlob, keyBlob_size, opt.nvindex);
-        free(keyBlob);
-        chkrc(rc, exit(1));
-
-        base32key = base32enc(secret, secret_size);
-        url = calloc(1, strlen(base32key) + strlen(URL_PREFIX) + 1);
-        sprintf(url, URL_PREFIX "%s", base32key);
-        free(base32key);
+        if (opt.nvcount > 1) {
+            for (size_t i = 0; i < opt.nvcount; i++)
+                forget_prepared(opt.nvindices[i]);
+            rc = tpm2totp_context_generateKeys_nv(context, opt.pcrs, opt.banks,
+                                                  opt.password, opt.nvindices,
+                                                  opt.nvcount, print_uri, out);
+            chkrc(rc, return 1);
+            break;
+        }
+        forget_prepared(opt.nvindex);
+        if (pool) {
+            rc = tpm2totp_pool_generateKey_nv(pool, opt.nvindex,
+                                              &secret, &secret_size);
+            chkrc(rc, return 1);
+        } else {
+            rc = tpm2totp_context_generateKey(context, opt.pcrs, opt.banks,
+                                              opt.password,
+                                              &secret, &secret_size,
+                                              &keyBlob, &keyBlob_size);
+            chkrc(rc, return 1);
 
-        qrpic = qrencode(url);
+            rc = tpm2totp_context_storeKey_nv(context, keyBlob, keyBlob_size,
+                                              opt.nvindex);
+            free(keyBlob);
+            chkrc(rc, free(secret); return 1);
+        }
 
-        printf("%s\n", qrpic);
-        printf("%s\n", url);
-        free(qrpic);
-        free(url);
+        rc = print_secret(secret, secret_size, out);
+        free(secret);
+        if (rc)
+            return 1;
         break;
     case CMD_CALCULATE:
-        rc = tpm2totp_loadKey_nv(opt.nvindex, &keyBlob, &keyBlob_size);
-        chkrc(rc, exit(1));
+        if (opt.nvcount > 1)
+            return calculate_nvindices(context, out);
+        if (opt.tcticount > 1 || calculate_prepared(context, &now, &totp)) {
+            rc = tpm2totp_context_loadKey_nv(context, opt.nvindex,
+                                             &keyBlob, &keyBlob_size);
+            chkrc(rc, return 1);
 
-        rc = tpm2totp_calculate(keyBlob, keyBlob_size, &now, &totp);
-        free(keyBlob);
-        chkrc(rc, exit(1));
+            rc = tpm2totp_context_calculate(context, keyBlob, keyBlob_size,
+                                            &now, &totp);
+            free(keyBlob);
+            chkrc(rc, return 1);
+        }
         if (opt.time) {
             rc = !strftime (timestr, sizeof(timestr)-1, "%Y-%m-%d %H:%M:%S: ",
                             localtime (&now));
-            chkrc(rc, exit(1));
+            chkrc(rc, return 1);
         }
-        printf("%s%06ld", timestr, totp);
+        fprintf(out, "%s%06ld", timestr, totp);
         break;
     case CMD_RESEAL:
-        rc = tpm2totp_loadKey_nv(opt.nvindex, &keyBlob, &keyBlob_size);
-        chkrc(rc, exit(1));
+        if (opt.nvcount > 1) {
+            for (size_t i = 0; i < opt.nvcount; i++)
+                forget_prepared(opt.nvindices[i]);
+            rc = tpm2totp_context_resealKeys_nv(context, opt.password,
+                                                opt.pcrs, opt.banks,
+                                                opt.nvindices, opt.nvcount);
+            chkrc(rc, return 1);
+            break;
+        }
+        forget_prepared(opt.nvindex);
+        /* A single key is rewritten in place as well */
+        nvindex = opt.nvindex;
+        rc = tpm2totp_context_resealKeys_nv(context, opt.password,
+                                            opt.pcrs, opt.banks, &nvindex, 1);
+        chkrc(rc, return 1);
+        break;
+    case CMD_RECOVER:
+        rc = tpm2totp_context_loadKey_nv(context, opt.nvindex,
+                                         &keyBlob, &keyBlob_size);
+        chkrc(rc, return 1);
 
-        rc = tpm2totp_reseal(keyBlob, keyBlob_size, opt.password, opt.pcrs,
-                             opt.banks, &newBlob, &newBlob_size);
+        rc = tpm2totp_context_getSecret(context, keyBlob, keyBlob_size,
+                                        opt.password, &secret, &secret_size);
         free(keyBlob);
-        chkrc(rc, exit(1));
+        chkrc(rc, return 1);
 
+        rc = print_secret(secret, secret_size, out);
+        free(secret);
+        if (rc)
+            return 1;
+        break;
+    case CMD_CLEAN:
+        forget_prepared(opt.nvindex);
         //TODO: Are your sure ?
-        rc = tpm2totp_deleteKey_nv(opt.nvindex);
-        chkrc(rc, exit(1));
-
-        rc = tpm2totp_storeKey_nv(newBlob, newBlob_size, opt.nvindex);
-        free(newBlob);
-        chkrc(rc, exit(1));
+        rc = tpm2totp_context_deleteKey_nv(context, opt.nvindex);
+        chkrc(rc, return 1);
         break;
-    case CMD_RECOVER:
-        rc = tpm2totp_loadKey_nv(opt.nvindex, &keyBlob, &keyBlob_size);
-        chkrc(rc, exit(1));
+    case CMD_PARENT:
+        rc = tpm2totp_context_getPrimaryPublic(context,
+                                               &keyBlob, &keyBlob_size);
+        chkrc(rc, return 1);
 
-        rc = tpm2totp_getSecret(keyBlob, keyBlob_size, opt.password,
-                                &secret, &secret_size);
+        rc = write_file(opt.file, keyBlob, keyBlob_size);
         free(keyBlob);
-        chkrc(rc, exit(1));
+        if (rc != 0) {
+            ERR("Error writing %s: %s\n", opt.file, strerror(errno));
+            return 1;
+        }
+        break;
+    case CMD_IMPORT:
+        if (read_file(opt.file, &newBlob, &newBlob_size) != 0) {
+            ERR("Error reading %s: %s\n", opt.file, strerror(errno));
+            return 1;
+        }
 
-        base32key = base32enc(secret, secret_size);
-        url = calloc(1, strlen(base32key) + strlen(URL_PREFIX) + 1);
-        sprintf(url, URL_PREFIX "%s", base32key);
-        free(base32key);
+        rc = tpm2totp_context_importKey(context, newBlob, newBlob_size,
+                                        &keyBlob, &keyBlob_size);
+        free(newBlob);
+        chkrc(rc, return 1);
 
-        qrpic = qrencode(url);
+        forget_prepared(opt.nvindex);
 
-        printf("%s\n", qrpic);
-        printf("%s\n", url);
-        free(qrpic);
-        free(url);
+        rc = tpm2totp_context_storeKey_nv(context, keyBlob, keyBlob_size,
+                                          opt.nvindex);
+        free(keyBlob);
+        chkrc(rc, return 1);
         break;
-    case CMD_CLEAN:
-        //TODO: Are your sure ?
-        rc = tpm2totp_deleteKey_nv(opt.nvindex);
-        chkrc(rc, exit(1));
+    case CMD_PREPARE:
+        return prepare_nvindices(context);
+    case CMD_LIST:
+        rc = tpm2totp_context_listKeys_nv(context, print_key, out);
+        chkrc(rc, return 1);
         break;
     default:
+        return 1;
+    }
+
+    return 0;
+}
+
+/** Create a library context with the owner and NV passwords of the options.
+ *
+ * @param[in] tcti The TCTI of the TPM or NULL for the default.
+ * @param[out] context The library context.
+ * @retval 0 on success.
+ * @retval -1 on failure.
+ */
+static int
+context_new(TSS2_TCTI_CONTEXT *tcti, TPM2TOTP_CONTEXT **context)
+{
+    if (tpm2totp_context_new(tcti, context) != 0)
+        return -1;
+    if (tpm2totp_context_setAuth(*context, opt.ownerpassword,
+                                 opt.nvpassword) != 0) {
+        ERR("Error setting the owner or NV password.\n");
+        tpm2totp_context_free(*context);
+        *context = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* A command to be run on one of several TPMs */
+typedef struct {
+    const char *tcti;
+    char *out;
+    size_t out_size;
+    int rc;
+} TPM_JOB;
+
+typedef struct {
+    TPM_JOB *jobs;
+    size_t count;
+    size_t next;
+} TPM_QUEUE;
+
+static void
+run_job(TPM_JOB *job)
+{
+    TSS2_TCTI_CONTEXT *tcti = NULL;
+    TPM2TOTP_CONTEXT *context;
+    FILE *out = open_memstream(&job->out, &job->out_size);
+    TSS2_RC rc;
+
+    if (!out) {
+        job->rc = 1;
+        return;
+    }
+
+    rc = Tss2_TctiLdr_Initialize(job->tcti, &tcti);
+    if (rc != TSS2_RC_SUCCESS) {
+        fprintf(out, "ERROR initializing TCTI %s: 0x%08x\n", job->tcti, rc);
+        job->rc = 1;
+    } else if (context_new(tcti, &context) != 0) {
+        fprintf(out, "ERROR initializing TPM %s\n", job->tcti);
+        job->rc = 1;
+        Tss2_TctiLdr_Finalize(&tcti);
+    } else {
+        job->rc = run_command(context, NULL, out);
+        tpm2totp_context_free(context);
+        Tss2_TctiLdr_Finalize(&tcti);
+    }
+    fclose(out);
+}
+
+/** Take jobs from the shared queue until it is empty.
+ *
+ * Every job is all of the command on one TPM, whose commands run one after
+ * the other. With fewer workers than TPMs, a worker that is done continues
+ * with the next TPM no worker has started on yet.
+ */
+static void *
+tpm_worker(void *arg)
+{
+    TPM_QUEUE *queue = arg;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED))
+           < queue->count)
+        run_job(&queue->jobs[i]);
+    return NULL;
+}
+
+/** Print the outcome and the output of a command.
+ *
+ * @param[in] label What the command ran on.
+ * @param[in] rc Return code of the command.
+ * @param[in] out Output of the command.
+ * @param[in] out_size Size of the output.
+ */
+static void
+print_result(const char *label, int rc, const char *out, size_t out_size)
+{
+    printf("# %s: %s\n", label, rc ? "FAILED" : "OK");
+    if (out_size > 0) {
+        fwrite(out, out_size, 1, stdout);
+        if (out[out_size - 1] != '\n')
+            printf("\n");
+    }
+}
+
+/** Run the command on all TPMs given with -T concurrently.
+ *
+ * The outputs are printed in the order of the TPMs once all are done.
+ * @retval 0 if the command succeeded on all TPMs
+ * @retval 1 otherwise
+ */
+static int
+run_parallel(void)
+{
+    TPM_QUEUE queue = { .count = opt.tcticount, .next = 0 };
+    size_t workers = opt.jobs ? opt.jobs : opt.tcticount, started = 0, failed = 0;
+    pthread_t *threads;
+
+    if (workers > opt.tcticount)
+        workers = opt.tcticount;
+
+    queue.jobs = calloc(queue.count, sizeof(*queue.jobs));
+    threads = calloc(workers, sizeof(*threads));
+    if (!queue.jobs || !threads) {
+        ERR("Out of memory.\n");
+        free(queue.jobs);
+        free(threads);
+        return 1;
+    }
+    for (size_t i = 0; i < queue.count; i++)
+        queue.jobs[i].tcti = opt.tctis[i];
+
+    for (size_t i = 0; i < workers; i++) {
+        if (pthread_create(&threads[started], NULL, tpm_worker, &queue) == 0)
+            started++;
+    }
+    /* Without any thread left, work through the queue here */
+    if (started == 0)
+        tpm_worker(&queue);
+    for (size_t i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    for (size_t i = 0; i < queue.count; i++) {
+        TPM_JOB *job = &queue.jobs[i];
+
+        print_result(job->tcti, job->rc, job->out, job->out_size);
+        free(job->out);
+        if (job->rc)
+            failed++;
+    }
+    if (failed)
+        ERR("The command failed on %zu of %zu TPMs.\n", failed, queue.count);
+
+    free(threads);
+    free(queue.jobs);
+    return failed ? 1 : 0;
+}
+
+/** Split a line of a batch into arguments.
+ *
+ * Arguments are separated by whitespace. Single and double quotes group words
+ * and a backslash outside of single quotes escapes the next character. The
+ * arguments are unquoted in place.
+ * @param[in,out] line The line.
+ * @param[in] argv0 Program name to put before the arguments.
+ * @param[out] argv The arguments (callee-allocated).
+ * @param[out] argc Number of arguments including the program name.
+ * @retval 0 on success
+ * @retval -1 on unbalanced quotes or out of memory
+ */
+static int
+split_line(char *line, char *argv0, char ***argv, int *argc)
+{
+    char **args = NULL, **tmp, *in = line, *out = line, quote;
+    int count = 1;
+
+    args = malloc(2 * sizeof(*args));
+    if (!args)
+        return -1;
+    args[0] = argv0;
+
+    while (1) {
+        while (isspace((unsigned char)*in))
+            in++;
+        if (*in == '\0')
+            break;
+
+        tmp = realloc(args, (count + 2) * sizeof(*args));
+        if (!tmp) {
+            free(args);
+            return -1;
+        }
+        args = tmp;
+        args[count++] = out;
+
+        quote = '\0';
+        while (*in && (quote || !isspace((unsigned char)*in))) {
+            if (quote && *in == quote) {
+                quote = '\0';
+                in++;
+            } else if (!quote && (*in == '\'' || *in == '"')) {
+                quote = *in++;
+            } else if (*in == '\\' && quote != '\'' && in[1]) {
+                in++;
+                *out++ = *in++;
+            } else {
+                *out++ = *in++;
+            }
+        }
+        if (quote) {
+            free(args);
+            return -1;
+        }
+        if (*in)
+            in++;
+        *out++ = '\0';
+    }
+
+    args[count] = NULL;
+    *argv = args;
+    *argc = count;
+    return 0;
+}
+
+/** Run the commands of a batch read from stdin.
+ *
+ * Every line holds the options and the command of one invocation, using one
+ * library context for all of them. Empty lines and lines starting with # are
+ * skipped. The result of each command is printed as soon as it is done. With
+ * -k, generate takes keys for the PCRs, banks and password of the batch from
+ * a pool on a second connection to the TPM.
+ * @param[in] context Library context of the TPM.
+ * @param[in] argv0 Program name for the parsed lines.
+ * @retval 0 if all commands succeeded
+ * @retval 1 otherwise
+ */
+static int
+run_batch(TPM2TOTP_CONTEXT *context, char *argv0)
+{
+    TSS2_TCTI_CONTEXT *pooltcti = NULL;
+    TPM2TOTP_POOL *pool = NULL;
+    char *line = NULL, *label, *out, **argv;
+    size_t line_size = 0, out_size, commands = 0, failed = 0;
+    ssize_t len;
+    int argc, rc, pooled;
+    FILE *f;
+
+    /* The options of the batch itself are overwritten by its lines */
+    int pool_pcrs = opt.pcrs, pool_banks = opt.banks;
+    char *pool_password = opt.password ? opt.password : "";
+
+    if (opt.pool) {
+        if (opt.tcticount == 1) {
+            rc = Tss2_TctiLdr_Initialize(opt.tctis[0], &pooltcti);
+            chkrc(rc, return 1);
+        }
+        rc = tpm2totp_pool_new(opt.pcrs, opt.banks, opt.password, opt.pool,
+                               pooltcti, &pool);
+        if (rc != 0) {
+            ERR("Error starting the key pool; it needs a second connection "
+                "to the TPM.\n");
+            if (pooltcti)
+                Tss2_TctiLdr_Finalize(&pooltcti);
+            return 1;
+        }
+        if (opt.events && tpm2totp_pool_setMeasurements(pool, NULL, NULL)) {
+            ERR("Error watching the measurements of the kernel.\n");
+            tpm2totp_pool_free(pool);
+            if (pooltcti)
+                Tss2_TctiLdr_Finalize(&pooltcti);
+            return 1;
+        }
+    }
+
+    while ((len = getline(&line, &line_size, stdin)) != -1) {
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        label = line + strspn(line, " \t");
+        if (*label == '\0' || *label == '#')
+            continue;
+        label = strdup(label);
+        if (!label) {
+            ERR("Out of memory.\n");
+            failed++;
+            break;
+        }
+
+        out = NULL;
+        out_size = 0;
+        rc = split_line(line, argv0, &argv, &argc);
+        if (rc != 0) {
+            ERR("Error parsing command: %s\n", label);
+            rc = 1;
+        } else {
+            rc = parse_opts(argc, argv);
+            if (rc == 0 && (opt.cmd == CMD_WATCH || opt.cmd == CMD_AUDIT ||
+                            opt.cmd == CMD_WRAP || opt.cmd == CMD_BATCH ||
+                            opt.cmd == CMD_POLICY)) {
+                ERR("Only commands that use the TPM can be run in a batch.\n");
+                rc = 1;
+            } else if (rc == 0 && opt.tcticount > 0) {
+                ERR("The TPM is selected for the whole batch.\n");
+                rc = 1;
+            } else if (rc == 0 && (opt.ownerpassword || opt.nvpassword)) {
+                ERR("The TPM passwords are set for the whole batch.\n");
+                rc = 1;
+            } else if (rc == 0) {
+                pooled = pool && opt.cmd == CMD_GENERATE && opt.nvcount <= 1 &&
+                         opt.pcrs == pool_pcrs && opt.banks == pool_banks &&
+                         !strcmp(opt.password ? opt.password : "",
+                                 pool_password);
+                f = open_memstream(&out, &out_size);
+                if (!f) {
+                    ERR("Out of memory.\n");
+                    rc = 1;
+                } else {
+                    rc = run_command(context, pooled ? pool : NULL, f);
+                    fclose(f);
+                }
+            } else if (rc < 0) {
+                /* Only the help was printed */
+                rc = 0;
+            }
+            free(argv);
+        }
+
+        print_result(label, rc, out, out_size);
+        fflush(stdout);
+        free(out);
+        free(label);
+        commands++;
+        if (rc)
+            failed++;
+    }
+    free(line);
+
+    if (failed)
+        ERR("%zu of %zu commands failed.\n", failed, commands);
+
+    tpm2totp_pool_free(pool);
+    if (pooltcti)
+        Tss2_TctiLdr_Finalize(&pooltcti);
+    return failed ? 1 : 0;
+}
+
+/** Open the TPM, after waiting for it in the queue if requested.
+ *
+ * @param[out] queue The place in the queue, NULL without queue.
+ * @param[out] tcti The TCTI of the TPM, NULL for the default.
+ * @retval 0 on success
+ * @retval 1 on failure
+ */
+static int
+open_tpm(TPM2TOTP_QUEUE **queue, TSS2_TCTI_CONTEXT **tcti)
+{
+    TSS2_RC rc;
+
+    *queue = NULL;
+    *tcti = NULL;
+    if (opt.queue >= 0 &&
+        tpm2totp_queue_enter(NULL, opt.queue * 1000, queue) != 0) {
+        ERR("Error waiting for the TPM: %s\n", strerror(errno));
+        return 1;
+    }
+    if (opt.tcticount == 1) {
+        rc = Tss2_TctiLdr_Initialize(opt.tctis[0], tcti);
+        if (rc != TSS2_RC_SUCCESS) {
+            ERR("Error initializing TCTI %s: 0x%08x\n", opt.tctis[0], rc);
+            tpm2totp_queue_leave(*queue);
+            *queue = NULL;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/** Close the TPM and let the next process in the queue use it.
+ *
+ * @param[in,out] queue The place in the queue or NULL.
+ * @param[in,out] tcti The TCTI of the TPM or NULL.
+ */
+static void
+close_tpm(TPM2TOTP_QUEUE **queue, TSS2_TCTI_CONTEXT **tcti)
+{
+    if (*tcti)
+        Tss2_TctiLdr_Finalize(tcti);
+    *tcti = NULL;
+    tpm2totp_queue_leave(*queue);
+    *queue = NULL;
+}
+
+/** Main function
+ *
+ * This function initializes OpenSSL and then calls the key generation
+ * functions.
+ * @param argc The argument count.
+ * @param argv The arguments.
+ * @retval 0 on success
+ * @retval 1 on failure
+ */
+int
+main(int argc, char **argv)
+{
+    int rc = parse_opts(argc, argv);
+    if (rc != 0)
+        exit(rc < 0 ? 0 : 1);
+
+    uint8_t *keyBlob;
+    size_t keyBlob_size;
+    uint64_t totp;
+    time_t now;
+    char timestr[100] = { 0, };
+    char message[PLYMOUTH_MESSAGE_MAX + 1];
+    int metricsfd = -1;
+    PLYMOUTH *ply = NULL;
+    AUDIT_STATS stats;
+    TSS2_TCTI_CONTEXT *tcti = NULL;
+    TPM2TOTP_QUEUE *queue = NULL;
+    TPM2TOTP_CONTEXT *context;
+
+    if (opt.cmd == CMD_AUDIT) {
+        rc = audit_file(opt.file, opt.window, opt.jobs, stdout, &stats);
+        if (rc != 0) {
+            ERR("Error auditing %s: %s\n", opt.file, strerror(errno));
+            exit(1);
+        }
+        printf("%zu records of %zu devices: %zu mismatches, %zu invalid\n",
+               stats.records, stats.devices, stats.mismatches, stats.invalid);
+        if (stats.mismatches || stats.invalid)
+            exit(1);
+        return 0;
+    }
+
+    if (opt.cmd == CMD_WRAP)
+        return wrap();
+
+    if (opt.cmd == CMD_POLICY)
+        return policy();
+
+    if (opt.tcticount > 1)
+        return run_parallel();
+
+    if (open_tpm(&queue, &tcti) != 0)
         exit(1);
+
+    rc = context_new(tcti, &context);
+    chkrc(rc, exit(1));
+
+    if (opt.cmd != CMD_WATCH) {
+        if (opt.cmd == CMD_BATCH)
+            rc = run_batch(context, argv[0]);
+        else
+            rc = run_command(context, NULL, stdout);
+        tpm2totp_context_free(context);
+        close_tpm(&queue, &tcti);
+        return rc;
+    }
+
+    rc = tpm2totp_context_loadKey_nv(context, opt.nvindex,
+                                     &keyBlob, &keyBlob_size);
+    chkrc(rc, exit(1));
+
+    if (opt.metrics_socket) {
+        rc = tpm2totp_metrics_listen(opt.metrics_socket, &metricsfd);
+        chkrc(rc, exit(1));
+    }
+
+    if (opt.plymouth && plymouth_new(NULL, &ply) != 0) {
+        ERR("Error creating the plymouth connection: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    while (1) {
+        if (opt.queue >= 0 && !queue && open_tpm(&queue, &tcti) != 0) {
+            wait_timestep(metricsfd);
+            continue;
+        }
+        /* Start over if the TPM lost the primary key, e.g. on a reset */
+        if (!context && context_new(tcti, &context) != 0)
+            context = NULL;
+        rc = tpm2totp_context_calculate(context, keyBlob, keyBlob_size,
+                                        &now, &totp);
+        /* In the queue, the TPM is only held for a calculation */
+        if (queue) {
+            tpm2totp_context_free(context);
+            context = NULL;
+            close_tpm(&queue, &tcti);
+        }
+        if (rc == 0) {
+            if (opt.time) {
+                strftime(timestr, sizeof(timestr)-1, "%Y-%m-%d %H:%M:%S: ",
+                         localtime(&now));
+            }
+            if (ply) {
+                /* Updated in place, without spawning plymouth clients */
+                snprintf(message, sizeof(message), "%s%06ld", timestr, totp);
+                if (plymouth_update(ply, now / TIMESTEPSIZE, message) != 0)
+                    ERR("ERROR displaying TOTP with plymouth: %s\n",
+                        strerror(errno));
+            } else {
+                printf("%s%06ld\n", timestr, totp);
+                fflush(stdout);
+            }
+        } else {
+            ERR("ERROR calculating TOTP: 0x%08x\n", rc);
+            tpm2totp_context_free(context);
+            context = NULL;
+        }
+        if (opt.metrics && tpm2totp_metrics_writeFile(opt.metrics) != 0) {
+            ERR("ERROR writing metrics to %s\n", opt.metrics);
+        }
+        wait_timestep(metricsfd);
     }
 
     return 0;
@@ -0,0 +1,277 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#include <tpm2-totp.h>
+
+#include <string.h>
+
+#include "sha1mb.h"
+
+#define TIMESTEPSIZE 30
+#define DIGITS 1000000
+
+/* Inner and outer SHA-1 states after absorbing the padded HMAC key, so every
+   code costs exactly two compressions. */
+typedef struct {
+    uint32_t istate[5];
+    uint32_t ostate[5];
+} HMAC_KEY;
+
+static uint32_t
+load_be32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+           (uint32_t)p[2] << 8 | p[3];
+}
+
+/** Precompute the HMAC key states for up to SHA1MB_LANES secrets.
+ */
+static void
+hmac_keys(const uint8_t *const *secrets, const size_t *secret_sizes,
+          size_t n, HMAC_KEY *keys)
+{
+    sha1mb_state istate, ostate;
+    sha1mb_block iblock, oblock;
+    uint8_t key[64];
+
+    for (size_t lane = 0; lane < SHA1MB_LANES; lane++) {
+        memset(&key[0], 0, sizeof(key));
+        if (lane < n && secret_sizes[lane] > sizeof(key))
+            sha1mb_digest(secrets[lane], secret_sizes[lane], &key[0]);
+        else if (lane < n)
+            memcpy(&key[0], secrets[lane], secret_sizes[lane]);
+
+        for (int t = 0; t < 16; t++) {
+            iblock[t][lane] = load_be32(&key[4 * t]) ^ 0x36363636;
+            oblock[t][lane] = load_be32(&key[4 * t]) ^ 0x5c5c5c5c;
+        }
+        for (int i = 0; i < 5; i++)
+            istate[i][lane] = ostate[i][lane] = sha1mb_iv[i];
+    }
+    memset(&key[0], 0, sizeof(key));
+
+    sha1mb_compress(istate, iblock);
+    sha1mb_compress(ostate, oblock);
+
+    for (size_t lane = 0; lane < n; lane++) {
+        for (int i = 0; i < 5; i++) {
+            keys[lane].istate[i] = istate[i][lane];
+            keys[lane].ostate[i] = ostate[i][lane];
+        }
+    }
+    memset(iblock, 0, sizeof(iblock));
+    memset(oblock, 0, sizeof(oblock));
+}
+
+/** Calculate the RFC 6238 codes for up to SHA1MB_LANES (key, step) pairs.
+ */
+static void
+totp_lanes(const HMAC_KEY *const *keys, const uint64_t *steps, size_t n,
+           uint64_t *otps)
+{
+    sha1mb_state state;
+    sha1mb_block block;
+
+    memset(block, 0, sizeof(block));
+    for (size_t lane = 0; lane < SHA1MB_LANES; lane++) {
+        const uint32_t *istate = lane < n ? keys[lane]->istate : sha1mb_iv;
+        uint64_t step = lane < n ? steps[lane] : 0;
+
+        for (int i = 0; i < 5; i++)
+            state[i][lane] = istate[i];
+        /* The 8 byte counter, padding and the length of key block + counter */
+        block[0][lane] = step >> 32;
+        block[1][lane] = (uint32_t)step;
+        block[2][lane] = 0x80000000;
+        block[15][lane] = (64 + 8) * 8;
+    }
+    sha1mb_compress(state, block);
+
+    for (size_t lane = 0; lane < SHA1MB_LANES; lane++) {
+        const uint32_t *ostate = lane < n ? keys[lane]->ostate : sha1mb_iv;
+
+        /* The inner digest, padding and the length of key block + digest */
+        for (int i = 0; i < 5; i++) {
+            block[i][lane] = state[i][lane];
+            state[i][lane] = ostate[i];
+        }
+        block[5][lane] = 0x80000000;
+        block[15][lane] = (64 + 20) * 8;
+    }
+    sha1mb_compress(state, block);
+
+    /* Dynamic truncation of RFC 4226 on the big-endian digest bytes */
+    for (size_t lane = 0; lane < n; lane++) {
+        uint8_t digest[20];
+        int offset;
+
+        for (int i = 0; i < 20; i++)
+            digest[i] = state[i / 4][lane] >> (24 - 8 * (i % 4));
+        offset = digest[19] & 0x0f;
+        otps[lane] = (load_be32(&digest[offset]) & 0x7fffffff) % DIGITS;
+    }
+}
+
+/** Calculate TOTP values in software.
+ *
+ * Computes the codes of consecutive time steps from a secret, e.g. one
+ * recovered using tpm2totp_getSecret().
+ * @param[in] secret The TOTP secret.
+ * @param[in] secret_size Size of the secret.
+ * @param[in] now The time of the first code.
+ * @param[in] count Number of consecutive time steps.
+ * @param[out] otps The calculated codes (count elements).
+ * @retval 0 on success.
+ * @retval -1 on invalid parameters.
+ */
+int
+tpm2totp_softCalculate(const uint8_t *secret, size_t secret_size, time_t now,
+                       size_t count, uint64_t *otps)
+{
+    HMAC_KEY key;
+    const HMAC_KEY *keys[SHA1MB_LANES];
+    uint64_t steps[SHA1MB_LANES];
+
+    if (!secret || !otps || now < 0)
+        return -1;
+
+    hmac_keys(&secret, &secret_size, 1, &key);
+    for (size_t lane = 0; lane < SHA1MB_LANES; lane++)
+        keys[lane] = &key;
+
+    for (size_t i = 0; i < count; i += SHA1MB_LANES) {
+        size_t n = count - i < SHA1MB_LANES ? count - i : SHA1MB_LANES;
+
+        for (size_t lane = 0; lane < n; lane++)
+            steps[lane] = now / TIMESTEPSIZE + i + lane;
+        totp_lanes(keys, steps, n, &otps[i]);
+    }
+
+    memset(&key, 0, sizeof(key));
+    return 0;
+}
+
+/** Verify TOTP values of many secrets in software.
+ *
+ * For each secret, searches the time steps within ±window of the given time
+ * for the given code. Steps are tried in order of increasing distance and
+ * the lanes of the SHA-1 kernel are filled across secrets, so a secret stops
+ * costing work as soon as its code has been found.
+ * @param[in] count Number of secrets.
+ * @param[in] secrets The TOTP secrets.
+ * @param[in] secret_sizes Sizes of the secrets.
+ * @param[in] times The time each code was read off the machine.
+ * @param[in] otps The codes to verify.
+ * @param[in] window Number of time steps to search before and after.
+ * @param[out] drifts Distance of the matching time step (may be NULL).
+ * @param[out] matches 1 if the code was found, 0 otherwise.
+ * @retval 0 on success.
+ * @retval -1 on invalid parameters.
+ */
+int
+tpm2totp_verifyMany(size_t count, const uint8_t *const *secrets,
+                    const size_t *secret_sizes, const time_t *times,
+                    const uint64_t *otps, unsigned int window,
+                    int *drifts, int *matches)
+{
+    /* Keys are prepared in batches of SHA1MB_LANES secrets. A batch of lanes
+       covers at most SHA1MB_LANES consecutive secrets, so two batches in the
+       ring are sufficient. */
+    HMAC_KEY keys[2 * SHA1MB_LANES];
+    const HMAC_KEY *lane_keys[SHA1MB_LANES];
+    uint64_t lane_steps[SHA1MB_LANES], lane_otps[SHA1MB_LANES];
+    size_t lane_secret[SHA1MB_LANES];
+    int lane_drift[SHA1MB_LANES];
+    uint64_t jobs = 2 * (uint64_t)window + 1, job = 0;
+    size_t secret = 0, prepared = 0, n, lane;
+
+    if (!secrets || !secret_sizes || !times || !otps || !matches)
+        return -1;
+
+    for (size_t i = 0; i < count; i++) {
+        if (!secrets[i] || times[i] < 0)
+            return -1;
+        matches[i] = 0;
+        if (drifts)
+            drifts[i] = 0;
+    }
+
+    while (secret < count) {
+        for (n = 0; n < SHA1MB_LANES && secret < count; ) {
+            int64_t step;
+            int drift;
+
+            if (matches[secret] || job == jobs) {
+                secret++;
+                job = 0;
+                continue;
+            }
+            if (secret == prepared) {
+                size_t batch = count - prepared < SHA1MB_LANES ?
+                               count - prepared : SHA1MB_LANES;
+                hmac_keys(&secrets[prepared], &secret_sizes[prepared], batch,
+                          &keys[prepared % (2 * SHA1MB_LANES)]);
+                prepared += batch;
+            }
+
+            /* 0, -1, +1, -2, +2, ... */
+            drift = job % 2 ? -(int)((job + 1) / 2) : (int)(job / 2);
+            job++;
+            step = (int64_t)(times[secret] / TIMESTEPSIZE) + drift;
+            if (step < 0)
+                continue;
+
+            lane_keys[n] = &keys[secret % (2 * SHA1MB_LANES)];
+            lane_steps[n] = step;
+            lane_secret[n] = secret;
+            lane_drift[n] = drift;
+            n++;
+        }
+        if (n == 0)
+            break;
+
+        totp_lanes(lane_keys, lane_steps, n, lane_otps);
+
+        /* Lanes are in search order, the first hit is the closest step */
+        for (lane = 0; lane < n; lane++) {
+            size_t i = lane_secret[lane];
+
+            if (matches[i] || lane_otps[lane] != otps[i])
+                continue;
+            matches[i] = 1;
+            if (drifts)
+                drifts[i] = lane_drift[lane];
+        }
+    }
+
+    memset(&keys[0], 0, sizeof(keys));
+    return 0;
+}
+
+/** Verify a TOTP value in software.
+ *
+ * @param[in] secret The TOTP secret.
+ * @param[in] secret_size Size of the secret.
+ * @param[in] now The time the code was read off the machine.
+ * @param[in] otp The code to verify.
+ * @param[in] window Number of time steps to search before and after.
+ * @param[out] drift Distance of the matching time step (may be NULL).
+ * @retval 0 if the code matches.
+ * @retval -1 on invalid parameters.
+ * @retval -20 if the code does not match within the window.
+ */
+int
+tpm2totp_verify(const uint8_t *secret, size_t secret_size, time_t now,
+                uint64_t otp, unsigned int window, int *drift)
+{
+    int rc, match;
+
+    rc = tpm2totp_verifyMany(1, &secret, &secret_size, &now, &otp, window,
+                             drift, &match);
+    if (rc != 0)
+        return rc;
+    return match ? 0 : -20;
+}
@@ -0,0 +1,617 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#include <tpm2-totp.h>
+#include "context.h"
+#include "keytemplates.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CRYPTO
+
+#include <openssl/crypto.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/objects.h>
+#include <openssl/rand.h>
+#include <openssl/x509.h>
+
+#include <tss2/tss2_mu.h>
+
+/* The parent is always the storage primary of primaryPublic: an ECC NIST P-256
+   key with SHA256 as name algorithm and AES-128-CFB as symmetric algorithm. */
+#define DIGESTLEN 32
+#define NAMELEN (2 + DIGESTLEN)
+#define SYMKEYLEN 16
+#define ECCLEN 32
+
+/* DER SubjectPublicKeyInfo of a NIST P-256 key up to the uncompressed point */
+static const uint8_t p256_spki[] = {
+    0x30, 0x59, 0x30, 0x13, 0x06, 0x07, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x02,
+    0x01, 0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07, 0x03,
+    0x42, 0x00, 0x04
+};
+
+/** Derive a key with KDFa (TPM 2.0 Part 1, 11.4.10.2) using HMAC-SHA256.
+ *
+ * @param[in] key HMAC key.
+ * @param[in] key_size Size of the HMAC key.
+ * @param[in] label Label, used including its terminating zero.
+ * @param[in] context Optional contextU; contextV is always empty.
+ * @param[in] context_size Size of contextU.
+ * @param[out] out Derived key.
+ * @param[in] out_size Size of the derived key.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+static int
+kdfa(const uint8_t *key, size_t key_size, const char *label,
+     const uint8_t *context, size_t context_size,
+     uint8_t *out, size_t out_size)
+{
+    uint8_t input[4 + 16 + NAMELEN + 4], digest[DIGESTLEN];
+    size_t label_size = strlen(label) + 1, off;
+    uint32_t bits = out_size * 8;
+
+    if (label_size > 16 || context_size > NAMELEN)
+        return -1;
+
+    for (uint32_t counter = 1; out_size > 0; counter++) {
+        size_t n = out_size < DIGESTLEN ? out_size : DIGESTLEN;
+
+        off = 0;
+        input[off++] = counter >> 24; input[off++] = counter >> 16;
+        input[off++] = counter >> 8;  input[off++] = counter;
+        memcpy(&input[off], label, label_size);
+        off += label_size;
+        if (context_size)
+            memcpy(&input[off], context, context_size);
+        off += context_size;
+        input[off++] = bits >> 24; input[off++] = bits >> 16;
+        input[off++] = bits >> 8;  input[off++] = bits;
+
+        if (!HMAC(EVP_sha256(), key, key_size, input, off, digest, NULL))
+            return -1;
+        memcpy(out, digest, n);
+        out += n;
+        out_size -= n;
+    }
+    OPENSSL_cleanse(digest, sizeof(digest));
+    return 0;
+}
+
+/** Derive a seed with KDFe (TPM 2.0 Part 1, 11.4.10.3) using SHA256.
+ *
+ * @param[in] z Shared secret, i.e. the x coordinate of the ECDH point.
+ * @param[in] label Label, used including its terminating zero.
+ * @param[in] partyU x coordinate of the ephemeral public key.
+ * @param[in] partyV x coordinate of the parent's public key.
+ * @param[out] out Derived seed of DIGESTLEN bytes.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+static int
+kdfe(const uint8_t z[ECCLEN], const char *label,
+     const TPM2B_ECC_PARAMETER *partyU, const TPM2B_ECC_PARAMETER *partyV,
+     uint8_t out[DIGESTLEN])
+{
+    uint8_t input[4 + ECCLEN + 16 + 2 * sizeof(partyU->buffer)];
+    size_t label_size = strlen(label) + 1, off = 0;
+
+    if (label_size > 16)
+        return -1;
+
+    /* A single round of the counter suffices for DIGESTLEN bytes */
+    input[off++] = 0; input[off++] = 0; input[off++] = 0; input[off++] = 1;
+    memcpy(&input[off], z, ECCLEN);
+    off += ECCLEN;
+    memcpy(&input[off], label, label_size);
+    off += label_size;
+    memcpy(&input[off], &partyU->buffer[0], partyU->size);
+    off += partyU->size;
+    memcpy(&input[off], &partyV->buffer[0], partyV->size);
+    off += partyV->size;
+
+    if (!EVP_Digest(input, off, out, NULL, EVP_sha256(), NULL))
+        return -1;
+    OPENSSL_cleanse(input, sizeof(input));
+    return 0;
+}
+
+/** Compute the policy digest of TPM2_PolicyPCR in software.
+ *
+ * @param[in] pcrsel PCR selection of the policy.
+ * @param[in] pcrValues Expected PCR values in the order of the selection.
+ * @param[in] pcrValues_size Size of the PCR values.
+ * @param[out] policy Resulting SHA256 policy digest.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+static int
+policy_pcr(const TPML_PCR_SELECTION *pcrsel,
+           const uint8_t *pcrValues, size_t pcrValues_size,
+           TPM2B_DIGEST *policy)
+{
+    uint8_t input[DIGESTLEN + 4 + sizeof(TPML_PCR_SELECTION) + DIGESTLEN];
+    size_t off = DIGESTLEN;
+    TSS2_RC rc;
+
+    memset(&input[0], 0, DIGESTLEN);
+    rc = Tss2_MU_UINT32_Marshal(TPM2_CC_PolicyPCR, input, sizeof(input), &off);
+    chkrc(rc, return -1);
+    rc = Tss2_MU_TPML_PCR_SELECTION_Marshal(pcrsel, input, sizeof(input), &off);
+    chkrc(rc, return -1);
+
+    if (!EVP_Digest(pcrValues, pcrValues_size, &input[off], NULL,
+                    EVP_sha256(), NULL))
+        return -1;
+    off += DIGESTLEN;
+
+    policy->size = DIGESTLEN;
+    if (!EVP_Digest(input, off, &policy->buffer[0], NULL, EVP_sha256(), NULL))
+        return -1;
+    return 0;
+}
+
+/** Build the PCR selection of a key's policy.
+ *
+ * @param[in] pcrs PCRs of the policy (0 for DEFAULT_PCRS).
+ * @param[in] banks PCR banks of the policy (0 for DEFAULT_BANKS).
+ * @param[in] pcrValues_size Size of the expected PCR values.
+ * @param[out] pcrsel PCR selection with one entry per bank.
+ * @retval 0 on success.
+ * @retval -1 if no bank is selected or the size of the values does not match.
+ */
+static int
+pcr_selection(uint32_t pcrs, uint32_t banks, size_t pcrValues_size,
+              TPML_PCR_SELECTION *pcrsel)
+{
+    size_t expected = 0;
+
+    if (pcrs == 0) pcrs = DEFAULT_PCRS;
+    if (banks == 0) banks = DEFAULT_BANKS;
+    /* Choosing the bank needs the TPM */
+    if ((banks & TPM2TOTP_BANK_AUTO))
+        return -1;
+
+    pcrsel->count = 0;
+    if ((banks & TPM2TOTP_BANK_SHA1)) {
+        pcrsel->pcrSelections[pcrsel->count].hash = TPM2_ALG_SHA1;
+        pcrsel->count++;
+        expected += 20;
+    }
+    if ((banks & TPM2TOTP_BANK_SHA256)) {
+        pcrsel->pcrSelections[pcrsel->count].hash = TPM2_ALG_SHA256;
+        pcrsel->count++;
+        expected += 32;
+    }
+    if ((banks & TPM2TOTP_BANK_SHA384)) {
+        pcrsel->pcrSelections[pcrsel->count].hash = TPM2_ALG_SHA384;
+        pcrsel->count++;
+        expected += 48;
+    }
+
+    for (size_t i = 0; i < pcrsel->count; i++) {
+        pcrsel->pcrSelections[i].sizeofSelect = 3;
+        pcrsel->pcrSelections[i].pcrSelect[0] = pcrs & 0xff;
+        pcrsel->pcrSelections[i].pcrSelect[1] = pcrs >>8 & 0xff;
+        pcrsel->pcrSelections[i].pcrSelect[2] = pcrs >>16 & 0xff;
+    }
+
+    expected *= __builtin_popcount(pcrs & 0xffffff);
+    if (pcrsel->count == 0 || pcrValues_size != expected)
+        return -1;
+    return 0;
+}
+
+/** Create the seed of a duplication blob for an ECC parent.
+ *
+ * An ephemeral key is agreed with the parent's public key; the TPM repeats the
+ * agreement with its private key from the ephemeral point in inSymSeed.
+ *
+ * @param[in] parent Public area of the parent.
+ * @param[out] seed Seed for the outer wrapper.
+ * @param[out] inSymSeed Encrypted seed for TPM2_Import.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+static int
+seed_ecdh(const TPMT_PUBLIC *parent, uint8_t seed[DIGESTLEN],
+          TPM2B_ENCRYPTED_SECRET *inSymSeed)
+{
+    const TPMS_ECC_POINT *parentPoint = &parent->unique.ecc;
+    uint8_t spki[sizeof(p256_spki) + 2 * ECCLEN] = { 0 }, z[ECCLEN];
+    const uint8_t *p = &spki[0];
+    unsigned char *der = NULL;
+    EVP_PKEY *peer = NULL, *ephemeral = NULL;
+    EVP_PKEY_CTX *pctx = NULL;
+    TPMS_ECC_POINT point;
+    size_t z_size = sizeof(z), off = 0;
+    int der_size, ret = -1;
+    TSS2_RC rc;
+
+    if (parentPoint->x.size > ECCLEN || parentPoint->y.size > ECCLEN)
+        return -1;
+
+    memcpy(&spki[0], p256_spki, sizeof(p256_spki));
+    memcpy(&spki[sizeof(p256_spki) + ECCLEN - parentPoint->x.size],
+           &parentPoint->x.buffer[0], parentPoint->x.size);
+    memcpy(&spki[sizeof(p256_spki) + 2 * ECCLEN - parentPoint->y.size],
+           &parentPoint->y.buffer[0], parentPoint->y.size);
+    peer = d2i_PUBKEY(NULL, &p, sizeof(spki));
+    if (!peer) {
+        dbg("Invalid parent public key");
+        return -1;
+    }
+
+    pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    if (!pctx || EVP_PKEY_keygen_init(pctx) <= 0 ||
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx,
+                                               NID_X9_62_prime256v1) <= 0 ||
+        EVP_PKEY_keygen(pctx, &ephemeral) <= 0)
+        goto error;
+    EVP_PKEY_CTX_free(pctx);
+
+    pctx = EVP_PKEY_CTX_new(ephemeral, NULL);
+    if (!pctx || EVP_PKEY_derive_init(pctx) <= 0 ||
+        EVP_PKEY_derive_set_peer(pctx, peer) <= 0 ||
+        EVP_PKEY_derive(pctx, z, &z_size) <= 0 || z_size != ECCLEN)
+        goto error;
+
+    der_size = i2d_PUBKEY(ephemeral, &der);
+    if (der_size != (int)sizeof(spki) ||
+        memcmp(der, p256_spki, sizeof(p256_spki)))
+        goto error;
+
+    point.x.size = ECCLEN;
+    memcpy(&point.x.buffer[0], &der[sizeof(p256_spki)], ECCLEN);
+    point.y.size = ECCLEN;
+    memcpy(&point.y.buffer[0], &der[sizeof(p256_spki) + ECCLEN], ECCLEN);
+
+    if (kdfe(z, "DUPLICATE", &point.x, &parentPoint->x, seed))
+        goto error;
+
+    rc = Tss2_MU_TPMS_ECC_POINT_Marshal(&point, &inSymSeed->secret[0],
+                                        sizeof(inSymSeed->secret), &off);
+    chkrc(rc, goto error);
+    inSymSeed->size = off;
+
+    ret = 0;
+error:
+    OPENSSL_cleanse(z, sizeof(z));
+    OPENSSL_free(der);
+    EVP_PKEY_CTX_free(pctx);
+    EVP_PKEY_free(ephemeral);
+    EVP_PKEY_free(peer);
+    return ret;
+}
+
+/** Wrap a keyed hash object for TPM2_Import with an outer wrapper only.
+ *
+ * @param[in,out] keyPublic Public area; its unique field is filled in.
+ * @param[in] data Sensitive data of the object.
+ * @param[in] data_size Size of the sensitive data.
+ * @param[in] password Optional authorization value of the object.
+ * @param[in] seed Seed of the outer wrapper.
+ * @param[out] duplicate Wrapped private area.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+static int
+wrap_object(TPM2B_PUBLIC *keyPublic, const uint8_t *data, size_t data_size,
+            const char *password, const uint8_t seed[DIGESTLEN],
+            TPM2B_PRIVATE *duplicate)
+{
+    TPM2B_SENSITIVE sensitive = { .size = 0 };
+    TPMT_SENSITIVE *area = &sensitive.sensitiveArea;
+    uint8_t plain[sizeof(TPM2B_SENSITIVE) + NAMELEN], pub[sizeof(TPMT_PUBLIC)];
+    uint8_t name[NAMELEN], symKey[SYMKEYLEN], hmacKey[DIGESTLEN];
+    uint8_t iv[16] = { 0 }, *enc = &duplicate->buffer[2 + DIGESTLEN];
+    size_t plain_size = 0, pub_size = 0, off = 0;
+    unsigned int hmac_size = DIGESTLEN;
+    EVP_CIPHER_CTX *cctx = NULL;
+    int n, ret = -1;
+    TSS2_RC rc;
+
+    area->sensitiveType = TPM2_ALG_KEYEDHASH;
+    if (password) {
+        area->authValue.size = strlen(password);
+        memcpy(&area->authValue.buffer[0], password, area->authValue.size);
+    }
+    area->seedValue.size = DIGESTLEN;
+    if (RAND_bytes(&area->seedValue.buffer[0], DIGESTLEN) != 1)
+        goto error;
+    area->sensitive.bits.size = data_size;
+    memcpy(&area->sensitive.bits.buffer[0], data, data_size);
+
+    /* The TPM checks the binding unique = H(seedValue || data) on import */
+    memcpy(&plain[0], &area->seedValue.buffer[0], DIGESTLEN);
+    memcpy(&plain[DIGESTLEN], data, data_size);
+    keyPublic->publicArea.unique.keyedHash.size = DIGESTLEN;
+    if (!EVP_Digest(plain, DIGESTLEN + data_size,
+                    &keyPublic->publicArea.unique.keyedHash.buffer[0], NULL,
+                    EVP_sha256(), NULL))
+        goto error;
+
+    rc = Tss2_MU_TPMT_PUBLIC_Marshal(&keyPublic->publicArea, pub, sizeof(pub),
+                                     &pub_size);
+    chkrc(rc, goto error);
+    name[0] = TPM2_ALG_SHA256 >> 8;
+    name[1] = TPM2_ALG_SHA256 & 0xff;
+    if (!EVP_Digest(pub, pub_size, &name[2], NULL, EVP_sha256(), NULL))
+        goto error;
+
+    if (kdfa(seed, DIGESTLEN, "STORAGE", name, sizeof(name),
+             symKey, sizeof(symKey)) ||
+        kdfa(seed, DIGESTLEN, "INTEGRITY", NULL, 0,
+             hmacKey, sizeof(hmacKey)))
+        goto error;
+
+    rc = Tss2_MU_TPM2B_SENSITIVE_Marshal(&sensitive, plain, sizeof(plain),
+                                         &plain_size);
+    chkrc(rc, goto error);
+    if (2 + DIGESTLEN + plain_size > sizeof(duplicate->buffer))
+        goto error;
+
+    cctx = EVP_CIPHER_CTX_new();
+    if (!cctx ||
+        EVP_EncryptInit_ex(cctx, EVP_aes_128_cfb(), NULL, symKey, iv) != 1 ||
+        EVP_EncryptUpdate(cctx, enc, &n, plain, plain_size) != 1 ||
+        (size_t)n != plain_size)
+        goto error;
+
+    /* outerHMAC = HMAC(hmacKey, encSensitive || name) */
+    memcpy(&plain[0], enc, plain_size);
+    memcpy(&plain[plain_size], name, sizeof(name));
+    if (!HMAC(EVP_sha256(), hmacKey, sizeof(hmacKey), plain,
+              plain_size + sizeof(name), &duplicate->buffer[2], &hmac_size))
+        goto error;
+
+    rc = Tss2_MU_UINT16_Marshal(DIGESTLEN, &duplicate->buffer[0], 2, &off);
+    chkrc(rc, goto error);
+    duplicate->size = 2 + DIGESTLEN + plain_size;
+
+    ret = 0;
+error:
+    OPENSSL_cleanse(&sensitive, sizeof(sensitive));
+    OPENSSL_cleanse(plain, sizeof(plain));
+    OPENSSL_cleanse(symKey, sizeof(symKey));
+    OPENSSL_cleanse(hmacKey, sizeof(hmacKey));
+    EVP_CIPHER_CTX_free(cctx);
+    return ret;
+}
+
+/** Wrap a new secret for TPM2_Import into a TPM known by its primary key.
+ *
+ * This runs entirely in software, e.g. on a provisioning server. The policy of
+ * the key is computed from the expected PCR values of the target machine.
+ *
+ * @param[in] pcrs PCRs the key should be sealed against.
+ * @param[in] banks PCR banks the key should be sealed against.
+ * @param[in] pcrValues Expected PCR values, concatenated bank by bank (SHA1,
+ *            SHA256, SHA384) in ascending PCR order.
+ * @param[in] pcrValues_size Size of the PCR values.
+ * @param[in] password Optional password to recover or reseal the secret.
+ * @param[in] primaryPublic Primary key from tpm2totp_getPrimaryPublic().
+ * @param[in] primaryPublic_size Size of the primary key.
+ * @param[out] secret Generated secret.
+ * @param[out] secret_size Size of the secret.
+ * @param[out] importBlob Wrapped key for tpm2totp_importKey().
+ * @param[out] importBlob_size Size of the wrapped key.
+ * @retval 0 on success.
+ * @retval -1 on undefined/general failure.
+ */
+int
+tpm2totp_wrapKey(uint32_t pcrs, uint32_t banks,
+                 const uint8_t *pcrValues, size_t pcrValues_size,
+                 const char *password,
+                 const uint8_t *primaryPublic, size_t primaryPublic_size,
+                 uint8_t **secret, size_t *secret_size,
+                 uint8_t **importBlob, size_t *importBlob_size)
+{
+    if (pcrValues == NULL || primaryPublic == NULL ||
+        secret == NULL || secret_size == NULL ||
+        importBlob == NULL || importBlob_size == NULL) {
+        return -1;
+    }
+
+    TPM2B_PUBLIC parent = { .size = 0 };
+    TPM2B_PUBLIC keyPublicHmac = TPM2B_PUBLIC_KEY_TEMPLATE_HMAC;
+    TPM2B_PUBLIC keyPublicSeal = TPM2B_PUBLIC_KEY_TEMPLATE_UNSEAL;
+    TPM2B_PRIVATE keyPrivateHmac = { .size = 0 };
+    TPM2B_PRIVATE keyPrivateSeal = { .size = 0 };
+    TPM2B_ENCRYPTED_SECRET inSymSeed = { .size = 0 };
+    TPML_PCR_SELECTION pcrsel;
+    const TPMT_PUBLIC *p = &parent.publicArea;
+    uint8_t seed[DIGESTLEN];
+    size_t off = 0;
+    int sealed = password && strlen(password) > 0;
+    TSS2_RC rc;
+
+    *secret = NULL;
+    *importBlob = NULL;
+
+    if (pcrs == 0) pcrs = DEFAULT_PCRS;
+    if (banks == 0) banks = DEFAULT_BANKS;
+
+    if (pcr_selection(pcrs, banks, pcrValues_size, &pcrsel) != 0) {
+        dbg("PCR values do not match the selected PCRs and banks");
+        return -1;
+    }
+    if (sealed && strlen(password) > DIGESTLEN) {
+        dbg("Password too long");
+        return -1;
+    }
+
+    rc = Tss2_MU_TPM2B_PUBLIC_Unmarshal(primaryPublic, primaryPublic_size,
+                                        &off, &parent);
+    chkrc(rc, return -1);
+    if (off != primaryPublic_size || p->type != TPM2_ALG_ECC ||
+        p->nameAlg != TPM2_ALG_SHA256 ||
+        p->parameters.eccDetail.curveID != TPM2_ECC_NIST_P256 ||
+        p->parameters.eccDetail.symmetric.algorithm != TPM2_ALG_AES ||
+        p->parameters.eccDetail.symmetric.keyBits.aes != 128 ||
+        p->parameters.eccDetail.symmetric.mode.aes != TPM2_ALG_CFB) {
+        dbg("Unsupported parent key");
+        return -1;
+    }
+
+    if (policy_pcr(&pcrsel, pcrValues, pcrValues_size,
+                   &keyPublicHmac.publicArea.authPolicy))
+        return -1;
+
+    *secret_size = SECRETLEN;
+    *secret = malloc(SECRETLEN);
+    if (!*secret || RAND_bytes(*secret, SECRETLEN) != 1)
+        goto error;
+
+    /* Both objects share one seed; their names separate the storage keys */
+    if (seed_ecdh(p, seed, &inSymSeed))
+        goto error;
+    if (wrap_object(&keyPublicHmac, *secret, SECRETLEN, NULL, seed,
+                    &keyPrivateHmac))
+        goto error;
+    if (sealed && wrap_object(&keyPublicSeal, *secret, SECRETLEN, password,
+                              seed, &keyPrivateSeal))
+        goto error;
+    OPENSSL_cleanse(seed, sizeof(seed));
+
+    *importBlob_size = 4 + 4 + 4;
+    rc = Tss2_MU_TPM2B_ENCRYPTED_SECRET_Marshal(&inSymSeed, NULL, -1,
+                                                importBlob_size);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_TPM2B_PUBLIC_Marshal(&keyPublicHmac, NULL, -1, importBlob_size);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_TPM2B_PRIVATE_Marshal(&keyPrivateHmac, NULL, -1,
+                                       importBlob_size);
+    chkrc(rc, goto error);
+    if (sealed) {
+        rc = Tss2_MU_TPM2B_PUBLIC_Marshal(&keyPublicSeal, NULL, -1,
+                                          importBlob_size);
+        chkrc(rc, goto error);
+        rc = Tss2_MU_TPM2B_PRIVATE_Marshal(&keyPrivateSeal, NULL, -1,
+                                           importBlob_size);
+        chkrc(rc, goto error);
+    }
+
+    *importBlob = malloc(*importBlob_size);
+    if (!*importBlob)
+        goto error;
+
+    off = 0;
+    rc = Tss2_MU_UINT32_Marshal(IMPORTBLOB_MAGIC, *importBlob,
+                                *importBlob_size, &off);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_UINT32_Marshal(pcrs, *importBlob, *importBlob_size, &off);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_UINT32_Marshal(banks, *importBlob, *importBlob_size, &off);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_TPM2B_ENCRYPTED_SECRET_Marshal(&inSymSeed, *importBlob,
+                                                *importBlob_size, &off);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_TPM2B_PUBLIC_Marshal(&keyPublicHmac, *importBlob,
+                                      *importBlob_size, &off);
+    chkrc(rc, goto error);
+    rc = Tss2_MU_TPM2B_PRIVATE_Marshal(&keyPrivateHmac, *importBlob,
+                                       *importBlob_size, &off);
+    chkrc(rc, goto error);
+    if (sealed) {
+        rc = Tss2_MU_TPM2B_PUBLIC_Marshal(&keyPublicSeal, *importBlob,
+                                          *importBlob_size, &off);
+        chkrc(rc, goto error);
+        rc = Tss2_MU_TPM2B_PRIVATE_Marshal(&keyPrivateSeal, *importBlob,
+                                           *importBlob_size, &off);
+        chkrc(rc, goto error);
+    }
+
+    return 0;
+
+error:
+    OPENSSL_cleanse(seed, sizeof(seed));
+    free(*importBlob);
+    *importBlob = NULL;
+    free(*secret);
+    *secret = NULL;
+    *secret_size = 0;
+    return -1;
+}
+
+/** Compute the policy digest of a key in software.
+ *
+ * The digest is the authPolicy that tpm2totp_generateKey() and
+ * tpm2totp_reseal() obtain from their trial session on a TPM whose PCRs hold
+ * the given values, e.g. to compare golden PCR sets against the keys of a
+ * fleet. This does not touch a TPM and may be called from several threads.
+ * @param[in] pcrs PCRs of the policy (0 for the default).
+ * @param[in] banks PCR banks of the policy (0 for the default).
+ * @param[in] pcrValues Expected PCR values, concatenated bank by bank (SHA1,
+ *            SHA256, SHA384) in ascending PCR order.
+ * @param[in] pcrValues_size Size of the PCR values.
+ * @param[out] digest The SHA256 policy digest of TPM2TOTP_POLICY_SIZE bytes.
+ * @retval 0 on success.
+ * @retval -1 if the values do not match the selection or on undefined/general
+ *         failure.
+ */
+int
+tpm2totp_policyDigest(uint32_t pcrs, uint32_t banks,
+                      const uint8_t *pcrValues, size_t pcrValues_size,
+                      uint8_t *digest)
+{
+    TPML_PCR_SELECTION pcrsel;
+    TPM2B_DIGEST policy;
+
+    if (pcrValues == NULL || digest == NULL)
+        return -1;
+
+    /* Silently, as callers check whole streams of values */
+    if (pcr_selection(pcrs, banks, pcrValues_size, &pcrsel) != 0)
+        return -1;
+    if (policy_pcr(&pcrsel, pcrValues, pcrValues_size, &policy))
+        return -1;
+
+    memcpy(digest, &policy.buffer[0], TPM2TOTP_POLICY_SIZE);
+    return 0;
+}
+
+#else /* HAVE_CRYPTO */
+
+/* Without libcrypto, keys can only be created on the TPM itself */
+
+int
+tpm2totp_wrapKey(uint32_t pcrs, uint32_t banks,
+                 const uint8_t *pcrValues, size_t pcrValues_size,
+                 const char *password,
+                 const uint8_t *primaryPublic, size_t primaryPublic_size,
+                 uint8_t **secret, size_t *secret_size,
+                 uint8_t **importBlob, size_t *importBlob_size)
+{
+    (void)pcrs; (void)banks; (void)pcrValues; (void)pcrValues_size;
+    (void)password; (void)primaryPublic; (void)primaryPublic_size;
+    (void)secret_size; (void)importBlob_size;
+
+    if (secret)
+        *secret = NULL;
+    if (importBlob)
+        *importBlob = NULL;
+    dbg("Wrapping keys needs libcrypto, which this build does not use");
+    return -1;
+}
+
+int
+tpm2totp_policyDigest(uint32_t pcrs, uint32_t banks,
+                      const uint8_t *pcrValues, size_t pcrValues_size,
+                      uint8_t *digest)
+{
+    (void)pcrs; (void)banks; (void)pcrValues; (void)pcrValues_size;
+    (void)digest;
+
+    return -1;
+}
+
+#endif /* HAVE_CRYPTO */
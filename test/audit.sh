@@ -0,0 +1,63 @@
+# SPDX-License-Identifier: BSD-3
+# Copyright (c) 2018 Fraunhofer SIT
+# All rights reserved.
+#!/bin/bash
+
+echo "Audit tests"
+
+set -eEuf
+
+LANG=C
+PS4='$LINENO:'
+
+#Some debug options:
+set -x
+
+# RFC 6238 test vectors for the SHA-1 secret "12345678901234567890",
+# truncated to 6 digits
+SECRET="otpauth://totp/TPM2-TOTP?secret=GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ"
+
+INVENTORY=$(mktemp)
+OUTPUT=$(mktemp)
+
+function cleanup()
+{
+    rm -f $INVENTORY $OUTPUT
+    echo .
+}
+
+function error()
+{
+    echo "FAILED"
+}
+
+trap "cleanup" EXIT
+trap "error" ERR
+
+cat >$INVENTORY <<END
+# device uri code time
+dev-a $SECRET 287082 59
+dev-a $SECRET 081804 1111111109
+dev-b $SECRET 005924 1234567950
+dev-b $SECRET 005924 1234567890
+dev-c $SECRET 279037 2000000000
+END
+
+./tpm2-totp -j 2 audit $INVENTORY | tee $OUTPUT
+grep -q "^dev-a: 2 records, 0 mismatches, skew +0s$" $OUTPUT
+grep -q "^dev-b: 2 records, 0 mismatches, skew -30s$" $OUTPUT
+grep -q "^5 records of 3 devices: 0 mismatches, 0 invalid$" $OUTPUT
+
+# The code of dev-b is 2 steps off, outside a window of 1
+if ./tpm2-totp -w 1 audit $INVENTORY >$OUTPUT; then
+    echo "A code outside the window was accepted!"
+    exit 1
+fi
+grep -q "^dev-b: mismatch at 1234567950 (code 005924)$" $OUTPUT
+
+echo "dev-d otpauth://totp/TPM2-TOTP?secret=GEZDGNBVGY3TQOJQ&digits=8 12345678 59" >>$INVENTORY
+if ./tpm2-totp audit $INVENTORY >$OUTPUT; then
+    echo "An unsupported record was accepted!"
+    exit 1
+fi
+grep -q "^dev-d: invalid record$" $OUTPUT
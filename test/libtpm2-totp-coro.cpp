@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#include <tpm2-totp-coro.hpp>
+#include "tcti-libtpms.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <poll.h>
+
+#define check(cond) if (!(cond)) {\
+    std::fprintf(stderr, "ERROR in %s:%i: %s\n", __FILE__, __LINE__, #cond);\
+    std::exit(1); }
+
+#define NV 0x01800011
+
+static std::uint64_t
+soft_code(const tpm2totp::secret &secret, std::time_t now)
+{
+    std::uint64_t otp;
+    int rc = tpm2totp_softCalculate(secret.data(), secret.size(), now, 1, &otp);
+
+    check(rc == 0);
+    return otp;
+}
+
+static tpm2totp::task<int>
+single(tpm2totp::async_context &ac, const tpm2totp::generated_key &k)
+{
+    auto code = co_await ac.calculate(k.key);
+    check(code.ok());
+    check(code->code == soft_code(k.secret, code->time));
+    co_return 1;
+}
+
+static tpm2totp::task<>
+all(tpm2totp::async_context &ac, const tpm2totp::generated_key &k1,
+    const tpm2totp::generated_key &k2, int &served)
+{
+    auto loaded = co_await ac.load_key_nv(NV);
+    check(loaded.ok());
+    check(loaded->size() == k1.key.size() &&
+          !std::memcmp(loaded->data(), k1.key.data(), loaded->size()));
+
+    /* Awaited together, the calculations are coalesced into a batch */
+    tpm2totp::task<int> a = single(ac, k1), b = single(ac, k2);
+    a.start();
+    b.start();
+    auto codes = co_await ac.calculate_many<2>({ *loaded, k2.key });
+    check(codes.ok());
+    check((*codes)[0].code == soft_code(k1.secret, (*codes)[0].time));
+    check((*codes)[1].code == soft_code(k2.secret, (*codes)[1].time));
+    served += co_await a + co_await b;
+
+    auto bad = co_await ac.calculate(tpm2totp::blob_view());
+    check(!bad && bad.rc() == -1);
+    check(!(co_await ac.load_key_nv(NV + 1)).ok());
+}
+
+int
+main()
+{
+    TSS2_TCTI_CONTEXT *tcti;
+    int served = 0;
+
+    check(tcti_libtpms_new(nullptr, &tcti) == 0);
+    {
+        auto opened = tpm2totp::context::open(tcti);
+        check(opened.ok());
+        tpm2totp::context ctx = std::move(*opened);
+
+        auto k1 = ctx.generate_key();
+        auto k2 = ctx.generate_key(0x01, 0);
+        check(k1.ok() && k2.ok());
+        check(ctx.store_key_nv(k1->key, NV).ok());
+        tcti_libtpms_set_latency(tcti, 1000);
+
+        tpm2totp::async_context ac(ctx);
+        auto handles = ac.poll_handles();
+        check(handles.ok() && !handles->empty());
+
+        auto t = all(ac, *k1, *k2, served);
+        t.start();
+        while (!t.done()) {
+            check(ac.busy());
+            check(poll(handles->data(), handles->size(), -1) > 0);
+            ac.on_ready();
+        }
+        check(served == 2);
+
+        tcti_libtpms_set_latency(tcti, 0);
+        check(ctx.delete_key_nv(NV).ok());
+    }
+    tcti_libtpms_free(&tcti);
+    return 0;
+}
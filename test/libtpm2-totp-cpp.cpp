@@ -0,0 +1,97 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#include <tpm2-totp.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#ifdef HAVE_LIBTPMS
+#include "tcti-libtpms.h"
+#endif
+
+#define check(cond) if (!(cond)) {\
+    std::fprintf(stderr, "ERROR in %s:%i: %s\n", __FILE__, __LINE__, #cond);\
+    std::exit(1); }
+
+#define PWD "hallo"
+
+/* The code the library calculates in software for a secret */
+static std::uint64_t
+soft_code(const tpm2totp::secret &secret, std::time_t now)
+{
+    std::uint64_t otp;
+    int rc = tpm2totp_softCalculate(secret.data(), secret.size(), now, 1, &otp);
+
+    check(rc == 0);
+    return otp;
+}
+
+int
+main()
+{
+    TSS2_TCTI_CONTEXT *tcti = nullptr;
+#ifdef HAVE_LIBTPMS
+    check(tcti_libtpms_new(nullptr, &tcti) == 0);
+#endif
+    {
+        auto opened = tpm2totp::context::open(tcti);
+        check(opened.ok());
+        tpm2totp::context ctx = std::move(*opened);
+        check(ctx && !*opened);
+
+        auto k1 = ctx.generate_key(0, 0, PWD);
+        check(k1.ok());
+        auto k2 = ctx.generate_key(0x01, 0);
+        check(k2.ok());
+
+        check(ctx.store_key_nv(k1->key, 0x01800010).ok());
+        auto loaded = ctx.load_key_nv(0x01800010);
+        check(loaded.ok());
+        check(loaded->size() == k1->key.size() &&
+              !std::memcmp(loaded->data(), k1->key.data(), loaded->size()));
+
+        /* Blobs from other containers are viewed without copies */
+        std::vector<std::uint8_t> copy(loaded->data(),
+                                       loaded->data() + loaded->size());
+        auto code = ctx.calculate(copy);
+        check(code.ok());
+        check(code->code == soft_code(k1->secret, code->time));
+        check(code->timestep() == std::uint64_t(code->time) / 30);
+
+        auto prepared = ctx.prepare_key_nv(0x01800010);
+        check(prepared.ok());
+        auto fast = ctx.calculate_prepared(*prepared);
+        check(fast.ok() && fast->code == soft_code(k1->secret, fast->time));
+
+        auto codes = ctx.calculate_many<2>({ *loaded, k2->key });
+        check(codes.ok());
+        check((*codes)[0].code == soft_code(k1->secret, (*codes)[0].time));
+        check((*codes)[1].code == soft_code(k2->secret, (*codes)[1].time));
+
+        auto secret = ctx.get_secret(*loaded, PWD);
+        check(secret.ok());
+        check(secret->size() == k1->secret.size() &&
+              !std::memcmp(secret->data(), k1->secret.data(), secret->size()));
+
+        tpm2totp::secret moved = std::move(*secret);
+        check(moved.size() == k1->secret.size() && secret->empty());
+
+        /* Failures are reported as error codes */
+        auto none = ctx.get_secret(k2->key, PWD);
+        check(!none.ok() && none.error().category() == tpm2totp::category());
+        auto bad = ctx.calculate(tpm2totp::blob_view());
+        check(!bad && bad.rc() == -1 && !bad.error().message().empty());
+
+        check(ctx.delete_key_nv(0x01800010).ok());
+        check(!ctx.load_key_nv(0x01800010).ok());
+    }
+#ifdef HAVE_LIBTPMS
+    tcti_libtpms_free(&tcti);
+#endif
+    return 0;
+}
@@ -4,92 +4,1289 @@
  * All rights reserved.
  *******************************************************************************/
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <tpm2-totp.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <liboath/oath.h>
 
+#ifdef HAVE_LIBTPMS
+#include "tcti-libtpms.h"
+#endif
+
 #define chkrc(rc, cmd) if (rc != TSS2_RC_SUCCESS) {\
     fprintf(stderr, "ERROR in %s:%i: 0x%08x\n", __FILE__, __LINE__, rc); cmd; }
 
 #define PWD "hallo"
 
-int
-main(int argc, char **argv)
+/* Every test case runs against a fresh in-process TPM if libtpms is
+   available and against the default TCTI (the simulator) otherwise. */
+static TSS2_TCTI_CONTEXT *
+tpm_start(void)
 {
-    (void)(argc); (void)(argv);
+    TSS2_TCTI_CONTEXT *tcti = NULL;
+#ifdef HAVE_LIBTPMS
+    int rc = tcti_libtpms_new(NULL, &tcti);
+    chkrc(rc, exit(1));
+#endif
+    return tcti;
+}
+
+/* A second TCTI on the TPM of tpm_start(), for use next to a context that
+   a thread of the library owns. It has to be stopped first. */
+static TSS2_TCTI_CONTEXT *
+tpm_share(TSS2_TCTI_CONTEXT *tcti)
+{
+    TSS2_TCTI_CONTEXT *shared = NULL;
+#ifdef HAVE_LIBTPMS
+    int rc = tcti_libtpms_share(tcti, &shared);
+    chkrc(rc, exit(1));
+#else
+    (void)(tcti);
+#endif
+    return shared;
+}
+
+static void
+tpm_stop(TSS2_TCTI_CONTEXT *tcti)
+{
+#ifdef HAVE_LIBTPMS
+    tcti_libtpms_free(&tcti);
+#else
+    (void)(tcti);
+#endif
+}
+
+static void
+check_code(uint64_t totp, time_t now,
+           const uint8_t *secret, size_t secret_size)
+{
+    int rc;
+    char totp_string[7], totp_check[7];
+
+    snprintf(&totp_string[0], 7, "%.*ld", 6, totp);
+
+    rc = oath_totp_generate((char *)secret, secret_size, now, 30, 0, 6, &totp_check[0]);
+    chkrc(rc, exit(1));
+
+    if (!!memcmp(&totp_string[0], &totp_check[0], 7)) {
+        fprintf(stderr, "TPM's %s != %s\n", totp_string, totp_check);
+        exit(1);
+    }
+}
+
+static void
+check_totp(const uint8_t *keyBlob, size_t keyBlob_size,
+           const uint8_t *secret, size_t secret_size,
+           TSS2_TCTI_CONTEXT *tcti)
+{
+    int rc;
+    uint64_t totp;
+    time_t now;
+
+    rc = tpm2totp_calculate_tcti(keyBlob, keyBlob_size, tcti, &now, &totp);
+    chkrc(rc, exit(1));
+    check_code(totp, now, secret, secret_size);
+}
+
+static void
+test_calculate(void)
+{
+    int rc;
+    uint8_t *secret, *keyBlob;
+    size_t secret_size, keyBlob_size;
+    uint64_t totp;
+    time_t now;
+    TSS2_TCTI_CONTEXT *tcti = tpm_start();
+
+    rc = tpm2totp_generateKey_tcti(0x00, 0x00, PWD, tcti,
+                                   &secret, &secret_size,
+                                   &keyBlob, &keyBlob_size);
+    chkrc(rc, exit(1));
+
+    check_totp(keyBlob, keyBlob_size, secret, secret_size, tcti);
 
+    /* Without a TCTI of its own, the test uses the default one as well */
+    if (!tcti) {
+        rc = tpm2totp_calculate(keyBlob, keyBlob_size, &now, &totp);
+        chkrc(rc, exit(1));
+        check_code(totp, now, secret, secret_size);
+    }
+
+    free(keyBlob);
+    free(secret);
+    tpm_stop(tcti);
+}
+
+static void
+test_reseal(void)
+{
     int rc;
     uint8_t *secret, *keyBlob, *newBlob;
     size_t secret_size, keyBlob_size, newBlob_size;
+    TSS2_TCTI_CONTEXT *tcti = tpm_start();
+
+    rc = tpm2totp_generateKey_tcti(0x00, 0x00, PWD, tcti,
+                                   &secret, &secret_size,
+                                   &keyBlob, &keyBlob_size);
+    chkrc(rc, exit(1));
+
+    rc = tpm2totp_reseal_tcti(keyBlob, keyBlob_size, PWD, 0, 0, tcti,
+                              &newBlob, &newBlob_size);
+    chkrc(rc, exit(1));
+
+    check_totp(newBlob, newBlob_size, secret, secret_size, tcti);
+
+    free(newBlob);
+    free(keyBlob);
+    free(secret);
+    tpm_stop(tcti);
+}
+
+static void
+test_getSecret(void)
+{
+    int rc;
+    uint8_t *secret, *keyBlob, *recovered;
+    size_t secret_size, keyBlob_size, recovered_size;
+    TSS2_TCTI_CONTEXT *tcti = tpm_start();
+
+    rc = tpm2totp_generateKey_tcti(0x00, 0x00, PWD, tcti,
+                                   &secret, &secret_size,
+                                   &keyBlob, &keyBlob_size);
+    chkrc(rc, exit(1));
+
+    rc = tpm2totp_getSecret_tcti(keyBlob, keyBlob_size, PWD, tcti,
+                                 &recovered, &recovered_size);
+    chkrc(rc, exit(1));
+
+    if (recovered_size != secret_size ||
+        !!memcmp(recovered, secret, secret_size)) {
+        fprintf(stderr, "Recovered secret differs from the generated one\n");
+        exit(1);
+    }
+
+    free(recovered);
+    free(keyBlob);
+    free(secret);
+    tpm_stop(tcti);
+}
+
+#ifdef HAVE_CRYPTO
+static void
+test_wrapKey(void)
+{
+    int rc;
+    uint8_t *primary, *secret, *importBlob, *keyBlob, *recovered;
+    size_t primary_size, secret_size, importBlob_size, keyBlob_size;
+    size_t recovered_size;
+    /* PCRs 0, 2 and 4 of the SHA1 and SHA256 banks after TPM startup */
+    uint8_t pcrValues[3 * (20 + 32)] = { 0 };
+    TSS2_TCTI_CONTEXT *tcti = tpm_start();
+
+    rc = tpm2totp_getPrimaryPublic(tcti, &primary, &primary_size);
+    chkrc(rc, exit(1));
+
+    /* This part does not need the TPM */
+    rc = tpm2totp_wrapKey(0x00, 0x00, &pcrValues[0], sizeof(pcrValues), PWD,
+                          primary, primary_size, &secret, &secret_size,
+                          &importBlob, &importBlob_size);
+    chkrc(rc, exit(1));
+
+    rc = tpm2totp_wrapKey(0x00, 0x00, &pcrValues[0], sizeof(pcrValues) - 1,
+                          PWD, primary, primary_size, &recovered,
+                          &recovered_size, &keyBlob, &keyBlob_size);
+    if (rc == 0) {
+        fprintf(stderr, "Wrapped a key for PCR values of the wrong size\n");
+        exit(1);
+    }
+
+    rc = tpm2totp_importKey(importBlob, importBlob_size, tcti,
+                            &keyBlob, &keyBlob_size);
+    chkrc(rc, exit(1));
+
+    check_totp(keyBlob, keyBlob_size, secret, secret_size, tcti);
+
+    rc = tpm2totp_getSecret_tcti(keyBlob, keyBlob_size, PWD, tcti,
+                                 &recovered, &recovered_size);
+    chkrc(rc, exit(1));
+
+    if (recovered_size != secret_size ||
+        !!memcmp(recovered, secret, secret_size)) {
+        fprintf(stderr, "Recovered secret differs from the wrapped one\n");
+        exit(1);
+    }
+
+    free(recovered);
+    free(keyBlob);
+    free(importBlob);
+    free(secret);
+    free(primary);
+    tpm_stop(tcti);
+}
+
+/* The key blob starts with the PCRs, the banks and the public area of the
+   HMAC key: size, type, name algorithm, attributes and the policy */
+#define KEYBLOB_POLICY_OFFSET (4 + 4 + 2 + 2 + 2 + 4 + 2)
+
+static void
+test_policyDigest(void)
+{
+    int rc;
+    uint8_t *secret, *keyBlob;
+    size_t secret_size, keyBlob_size;
+    /* PCRs 0, 2 and 4 of the SHA1 and SHA256 banks after TPM startup */
+    uint8_t pcrValues[3 * (20 + 32)] = { 0 };
+    uint8_t digest[TPM2TOTP_POLICY_SIZE];
+    TSS2_TCTI_CONTEXT *tcti = tpm_start();
+
+    rc = tpm2totp_generateKey_tcti(0x00, 0x00, NULL, tcti,
+                                   &secret, &secret_size,
+                                   &keyBlob, &keyBlob_size);
+    chkrc(rc, exit(1));
+
+    rc = tpm2totp_policyDigest(0x00, 0x00, &pcrValues[0], sizeof(pcrValues),
+                               &digest[0]);
+    chkrc(rc, exit(1));
+
+    if (keyBlob_size < KEYBLOB_POLICY_OFFSET + sizeof(digest) ||
+        keyBlob[KEYBLOB_POLICY_OFFSET - 1] != sizeof(digest) ||
+        !!memcmp(&keyBlob[KEYBLOB_POLICY_OFFSET], digest, sizeof(digest))) {
+        fprintf(stderr, "Policy digest differs from the trial session's\n");
+        exit(1);
+    }
+
+    /* The same values for explicitly selected PCRs and banks */
+    rc = tpm2totp_policyDigest(0x15, TPM2TOTP_BANK_SHA1 | TPM2TOTP_BANK_SHA256,
+                               &pcrValues[0], sizeof(pcrValues), &digest[0]);
+    chkrc(rc, exit(1));
+    if (!!memcmp(&keyBlob[KEYBLOB_POLICY_OFFSET], digest, sizeof(digest))) {
+        fprintf(stderr, "Policy digest depends on the default selection\n");
+        exit(1);
+    }
+
+    rc = tpm2totp_policyDigest(0x00, TPM2TOTP_BANK_SHA256, &pcrValues[0],
+                               sizeof(pcrValues), &digest[0]);
+    if (rc == 0) {
+        fprintf(stderr, "Computed a policy for PCR values of the wrong size\n");
+        exit(1);
+    }
+
+    free(keyBlob);
+    free(secret);
+    tpm_stop(tcti);
+}
+#endif /* HAVE_CRYPTO */
+
+static void
+test_nv(void)
+{
+    int rc;
+    uint8_t *secret, *keyBlob;
+    size_t secret_size, keyBlob_size;
+    TSS2_TCTI_CONTEXT *tcti = tpm_start();
+
+    rc = tpm2totp_generateKey_tcti(0x00, 0x00, PWD, tcti,
+                                   &secret, &secret_size,
+                                   &keyBlob, &keyBlob_size);
+    chkrc(rc, exit(1));
+
+    rc = tpm2totp_storeKey_nv_tcti(keyBlob, keyBlob_size, 0, tcti);
+    chkrc(rc, exit(1));
+
+    free(keyBlob);
+    rc = tpm2totp_loadKey_nv_tcti(0, tcti, &keyBlob, &keyBlob_size);
+    chkrc(rc, exit(1));
+
+    rc = tpm2totp_deleteKey_nv_tcti(0, tcti);
+    chkrc(rc, exit(1));
+
+    rc = tpm2totp_storeKey_nv_tcti(keyBlob, keyBlob_size, 0, tcti);
+    chkrc(rc, exit(1));
+
+    rc = tpm2totp_deleteKey_nv_tcti(0, tcti);
+    chkrc(rc, exit(1));
+
+    free(keyBlob);
+    free(secret);
+    tpm_stop(tcti);
+}
+
+#define BATCH 3
+
+struct batch {
+    size_t count;
+    uint32_t nv[BATCH];
+    uint8_t secret[BATCH][20];
+};
+
+static int
+collect_secret(uint32_t nv, const uint8_t *secret, size_t secret_size,
+               void *userdata)
+{
+    struct batch *batch = userdata;
+
+    if (batch->count == BATCH || secret_size != sizeof(batch->secret[0]))
+        return -1;
+    batch->nv[batch->count] = nv;
+    memcpy(&batch->secret[batch->count][0], secret, secret_size);
+    batch->count++;
+    return 0;
+}
+
+static void
+test_generateKeys_nv(void)
+{
+    int rc;
+    uint8_t *keyBlob, *single, *secret, *recovered;
+    size_t keyBlob_size, single_size, secret_size, recovered_size;
+    uint32_t nvs[BATCH] = { 0x01800010, 0x01800011, 0x01800012 };
+    struct batch batch = { .count = 0 };
+    TSS2_TCTI_CONTEXT *tcti = tpm_start();
+
+    /* The keys of a batch are made like single keys */
+    rc = tpm2totp_generateKey_tcti(0x00, 0x00, PWD, tcti,
+                                   &secret, &secret_size,
+                                   &single, &single_size);
+    chkrc(rc, exit(1));
+    free(secret);
+
+    rc = tpm2totp_generateKeys_nv(0x00, 0x00, PWD, &nvs[0], BATCH, tcti,
+                                  collect_secret, &batch);
+    chkrc(rc, exit(1));
+
+    if (batch.count != BATCH) {
+        fprintf(stderr, "Reported %zu of %i keys\n", batch.count, BATCH);
+        exit(1);
+    }
+
+    for (size_t i = 0; i < BATCH; i++) {
+        if (batch.nv[i] != nvs[i]) {
+            fprintf(stderr, "Keys reported out of order\n");
+            exit(1);
+        }
+        rc = tpm2totp_loadKey_nv_tcti(nvs[i], tcti, &keyBlob, &keyBlob_size);
+        chkrc(rc, exit(1));
+
+        check_totp(keyBlob, keyBlob_size, &batch.secret[i][0],
+                   sizeof(batch.secret[i]), tcti);
+
+        /* The password is only part of the sealed copy of the secret */
+        if (keyBlob_size != single_size) {
+            fprintf(stderr, "Batch key of %zu bytes instead of %zu\n",
+                    keyBlob_size, single_size);
+            exit(1);
+        }
+        rc = tpm2totp_getSecret_tcti(keyBlob, keyBlob_size, PWD, tcti,
+                                     &recovered, &recovered_size);
+        chkrc(rc, exit(1));
+        if (recovered_size != sizeof(batch.secret[i]) ||
+            memcmp(recovered, &batch.secret[i][0], recovered_size)) {
+            fprintf(stderr, "Recovered a different batch secret\n");
+            exit(1);
+        }
+        free(recovered);
+        free(keyBlob);
+
+        rc = tpm2totp_deleteKey_nv_tcti(nvs[i], tcti);
+        chkrc(rc, exit(1));
+    }
+
+    free(single);
+    tpm_stop(tcti);
+}
+
+struct listed {
+    size_t count;
+    uint32_t nv[BATCH];
+    uint32_t pcrs[BATCH];
+    uint32_t banks[BATCH];
+};
+
+static int
+collect_key(uint32_t nv, uint32_t pcrs, uint32_t banks, void *userdata)
+{
+    struct listed *listed = userdata;
+
+    if (listed->count == BATCH)
+        return -1;
+    listed->nv[listed->count] = nv;
+    listed->pcrs[listed->count] = pcrs;
+    listed->banks[listed->count] = banks;
+    listed->count++;
+    return 0;
+}
+
+static void
+test_listKeys_nv(void)
+{
+    int rc;
+    uint8_t *secret, *keyBlob;
+    size_t secret_size, keyBlob_size;
+    const uint8_t junk[64] = { 0x00, 0x00, 0x00, 0x15 };
+    struct listed listed = { .count = 0 };
+    TSS2_TCTI_CONTEXT *tcti = tpm_start();
+
+    rc = tpm2totp_generateKey_tcti(0x05, TPM2TOTP_BANK_SHA256, PWD, tcti,
+                                   &secret, &secret_size,
+                                   &keyBlob, &keyBlob_size);
+    chkrc(rc, exit(1));
+
+    rc = tpm2totp_storeKey_nv_tcti(keyBlob, keyBlob_size, 0x01800020, tcti);
+    chkrc(rc, exit(1));
+    rc = tpm2totp_storeKey_nv_tcti(keyBlob, keyBlob_size, 0x01000010, tcti);
+    chkrc(rc, exit(1));
+
+    /* An index like the ones of keys that holds something else */
+    rc = tpm2totp_storeKey_nv_tcti(&junk[0], sizeof(junk), 0x01800010, tcti);
+    chkrc(rc, exit(1));
+
+    rc = tpm2totp_listKeys_nv(tcti, collect_key, &listed);
+    chkrc(rc, exit(1));
+
+    if (listed.count != 2 || listed.nv[0] != 0x01000010 ||
+        listed.nv[1] != 0x01800020) {
+        fprintf(stderr, "Listed %zu keys instead of the 2 stored\n",
+                listed.count);
+        exit(1);
+    }
+    if (listed.pcrs[1] != 0x05 || listed.banks[1] != TPM2TOTP_BANK_SHA256) {
+        fprintf(stderr, "Listed PCRs or banks differ from the stored\n");
+        exit(1);
+    }
+
+    /* The callback stops the listing */
+    listed.count = BATCH;
+    rc = tpm2totp_listKeys_nv(tcti, collect_key, &listed);
+    if (rc != -20) {
+        fprintf(stderr, "Listing was not stopped by the callback\n");
+        exit(1);
+    }
+
+    rc = tpm2totp_deleteKey_nv_tcti(0x01800020, tcti);
+    chkrc(rc, exit(1));
+    rc = tpm2totp_deleteKey_nv_tcti(0x01000010, tcti);
+    chkrc(rc, exit(1));
+    rc = tpm2totp_deleteKey_nv_tcti(0x01800010, tcti);
+    chkrc(rc, exit(1));
+
+    free(keyBlob);
+    free(secret);
+    tpm_stop(tcti);
+}
+
+static void
+test_resealKeys_nv(void)
+{
+    int rc;
+    uint8_t *keyBlob, *before;
+    size_t keyBlob_size, before_size;
+    uint32_t nvs[BATCH] = { 0x01800010, 0x01800011, 0x01800012 };
+    uint32_t twice[2] = { 0x01800011, 0x01800011 };
+    struct batch batch = { .count = 0 };
+    struct listed listed = { .count = 0 };
+    TSS2_TCTI_CONTEXT *tcti = tpm_start();
+
+    rc = tpm2totp_generateKeys_nv(0x00, 0x00, PWD, &nvs[0], BATCH, tcti,
+                                  collect_secret, &batch);
+    chkrc(rc, exit(1));
+
+    /* A wrong password for one key leaves all keys unchanged */
+    rc = tpm2totp_loadKey_nv_tcti(nvs[0], tcti, &before, &before_size);
+    chkrc(rc, exit(1));
+    rc = tpm2totp_resealKeys_nv("wrong", 0x01, TPM2TOTP_BANK_SHA256,
+                                &nvs[0], BATCH, tcti);
+    if (rc == 0) {
+        fprintf(stderr, "Resealed keys with a wrong password\n");
+        exit(1);
+    }
+    rc = tpm2totp_loadKey_nv_tcti(nvs[0], tcti, &keyBlob, &keyBlob_size);
+    chkrc(rc, exit(1));
+    if (keyBlob_size != before_size || !!memcmp(keyBlob, before, before_size)) {
+        fprintf(stderr, "Failed batch reseal changed a key\n");
+        exit(1);
+    }
+    free(keyBlob);
+    free(before);
+
+    /* An index listed twice is rejected */
+    rc = tpm2totp_resealKeys_nv(PWD, 0x01, TPM2TOTP_BANK_SHA256,
+                                &twice[0], 2, tcti);
+    if (rc == 0) {
+        fprintf(stderr, "Resealed a key listed twice\n");
+        exit(1);
+    }
+
+    rc = tpm2totp_resealKeys_nv(PWD, 0x01, TPM2TOTP_BANK_SHA256,
+                                &nvs[0], BATCH, tcti);
+    chkrc(rc, exit(1));
+
+    rc = tpm2totp_listKeys_nv(tcti, collect_key, &listed);
+    chkrc(rc, exit(1));
+    for (size_t i = 0; i < BATCH; i++) {
+        if (listed.count != BATCH || listed.nv[i] != nvs[i] ||
+            listed.pcrs[i] != 0x01 ||
+            listed.banks[i] != TPM2TOTP_BANK_SHA256) {
+            fprintf(stderr, "Keys were not resealed to the new PCRs\n");
+            exit(1);
+        }
+
+        rc = tpm2totp_loadKey_nv_tcti(nvs[i], tcti, &keyBlob, &keyBlob_size);
+        chkrc(rc, exit(1));
+        check_totp(keyBlob, keyBlob_size, &batch.secret[i][0],
+                   sizeof(batch.secret[i]), tcti);
+        free(keyBlob);
+
+        rc = tpm2totp_deleteKey_nv_tcti(nvs[i], tcti);
+        chkrc(rc, exit(1));
+    }
+
+    tpm_stop(tcti);
+}
+
+static void
+test_context(void)
+{
+    int rc;
+    uint8_t *secret, *keyBlob, *recovered;
+    size_t secret_size, keyBlob_size, recovered_size;
     uint64_t totp;
-    char totp_string[7], totp_check[7];
     time_t now;
+    TPM2TOTP_CONTEXT *context;
+    TSS2_TCTI_CONTEXT *tcti = tpm_start();
 
-/**********/
+    rc = tpm2totp_context_new(tcti, &context);
+    chkrc(rc, exit(1));
 
-    rc = tpm2totp_generateKey(0x00, 0x00, PWD,
-                              &secret, &secret_size, &keyBlob, &keyBlob_size);
+    rc = tpm2totp_context_generateKey(context, 0x00, 0x00, PWD,
+                                      &secret, &secret_size,
+                                      &keyBlob, &keyBlob_size);
     chkrc(rc, exit(1));
 
-    rc = tpm2totp_calculate(keyBlob, keyBlob_size, &now, &totp);
+    rc = tpm2totp_context_storeKey_nv(context, keyBlob, keyBlob_size, 0);
     chkrc(rc, exit(1));
-    snprintf(&totp_string[0], 7, "%.*ld", 6, totp);
 
-    rc = oath_totp_generate((char *)secret, secret_size, now, 30, 0, 6, &totp_check[0]);
+    free(keyBlob);
+    rc = tpm2totp_context_loadKey_nv(context, 0, &keyBlob, &keyBlob_size);
     chkrc(rc, exit(1));
 
-    if (!!memcmp(&totp_string[0], &totp_check[0], 7)) {
-        fprintf(stderr, "TPM's %s != %s\n", totp_string, totp_check);
+    /* The operations share the primary key created by the first one */
+    for (int i = 0; i < 2; i++) {
+        rc = tpm2totp_context_calculate(context, keyBlob, keyBlob_size,
+                                        &now, &totp);
+        chkrc(rc, exit(1));
+        check_code(totp, now, secret, secret_size);
+    }
+
+    rc = tpm2totp_context_getSecret(context, keyBlob, keyBlob_size, PWD,
+                                    &recovered, &recovered_size);
+    chkrc(rc, exit(1));
+
+    if (recovered_size != secret_size ||
+        !!memcmp(recovered, secret, secret_size)) {
+        fprintf(stderr, "Recovered secret differs from the generated one\n");
+        exit(1);
+    }
+
+    rc = tpm2totp_context_deleteKey_nv(context, 0);
+    chkrc(rc, exit(1));
+
+    tpm2totp_context_free(context);
+    free(recovered);
+    free(keyBlob);
+    free(secret);
+    tpm_stop(tcti);
+}
+
+/* Write an event log starting with a crypto agile Spec ID event for the
+   given algorithms or, without algorithms, with an event of the SHA1 format */
+static void
+write_eventlog(const char *path, const uint16_t *algs, uint32_t count)
+{
+    static const uint8_t specid[] = "Spec ID Event03";
+    static const uint8_t zeros[20];
+    uint32_t type = count ? 3/*EV_NO_ACTION*/ : 8/*EV_S_CRTM_VERSION*/;
+    uint32_t eventSize = 16 + 4 + 4 + 4 + 4 * count + 1;
+    uint16_t size;
+    FILE *f = fopen(path, "wb");
+
+    if (!f) {
+        fprintf(stderr, "Cannot write the event log %s\n", path);
         exit(1);
-    }    
+    }
+    /* The log is little endian, as the machines writing it */
+    fwrite(zeros, 1, 4, f);
+    fwrite(&type, 4, 1, f);
+    fwrite(zeros, 1, 20, f);
+    fwrite(&eventSize, 4, 1, f);
+    fwrite(specid, 1, sizeof(specid), f);
+    fwrite(zeros, 1, 4, f);
+    fwrite("\0\2\0\2", 1, 4, f);
+    fwrite(&count, 4, 1, f);
+    for (uint32_t i = 0; i < count; i++) {
+        size = algs[i] == 0x0004 ? 20 : algs[i] == 0x000b ? 32 : 48;
+        fwrite(&algs[i], 2, 1, f);
+        fwrite(&size, 2, 1, f);
+    }
+    fwrite(zeros, 1, 1, f);
+    fclose(f);
+}
 
-/**********/
+/* Generate a key with automatically chosen banks and return the banks */
+static uint32_t
+generate_banks(TPM2TOTP_CONTEXT *context, uint32_t banks)
+{
+    int rc;
+    uint8_t *secret, *keyBlob;
+    size_t secret_size, keyBlob_size;
+    uint64_t totp;
+    time_t now;
 
-    rc = tpm2totp_reseal(keyBlob, keyBlob_size, PWD, 0, 0, &newBlob, &newBlob_size);
+    rc = tpm2totp_context_generateKey(context, 0x00, banks, NULL,
+                                      &secret, &secret_size,
+                                      &keyBlob, &keyBlob_size);
     chkrc(rc, exit(1));
 
-    rc = tpm2totp_calculate(newBlob, newBlob_size, &now, &totp);
+    rc = tpm2totp_context_calculate(context, keyBlob, keyBlob_size,
+                                    &now, &totp);
     chkrc(rc, exit(1));
-    snprintf(&totp_string[0], 7, "%.*ld", 6, totp);
+    check_code(totp, now, secret, secret_size);
 
-    rc = oath_totp_generate((char *)secret, secret_size, now, 30, 0, 6, &totp_check[0]);
+    /* The banks are stored after the PCRs in big endian */
+    banks = (uint32_t)keyBlob[4] << 24 | (uint32_t)keyBlob[5] << 16 |
+            (uint32_t)keyBlob[6] << 8 | keyBlob[7];
+    free(keyBlob);
+    free(secret);
+    return banks;
+}
+
+static void
+test_banks(void)
+{
+    static const uint16_t agile[] = { 0x0004/*SHA1*/, 0x000b/*SHA256*/ };
+    int rc;
+    uint32_t banks;
+    uint8_t digest[TPM2TOTP_POLICY_SIZE], values[3 * 20] = { 0 };
+    char path[] = "eventlog-XXXXXX";
+    TPM2TOTP_CONTEXT *context;
+    TSS2_TCTI_CONTEXT *tcti = tpm_start();
+
+    rc = tpm2totp_context_new(tcti, &context);
     chkrc(rc, exit(1));
 
-    if (!!memcmp(&totp_string[0], &totp_check[0], 7)) {
-        fprintf(stderr, "TPM's %s != %s\n", totp_string, totp_check);
+    /* Without an event log, the TPM's strongest active bank is used */
+    rc = tpm2totp_context_setEventLog(context, "");
+    chkrc(rc, exit(1));
+    banks = generate_banks(context, TPM2TOTP_BANK_AUTO);
+    if (banks == 0 || (banks & (banks - 1)) != 0 ||
+        (banks & TPM2TOTP_BANK_AUTO)) {
+        fprintf(stderr, "Automatic banks 0x%x are not a single bank\n", banks);
         exit(1);
     }
-    free(newBlob);
 
-/**********/
+    /* The bank is chosen among the given ones */
+    banks = generate_banks(context, TPM2TOTP_BANK_AUTO | TPM2TOTP_BANK_SHA1 |
+                                    TPM2TOTP_BANK_SHA256);
+    if (banks != TPM2TOTP_BANK_SHA256) {
+        fprintf(stderr, "Automatic banks 0x%x instead of SHA256\n", banks);
+        exit(1);
+    }
+
+    /* The banks that the firmware measures into are preferred */
+    close(mkstemp(path));
+    write_eventlog(path, agile, 2);
+    rc = tpm2totp_context_setEventLog(context, path);
+    chkrc(rc, exit(1));
+    banks = generate_banks(context, TPM2TOTP_BANK_AUTO);
+    if (banks != TPM2TOTP_BANK_SHA256) {
+        fprintf(stderr, "Automatic banks 0x%x instead of SHA256\n", banks);
+        exit(1);
+    }
+
+    write_eventlog(path, NULL, 0);
+    banks = generate_banks(context, TPM2TOTP_BANK_AUTO);
+    if (banks != TPM2TOTP_BANK_SHA1) {
+        fprintf(stderr, "Automatic banks 0x%x instead of SHA1\n", banks);
+        exit(1);
+    }
+    unlink(path);
+    tpm2totp_context_free(context);
+
+    /* Without a TPM, the bank cannot be chosen */
+    if (tpm2totp_policyDigest(0x00, TPM2TOTP_BANK_AUTO, values, sizeof(values),
+                              digest) == 0) {
+        fprintf(stderr, "Policy digest computed for automatic banks\n");
+        exit(1);
+    }
+
+    tpm_stop(tcti);
+}
+
+static void
+test_prepare(void)
+{
+    int rc;
+    uint8_t *secret, *keyBlob, *prepared;
+    size_t secret_size, keyBlob_size, prepared_size;
+    uint64_t totp;
+    time_t now;
+    TPM2TOTP_CONTEXT *context;
+    TSS2_TCTI_CONTEXT *tcti = tpm_start();
+
+    rc = tpm2totp_generateKey_tcti(0x00, 0x00, PWD, tcti,
+                                   &secret, &secret_size,
+                                   &keyBlob, &keyBlob_size);
+    chkrc(rc, exit(1));
+
+    rc = tpm2totp_storeKey_nv_tcti(keyBlob, keyBlob_size, 0, tcti);
+    chkrc(rc, exit(1));
+
+    rc = tpm2totp_prepareKey_nv(0, tcti, &prepared, &prepared_size);
+    chkrc(rc, exit(1));
+
+    rc = tpm2totp_calculatePrepared(prepared, prepared_size, tcti,
+                                    &now, &totp);
+    chkrc(rc, exit(1));
+    check_code(totp, now, secret, secret_size);
+
+    /* The prepared key stays valid in other contexts of the same TPM */
+    rc = tpm2totp_context_new(tcti, &context);
+    chkrc(rc, exit(1));
+    for (int i = 0; i < 2; i++) {
+        rc = tpm2totp_context_calculatePrepared(context, prepared,
+                                                prepared_size, &now, &totp);
+        chkrc(rc, exit(1));
+        check_code(totp, now, secret, secret_size);
+    }
+
+    rc = tpm2totp_context_calculatePrepared(context, prepared,
+                                            prepared_size - 1, &now, &totp);
+    if (rc == 0) {
+        fprintf(stderr, "Calculated with a truncated prepared key\n");
+        exit(1);
+    }
+    tpm2totp_context_free(context);
+
+    rc = tpm2totp_deleteKey_nv_tcti(0, tcti);
+    chkrc(rc, exit(1));
+
+    free(prepared);
+    free(keyBlob);
+    free(secret);
+    tpm_stop(tcti);
+}
+
+#define KEYS 3
+
+static void
+test_calculateMany(void)
+{
+    int rc;
+    uint8_t *secrets[KEYS], *keyBlobs[KEYS];
+    size_t secret_sizes[KEYS], keyBlob_sizes[KEYS];
+    uint64_t totps[KEYS];
+    time_t now;
+    TPM2TOTP_CONTEXT *context;
+    TSS2_TCTI_CONTEXT *tcti = tpm_start();
+
+    rc = tpm2totp_context_new(tcti, &context);
+    chkrc(rc, exit(1));
+
+    /* Keys with different PCR selections share one policy session */
+    for (int i = 0; i < KEYS; i++) {
+        rc = tpm2totp_context_generateKey(context, 1 << i, 0x00, NULL,
+                                          &secrets[i], &secret_sizes[i],
+                                          &keyBlobs[i], &keyBlob_sizes[i]);
+        chkrc(rc, exit(1));
+    }
+
+    rc = tpm2totp_context_calculateMany(context, KEYS,
+                                        (const uint8_t *const *)keyBlobs,
+                                        keyBlob_sizes, &now, totps);
+    chkrc(rc, exit(1));
+    for (int i = 0; i < KEYS; i++)
+        check_code(totps[i], now, secrets[i], secret_sizes[i]);
+    tpm2totp_context_free(context);
+
+    rc = tpm2totp_calculateMany(KEYS, (const uint8_t *const *)keyBlobs,
+                                keyBlob_sizes, tcti, &now, totps);
+    chkrc(rc, exit(1));
+    for (int i = 0; i < KEYS; i++) {
+        check_code(totps[i], now, secrets[i], secret_sizes[i]);
+        free(keyBlobs[i]);
+        free(secrets[i]);
+    }
+
+    tpm_stop(tcti);
+}
+
+/* Wait for the TPM to answer, busy-waiting if there are no poll handles */
+static void
+wait_tpm(TPM2TOTP_CONTEXT *context)
+{
+    TSS2_TCTI_POLL_HANDLE *handles;
+    size_t count;
+
+    if (tpm2totp_context_getPollHandles(context, &handles, &count) != 0)
+        return;
+    poll(handles, count, -1);
+    free(handles);
+}
+
+static void
+test_async(void)
+{
+    int rc;
+    uint8_t *secrets[2], *keyBlobs[2], *loaded;
+    size_t secret_sizes[2], keyBlob_sizes[2], loaded_size;
+    uint64_t totps[2];
+    time_t now;
+    TPM2TOTP_CONTEXT *context;
+    TSS2_TCTI_CONTEXT *tcti = tpm_start();
+
+    rc = tpm2totp_context_new(tcti, &context);
+    chkrc(rc, exit(1));
+
+    for (int i = 0; i < 2; i++) {
+        rc = tpm2totp_context_generateKey(context, 1 << i, 0x00, NULL,
+                                          &secrets[i], &secret_sizes[i],
+                                          &keyBlobs[i], &keyBlob_sizes[i]);
+        chkrc(rc, exit(1));
+    }
+    rc = tpm2totp_context_storeKey_nv(context, keyBlobs[0], keyBlob_sizes[0],
+                                      0);
+    chkrc(rc, exit(1));
+#ifdef HAVE_LIBTPMS
+    /* Responses take a while, so the operations have to wait for them */
+    tcti_libtpms_set_latency(tcti, 1000);
+#endif
+
+    rc = tpm2totp_context_loadKey_nv_async(context, 0);
+    chkrc(rc, exit(1));
+    if (tpm2totp_context_calculate_async(context, keyBlobs[0],
+                                         keyBlob_sizes[0]) != -1) {
+        fprintf(stderr, "Second asynchronous operation was started\n");
+        exit(1);
+    }
+    while ((rc = tpm2totp_context_loadKey_nv_finish(context, &loaded,
+                                                    &loaded_size))
+            == TPM2TOTP_RC_TRY_AGAIN)
+        wait_tpm(context);
+    chkrc(rc, exit(1));
+    if (loaded_size != keyBlob_sizes[0] ||
+        !!memcmp(loaded, keyBlobs[0], loaded_size)) {
+        fprintf(stderr, "Loaded key differs from the stored one\n");
+        exit(1);
+    }
+
+    rc = tpm2totp_context_calculate_async(context, loaded, loaded_size);
+    chkrc(rc, exit(1));
+    free(loaded);
+    while ((rc = tpm2totp_context_calculate_finish(context, &now, &totps[0]))
+            == TPM2TOTP_RC_TRY_AGAIN)
+        wait_tpm(context);
+    chkrc(rc, exit(1));
+    check_code(totps[0], now, secrets[0], secret_sizes[0]);
+
+    rc = tpm2totp_context_calculateMany_async(context, 2,
+                                              (const uint8_t *const *)keyBlobs,
+                                              keyBlob_sizes);
+    chkrc(rc, exit(1));
+    while ((rc = tpm2totp_context_calculateMany_finish(context, &now, totps))
+            == TPM2TOTP_RC_TRY_AGAIN)
+        wait_tpm(context);
+    chkrc(rc, exit(1));
+    for (int i = 0; i < 2; i++)
+        check_code(totps[i], now, secrets[i], secret_sizes[i]);
+
+    /* A pending operation is aborted when the context is freed */
+    rc = tpm2totp_context_deleteKey_nv(context, 0);
+    chkrc(rc, exit(1));
+    rc = tpm2totp_context_calculate_async(context, keyBlobs[1],
+                                          keyBlob_sizes[1]);
+    chkrc(rc, exit(1));
+    tpm2totp_context_free(context);
+
+    for (int i = 0; i < 2; i++) {
+        free(keyBlobs[i]);
+        free(secrets[i]);
+    }
+    tpm_stop(tcti);
+}
+
+#define OWNERPWD "owner"
+#define NVPWD "nv"
+
+/* Set the owner password of the TPM, which is empty on a fresh one */
+static void
+set_owner_password(TSS2_TCTI_CONTEXT *tcti, const char *old, const char *new)
+{
+    TPM2B_AUTH oldAuth = { .size = strlen(old) };
+    TPM2B_AUTH newAuth = { .size = strlen(new) };
+    ESYS_CONTEXT *ctx;
+    int rc;
+
+    memcpy(&oldAuth.buffer[0], old, oldAuth.size);
+    memcpy(&newAuth.buffer[0], new, newAuth.size);
+
+    rc = Esys_Initialize(&ctx, tcti, NULL);
+    chkrc(rc, exit(1));
+    rc = Esys_Startup(ctx, TPM2_SU_CLEAR);
+    if (rc != TPM2_RC_INITIALIZE) chkrc(rc, exit(1));
+    rc = Esys_TR_SetAuth(ctx, ESYS_TR_RH_OWNER, &oldAuth);
+    chkrc(rc, exit(1));
+    rc = Esys_HierarchyChangeAuth(ctx, ESYS_TR_RH_OWNER,
+                                  ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
+                                  &newAuth);
+    chkrc(rc, exit(1));
+    Esys_Finalize(&ctx);
+}
+
+static void
+test_auth(void)
+{
+    int rc;
+    uint8_t *secret, *keyBlob, *loaded;
+    size_t secret_size, keyBlob_size, loaded_size;
+    uint64_t totp;
+    time_t now;
+    char toolong[64];
+    TPM2TOTP_CONTEXT *context, *unauthorized;
+    TSS2_TCTI_CONTEXT *tcti = tpm_start();
+
+    set_owner_password(tcti, "", OWNERPWD);
+
+    rc = tpm2totp_context_new(tcti, &context);
+    chkrc(rc, exit(1));
+    rc = tpm2totp_context_setAuth(context, OWNERPWD, NVPWD);
+    chkrc(rc, exit(1));
+
+    /* The NV indices of keys hold at most a SHA1 digest as password */
+    memset(toolong, 'a', sizeof(toolong) - 1);
+    toolong[sizeof(toolong) - 1] = '\0';
+    if (tpm2totp_context_setAuth(context, OWNERPWD, toolong) != -1) {
+        fprintf(stderr, "Too long NV password was accepted\n");
+        exit(1);
+    }
+
+    /* Creating the primary key and the NV commands share one session */
+    rc = tpm2totp_context_generateKey(context, 0x00, 0x00, PWD,
+                                      &secret, &secret_size,
+                                      &keyBlob, &keyBlob_size);
+    chkrc(rc, exit(1));
+    rc = tpm2totp_context_storeKey_nv(context, keyBlob, keyBlob_size, 0);
+    chkrc(rc, exit(1));
+
+    rc = tpm2totp_context_loadKey_nv(context, 0, &loaded, &loaded_size);
+    chkrc(rc, exit(1));
+    if (loaded_size != keyBlob_size ||
+        !!memcmp(loaded, keyBlob, loaded_size)) {
+        fprintf(stderr, "Loaded key differs from the stored one\n");
+        exit(1);
+    }
+    free(loaded);
+
+    rc = tpm2totp_context_calculate(context, keyBlob, keyBlob_size,
+                                    &now, &totp);
+    chkrc(rc, exit(1));
+    check_code(totp, now, secret, secret_size);
+
+    /* Without the owner password, the index cannot be deleted */
+    rc = tpm2totp_context_new(tcti, &unauthorized);
+    chkrc(rc, exit(1));
+    if (tpm2totp_context_deleteKey_nv(unauthorized, 0) == 0) {
+        fprintf(stderr, "Key was deleted without the owner password\n");
+        exit(1);
+    }
+    tpm2totp_context_free(unauthorized);
+
+    /* A new context starts its own session, also asynchronously */
+    tpm2totp_context_free(context);
+    rc = tpm2totp_context_new(tcti, &context);
+    chkrc(rc, exit(1));
+    rc = tpm2totp_context_setAuth(context, OWNERPWD, NVPWD);
+    chkrc(rc, exit(1));
+    rc = tpm2totp_context_loadKey_nv_async(context, 0);
+    chkrc(rc, exit(1));
+    while ((rc = tpm2totp_context_loadKey_nv_finish(context, &loaded,
+                                                    &loaded_size))
+            == TPM2TOTP_RC_TRY_AGAIN)
+        wait_tpm(context);
+    chkrc(rc, exit(1));
+    free(loaded);
+
+    rc = tpm2totp_context_deleteKey_nv(context, 0);
+    chkrc(rc, exit(1));
+    tpm2totp_context_free(context);
+
+    set_owner_password(tcti, OWNERPWD, "");
+
+    free(keyBlob);
+    free(secret);
+    tpm_stop(tcti);
+}
+
+#define POOL 2
+
+/* Wait until the pool's background thread has filled it */
+static void
+pool_wait(TPM2TOTP_POOL *pool)
+{
+    struct timespec tick = { .tv_sec = 0, .tv_nsec = 100000000 };
+
+    for (int i = 0; tpm2totp_pool_count(pool) < POOL; i++) {
+        if (i == 1200) {
+            fprintf(stderr, "The key pool was not filled\n");
+            exit(1);
+        }
+        nanosleep(&tick, NULL);
+    }
+}
+
+static void
+test_pool(void)
+{
+    int rc;
+    uint8_t *secret, *keyBlob;
+    size_t secret_size, keyBlob_size;
+    uint32_t nv = 0x01800020;
+    TPM2TOTP_POOL *pool;
+    ESYS_CONTEXT *ctx;
+    TPML_DIGEST_VALUES digests = { .count = 1, .digests = {
+        { .hashAlg = TPM2_ALG_SHA256, .digest = { .sha256 = { 0 } } } } };
+    TSS2_TCTI_CONTEXT *tcti = tpm_start(), *shared;
+
+    rc = tpm2totp_pool_new(0x00, 0x00, PWD, POOL, tcti, &pool);
+    chkrc(rc, exit(1));
+
+    /* A ready key is taken */
+    pool_wait(pool);
+    rc = tpm2totp_pool_generateKey_nv(pool, nv, &secret, &secret_size);
+    chkrc(rc, exit(1));
+    free(secret);
+
+    /* After a PCR change all ready keys are stale and one is created anew */
+    pool_wait(pool);
+    shared = tpm_share(tcti);
+    rc = Esys_Initialize(&ctx, shared, NULL);
+    chkrc(rc, exit(1));
+    rc = Esys_Startup(ctx, TPM2_SU_CLEAR);
+    if (rc != TPM2_RC_INITIALIZE) chkrc(rc, exit(1));
+    rc = Esys_PCR_Extend(ctx, ESYS_TR_PCR4,
+                         ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
+                         &digests);
+    chkrc(rc, exit(1));
+    Esys_Finalize(&ctx);
+    tpm_stop(shared);
 
-    rc = tpm2totp_getSecret(keyBlob, keyBlob_size, PWD,
-                            &secret, &secret_size);
+    rc = tpm2totp_pool_generateKey_nv(pool, nv + 1, &secret, &secret_size);
     chkrc(rc, exit(1));
+    tpm2totp_pool_free(pool);
 
-/**********/
+    rc = tpm2totp_loadKey_nv_tcti(nv + 1, tcti, &keyBlob, &keyBlob_size);
+    chkrc(rc, exit(1));
+    check_totp(keyBlob, keyBlob_size, secret, secret_size, tcti);
+    free(keyBlob);
+    free(secret);
 
-    rc = tpm2totp_storeKey_nv(keyBlob, keyBlob_size, 0);
+    rc = tpm2totp_deleteKey_nv_tcti(nv, tcti);
+    chkrc(rc, exit(1));
+    rc = tpm2totp_deleteKey_nv_tcti(nv + 1, tcti);
     chkrc(rc, exit(1));
 
+    tpm_stop(tcti);
+}
+
+#define CALCULATED "tpm2totp_operation_duration_seconds_count{op=\"calculate\"}"
+#define DISCARDED "tpm2totp_pool_discarded_total"
+
+/* Current value of a metric; earlier tests have counted already */
+static long long
+metric(const char *name)
+{
+    char line[256];
+    size_t len = strlen(name);
+    long long value = -1;
+    FILE *out = tmpfile();
+
+    if (!out || tpm2totp_metrics_write(out) != 0) {
+        fprintf(stderr, "Writing metrics failed\n");
+        exit(1);
+    }
+    rewind(out);
+    while (fgets(line, sizeof(line), out)) {
+        if (!strncmp(line, name, len) && line[len] == ' ')
+            value = strtoll(&line[len + 1], NULL, 10);
+    }
+    fclose(out);
+
+    if (value < 0) {
+        fprintf(stderr, "Metric %s missing\n", name);
+        exit(1);
+    }
+    return value;
+}
+
+static void
+test_metrics(void)
+{
+    int rc;
+    uint8_t *secret, *keyBlob;
+    size_t secret_size, keyBlob_size;
+    uint32_t nv = 0x01800040;
+    TPM2TOTP_POOL *pool;
+    ESYS_CONTEXT *ctx;
+    TPML_DIGEST_VALUES digests = { .count = 1, .digests = {
+        { .hashAlg = TPM2_ALG_SHA256, .digest = { .sha256 = { 0 } } } } };
+    long long calculated = metric(CALCULATED), discarded = metric(DISCARDED);
+    TSS2_TCTI_CONTEXT *tcti = tpm_start(), *shared;
+
+    rc = tpm2totp_generateKey_tcti(0x00, 0x00, PWD, tcti,
+                                   &secret, &secret_size,
+                                   &keyBlob, &keyBlob_size);
+    chkrc(rc, exit(1));
+    check_totp(keyBlob, keyBlob_size, secret, secret_size, tcti);
+    check_totp(keyBlob, keyBlob_size, secret, secret_size, tcti);
     free(keyBlob);
-    rc = tpm2totp_loadKey_nv(0, &keyBlob, &keyBlob_size);
+    free(secret);
+
+    if (metric(CALCULATED) - calculated != 2) {
+        fprintf(stderr, "Calculate operations missing from metrics\n");
+        exit(1);
+    }
+
+    /* All ready keys of the pool go stale with the PCR change */
+    rc = tpm2totp_pool_new(0x00, 0x00, PWD, POOL, tcti, &pool);
+    chkrc(rc, exit(1));
+    pool_wait(pool);
+    shared = tpm_share(tcti);
+    rc = Esys_Initialize(&ctx, shared, NULL);
+    chkrc(rc, exit(1));
+    rc = Esys_Startup(ctx, TPM2_SU_CLEAR);
+    if (rc != TPM2_RC_INITIALIZE) chkrc(rc, exit(1));
+    rc = Esys_PCR_Extend(ctx, ESYS_TR_PCR4,
+                         ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
+                         &digests);
+    chkrc(rc, exit(1));
+    Esys_Finalize(&ctx);
+    tpm_stop(shared);
+
+    rc = tpm2totp_pool_generateKey_nv(pool, nv, &secret, &secret_size);
     chkrc(rc, exit(1));
+    free(secret);
+    tpm2totp_pool_free(pool);
+
+    if (metric(DISCARDED) - discarded != POOL) {
+        fprintf(stderr, "Stale pool keys missing from metrics\n");
+        exit(1);
+    }
 
-    rc = tpm2totp_deleteKey_nv(0);
+    rc = tpm2totp_deleteKey_nv_tcti(nv, tcti);
     chkrc(rc, exit(1));
+    tpm_stop(tcti);
+}
+
+/* With measurements, the pool follows a PCR change once the kernel tells */
+static void
+test_pool_measurements(void)
+{
+    int rc;
+    uint8_t *secret, *keyBlob;
+    size_t secret_size, keyBlob_size;
+    uint32_t nv = 0x01800030;
+    char path[] = "/tmp/tpm2-totp-count-XXXXXX";
+    TPM2TOTP_POOL *pool;
+    ESYS_CONTEXT *ctx;
+    FILE *f;
+    TPML_DIGEST_VALUES digests = { .count = 1, .digests = {
+        { .hashAlg = TPM2_ALG_SHA256, .digest = { .sha256 = { 0 } } } } };
+    TSS2_TCTI_CONTEXT *tcti = tpm_start(), *shared;
 
-    rc = tpm2totp_storeKey_nv(keyBlob, keyBlob_size, 0);
+    close(mkstemp(path));
+    f = fopen(path, "w");
+    fputs("1\n", f);
+    fclose(f);
+
+    rc = tpm2totp_pool_new(0x00, 0x00, PWD, POOL, tcti, &pool);
+    chkrc(rc, exit(1));
+    rc = tpm2totp_pool_setMeasurements(pool, path, "");
     chkrc(rc, exit(1));
+    if (tpm2totp_pool_setMeasurements(pool, path, "") == 0) {
+        fprintf(stderr, "Measurements of the pool set twice\n");
+        exit(1);
+    }
+
+    pool_wait(pool);
+    rc = tpm2totp_pool_generateKey_nv(pool, nv, &secret, &secret_size);
+    chkrc(rc, exit(1));
+    free(secret);
 
-    rc = tpm2totp_deleteKey_nv(0);
+    /* IMA extends the PCR and counts the measurement */
+    pool_wait(pool);
+    shared = tpm_share(tcti);
+    rc = Esys_Initialize(&ctx, shared, NULL);
     chkrc(rc, exit(1));
+    rc = Esys_Startup(ctx, TPM2_SU_CLEAR);
+    if (rc != TPM2_RC_INITIALIZE) chkrc(rc, exit(1));
+    rc = Esys_PCR_Extend(ctx, ESYS_TR_PCR4,
+                         ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
+                         &digests);
+    chkrc(rc, exit(1));
+    Esys_Finalize(&ctx);
+    tpm_stop(shared);
+    f = fopen(path, "w");
+    fputs("2\n", f);
+    fclose(f);
 
-/***********/
+    rc = tpm2totp_pool_generateKey_nv(pool, nv + 1, &secret, &secret_size);
+    chkrc(rc, exit(1));
+    tpm2totp_pool_free(pool);
+    unlink(path);
 
+    rc = tpm2totp_loadKey_nv_tcti(nv + 1, tcti, &keyBlob, &keyBlob_size);
+    chkrc(rc, exit(1));
+    check_totp(keyBlob, keyBlob_size, secret, secret_size, tcti);
     free(keyBlob);
     free(secret);
+
+    rc = tpm2totp_deleteKey_nv_tcti(nv, tcti);
+    chkrc(rc, exit(1));
+    rc = tpm2totp_deleteKey_nv_tcti(nv + 1, tcti);
+    chkrc(rc, exit(1));
+
+    tpm_stop(tcti);
+}
+
+int
+main(int argc, char **argv)
+{
+    (void)(argc); (void)(argv);
+
+    test_calculate();
+    test_reseal();
+    test_getSecret();
+#ifdef HAVE_CRYPTO
+    test_wrapKey();
+    test_policyDigest();
+#endif
+    test_nv();
+    test_generateKeys_nv();
+    test_listKeys_nv();
+    test_resealKeys_nv();
+    test_context();
+    test_banks();
+    test_prepare();
+    test_calculateMany();
+    test_async();
+    test_auth();
+    test_pool();
+    test_metrics();
+    test_pool_measurements();
+
     return 0;
 }
@@ -64,5 +64,8 @@ prereq
 prepare
 
 ./libtpm2-totp
+if [ -x ./libtpm2-totp-cpp ]; then
+    ./libtpm2-totp-cpp
+fi
 
 
@@ -0,0 +1,146 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "measure.h"
+
+#define check(cond) if (!(cond)) {\
+    fprintf(stderr, "ERROR in %s:%i: %s\n", __FILE__, __LINE__, #cond);\
+    exit(1); }
+
+/* Long enough that an early wakeup cannot be the timeout */
+#define WAIT_MS 10000
+
+static char count[] = "/tmp/tpm2-totp-count-XXXXXX";
+static char eventlog[] = "/tmp/tpm2-totp-eventlog-XXXXXX";
+
+/* Rewrite a fixture in place, since a new file would not be watched */
+static void
+write_file(const char *path, const char *mode, const char *content)
+{
+    FILE *f = fopen(path, mode);
+
+    check(f != NULL);
+    check(fputs(content, f) >= 0);
+    check(fclose(f) == 0);
+}
+
+/* Measure something while the main thread waits */
+static void *
+extend(void *arg)
+{
+    (void)arg;
+    usleep(100000);
+    write_file(eventlog, "a", "event");
+    return NULL;
+}
+
+static double
+elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 +
+           (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+int
+main(void)
+{
+    struct timespec start;
+    struct pollfd pfd = { .events = POLLIN };
+    pthread_t thread;
+    MEASURE *m;
+    uint64_t generation;
+    int fd;
+
+    fd = mkstemp(count);
+    check(fd >= 0);
+    close(fd);
+    fd = mkstemp(eventlog);
+    check(fd >= 0);
+    close(fd);
+    write_file(count, "w", "5\n");
+    write_file(eventlog, "w", "header");
+
+    check(measure_new(count, eventlog, NULL) != 0);
+    check(measure_new(count, eventlog, &m) == 0);
+    pfd.fd = measure_fd(m);
+    check(pfd.fd >= 0);
+
+    /* Nothing was measured, and the checks took all events */
+    generation = measure_generation(m);
+    check(measure_generation(m) == generation);
+    check(poll(&pfd, 1, 0) == 0);
+
+    /* IMA measured a file */
+    write_file(count, "w", "6\n");
+    check(measure_generation(m) == ++generation);
+    check(measure_generation(m) == generation);
+
+    /* The same count written again is no measurement */
+    write_file(count, "w", "6\n");
+    check(measure_generation(m) == generation);
+
+    /* The event log grew */
+    write_file(eventlog, "a", "event");
+    check(measure_generation(m) == ++generation);
+
+    /* A waiter wakes up on the change instead of the timeout */
+    check(pthread_create(&thread, NULL, extend, NULL) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    check(poll(&pfd, 1, WAIT_MS) == 1);
+    check(elapsed_ms(&start) < WAIT_MS / 2);
+    check(pthread_join(thread, NULL) == 0);
+    check(measure_generation(m) == ++generation);
+    check(poll(&pfd, 1, 0) == 0);
+
+    /* An emptied log is a change, although only new bytes are read */
+    write_file(eventlog, "w", "");
+    check(measure_generation(m) == ++generation);
+    write_file(eventlog, "w", "header");
+    check(measure_generation(m) == ++generation);
+
+    /* A vanished file counts as a change, and so does its return */
+    check(unlink(count) == 0);
+    check(measure_generation(m) == ++generation);
+    check(measure_generation(m) == generation);
+    write_file(count, "w", "6\n");
+    check(measure_generation(m) == ++generation);
+    measure_free(m);
+
+    /* Unused sources are not read at all */
+    check(measure_new("", "", &m) == 0);
+    generation = measure_generation(m);
+    write_file(count, "w", "7\n");
+    write_file(eventlog, "a", "event");
+    check(measure_generation(m) == generation);
+    measure_free(m);
+
+    /* Missing files can still appear later */
+    check(unlink(eventlog) == 0);
+    check(measure_new("", eventlog, &m) == 0);
+    generation = measure_generation(m);
+    check(measure_generation(m) == generation);
+    write_file(eventlog, "w", "header");
+    check(measure_generation(m) == generation + 1);
+    measure_free(m);
+
+    measure_free(NULL);
+    unlink(count);
+    unlink(eventlog);
+    return 0;
+}
@@ -0,0 +1,163 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "plymouth.h"
+
+#define check(cond) if (!(cond)) {\
+    fprintf(stderr, "ERROR in %s:%i: %s\n", __FILE__, __LINE__, #cond);\
+    exit(1); }
+
+/* Requests answered before the mock closes its first connection, as if
+   plymouthd was restarted */
+#define FIRST_REQUESTS 3
+
+/* A plymouthd speaking the boot protocol, which logs the requests and
+   refuses to hide messages it does not display */
+struct mock {
+    int fd;
+    pthread_mutex_t lock;
+    char log[1024];
+};
+
+static int
+read_all(int fd, void *buf, size_t size)
+{
+    ssize_t n;
+
+    for (size_t done = 0; done < size; done += n) {
+        n = read(fd, (char *)buf + done, size - done);
+        if (n <= 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void *
+mock_plymouthd(void *arg)
+{
+    struct mock *mock = arg;
+    char command, marker, reply, shown[PLYMOUTH_MESSAGE_MAX + 1];
+    char argument[PLYMOUTH_MESSAGE_MAX + 1];
+    unsigned char len;
+    int client;
+
+    for (int conn = 0; conn < 2; conn++) {
+        client = accept(mock->fd, NULL, NULL);
+        check(client >= 0);
+        shown[0] = '\0';
+
+        for (int i = 0; conn > 0 || i < FIRST_REQUESTS; i++) {
+            if (read_all(client, &command, 1) != 0)
+                break;
+            check(read_all(client, &marker, 1) == 0 && marker == '\002');
+            check(read_all(client, &len, 1) == 0 && len > 0);
+            check(read_all(client, argument, len) == 0 &&
+                  argument[len - 1] == '\0');
+
+            reply = '\006';
+            if (command == 'M') {
+                strcpy(shown, argument);
+            } else if (command == 'm' && !strcmp(shown, argument)) {
+                shown[0] = '\0';
+            } else {
+                reply = '\025';
+            }
+
+            pthread_mutex_lock(&mock->lock);
+            snprintf(&mock->log[strlen(mock->log)],
+                     sizeof(mock->log) - strlen(mock->log), "%c%s%s\n",
+                     command, argument, reply == '\006' ? "" : " NAK");
+            pthread_mutex_unlock(&mock->lock);
+            check(write(client, &reply, 1) == 1);
+        }
+        close(client);
+    }
+    return NULL;
+}
+
+/* Check and clear the requests logged by the mock */
+static void
+check_log(struct mock *mock, const char *expected)
+{
+    pthread_mutex_lock(&mock->lock);
+    if (strcmp(mock->log, expected)) {
+        fprintf(stderr, "Requests:\n%sExpected:\n%s", mock->log, expected);
+        exit(1);
+    }
+    mock->log[0] = '\0';
+    pthread_mutex_unlock(&mock->lock);
+}
+
+int
+main(void)
+{
+    struct mock mock = { .lock = PTHREAD_MUTEX_INITIALIZER };
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char path[64], toolong[PLYMOUTH_MESSAGE_MAX + 2];
+    pthread_t thread;
+    PLYMOUTH *ply;
+
+    /* An abstract socket of this process, named like plymouthd's */
+    snprintf(path, sizeof(path), "@/org/freedesktop/plymouthd-test-%d",
+             (int)getpid());
+    memcpy(addr.sun_path, path, strlen(path));
+    addr.sun_path[0] = '\0';
+
+    mock.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    check(mock.fd >= 0);
+    check(bind(mock.fd, (struct sockaddr *)&addr,
+               offsetof(struct sockaddr_un, sun_path) + strlen(path)) == 0);
+    check(listen(mock.fd, 1) == 0);
+
+    check(plymouth_new("", &ply) != 0);
+    check(plymouth_new(path, &ply) == 0);
+
+    check(pthread_create(&thread, NULL, mock_plymouthd, &mock) == 0);
+
+    check(plymouth_update(ply, 1, "111111") == 0);
+    check_log(&mock, "M111111\n");
+
+    /* The same step is not sent again */
+    check(plymouth_update(ply, 1, "111111") == 0);
+    check_log(&mock, "");
+
+    /* A new step replaces the message in place */
+    check(plymouth_update(ply, 2, "222222") == 0);
+    check_log(&mock, "m111111\nM222222\n");
+
+    /* After a restart, the daemon is reconnected within the same update */
+    check(plymouth_update(ply, 3, "333333") == 0);
+    check_log(&mock, "m222222 NAK\nM333333\n");
+
+    memset(toolong, '1', sizeof(toolong) - 1);
+    toolong[sizeof(toolong) - 1] = '\0';
+    check(plymouth_update(ply, 4, toolong) != 0 && errno == EMSGSIZE);
+    check_log(&mock, "");
+
+    plymouth_free(ply);
+    check(pthread_join(thread, NULL) == 0);
+    close(mock.fd);
+
+    /* Without plymouthd, updates fail and are retried */
+    check(plymouth_new(path, &ply) == 0);
+    check(plymouth_update(ply, 5, "555555") != 0);
+    check(plymouth_update(ply, 5, "555555") != 0);
+    plymouth_free(ply);
+
+    return 0;
+}
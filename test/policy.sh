@@ -0,0 +1,89 @@
+# SPDX-License-Identifier: BSD-3
+# Copyright (c) 2018 Fraunhofer SIT
+# All rights reserved.
+#!/bin/bash
+
+echo "Policy tests"
+
+set -eEuf
+
+LANG=C
+PS4='$LINENO:'
+
+#Some debug options:
+set -x
+
+# PCRs 0, 2 and 4 of the SHA1 and SHA256 banks after TPM startup
+ZEROS=$(printf '0%.0s' $(seq 312))
+ZERODIGEST=ea95a4e6f95d9a5bbd888baee5acfd380a7a2cc098891dd0b4d184d993c8d747
+ONE=${ZEROS:0:310}01
+ONEDIGEST=15ff3c453a21532f0bcf47944de1f5b0a1fa18592c451bb99d1c171efae4acd7
+PCR7=000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f
+PCR7DIGEST=ef23ccc71b928bf66889c4390f780400ae6a7a091201becfffd13998660b40e3
+
+SETS=$(mktemp)
+OUTPUT=$(mktemp)
+EXPECTED=$(mktemp)
+
+function cleanup()
+{
+    rm -f $SETS $OUTPUT $EXPECTED
+    echo .
+}
+
+function error()
+{
+    echo "FAILED"
+}
+
+trap "cleanup" EXIT
+trap "error" ERR
+
+cat >$SETS <<END
+# id [pcrs banks] values
+model-a/fw-1 $ZEROS
+model-a/fw-2 $ONE
+model-b/fw-1 7 SHA256 $PCR7
+model-b/fw-2 0,2,4 SHA1,SHA256 $ZEROS
+END
+
+./tpm2-totp -j 2 policy $SETS | tee $OUTPUT
+cat >$EXPECTED <<END
+model-a/fw-1 $ZERODIGEST
+model-a/fw-2 $ONEDIGEST
+model-b/fw-1 $PCR7DIGEST
+model-b/fw-2 $ZERODIGEST
+END
+cmp $OUTPUT $EXPECTED
+
+# The selection of the command line applies to sets without one
+echo "model-c $PCR7" | ./tpm2-totp -p 7 -b SHA256 policy - >$OUTPUT
+grep -q "^model-c $PCR7DIGEST$" $OUTPUT
+
+# Sets not matching their selection are reported in place
+cat >>$SETS <<END
+model-c/fw-1 ${ZEROS:2}
+model-c/fw-2 7 SHA512 $PCR7
+model-c/fw-3 7 SHA256 ${PCR7:0:63}x
+END
+if ./tpm2-totp policy $SETS >$OUTPUT; then
+    echo "Invalid PCR values were accepted!"
+    exit 1
+fi
+grep -q "^model-b/fw-2 $ZERODIGEST$" $OUTPUT
+grep -q "^model-c/fw-1 invalid$" $OUTPUT
+grep -q "^model-c/fw-2 invalid$" $OUTPUT
+grep -q "^model-c/fw-3 invalid$" $OUTPUT
+
+# Many chunks are written in input order, whatever the number of workers
+awk -v z=$ZEROS -v o=$ONE -v zd=$ZERODIGEST -v od=$ONEDIGEST \
+    -v s=$SETS -v e=$EXPECTED 'BEGIN {
+        for (i = 0; i < 20000; i++) {
+            print "machine-" i " " (i % 3 ? z : o) >s
+            print "machine-" i " " (i % 3 ? zd : od) >e
+        }
+    }'
+./tpm2-totp -j 4 -v policy $SETS >$OUTPUT
+cmp $OUTPUT $EXPECTED
+./tpm2-totp -j 1 policy - <$SETS >$OUTPUT
+cmp $OUTPUT $EXPECTED
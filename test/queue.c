@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tpm2-totp.h>
+
+#define check(cond) if (!(cond)) {\
+    fprintf(stderr, "ERROR in %s:%i: %s\n", __FILE__, __LINE__, #cond);\
+    exit(1); }
+
+#define CLIENTS 4
+#define TIMEOUT_MS 200
+
+static char path[] = "/tmp/tpm2-totp-queue-XXXXXX";
+
+static double
+elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 +
+           (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Wait until the queue handed out a number of tickets, which is the first
+   counter in the file */
+static void
+wait_tickets(uint64_t tickets)
+{
+    struct timespec tick = { .tv_sec = 0, .tv_nsec = 1000000 };
+    uint64_t next = 0;
+    FILE *f;
+
+    for (int i = 0; next < tickets; i++) {
+        check(i < 10000);
+        nanosleep(&tick, NULL);
+        f = fopen(path, "r");
+        check(f != NULL);
+        if (fread(&next, sizeof(next), 1, f) != 1)
+            next = 0;
+        fclose(f);
+    }
+}
+
+/* A client that reports its turn on a pipe */
+static pid_t
+client(int fd, char id, int leave)
+{
+    TPM2TOTP_QUEUE *queue;
+    pid_t pid = fork();
+
+    check(pid >= 0);
+    if (pid > 0)
+        return pid;
+    if (tpm2totp_queue_enter(path, -1, &queue) != 0)
+        _exit(1);
+    if (write(fd, &id, 1) != 1)
+        _exit(1);
+    usleep(10000);
+    if (leave)
+        tpm2totp_queue_leave(queue);
+    _exit(0);
+}
+
+int
+main(void)
+{
+    TPM2TOTP_QUEUE *queue, *other;
+    struct timespec start;
+    char order[CLIENTS + 1] = { 0 };
+    pid_t pids[CLIENTS];
+    int fds[2], status;
+
+    check(close(mkstemp(path)) == 0);
+    check(pipe(fds) == 0);
+
+    check(tpm2totp_queue_enter(path, 0, NULL) != 0);
+
+    /* An empty queue is entered right away */
+    check(tpm2totp_queue_enter(path, 0, &queue) == 0);
+
+    /* The wait is bounded while the TPM is in use */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    check(tpm2totp_queue_enter(path, TIMEOUT_MS, &other) != 0 &&
+          errno == ETIMEDOUT);
+    check(elapsed_ms(&start) >= TIMEOUT_MS);
+    check(elapsed_ms(&start) < TIMEOUT_MS * 5);
+
+    /* Clients are served in the order they arrived, skipping one that ends
+       without leaving */
+    for (int i = 0; i < CLIENTS; i++) {
+        pids[i] = client(fds[1], 'a' + i, i != 1);
+        wait_tickets(3 + i);
+    }
+    tpm2totp_queue_leave(queue);
+    for (int i = 0; i < CLIENTS; i++) {
+        check(waitpid(pids[i], &status, 0) == pids[i]);
+        check(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    check(read(fds[0], order, CLIENTS) == CLIENTS);
+    check(!strcmp(order, "abcd"));
+
+    /* The queue is empty again */
+    check(tpm2totp_queue_enter(path, 0, &queue) == 0);
+    tpm2totp_queue_leave(queue);
+    tpm2totp_queue_leave(NULL);
+
+    close(fds[0]);
+    close(fds[1]);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,411 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#define _DEFAULT_SOURCE
+
+#include "tcti-libtpms.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <libtpms/tpm_error.h>
+#include <libtpms/tpm_library.h>
+#include <libtpms/tpm_memory.h>
+
+#define TCTI_LIBTPMS_MAGIC 0x7470326c6962746dULL
+#define TCTI_LIBTPMS_TEMPLATE "/tmp/tpm2-totp-libtpms.XXXXXX"
+
+#define dbg(m, ...) fprintf(stderr, m "\n", ##__VA_ARGS__)
+
+typedef struct {
+    TSS2_TCTI_CONTEXT_COMMON_V1 common;
+    enum { STATE_TRANSMIT, STATE_RECEIVE } state;
+    unsigned char *response;
+    uint32_t response_size;
+    uint32_t response_buffer_size;
+    char statedir[sizeof(TCTI_LIBTPMS_TEMPLATE)];
+    int tempdir;
+    int timer;          /* timerfd expiring when the response is due */
+    int ready;          /* timer expired since the last command */
+    unsigned long latency;
+    int shared;         /* uses the TPM of another context */
+} TCTI_LIBTPMS_CONTEXT;
+
+static int active = 0;
+
+/* Serializes the commands of contexts sharing the TPM */
+static pthread_mutex_t process_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static TCTI_LIBTPMS_CONTEXT *
+tcti_libtpms_context(TSS2_TCTI_CONTEXT *tcti_context)
+{
+    TCTI_LIBTPMS_CONTEXT *tcti = (TCTI_LIBTPMS_CONTEXT *)tcti_context;
+
+    if (tcti == NULL || tcti->common.magic != TCTI_LIBTPMS_MAGIC)
+        return NULL;
+    return tcti;
+}
+
+static TSS2_RC
+tcti_libtpms_transmit(TSS2_TCTI_CONTEXT *tcti_context, size_t size,
+                      const uint8_t *command)
+{
+    TCTI_LIBTPMS_CONTEXT *tcti = tcti_libtpms_context(tcti_context);
+    struct itimerspec due = { .it_value = { .tv_nsec = 1 } };
+    TPM_RESULT res;
+
+    if (!tcti)
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    if (!command)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    if (tcti->state != STATE_TRANSMIT)
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+
+    /* libtpms executes the command synchronously and (re)allocates the
+       response buffer, which is kept across commands. */
+    pthread_mutex_lock(&process_lock);
+    res = TPMLIB_Process(&tcti->response, &tcti->response_size,
+                         &tcti->response_buffer_size,
+                         (unsigned char *)command, size);
+    pthread_mutex_unlock(&process_lock);
+    if (res != TPM_SUCCESS) {
+        dbg("TPMLIB_Process failed: 0x%08x", res);
+        return TSS2_TCTI_RC_IO_ERROR;
+    }
+
+    /* The response is held back for the injected latency like by a real
+       TPM; a zero timer would disarm the timerfd, hence 1 ns at least. */
+    if (tcti->latency) {
+        due.it_value.tv_sec = tcti->latency / 1000000;
+        due.it_value.tv_nsec = (tcti->latency % 1000000) * 1000;
+    }
+    if (timerfd_settime(tcti->timer, 0, &due, NULL) != 0)
+        return TSS2_TCTI_RC_IO_ERROR;
+
+    tcti->ready = 0;
+    tcti->state = STATE_RECEIVE;
+    return TSS2_RC_SUCCESS;
+}
+
+/* Wait up to timeout ms for the response, -1 blocks */
+static TSS2_RC
+tcti_libtpms_wait(TCTI_LIBTPMS_CONTEXT *tcti, int32_t timeout)
+{
+    struct pollfd pfd = { .fd = tcti->timer, .events = POLLIN };
+    uint64_t expirations;
+    int n;
+
+    if (tcti->ready)
+        return TSS2_RC_SUCCESS;
+
+    do {
+        n = poll(&pfd, 1, timeout);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        return TSS2_TCTI_RC_IO_ERROR;
+    if (n == 0)
+        return TSS2_TCTI_RC_TRY_AGAIN;
+
+    if (read(tcti->timer, &expirations, sizeof(expirations)) < 0 &&
+            errno != EAGAIN)
+        return TSS2_TCTI_RC_IO_ERROR;
+    tcti->ready = 1;
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC
+tcti_libtpms_receive(TSS2_TCTI_CONTEXT *tcti_context, size_t *size,
+                     uint8_t *response, int32_t timeout)
+{
+    TCTI_LIBTPMS_CONTEXT *tcti = tcti_libtpms_context(tcti_context);
+    TSS2_RC rc;
+
+    if (!tcti)
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    if (!size)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    if (tcti->state != STATE_RECEIVE)
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+
+    rc = tcti_libtpms_wait(tcti, timeout);
+    if (rc != TSS2_RC_SUCCESS)
+        return rc;
+
+    if (!response) {
+        *size = tcti->response_size;
+        return TSS2_RC_SUCCESS;
+    }
+    if (*size < tcti->response_size) {
+        *size = tcti->response_size;
+        return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+    }
+
+    memcpy(response, tcti->response, tcti->response_size);
+    *size = tcti->response_size;
+    tcti->state = STATE_TRANSMIT;
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC
+tcti_libtpms_cancel(TSS2_TCTI_CONTEXT *tcti_context)
+{
+    (void)(tcti_context);
+    return TSS2_TCTI_RC_NOT_IMPLEMENTED;
+}
+
+static TSS2_RC
+tcti_libtpms_get_poll_handles(TSS2_TCTI_CONTEXT *tcti_context,
+                              TSS2_TCTI_POLL_HANDLE *handles,
+                              size_t *num_handles)
+{
+    TCTI_LIBTPMS_CONTEXT *tcti = tcti_libtpms_context(tcti_context);
+
+    if (!tcti)
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    if (!num_handles)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    if (handles) {
+        if (*num_handles < 1)
+            return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+        handles[0].fd = tcti->timer;
+        handles[0].events = POLLIN;
+        handles[0].revents = 0;
+    }
+    *num_handles = 1;
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC
+tcti_libtpms_set_locality(TSS2_TCTI_CONTEXT *tcti_context, uint8_t locality)
+{
+    (void)(tcti_context); (void)(locality);
+    return TSS2_TCTI_RC_NOT_IMPLEMENTED;
+}
+
+static void
+remove_statedir(const char *path)
+{
+    struct dirent *entry;
+    DIR *dir = opendir(path);
+
+    if (!dir)
+        return;
+    while ((entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+            unlinkat(dirfd(dir), entry->d_name, 0);
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+static void
+tcti_libtpms_finalize(TSS2_TCTI_CONTEXT *tcti_context)
+{
+    TCTI_LIBTPMS_CONTEXT *tcti = tcti_libtpms_context(tcti_context);
+
+    if (!tcti)
+        return;
+
+    if (!tcti->shared)
+        TPMLIB_Terminate();
+    TPM_Free(tcti->response);
+    tcti->response = NULL;
+    close(tcti->timer);
+    if (tcti->tempdir)
+        remove_statedir(tcti->statedir);
+    tcti->common.magic = 0;
+    if (!tcti->shared)
+        active = 0;
+}
+
+/** Initialize the libtpms TCTI.
+ *
+ * Follows the usual TCTI initialization protocol: if tcti_context is NULL,
+ * only the required size is returned.
+ * @param[in,out] tcti_context Memory for the TCTI context.
+ * @param[in,out] size Size of the TCTI context.
+ * @param[in] statedir Directory holding the NV state. If NULL or empty, a
+ *            temporary directory is created and removed on finalization.
+ * @retval TSS2_RC_SUCCESS on success.
+ * @retval TSS2_TCTI_RC_NOT_PERMITTED if another instance is active.
+ */
+TSS2_RC
+tcti_libtpms_init(TSS2_TCTI_CONTEXT *tcti_context, size_t *size,
+                  const char *statedir)
+{
+    TCTI_LIBTPMS_CONTEXT *tcti = (TCTI_LIBTPMS_CONTEXT *)tcti_context;
+    TPM_RESULT res;
+
+    if (!size)
+        return TSS2_TCTI_RC_BAD_VALUE;
+    if (!tcti_context) {
+        *size = sizeof(TCTI_LIBTPMS_CONTEXT);
+        return TSS2_RC_SUCCESS;
+    }
+    if (*size < sizeof(TCTI_LIBTPMS_CONTEXT))
+        return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+    if (active)
+        return TSS2_TCTI_RC_NOT_PERMITTED;
+
+    memset(tcti, 0, sizeof(*tcti));
+    tcti->timer = -1;
+    if (statedir && strlen(statedir) > 0) {
+        if (setenv("TPM_PATH", statedir, 1) != 0)
+            return TSS2_TCTI_RC_MEMORY;
+    } else {
+        strcpy(tcti->statedir, TCTI_LIBTPMS_TEMPLATE);
+        if (!mkdtemp(tcti->statedir)) {
+            dbg("Cannot create state directory");
+            return TSS2_TCTI_RC_IO_ERROR;
+        }
+        tcti->tempdir = 1;
+        if (setenv("TPM_PATH", tcti->statedir, 1) != 0)
+            goto error;
+    }
+
+    tcti->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tcti->timer < 0)
+        goto error;
+
+    res = TPMLIB_ChooseTPMVersion(TPMLIB_TPM_VERSION_2);
+    if (res != TPM_SUCCESS)
+        goto error;
+    res = TPMLIB_MainInit();
+    if (res != TPM_SUCCESS) {
+        dbg("TPMLIB_MainInit failed: 0x%08x", res);
+        /* Leave no half initialized TPM behind for the next instance */
+        TPMLIB_Terminate();
+        goto error;
+    }
+
+    tcti->common.magic = TCTI_LIBTPMS_MAGIC;
+    tcti->common.version = 1;
+    tcti->common.transmit = tcti_libtpms_transmit;
+    tcti->common.receive = tcti_libtpms_receive;
+    tcti->common.finalize = tcti_libtpms_finalize;
+    tcti->common.cancel = tcti_libtpms_cancel;
+    tcti->common.getPollHandles = tcti_libtpms_get_poll_handles;
+    tcti->common.setLocality = tcti_libtpms_set_locality;
+    tcti->state = STATE_TRANSMIT;
+    active = 1;
+
+    return TSS2_RC_SUCCESS;
+
+error:
+    if (tcti->timer >= 0)
+        close(tcti->timer);
+    if (tcti->tempdir)
+        remove_statedir(tcti->statedir);
+    return TSS2_TCTI_RC_IO_ERROR;
+}
+
+/** Allocate and initialize a libtpms TCTI.
+ *
+ * @param[in] statedir Directory holding the NV state or NULL for a fresh TPM.
+ * @param[out] tcti_context The new TCTI context.
+ * @retval TSS2_RC_SUCCESS on success.
+ */
+TSS2_RC
+tcti_libtpms_new(const char *statedir, TSS2_TCTI_CONTEXT **tcti_context)
+{
+    TSS2_RC rc;
+    size_t size;
+
+    if (!tcti_context)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+
+    rc = tcti_libtpms_init(NULL, &size, NULL);
+    if (rc != TSS2_RC_SUCCESS)
+        return rc;
+
+    *tcti_context = calloc(1, size);
+    if (!*tcti_context)
+        return TSS2_TCTI_RC_MEMORY;
+
+    rc = tcti_libtpms_init(*tcti_context, &size, statedir);
+    if (rc != TSS2_RC_SUCCESS) {
+        free(*tcti_context);
+        *tcti_context = NULL;
+    }
+    return rc;
+}
+
+/** Allocate a second libtpms TCTI on the TPM of another one.
+ *
+ * The contexts have their own command state, so that e.g. a test can use
+ * the TPM while a thread of the library uses it through the other context.
+ * The shared context has to be freed before the one it shares the TPM of.
+ * @param[in] tcti_context The TCTI context running the TPM.
+ * @param[out] shared The new TCTI context.
+ * @retval TSS2_RC_SUCCESS on success.
+ */
+TSS2_RC
+tcti_libtpms_share(TSS2_TCTI_CONTEXT *tcti_context,
+                   TSS2_TCTI_CONTEXT **shared)
+{
+    TCTI_LIBTPMS_CONTEXT *tcti = tcti_libtpms_context(tcti_context), *other;
+
+    if (!tcti)
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    if (!shared)
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+
+    other = calloc(1, sizeof(*other));
+    if (!other)
+        return TSS2_TCTI_RC_MEMORY;
+    other->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (other->timer < 0) {
+        free(other);
+        return TSS2_TCTI_RC_IO_ERROR;
+    }
+    other->common = tcti->common;
+    other->state = STATE_TRANSMIT;
+    other->latency = tcti->latency;
+    other->shared = 1;
+
+    *shared = (TSS2_TCTI_CONTEXT *)other;
+    return TSS2_RC_SUCCESS;
+}
+
+/** Set the latency of the simulated TPM.
+ *
+ * Responses are only available the given time after their command was
+ * transmitted; receiving earlier with a timeout of 0 returns TRY_AGAIN, as
+ * with a hardware TPM. The poll handle becomes readable when it is due.
+ * @param[in] tcti_context The TCTI context.
+ * @param[in] usec Latency of each command in microseconds.
+ */
+void
+tcti_libtpms_set_latency(TSS2_TCTI_CONTEXT *tcti_context, unsigned long usec)
+{
+    TCTI_LIBTPMS_CONTEXT *tcti = tcti_libtpms_context(tcti_context);
+
+    if (tcti)
+        tcti->latency = usec;
+}
+
+/** Finalize and free a libtpms TCTI.
+ *
+ * @param[in,out] tcti_context The TCTI context; set to NULL.
+ */
+void
+tcti_libtpms_free(TSS2_TCTI_CONTEXT **tcti_context)
+{
+    if (!tcti_context || !*tcti_context)
+        return;
+
+    tcti_libtpms_finalize(*tcti_context);
+    free(*tcti_context);
+    *tcti_context = NULL;
+}
@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#ifndef TCTI_LIBTPMS_H
+#define TCTI_LIBTPMS_H
+
+#include <tss2/tss2_tcti.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* In-process TCTI backed by libtpms for the tests and benchmarks.
+ *
+ * libtpms holds its TPM state in global variables, so only one instance can
+ * exist per process at a time. Parallelism is achieved by running several
+ * test processes, which no longer share a simulator port or NVChip file. */
+
+TSS2_RC
+tcti_libtpms_init(TSS2_TCTI_CONTEXT *tcti_context, size_t *size,
+                  const char *statedir);
+
+TSS2_RC
+tcti_libtpms_new(const char *statedir, TSS2_TCTI_CONTEXT **tcti_context);
+
+TSS2_RC
+tcti_libtpms_share(TSS2_TCTI_CONTEXT *tcti_context,
+                   TSS2_TCTI_CONTEXT **shared);
+
+void
+tcti_libtpms_set_latency(TSS2_TCTI_CONTEXT *tcti_context, unsigned long usec);
+
+void
+tcti_libtpms_free(TSS2_TCTI_CONTEXT **tcti_context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TCTI_LIBTPMS_H */
@@ -94,3 +94,104 @@ if ./tpm2-totp calculate; then
 fi
 
 ./tpm2-totp clean
+
+# Batch provisioning of a range of NV indices
+./tpm2-totp -P abc -N 0x01800001-0x01800003 generate | tee batch.txt
+test $(grep -c "otpauth://totp/TPM2-TOTP?secret=" batch.txt) -eq 3
+rm batch.txt
+
+./tpm2-totp -N 0x01800002 calculate
+
+# The codes of several NV indices in one call, one line each
+./tpm2-totp -N 0x01800001-0x01800003 calculate | tee many.txt
+test $(grep -c "^0x0180000[1-3] [0-9]\{6\}$" many.txt) -eq 3
+rm many.txt
+
+# The same command on several TPMs (here the same simulator twice)
+./tpm2-totp -N 0x01800002 -T mssim -T mssim calculate | tee multi.txt
+test $(grep -c "^# mssim: OK$" multi.txt) -eq 2
+rm multi.txt
+
+for nv in 0x01800001 0x01800002 0x01800003; do
+    ./tpm2-totp -N $nv clean
+done
+
+# Several commands in one process over one TPM context
+./tpm2-totp batch > batch.txt <<EOF
+# comments and empty lines are skipped
+
+-P abc -N 0x01800001 generate
+calculate --nvindex 0x01800001
+-N 0x01800001 -P 'abc' recover
+-N 0x01800001 clean
+EOF
+test $(grep -c "^# .*: OK$" batch.txt) -eq 4
+test $(grep -c "otpauth://totp/TPM2-TOTP?secret=" batch.txt) -eq 2
+rm batch.txt
+
+# A failing command does not stop the batch but fails it
+if printf 'calculate -N 0x01800001\n-N 0x01800004 generate\n' | \
+       ./tpm2-totp batch > batch.txt; then
+    echo "The batch succeeded despite a failed command!"
+    exit 1
+fi
+grep -q "^# calculate -N 0x01800001: FAILED$" batch.txt
+grep -q "^# -N 0x01800004 generate: OK$" batch.txt
+./tpm2-totp -N 0x01800004 clean
+rm batch.txt
+
+# Offline provisioning: wrap a key for this TPM's primary key in software,
+# which needs libcrypto
+if [ -n "${HAVE_CRYPTO:-}" ]; then
+    ./tpm2-totp parent primary.pub
+    tpm2_pcrread -T mssim -o pcrs.bin sha1:0,2,4+sha256:0,2,4
+    ./tpm2-totp -P abc -p 0,2,4 -b SHA1,SHA256 wrap primary.pub pcrs.bin key.wrap
+    ./tpm2-totp import key.wrap
+    ./tpm2-totp calculate
+    ./tpm2-totp -P abc recover
+
+    # The wrapped key is bound to the PCR values it was wrapped for
+    ./tpm2-totp clean
+    head -c 156 /dev/urandom > pcrs.bin
+    ./tpm2-totp -p 0,2,4 -b SHA1,SHA256 wrap primary.pub pcrs.bin key.wrap
+    ./tpm2-totp import key.wrap
+    if ./tpm2-totp calculate; then
+        echo "The TOTP was calculated with a key wrapped for other PCR values!"
+        exit 1
+    fi
+    ./tpm2-totp clean
+    rm primary.pub pcrs.bin key.wrap
+fi
+
+# A prepared key is used by calculate and removed with its NV index
+RUNDIR=$(mktemp -d)
+./tpm2-totp -P abc generate
+./tpm2-totp -r $RUNDIR prepare
+test -f $RUNDIR/0x00000000
+./tpm2-totp -r $RUNDIR -v calculate 2>&1 | grep -q "Calculated with prepared key"
+# A stale prepared key falls back to the key in NV
+head -c 64 /dev/urandom > $RUNDIR/0x00000000
+./tpm2-totp -r $RUNDIR calculate
+./tpm2-totp -r $RUNDIR clean
+test ! -e $RUNDIR/0x00000000
+rmdir $RUNDIR
+
+# Keys are found without knowing their NV indices
+./tpm2-totp -p 0,2 -b SHA256 generate
+./tpm2-totp -N 0x01800001 generate
+./tpm2-totp list > list.txt
+grep -q "^0x01800001 pcrs=0,2,4 banks=SHA1,SHA256$" list.txt
+grep -q "^0x018094af pcrs=0,2 banks=SHA256$" list.txt
+test $(wc -l < list.txt) -eq 2
+./tpm2-totp -N 0x01800001 clean
+./tpm2-totp clean
+test $(./tpm2-totp list | wc -l) -eq 0
+rm list.txt
+
+# All keys are resealed at once, e.g. after a firmware update
+./tpm2-totp -P abc -N 0x01800001-0x01800003 generate
+./tpm2-totp -P abc -p 0,2 -b SHA256 -N 0x01800001-0x01800003 reseal
+test $(./tpm2-totp list | grep -c "pcrs=0,2 banks=SHA256$") -eq 3
+./tpm2-totp -N 0x01800001-0x01800003 calculate
+./tpm2-totp -P abc -N 0x01800002 recover
+for i in 1 2 3; do ./tpm2-totp -N 0x0180000$i clean; done
@@ -0,0 +1,160 @@
+/* SPDX-License-Identifier: BSD-3 */
+/*******************************************************************************
+ * Copyright 2018, Fraunhofer SIT
+ * All rights reserved.
+ *******************************************************************************/
+
+#include <tpm2-totp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <liboath/oath.h>
+
+#include "sha1mb.h"
+
+#define chkrc(rc, cmd) if (rc != 0) {\
+    fprintf(stderr, "ERROR in %s:%i: %i\n", __FILE__, __LINE__, rc); cmd; }
+
+#define STEPS 37
+#define SECRETS 29
+
+/* 20 is the size generated by tpm2totp_generateKey(); the others cover
+   short keys, a full key block and keys that are hashed first. */
+static const size_t secret_sizes[] = { 20, 1, 32, 63, 64, 65, 100 };
+
+static void
+random_bytes(uint8_t *buf, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        buf[i] = rand();
+}
+
+static uint64_t
+oath_code(const uint8_t *secret, size_t secret_size, time_t now)
+{
+    char otp[7];
+    int rc;
+
+    rc = oath_totp_generate((const char *)secret, secret_size, now, 30, 0, 6,
+                            &otp[0]);
+    chkrc(rc, exit(1));
+    return strtoul(&otp[0], NULL, 10);
+}
+
+static void
+test_softCalculate(void)
+{
+    uint8_t secret[100];
+    uint64_t otps[STEPS];
+    time_t now = 1234567890;
+    int rc;
+
+    for (size_t s = 0; s < sizeof(secret_sizes) / sizeof(secret_sizes[0]); s++) {
+        random_bytes(&secret[0], secret_sizes[s]);
+        rc = tpm2totp_softCalculate(&secret[0], secret_sizes[s], now, STEPS,
+                                    &otps[0]);
+        chkrc(rc, exit(1));
+
+        for (int i = 0; i < STEPS; i++) {
+            uint64_t check = oath_code(&secret[0], secret_sizes[s], now + 30 * i);
+            if (otps[i] != check) {
+                fprintf(stderr, "Size %zu step %i: %06lu != %06lu\n",
+                        secret_sizes[s], i, otps[i], check);
+                exit(1);
+            }
+        }
+    }
+}
+
+static void
+test_verify(void)
+{
+    uint8_t secret[20];
+    time_t now = 1234567890;
+    int rc, drift;
+
+    random_bytes(&secret[0], sizeof(secret));
+
+    rc = tpm2totp_verify(&secret[0], sizeof(secret), now,
+                         oath_code(&secret[0], sizeof(secret), now), 0, &drift);
+    chkrc(rc, exit(1));
+    if (drift != 0) {
+        fprintf(stderr, "Drift %i instead of 0\n", drift);
+        exit(1);
+    }
+
+    rc = tpm2totp_verify(&secret[0], sizeof(secret), now,
+                         oath_code(&secret[0], sizeof(secret), now - 30 * 5),
+                         10, &drift);
+    chkrc(rc, exit(1));
+    if (drift != -5) {
+        fprintf(stderr, "Drift %i instead of -5\n", drift);
+        exit(1);
+    }
+
+    rc = tpm2totp_verify(&secret[0], sizeof(secret), now,
+                         oath_code(&secret[0], sizeof(secret), now + 30 * 5),
+                         4, &drift);
+    if (rc != -20) {
+        fprintf(stderr, "Code outside the window was accepted\n");
+        exit(1);
+    }
+}
+
+static void
+test_verifyMany(void)
+{
+    uint8_t secrets[SECRETS][20];
+    const uint8_t *secret_ptrs[SECRETS];
+    size_t sizes[SECRETS];
+    time_t times[SECRETS];
+    uint64_t otps[SECRETS];
+    int drifts[SECRETS], matches[SECRETS], rc;
+
+    /* Drifts from -7 to +7 with a window of 6, so some secrets must fail */
+    for (int i = 0; i < SECRETS; i++) {
+        random_bytes(&secrets[i][0], sizeof(secrets[i]));
+        secret_ptrs[i] = &secrets[i][0];
+        sizes[i] = sizeof(secrets[i]);
+        times[i] = 1500000000 + 7 * i;
+        otps[i] = oath_code(&secrets[i][0], sizes[i], times[i] + 30 * (i % 15 - 7));
+    }
+
+    rc = tpm2totp_verifyMany(SECRETS, &secret_ptrs[0], &sizes[0], &times[0],
+                             &otps[0], 6, &drifts[0], &matches[0]);
+    chkrc(rc, exit(1));
+
+    for (int i = 0; i < SECRETS; i++) {
+        int drift = i % 15 - 7;
+
+        if (matches[i] != (abs(drift) <= 6) ||
+            (matches[i] && drifts[i] != drift)) {
+            fprintf(stderr, "Secret %i: match %i drift %i, expected %i\n",
+                    i, matches[i], drifts[i], drift);
+            exit(1);
+        }
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *kernels[] = { "scalar", "sse2", "avx2" };
+    (void)(argc); (void)(argv);
+
+    srand(time(NULL));
+
+    /* Cross-check every kernel this CPU can run */
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (sha1mb_use(kernels[i]) != 0) {
+            printf("Skipping unsupported SHA-1 kernel %s\n", kernels[i]);
+            continue;
+        }
+        test_softCalculate();
+        test_verify();
+        test_verifyMany();
+    }
+
+    return 0;
+}